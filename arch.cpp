@@ -5,6 +5,13 @@
 
 using memory::PAGESIZE;
 
+#ifdef RT_LINUX
+// Provided by libgcc's unwinder, which takes a whole .eh_frame section. These
+// are weak, so we only register frames when an unwinder is linked in.
+extern "C" void __register_frame(void* begin) __attribute__((weak));
+extern "C" void __deregister_frame(void* begin) __attribute__((weak));
+#endif
+
 void LinkedAssembly::load() {
     iword n_code = codesize / PAGESIZE;
     iword n_data = datasize / PAGESIZE;
@@ -12,30 +19,218 @@ void LinkedAssembly::load() {
     memory::tag({pages.data(), n_code}, memory::READ | memory::EXEC);
     memory::tag({pages.data() + n_code, n_data}, memory::READ);
     memory::tag({pages.data() + n_code + n_data, n_static}, memory::READ | memory::WRITE);
+    memory::tag({pages.data() + n_code + n_data + n_static, pages.size() - n_code - n_data - n_static}, memory::READ);
+    if (perfMap)
+        writePerfMap(*perfMap);
+}
+
+void LinkedAssembly::unload() {
+    #ifdef RT_LINUX
+    if (frames && __deregister_frame)
+        __deregister_frame(frames);
+    #endif
+    memory::unmap(pages);
+    pages = { nullptr, iptr(0) };
+    code = data = stat = frames = nullptr; // So the destructor doesn't unload us again.
+}
+
+fd* LinkedAssembly::perfMap = nullptr;
+
+void LinkedAssembly::writePerfMap(fd file) const {
+    for (const LinkedFunction& function : functions)
+        write(file, hex(u64(code + function.offset)), ' ', hex(u64(function.size)), ' ', (*symtab)[function.sym], '\n');
 }
 
 inline iword up_to_nearest_page(iword p) {
     return p + PAGESIZE - 1 & ~(PAGESIZE - 1);
 }
 
+// Defs are recorded as they're emitted, so within each section they're
+// already in order of offset. Walking them backwards tells us where each
+// symbol ends: a function runs up to the next global in the code section
+// (local code symbols are just labels within it), and a piece of data runs
+// up to the next symbol in its section.
+static void computeSymbolSizes(const Assembly& as, vec<u32, 16>& sizes) {
+    for (u32 i = 0; i < as.defs.size(); i ++)
+        sizes.push(0);
+    u32 nextFunction = as.code.size(), nextData = as.data.size(), nextStatic = as.stat.size();
+    for (i32 i = i32(as.defs.size()) - 1; i >= 0; i --) {
+        const Def& def = as.defs[i];
+        u32* next;
+        switch (def.section) {
+            case CODE_SECTION: next = &nextFunction; break;
+            case DATA_SECTION: next = &nextData; break;
+            case STATIC_SECTION: next = &nextStatic; break;
+        }
+        if (def.section == CODE_SECTION && def.type != DEF_GLOBAL)
+            continue;
+        if (u32(def.offset) <= *next)
+            sizes[i] = *next - def.offset;
+        *next = def.offset;
+    }
+}
+
+static void collectFunctions(const Assembly& as, vec<LinkedFunction, 8>& functions) {
+    vec<u32, 16> sizes;
+    computeSymbolSizes(as, sizes);
+    for (u32 i = 0; i < as.defs.size(); i ++) if (as.defs[i].section == CODE_SECTION && as.defs[i].type == DEF_GLOBAL)
+        functions.push({ as.defs[i].sym, as.defs[i].offset, i32(sizes[i]) });
+}
+
+inline void writeULEB(bytebuf& buf, u64 value) {
+    do {
+        u8 byte = value & 0x7f;
+        value >>= 7;
+        buf.write<u8>(value ? byte | 0x80 : byte);
+    } while (value);
+}
+
+inline void writeLEB(bytebuf& buf, i64 value) {
+    while (true) {
+        u8 byte = value & 0x7f;
+        value >>= 7;
+        if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)))
+            return buf.write<u8>(byte);
+        buf.write<u8>(byte | 0x80);
+    }
+}
+
+/*
+ * Writes .eh_frame contents: a single CIE giving the rules at function entry,
+ * followed by an FDE for each function translating the frame ops within it.
+ * The i-th FDE describes the i-th function, and its pc_begin is pc-relative
+ * and left zeroed, since it depends on where things end up; its offset is
+ * added to pcFields to be patched or relocated by the caller. No zero
+ * terminator is written.
+ */
+static void writeEHFrame(const Assembly& as, const vec<LinkedFunction, 8>& functions, bytebuf& out, vec<u32, 8>& pcFields) {
+    constexpr u8 DW_CFA_advance_loc = 0x40, DW_CFA_offset = 0x80, DW_CFA_restore = 0xc0;
+    constexpr u8 DW_CFA_nop = 0x00, DW_CFA_advance_loc1 = 0x02, DW_CFA_advance_loc2 = 0x03, DW_CFA_advance_loc4 = 0x04,
+        DW_CFA_offset_extended = 0x05, DW_CFA_restore_extended = 0x06, DW_CFA_remember_state = 0x0a, DW_CFA_restore_state = 0x0b,
+        DW_CFA_def_cfa = 0x0c, DW_CFA_def_cfa_register = 0x0d, DW_CFA_def_cfa_offset = 0x0e;
+    constexpr u8 DW_EH_PE_sdata4 = 0x0b, DW_EH_PE_pcrel = 0x10;
+
+    #ifdef RT_AMD64
+        constexpr u8 RETURN_ADDRESS = 16, STACK_POINTER = 7;
+        constexpr i32 DATA_ALIGN = -8;
+    #else
+        #error "Unsupported architecture for unwind info."
+    #endif
+
+    // Entries are padded with nops to a multiple of the pointer size.
+    auto writeEntry = [&](const bytebuf& entry) {
+        u32 length = entry.size();
+        while ((4 + length) % sizeof(uptr)) length ++;
+        out.writeLE<u32>(length); // length : u32 (not counting this field)
+        out.write(entry);
+        for (u32 i = entry.size(); i < length; i ++)
+            out.write<u8>(DW_CFA_nop);
+    };
+
+    bytebuf cie;
+    cie.writeLE<u32>(0); // CIE_id : u32 = 0 (distinguishes CIEs from FDEs)
+    cie.write<u8>(1); // version : u8 = 1
+    cie.write("zR", 3); // augmentation : string = "zR" (has augmentation data, which gives the FDE pointer encoding)
+    writeULEB(cie, 1); // code_alignment_factor : uleb = 1 (instructions are byte-aligned)
+    writeLEB(cie, DATA_ALIGN); // data_alignment_factor : leb (stack slots are this size)
+    cie.write<u8>(RETURN_ADDRESS); // return_address_register : u8
+    writeULEB(cie, 1); // augmentation_length : uleb = 1
+    cie.write<u8>(DW_EH_PE_pcrel | DW_EH_PE_sdata4); // FDE pointer encoding : u8 (pc-relative i32)
+    #ifdef RT_AMD64
+        cie.write<u8>(DW_CFA_def_cfa), writeULEB(cie, STACK_POINTER), writeULEB(cie, 8); // CFA is rsp + 8 on entry...
+        cie.write<u8>(DW_CFA_offset | RETURN_ADDRESS), writeULEB(cie, 1); // ...and the return address is just below it.
+    #endif
+    writeEntry(cie);
+
+    u32 op = 0;
+    for (const LinkedFunction& function : functions) {
+        u32 start = function.offset, end = function.offset + function.size;
+
+        // Ops are recorded after the instruction that caused them, so one at
+        // the very start of a function belongs to whatever came before it.
+        while (op < as.frameOps.size() && u32(as.frameOps[op].offset) <= start)
+            op ++;
+        bytebuf program;
+        u32 loc = start;
+        for (; op < as.frameOps.size() && u32(as.frameOps[op].offset) < end; op ++) {
+            const FrameOp& frameOp = as.frameOps[op];
+            u32 delta = frameOp.offset - loc;
+            if (delta < 64) {
+                if (delta) program.write<u8>(DW_CFA_advance_loc | delta);
+            }
+            else if (delta < 0x100) program.write<u8>(DW_CFA_advance_loc1), program.write<u8>(delta);
+            else if (delta < 0x10000) program.write<u8>(DW_CFA_advance_loc2), program.writeLE<u16>(delta);
+            else program.write<u8>(DW_CFA_advance_loc4), program.writeLE<u32>(delta);
+            loc = frameOp.offset;
+
+            switch (frameOp.kind) {
+                case FrameOp::DEF_CFA:
+                    program.write<u8>(DW_CFA_def_cfa), writeULEB(program, frameOp.reg), writeULEB(program, frameOp.value);
+                    break;
+                case FrameOp::DEF_CFA_OFFSET:
+                    program.write<u8>(DW_CFA_def_cfa_offset), writeULEB(program, frameOp.value);
+                    break;
+                case FrameOp::DEF_CFA_REGISTER:
+                    program.write<u8>(DW_CFA_def_cfa_register), writeULEB(program, frameOp.reg);
+                    break;
+                case FrameOp::SAVE:
+                    if (frameOp.reg < 64) program.write<u8>(DW_CFA_offset | frameOp.reg);
+                    else program.write<u8>(DW_CFA_offset_extended), writeULEB(program, frameOp.reg);
+                    writeULEB(program, frameOp.value / -DATA_ALIGN);
+                    break;
+                case FrameOp::RESTORE:
+                    if (frameOp.reg < 64) program.write<u8>(DW_CFA_restore | frameOp.reg);
+                    else program.write<u8>(DW_CFA_restore_extended), writeULEB(program, frameOp.reg);
+                    break;
+                case FrameOp::REMEMBER_STATE:
+                    program.write<u8>(DW_CFA_remember_state);
+                    break;
+                case FrameOp::RESTORE_STATE:
+                    program.write<u8>(DW_CFA_restore_state);
+                    break;
+            }
+        }
+
+        bytebuf fde;
+        fde.writeLE<u32>(out.size() + 4); // CIE_pointer : u32 (distance back from this field to the CIE, which is at 0)
+        pcFields.push(out.size() + 8);
+        fde.writeLE<i32>(0); // pc_begin : i32 (pc-relative, filled in later)
+        fde.writeLE<u32>(function.size); // pc_range : u32
+        writeULEB(fde, 0); // augmentation_length : uleb = 0
+        fde.write(program);
+        writeEntry(fde);
+    }
+}
+
 void Assembly::linkInto(LinkedAssembly& linked) {
+    linked.functions.clear();
+    collectFunctions(*this, linked.functions);
+
+    bytebuf frames;
+    vec<u32, 8> pcFields;
+    writeEHFrame(*this, linked.functions, frames, pcFields);
+    frames.writeLE<u32>(0); // Terminates the list of entries.
+
     iword codestart = 0;
     iword datastart = codestart + up_to_nearest_page(code.size());
     iword staticstart = datastart + up_to_nearest_page(data.size());
-    iword totalsize = staticstart + up_to_nearest_page(stat.size());
+    iword framestart = staticstart + up_to_nearest_page(stat.size());
+    iword totalsize = framestart + up_to_nearest_page(frames.size());
     
     linked.codesize = datastart;
     linked.datasize = staticstart - datastart;
-    linked.statsize = totalsize - staticstart;
+    linked.statsize = framestart - staticstart;
     linked.pages = memory::map(totalsize / PAGESIZE);
     linked.code = (i8*)linked.pages.data() + codestart;
     linked.data = (i8*)linked.pages.data() + datastart;
     linked.stat = (i8*)linked.pages.data() + staticstart;
+    linked.frames = (i8*)linked.pages.data() + framestart;
     linked.symtab = &symtab;
 
     code.read(linked.code, code.size());
     data.read(linked.data, data.size());
     stat.read(linked.stat, stat.size());
+    frames.read(linked.frames, frames.size());
 
     for (const Def& def : defs) {
         iptr base;
@@ -60,7 +255,7 @@ void Assembly::linkInto(LinkedAssembly& linked) {
             panic("Undefined symbol!");
         iptr sym = it->value;
 
-        iptr diff = sym - reloc;
+        iptr diff = sym + ref.addend - reloc;
         switch (ref.kind) {
             case Reloc::REL8:
                 if (diff < -128 || diff > 127)
@@ -96,6 +291,15 @@ void Assembly::linkInto(LinkedAssembly& linked) {
         }
     }
 
+    for (u32 i = 0; i < pcFields.size(); i ++) {
+        i8* field = linked.frames + pcFields[i];
+        *(i32*)field = little_endian<i32>(iptr(linked.code + linked.functions[i].offset) - iptr(field));
+    }
+    #ifdef RT_LINUX
+    if (__register_frame)
+        __register_frame(linked.frames);
+    #endif
+
     if (config::printMachineCode) {
         for (i8 i : const_slice<i8>{ linked.code, linked.codesize })
             print(hex((u64)(u8)i, 2));
@@ -103,237 +307,350 @@ void Assembly::linkInto(LinkedAssembly& linked) {
     }
 }
 
+// Segment readers never step past the end of their segment, since the
+// directory only tells us where each segment lies, not that it's well-formed.
+inline void deserializeCheck(bool condition) {
+    if (!condition)
+        panic("Failed to deserialize assembly: malformed segment!");
+}
+
+inline u64 readULEB(const i8*& ptr, const i8* end) {
+    u64 value = 0;
+    u32 shift = 0;
+    u8 byte;
+    do {
+        deserializeCheck(ptr < end && shift < 64);
+        byte = *ptr ++;
+        value |= u64(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+inline i64 readLEB(const i8*& ptr, const i8* end) {
+    i64 value = 0;
+    u32 shift = 0;
+    u8 byte;
+    do {
+        deserializeCheck(ptr < end && shift < 64);
+        byte = *ptr ++;
+        value |= i64(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40))
+        value |= -(i64(1) << shift);
+    return value;
+}
+
+inline u8 readByte(const i8*& ptr, const i8* end) {
+    deserializeCheck(ptr < end);
+    return *ptr ++;
+}
+
+// Reads an entry count, checking there's room left for that many entries of
+// at least the given size.
+inline u32 readCount(const i8*& ptr, const i8* end, u32 minEntrySize) {
+    u64 count = readULEB(ptr, end);
+    deserializeCheck(count <= u64(end - ptr) / minEntrySize);
+    return count;
+}
+
+inline u32 readU32LE(const i8* ptr) {
+    const u8* bytes = (const u8*)ptr;
+    return u32(bytes[0]) | u32(bytes[1]) << 8 | u32(bytes[2]) << 16 | u32(bytes[3]) << 24;
+}
+
+struct DeserializeState {
+    Assembly* as;
+    const i8* segments[Assembly::NUM_SEGMENTS];
+    u32 sizes[Assembly::NUM_SEGMENTS];
+};
+
+static void deserializeSegment(void* env, u32 i) {
+    DeserializeState& state = *(DeserializeState*)env;
+    Assembly& as = *state.as;
+    const i8* ptr = state.segments[i];
+    const i8* end = ptr + state.sizes[i];
+    switch (i) {
+        case Assembly::SEGMENT_CODE:
+            as.code.write(ptr, state.sizes[i]);
+            return;
+        case Assembly::SEGMENT_DATA:
+            as.data.write(ptr, state.sizes[i]);
+            return;
+        case Assembly::SEGMENT_STATIC:
+            as.stat.write(ptr, state.sizes[i]);
+            return;
+        case Assembly::SEGMENT_STRINGS: {
+            as.symtab.strings.clear();
+            as.symtab.strtab.clear();
+            u32 syms = readCount(ptr, end, 1);
+            for (u32 j = 0; j < syms; j ++) {
+                u64 size = readULEB(ptr, end);
+                deserializeCheck(size <= u64(end - ptr));
+                slice<i8> newString = { new i8[size], iword(size) };
+                for (u32 k = 0; k < size; k ++) newString[k] = ptr[k];
+                ptr += size;
+                as.symtab.strings.push(newString);
+                as.symtab.strtab.put(newString, j);
+            }
+            break;
+        }
+        case Assembly::SEGMENT_DEFS: {
+            u32 ndefs = readCount(ptr, end, 4);
+            for (u32 j = 0; j < ndefs; j ++) {
+                Def def;
+                def.section = (Section)readByte(ptr, end);
+                def.type = (DefType)readByte(ptr, end);
+                def.offset = readLEB(ptr, end);
+                def.sym = readULEB(ptr, end);
+                as.defs.push(def);
+            }
+            break;
+        }
+        case Assembly::SEGMENT_RELOCS: {
+            u32 nrelocs = readCount(ptr, end, 6);
+            for (u32 j = 0; j < nrelocs; j ++) {
+                Reloc reloc;
+                reloc.section = (Section)readByte(ptr, end);
+                reloc.type = (DefType)readByte(ptr, end);
+                reloc.kind = (Reloc::Kind)readByte(ptr, end);
+                reloc.offset = readLEB(ptr, end);
+                reloc.sym = readULEB(ptr, end);
+                reloc.addend = readLEB(ptr, end);
+                as.relocs.push(reloc);
+            }
+            break;
+        }
+        case Assembly::SEGMENT_FRAMES: {
+            u32 nops = readCount(ptr, end, 4);
+            for (u32 j = 0; j < nops; j ++) {
+                FrameOp op;
+                op.kind = (FrameOp::Kind)readByte(ptr, end);
+                op.reg = readByte(ptr, end);
+                op.offset = readLEB(ptr, end);
+                op.value = readLEB(ptr, end);
+                as.frameOps.push(op);
+            }
+            break;
+        }
+        default:
+            unreachable("Unknown serialized segment.");
+    }
+    deserializeCheck(ptr == end); // Anything left over means we misread the segment.
+}
+
+void Assembly::deserialize(const_slice<i8> bytes, TaskRunner runner) {
+    if (bytes.size() < SERIALIZED_HEADER_SIZE || memory::compare(bytes.data(), "\0aob", 4))
+        panic("Failed to deserialize assembly!");
+    if (readU32LE(bytes.data() + 4) != SERIALIZED_VERSION)
+        panic("Failed to deserialize assembly: unsupported format version!");
+
+    DeserializeState state;
+    state.as = this;
+    const i8* payload = bytes.data() + SERIALIZED_HEADER_SIZE;
+    iword payloadSize = bytes.size() - SERIALIZED_HEADER_SIZE;
+    for (u32 i = 0; i < NUM_SEGMENTS; i ++) {
+        u32 offset = readU32LE(bytes.data() + 8 + i * 8);
+        state.sizes[i] = readU32LE(bytes.data() + 12 + i * 8);
+        if (iword(offset) + iword(state.sizes[i]) > payloadSize)
+            panic("Failed to deserialize assembly: segment out of bounds!");
+        state.segments[i] = payload + offset;
+    }
+
+    if (runner)
+        runner(NUM_SEGMENTS, deserializeSegment, &state);
+    else for (u32 i = 0; i < NUM_SEGMENTS; i ++)
+        deserializeSegment(&state, i);
+}
+
 struct ELFSymbolInfo {
     u32 index;
     u32 nameOffset;
     u32 offset; // -1 if undefined
+    u32 size;
     Section section;
     DefType type;
 };
 
-void Assembly::writeELFObject(fd file) {
-    // Overall ELF relocatable object header
+// Describes one section of an ELF object. Section contents either live in an
+// existing buffer (like the assembly's code), and are read straight out of
+// it, or were generated into a shared table buffer while building the object.
+struct ELFSection {
+    u32 name; // offset of the section name in .shstrtab
+    u32 type;
+    u64 flags;
+    u32 link, info;
+    u64 align, entsize;
+    bytebuf* contents; // nullptr if the contents are in the table buffer
+    u64 offset; // offset within the table buffer, and later within the file
+    u64 size;
+};
+
+inline u64 elfPadding(u64 size) {
+    return (64 - size % 64) % 64;
+}
 
-    bytebuf objectHeader;
-    objectHeader.write("\x7f" "ELF", 4); // elf magic
+// Writes the ELF identification and file header, which start every ELF file
+// we produce. Program headers, if any, are expected to follow immediately.
+static void writeELFHeader(bytebuf& out, u16 type, u64 entry, u64 phoff, u16 phnum, u64 shoff, u16 shnum, u16 shstrndx) {
+    assert(out.size() == 0);
+    out.write("\x7f" "ELF", 4); // elf magic
 
     constexpr u8 ELFCLASSNONE = 0, ELFCLASS32 = 1, ELFCLASS64 = 2;
     #ifdef RT_64
-    objectHeader.write<u8>(ELFCLASS64); // elf class. we assume 64-bit due to host
+    out.write<u8>(ELFCLASS64); // elf class. we assume 64-bit due to host
     #elif defined(RT_32)
-    objectHeader.write<u8>(ELFCLASS32); // elf class. we assume 32-bit due to host
+    out.write<u8>(ELFCLASS32); // elf class. we assume 32-bit due to host
     #else
     #error "Can't generate ELF binaries for non-32-bit, non-64-bit platform."
     #endif
 
     constexpr u8 ELFDATANONE = 0, ELFDATALSB = 1, ELFDATAMSB = 2;
-    objectHeader.write<u8>(ELFDATALSB); // elf data format. we always write little-endian for now
+    out.write<u8>(ELFDATALSB); // elf data format. we always write little-endian for now
 
-    objectHeader.writeLE<u8>(1); // elf version. always 1 (current version)
+    out.writeLE<u8>(1); // elf version. always 1 (current version)
 
-    objectHeader.writeLE<u8>(0); // elf os abi. 0 for now, until it becomes important
+    out.writeLE<u8>(0); // elf os abi. 0 for now, until it becomes important
 
-    objectHeader.writeLE<u8>(0); // elf abi version. 0 for now as well
+    out.writeLE<u8>(0); // elf abi version. 0 for now as well
 
-    objectHeader.write("\0\0\0\0\0\0\0", 7); // elf padding. the identifying header should be 16 bytes
-    assert(objectHeader.size() == 16);
-    
-    constexpr u16 ET_NONE = 0, ET_REL = 1, ET_EXEC = 2, ET_DYN = 3;
-    objectHeader.writeLE<u16>(ET_REL); // e_type : u16
+    out.write("\0\0\0\0\0\0\0", 7); // elf padding. the identifying header should be 16 bytes
+    assert(out.size() == 16);
+
+    out.writeLE<u16>(type); // e_type : u16
 
     constexpr u16 EM_NONE = 0, EM_X86_64 = 62, EM_AARCH64 = 183;
     #ifdef RT_AMD64
-    objectHeader.writeLE<u16>(EM_X86_64); // e_machine : u16
+    out.writeLE<u16>(EM_X86_64); // e_machine : u16
     #elif defined(RT_ARM64)
-    objectHeader.writeLE<u16>(EM_AARCH64); // e_machine : u16
+    out.writeLE<u16>(EM_AARCH64); // e_machine : u16
     #else
     #error "Can't generate ELF binaries for this machine."
     #endif
 
-    objectHeader.writeLE<u32>(1); // e_version : u32 = 1 (current version)
-    objectHeader.writeLE<uptr>(0); // e_entry : uptr = 0x0 (since we're relocatable)
-    objectHeader.writeLE<u64>(0); // e_phoff : u64 = 0x0 (again, since we're relocatable)
-    objectHeader.writeLE<u64>(64); // e_shoff : u64 = 64 (right after this header)
-    objectHeader.writeLE<u32>(0); // e_flags : u32 = 0x0 (no arch-specific flags yet)
-    objectHeader.writeLE<u16>(64); // e_ehsize : u16 = 64 (size of ELF header, always the same)
-    objectHeader.writeLE<u16>(0); // e_phentsize : u16 = 0 (size of program header table entries, we don't have any)
-    objectHeader.writeLE<u16>(0); // e_phnum : u16 = 0 (number of program header table entries, again we don't have any)
-    objectHeader.writeLE<u16>(64); // e_shentsize : u16 = 64 (size of section header table entries, fixed for 64-bit binaries)
-    objectHeader.writeLE<u16>(10); // e_shnum : u16 = 10 (number of section header table entries, for us that's <null>, .shstrtab, .text, .data, .rodata, .strtab, .symtab, .rel.text, .rel.rodata, .rel.data)
-    objectHeader.writeLE<u16>(1); // e_shstrndx : u16 = 1 (index of .shstrtab)
-    assert(objectHeader.size() == 64);
-
-    // Section header table. Really we just define it here, and add entries
-    // onto it as we generate subsequent sections.
+    out.writeLE<u32>(1); // e_version : u32 = 1 (current version)
+    out.writeLE<uptr>(entry); // e_entry : uptr (virtual address of the entry point, or 0 if there isn't one)
+    out.writeLE<u64>(phoff); // e_phoff : u64 (0 if there's no program header table)
+    out.writeLE<u64>(shoff); // e_shoff : u64 (0 if there's no section header table)
+    out.writeLE<u32>(0); // e_flags : u32 = 0x0 (no arch-specific flags yet)
+    out.writeLE<u16>(64); // e_ehsize : u16 = 64 (size of ELF header, always the same)
+    out.writeLE<u16>(phnum ? 56 : 0); // e_phentsize : u16 (size of program header table entries, fixed for 64-bit binaries)
+    out.writeLE<u16>(phnum); // e_phnum : u16
+    out.writeLE<u16>(64); // e_shentsize : u16 = 64 (size of section header table entries, fixed for 64-bit binaries)
+    out.writeLE<u16>(shnum); // e_shnum : u16
+    out.writeLE<u16>(shstrndx); // e_shstrndx : u16 (index of the section name string table)
+    assert(out.size() == 64);
+}
 
-    bytebuf sectionHeaderTable;
+void Assembly::writeELFObject(fd file, bool functionSections) {
+    // We lay out the whole object before writing any of it: the ELF header
+    // and section header table come first, followed by the code, data, and
+    // static sections (read directly out of our own buffers), followed by
+    // every generated table. Sections always start on a 64-byte boundary.
+    // The finished object goes out in a single write.
 
     constexpr u32 SHT_NULL = 0, SHT_PROGBITS = 1, SHT_SYMTAB = 2, SHT_STRTAB = 3, SHT_RELA = 4, SHT_REL = 9;
     constexpr u32 SHF_WRITE = 1, SHF_ALLOC = 2, SHF_EXECINSTR = 4, SHF_MERGE = 16, SHF_STRINGS = 32, SHF_INFO_LINK = 64, SHF_TLS = 1024;
     constexpr u32 SHN_UNDEF = 0;
 
-    constexpr u32 offsetOfFirstSection = 64 + 10 * 64; // e_ehsize + e_shnum * e_shentsize
+    constexpr u32 SECTION_SHSTRTAB = 1, SECTION_TEXT = 2, SECTION_RODATA = 3, SECTION_DATA = 4, SECTION_STRTAB = 5, SECTION_SYMTAB = 6,
+        SECTION_RELA_TEXT = 7, SECTION_RELA_RODATA = 8, SECTION_RELA_DATA = 9, SECTION_EH_FRAME = 10, SECTION_RELA_EH_FRAME = 11,
+        NUM_FIXED_SECTIONS = 12;
 
-    // Null section
+    vec<ELFSection, 16> sections;
+    for (u32 i = 0; i < NUM_FIXED_SECTIONS; i ++)
+        sections.push({});
+    sections[0] = { 0, SHT_NULL, 0, SHN_UNDEF, 0, 0, 0, nullptr, 0, 0 };
+    sections[SECTION_SHSTRTAB] = { 0, SHT_STRTAB, SHF_STRINGS | SHF_MERGE, SHN_UNDEF, 0, 0, 0, nullptr, 0, 0 };
+    sections[SECTION_TEXT] = { 0, SHT_PROGBITS, SHF_EXECINSTR | SHF_ALLOC, SHN_UNDEF, 0, 16, 0, &code, 0, code.size() }; // code is executable and must be allocated at load time
+    sections[SECTION_RODATA] = { 0, SHT_PROGBITS, SHF_ALLOC, SHN_UNDEF, 0, 16, 0, &data, 0, data.size() }; // data must be allocated, but not writable or executable
+    sections[SECTION_DATA] = { 0, SHT_PROGBITS, SHF_WRITE | SHF_ALLOC, SHN_UNDEF, 0, 16, 0, &stat, 0, stat.size() }; // static data must be allocated and writable, but not executable
+    sections[SECTION_STRTAB] = { 0, SHT_STRTAB, SHF_MERGE | SHF_STRINGS, SHN_UNDEF, 0, 0, 0, nullptr, 0, 0 };
+    sections[SECTION_SYMTAB] = { 0, SHT_SYMTAB, SHF_MERGE | SHF_ALLOC, SECTION_STRTAB, 0, 0, 24, nullptr, 0, 0 }; // sh_info is filled in once we know how many local symbols there are
+    sections[SECTION_RELA_TEXT] = { 0, SHT_RELA, SHF_MERGE | SHF_INFO_LINK, SECTION_SYMTAB, SECTION_TEXT, 0, 24, nullptr, 0, 0 };
+    sections[SECTION_RELA_RODATA] = { 0, SHT_RELA, SHF_MERGE | SHF_INFO_LINK, SECTION_SYMTAB, SECTION_RODATA, 0, 24, nullptr, 0, 0 };
+    sections[SECTION_RELA_DATA] = { 0, SHT_RELA, SHF_MERGE | SHF_INFO_LINK, SECTION_SYMTAB, SECTION_DATA, 0, 24, nullptr, 0, 0 };
+    sections[SECTION_EH_FRAME] = { 0, SHT_PROGBITS, SHF_ALLOC, SHN_UNDEF, 0, 8, 0, nullptr, 0, 0 }; // unwind info is read by the unwinder at runtime, so it must be allocated
+    sections[SECTION_RELA_EH_FRAME] = { 0, SHT_RELA, SHF_INFO_LINK, SECTION_SYMTAB, SECTION_EH_FRAME, 0, 24, nullptr, 0, 0 };
 
-    sectionHeaderTable.writeLE<u32>(0); // sh_name : u32 = 0
-    sectionHeaderTable.writeLE<u32>(SHT_NULL); // sh_type : u32 = SHT_NULL
-    sectionHeaderTable.writeLE<u64>(0); // sh_flags : u64 = 0
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0
-    sectionHeaderTable.writeLE<u64>(0); // sh_offset : u64 (we are the first section)
-    sectionHeaderTable.writeLE<u64>(0); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(SHN_UNDEF); // sh_link : u32 = 0
-    sectionHeaderTable.writeLE<u32>(0); // sh_info : u32 = 0
-    sectionHeaderTable.writeLE<u64>(0); // sh_addralign : u64 = 0
-    sectionHeaderTable.writeLE<u64>(0); // sh_entsize : u64 = 0
-    assert(sectionHeaderTable.size() == 64);
+    // With function sections, each global function gets its own .text.<name>
+    // section and relocation section, so the linker can discard the ones
+    // nobody refers to. Only code before the first function stays in .text.
+    // These are consecutive slices of our code buffer, so reading each one in
+    // turn splits it up.
 
-    // Section header string table
+    vec<LinkedFunction, 8> functions;
+    collectFunctions(*this, functions);
+    vec<u32, 8> textSections; // section index for each function
+    if (functionSections && functions.size()) {
+        sections[SECTION_TEXT].size = functions[0].offset;
+        for (const LinkedFunction& function : functions) {
+            textSections.push(sections.size());
+            sections.push({ 0, SHT_PROGBITS, SHF_EXECINSTR | SHF_ALLOC, SHN_UNDEF, 0, 16, 0, &code, 0, u64(function.size) });
+            sections.push({ 0, SHT_RELA, SHF_MERGE | SHF_INFO_LINK, SECTION_SYMTAB, textSections.last(), 0, 24, nullptr, 0, 0 });
+        }
+    }
 
-    bytebuf sectionHeaderStringTable;
-    u32 sectionHeaderStringTableOffset = offsetOfFirstSection;
-
-    sectionHeaderStringTable.write("", 1); // string 0 must be the empty string
-
-    u32 sectionHeaderStringTableNameOffset = sectionHeaderStringTable.size();
-    sectionHeaderStringTable.write(".shstrtab", 10); // data for the shstrtab - just some fixed string literals
-    u32 textSectionNameOffset = sectionHeaderStringTable.size();
-    sectionHeaderStringTable.write(".text", 6);
-    u32 dataSectionNameOffset = sectionHeaderStringTable.size();
-    sectionHeaderStringTable.write(".rodata", 8);
-    u32 staticSectionNameOffset = sectionHeaderStringTable.size();
-    sectionHeaderStringTable.write(".data", 6);
-    u32 stringTableNameOffset = sectionHeaderStringTable.size();
-    sectionHeaderStringTable.write(".strtab", 8);
-    u32 symbolTableNameOffset = sectionHeaderStringTable.size();
-    sectionHeaderStringTable.write(".symtab", 8);
-    u32 textRelocationTableNameOffset = sectionHeaderStringTable.size();
-    sectionHeaderStringTable.write(".rela.text", 11);
-    u32 dataRelocationTableNameOffset = sectionHeaderStringTable.size();
-    sectionHeaderStringTable.write(".rela.rodata", 13);
-    u32 staticRelocationTableNameOffset = sectionHeaderStringTable.size();
-    sectionHeaderStringTable.write(".rela.data", 11);
-    
-    while (sectionHeaderStringTable.size() % 64) // pad to multiple of 64 bytes
-        sectionHeaderStringTable.write<u8>(0);
-
-    sectionHeaderTable.writeLE<u32>(sectionHeaderStringTableNameOffset); // sh_name : u32 = 1 (.shstrtab)
-    sectionHeaderTable.writeLE<u32>(SHT_STRTAB); // sh_type : u32 = SHT_STRTAB (shstrtab is a string table)
-    sectionHeaderTable.writeLE<u64>(SHF_STRINGS | SHF_MERGE); // sh_flags : u64 = SHF_STRINGS | SHF_MERGE
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
-    sectionHeaderTable.writeLE<u64>(sectionHeaderStringTableOffset); // sh_offset : u64 (we are the first section)
-    sectionHeaderTable.writeLE<u64>(sectionHeaderStringTable.size()); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(SHN_UNDEF); // sh_link : u32 = 0
-    sectionHeaderTable.writeLE<u32>(0); // sh_info : u32 = 0
-    sectionHeaderTable.writeLE<u64>(0); // sh_addralign : u64 = 0 (we don't care about alignment)
-    sectionHeaderTable.writeLE<u64>(0); // sh_entsize : u64 = 0 (we don't have any entries with regular size)
-    assert(sectionHeaderTable.size() == 128);
-
-    // Text section
-
-    bytebuf textSection;
-    u32 textSectionOffset = sectionHeaderStringTableOffset + sectionHeaderStringTable.size();
-    assert(textSectionOffset % 64 == 0);
-    textSection.write(this->code); // copy in our binary
-    while (textSection.size() % 64) // pad to multiple of 64 bytes
-        textSection.write<u8>(0);
-
-    sectionHeaderTable.writeLE<u32>(textSectionNameOffset); // sh_name : u32 (.text in the section header string table)
-    sectionHeaderTable.writeLE<u32>(SHT_PROGBITS); // sh_type : u32 = SHT_PROGBITS (code is program data)
-    sectionHeaderTable.writeLE<u64>(SHF_EXECINSTR | SHF_ALLOC); // sh_flags : u64 (code is executable and must be allocated at load time)
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
-    sectionHeaderTable.writeLE<u64>(textSectionOffset); // sh_offset : u64 (text comes after the section header table)
-    sectionHeaderTable.writeLE<u64>(textSection.size()); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(SHN_UNDEF); // sh_link : u32 = 0
-    sectionHeaderTable.writeLE<u32>(0); // sh_info : u32 = 0
-    sectionHeaderTable.writeLE<u64>(16); // sh_addralign : u64 = 16 (reasonable code alignment requirement)
-    sectionHeaderTable.writeLE<u64>(0); // sh_entsize : u64 = 0 (we don't have any entries with regular size)
-    assert(sectionHeaderTable.size() == 192);
-
-    // Data section
-
-    bytebuf dataSection;
-    u32 dataSectionOffset = textSectionOffset + textSection.size();
-    assert(dataSectionOffset % 64 == 0);
-    dataSection.write(this->data); // copy in our binary
-    while (dataSection.size() % 64) // pad to multiple of 64 bytes
-        dataSection.write<u8>(0);
-
-    sectionHeaderTable.writeLE<u32>(dataSectionNameOffset); // sh_name : u32 (.rodata in the section header string table)
-    sectionHeaderTable.writeLE<u32>(SHT_PROGBITS); // sh_type : u32 = SHT_PROGBITS (data is program data)
-    sectionHeaderTable.writeLE<u64>(SHF_ALLOC); // sh_flags : u64 (must be allocated, but not writable or executable)
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
-    sectionHeaderTable.writeLE<u64>(dataSectionOffset); // sh_offset : u64 (text comes after the section header table)
-    sectionHeaderTable.writeLE<u64>(dataSection.size()); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(SHN_UNDEF); // sh_link : u32 = 0
-    sectionHeaderTable.writeLE<u32>(0); // sh_info : u32 = 0
-    sectionHeaderTable.writeLE<u64>(16); // sh_addralign : u64 = 16 (minimal data alignment requirement)
-    sectionHeaderTable.writeLE<u64>(0); // sh_entsize : u64 = 0 (we don't have any entries with regular size)
-    assert(sectionHeaderTable.size() == 256);
-
-    // Static section
-
-    bytebuf staticSection;
-    u32 staticSectionOffset = dataSectionOffset + dataSection.size();
-    assert(staticSectionOffset % 64 == 0);
-    staticSection.write(this->stat); // copy in our binary
-    while (staticSection.size() % 64) // pad to multiple of 64 bytes
-        staticSection.write<u8>(0);
-
-    sectionHeaderTable.writeLE<u32>(staticSectionNameOffset); // sh_name : u32 (.data in the section header string table)
-    sectionHeaderTable.writeLE<u32>(SHT_PROGBITS); // sh_type : u32 = SHT_PROGBITS (static data is program data)
-    sectionHeaderTable.writeLE<u64>(SHF_WRITE | SHF_ALLOC); // sh_flags : u64 (must be allocated and writable, but not executable)
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
-    sectionHeaderTable.writeLE<u64>(staticSectionOffset); // sh_offset : u64 (text comes after the section header table)
-    sectionHeaderTable.writeLE<u64>(staticSection.size()); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(SHN_UNDEF); // sh_link : u32 = 0
-    sectionHeaderTable.writeLE<u32>(0); // sh_info : u32 = 0
-    sectionHeaderTable.writeLE<u64>(16); // sh_addralign : u64 = 16 (minimal data alignment requirement)
-    sectionHeaderTable.writeLE<u64>(0); // sh_entsize : u64 = 0 (we don't have any entries with regular size)
-    assert(sectionHeaderTable.size() == 320);
+    // Finds the section containing the given code offset, and where it starts.
+    auto codeSection = [&](u32 offset, u32& base) -> u32 {
+        base = 0;
+        if (!textSections.size() || offset < u32(functions[0].offset))
+            return SECTION_TEXT;
+        u32 lo = 0, hi = functions.size();
+        while (hi - lo > 1) {
+            u32 mid = (lo + hi) / 2;
+            if (u32(functions[mid].offset) <= offset) lo = mid;
+            else hi = mid;
+        }
+        base = functions[lo].offset;
+        return textSections[lo];
+    };
+
+    bytebuf tables;
+    auto beginTable = [&](u32 section) {
+        sections[section].offset = tables.size();
+    };
+    auto endTable = [&](u32 section) {
+        sections[section].size = tables.size() - sections[section].offset;
+        while (tables.size() % 64) // pad to multiple of 64 bytes
+            tables.write<u8>(0);
+    };
 
     // String table
 
-    bytebuf stringTable;
-    u32 stringTableOffset = staticSectionOffset + staticSection.size();
-    assert(stringTableOffset % 64 == 0);
-    stringTable.write<u8>(0); // First string is always empty.
+    beginTable(SECTION_STRTAB);
+    tables.write<u8>(0); // First string is always empty.
+
+    vec<u32, 16> sizes;
+    computeSymbolSizes(*this, sizes);
+
     map<Symbol, ELFSymbolInfo> symbols;
-    for (Def def : defs) if (!symbols.contains(def.sym))
-        symbols.put(def.sym, { 0, 0, (u32)def.offset, def.section, def.type });
+    for (u32 i = 0; i < defs.size(); i ++) if (!symbols.contains(defs[i].sym))
+        symbols.put(defs[i].sym, { 0, 0, (u32)defs[i].offset, sizes[i], defs[i].section, defs[i].type });
     for (Reloc reloc : relocs) if (!symbols.contains(reloc.sym))
-        symbols.put(reloc.sym, { 0, 0, 0xffffffffu, CODE_SECTION, DEF_GLOBAL }); // If a symbol is referenced only in relocations, it must not be defined locally, so it must be global.
+        symbols.put(reloc.sym, { 0, 0, 0xffffffffu, 0, CODE_SECTION, DEF_GLOBAL }); // If a symbol is referenced only in relocations, it must not be defined locally, so it must be global.
     u32 cumulativeOffset = 1;
-    u32 symbolIndex = 1;
     for (auto& entry : symbols) {
         auto str = symtab[entry.key];
         entry.value.nameOffset = cumulativeOffset;
-        entry.value.index = symbolIndex ++;
-        stringTable.write(str.data(), str.size());
+        tables.write(str.data(), str.size());
         cumulativeOffset += str.size();
         if (str.last() != '\0')
-            stringTable.write<u8>(0), cumulativeOffset ++;
+            tables.write<u8>(0), cumulativeOffset ++;
     }
-    while (stringTable.size() % 64) // pad to multiple of 64 bytes
-        stringTable.write<u8>(0);
-
-    sectionHeaderTable.writeLE<u32>(stringTableNameOffset); // sh_name : u32 (.strtab in the section header string table)
-    sectionHeaderTable.writeLE<u32>(SHT_STRTAB); // sh_type : u32 = SHT_STRTAB
-    sectionHeaderTable.writeLE<u64>(SHF_MERGE | SHF_STRINGS); // sh_flags : u64 (it's a string table, and it's fine to merge it)
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
-    sectionHeaderTable.writeLE<u64>(stringTableOffset); // sh_offset : u64 (text comes after the section header table)
-    sectionHeaderTable.writeLE<u64>(stringTable.size()); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(SHN_UNDEF); // sh_link : u32 = 0
-    sectionHeaderTable.writeLE<u32>(0); // sh_info : u32 = 0
-    sectionHeaderTable.writeLE<u64>(0); // sh_addralign : u64 = 0 (we don't care about alignment)
-    sectionHeaderTable.writeLE<u64>(0); // sh_entsize : u64 = 0 (we don't have any entries with regular size)
-    assert(sectionHeaderTable.size() == 384);
+    endTable(SECTION_STRTAB);
 
-    // Symbol table
+    // ELF requires all local symbols to come before any global ones, so we
+    // number the locals first. sh_info of .symtab is the first global index.
+    u32 symbolIndex = 1;
+    for (auto& entry : symbols) if (entry.value.type != DEF_GLOBAL)
+        entry.value.index = symbolIndex ++;
+    sections[SECTION_SYMTAB].info = symbolIndex;
+    for (auto& entry : symbols) if (entry.value.type == DEF_GLOBAL)
+        entry.value.index = symbolIndex ++;
 
-    bytebuf symbolTable;
-    u32 symbolTableOffset = stringTableOffset + stringTable.size();
-    assert(symbolTableOffset % 64 == 0);
+    // Symbol table
 
     constexpr u8 STB_LOCAL = 0, STB_GLOBAL = 1, STB_WEAK = 2;
     constexpr u8 STT_NOTYPE = 0, STT_OBJECT = 1, STT_FUNC = 2, STT_TLS = 6;
@@ -342,161 +659,746 @@ void Assembly::writeELFObject(fd file) {
         return binding << 4 | type;
     };
 
-    symbolTable.writeLE<u32>(0); // st_name : u32, for the first symbol this is undefined
-    symbolTable.write<u8>(symbolInfo(STB_LOCAL, STT_NOTYPE)); // st_info : u8, doesn't matter since this is a placeholder symbol
-    symbolTable.write<u8>(STV_DEFAULT); // st_other : u8, again doesn't matter since this is a placeholder symbol
-    symbolTable.writeLE<u16>(0); // st_shndx : u16
-    symbolTable.writeLE<uptr>(0); // st_value : uptr = 0
-    symbolTable.writeLE<u64>(0); // st_size : u64 = 0
+    beginTable(SECTION_SYMTAB);
+    tables.writeLE<u32>(0); // st_name : u32, for the first symbol this is undefined
+    tables.write<u8>(symbolInfo(STB_LOCAL, STT_NOTYPE)); // st_info : u8, doesn't matter since this is a placeholder symbol
+    tables.write<u8>(STV_DEFAULT); // st_other : u8, again doesn't matter since this is a placeholder symbol
+    tables.writeLE<u16>(0); // st_shndx : u16
+    tables.writeLE<uptr>(0); // st_value : uptr = 0
+    tables.writeLE<u64>(0); // st_size : u64 = 0
 
-    for (const auto& entry : symbols) {
+    for (DefType binding : { DEF_LOCAL, DEF_GLOBAL }) for (const auto& entry : symbols) if ((entry.value.type == DEF_GLOBAL) == (binding == DEF_GLOBAL)) {
         u16 shndx;
+        u32 base = 0;
         switch (entry.value.section) {
-            case CODE_SECTION: shndx = 2; break; // .text
-            case DATA_SECTION: shndx = 3; break; // .rodata
-            case STATIC_SECTION: shndx = 4; break; // .data
+            case CODE_SECTION: shndx = codeSection(entry.value.offset, base); break;
+            case DATA_SECTION: shndx = SECTION_RODATA; break;
+            case STATIC_SECTION: shndx = SECTION_DATA; break;
             default:
                 unreachable("Shouldn't be able to define a symbol in any other section.");
         }
+        u8 type = entry.value.section == CODE_SECTION ? STT_FUNC : STT_OBJECT;
+        if (entry.value.section == CODE_SECTION && entry.value.type != DEF_GLOBAL)
+            type = STT_NOTYPE; // local code symbols are labels, not functions
         if (entry.value.offset == 0xffffffffu)
-            shndx = SHN_UNDEF;
-
-        symbolTable.writeLE<u32>(entry.value.nameOffset); // st_name : u32 (we generated strings in definition order, so st_name can just be the cumulative offset)
-        symbolTable.write<u8>(symbolInfo(entry.value.type == DEF_GLOBAL ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE)); // st_info : u8
-        symbolTable.write<u8>(STV_DEFAULT); // st_other : u8, we just use default visibility
-        symbolTable.writeLE<u16>(shndx);
-        symbolTable.writeLE<uptr>(entry.value.offset == 0xffffffffu ? 0 : entry.value.offset); // st_value : uptr (since it's relative to the start of the section, we can use the same offset)
-        symbolTable.writeLE<u64>(0); // st_size : u64 = 0
+            shndx = SHN_UNDEF, type = STT_NOTYPE;
+
+        tables.writeLE<u32>(entry.value.nameOffset); // st_name : u32 (we generated strings in definition order, so st_name can just be the cumulative offset)
+        tables.write<u8>(symbolInfo(entry.value.type == DEF_GLOBAL ? STB_GLOBAL : STB_LOCAL, type)); // st_info : u8
+        tables.write<u8>(STV_DEFAULT); // st_other : u8, we just use default visibility
+        tables.writeLE<u16>(shndx); // st_shndx : u16
+        tables.writeLE<uptr>(entry.value.offset == 0xffffffffu ? 0 : entry.value.offset - base); // st_value : uptr (relative to the start of the section)
+        tables.writeLE<u64>(entry.value.size); // st_size : u64 (extent of the function or object, 0 for labels and undefined symbols)
     }
+    endTable(SECTION_SYMTAB);
+
+    // Relocation tables, one per section with contents. We sort relocations by
+    // the table they belong in (a counting sort, so each table keeps them in
+    // their original order), then write the tables in section order.
 
-    while (symbolTable.size() % 64) // pad to multiple of 64 bytes
-        symbolTable.write<u8>(0);
-
-    sectionHeaderTable.writeLE<u32>(symbolTableNameOffset); // sh_name : u32 (.symtab in the section header string table)
-    sectionHeaderTable.writeLE<u32>(SHT_SYMTAB); // sh_type : u32 = SHT_SYMTAB
-    sectionHeaderTable.writeLE<u64>(SHF_MERGE | SHF_ALLOC); // sh_flags : u64 (it should be fine to merge our symbol table with others)
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
-    sectionHeaderTable.writeLE<u64>(symbolTableOffset); // sh_offset : u64 (text comes after the section header table)
-    sectionHeaderTable.writeLE<u64>(24 * (symbols.size() + 1)); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(5); // sh_link : u32 = 5 (.strtab)
-    sectionHeaderTable.writeLE<u32>(1); // sh_info : u32 = 2 (currently all symbols but the first are global; in the future this should be used to delineate local symbols)
-    sectionHeaderTable.writeLE<u64>(0); // sh_addralign : u64 = 8 (minimum alignment for entry type)
-    sectionHeaderTable.writeLE<u64>(24); // sh_entsize : u64 = 24 (size of each symbol entry)
-    assert(sectionHeaderTable.size() == 448);
-
-    // Relocation tables
-
-    bytebuf textRelocationTable, dataRelocationTable, staticRelocationTable;
-    u32 numTextRelocs = 0, numDataRelocs = 0, numStaticRelocs = 0;
-    for (Reloc reloc : relocs) {
-        bytebuf* buf;
+    vec<u32, 16> relocTables, relocBases, tableStarts, sortedRelocs;
+    for (u32 i = 0; i <= sections.size(); i ++)
+        tableStarts.push(0);
+    for (const Reloc& reloc : relocs) {
+        u32 table, base = 0;
         switch (reloc.section) {
-            case CODE_SECTION: buf = &textRelocationTable; numTextRelocs ++; break;
-            case DATA_SECTION: buf = &dataRelocationTable; numDataRelocs ++; break;
-            case STATIC_SECTION: buf = &staticRelocationTable; numStaticRelocs ++; break;
-            default:
-                unreachable("Shouldn't have relocations to any other section.");
+            case CODE_SECTION: {
+                u32 text = codeSection(reloc.offset - 1, base); // the relocated field ends at the reloc's offset
+                table = text == SECTION_TEXT ? SECTION_RELA_TEXT : text + 1;
+                break;
+            }
+            case DATA_SECTION: table = SECTION_RELA_RODATA; break;
+            case STATIC_SECTION: table = SECTION_RELA_DATA; break;
+        }
+        relocTables.push(table);
+        relocBases.push(base);
+        tableStarts[table + 1] ++;
+        sortedRelocs.push(0);
+    }
+    for (u32 i = 1; i < tableStarts.size(); i ++)
+        tableStarts[i] += tableStarts[i - 1];
+    vec<u32, 16> tableEnds;
+    for (u32 start : tableStarts)
+        tableEnds.push(start);
+    for (u32 i = 0; i < relocs.size(); i ++)
+        sortedRelocs[tableEnds[relocTables[i]] ++] = i;
+
+    for (u32 index = 0; index < sections.size(); index ++) if (sections[index].type == SHT_RELA && index != SECTION_RELA_EH_FRAME) {
+        beginTable(index);
+        for (u32 i = tableStarts[index]; i < tableStarts[index + 1]; i ++) {
+            const Reloc& reloc = relocs[sortedRelocs[i]];
+            uptr offset = reloc.offset - relocBases[sortedRelocs[i]];
+            u8 type = 0;
+            u64 addend = 0;
+            #ifdef RT_AMD64
+                constexpr u8 R_AMD64_PC16 = 13, R_AMD64_PC32 = 2, R_AMD64_PC8 = 15, R_AMD64_PC64 = 24; 
+                switch (reloc.kind) {
+                    case Reloc::REL8:
+                        offset -= 1;
+                        type = R_AMD64_PC8;
+                        addend = -1;
+                        break;
+                    case Reloc::REL16_LE:
+                        offset -= 2;
+                        type = R_AMD64_PC16;
+                        addend = -2;
+                        break;
+                    case Reloc::REL32_LE:
+                        offset -= 4;
+                        type = R_AMD64_PC32;
+                        addend = -4;
+                        break;
+                    case Reloc::REL64_LE:
+                        offset -= 8;
+                        type = R_AMD64_PC64;
+                        addend = -8;
+                        break;
+                    case Reloc::REL16_BE:
+                    case Reloc::REL32_BE:
+                    case Reloc::REL64_BE:
+                        unreachable("Shouldn't have big-endian relocations on amd64.");
+                }
+            #else
+                #error "Unsupported architecture for ELF relocations."
+            #endif
+            addend += reloc.addend;
+            tables.writeLE<uptr>(offset); // r_offset : uptr
+            tables.writeLE<u64>(u64(symbols[reloc.sym].index) << 32 | type); // r_info : u64
+            tables.writeLE<u64>(addend); // r_addend : u64
         }
-        uptr offset = reloc.offset;
-        u8 type = 0;
-        u64 addend = 0;
+        endTable(index);
+    }
+
+    // Unwind info, with each FDE's pc_begin relocated against its function.
+
+    vec<u32, 8> pcFields;
+    bytebuf ehFrame;
+    if (functions.size())
+        writeEHFrame(*this, functions, ehFrame, pcFields);
+    beginTable(SECTION_EH_FRAME);
+    tables.write(ehFrame);
+    endTable(SECTION_EH_FRAME);
+
+    beginTable(SECTION_RELA_EH_FRAME);
+    for (u32 i = 0; i < pcFields.size(); i ++) {
         #ifdef RT_AMD64
-            constexpr u8 R_AMD64_PC16 = 13, R_AMD64_PC32 = 2, R_AMD64_PC8 = 15, R_AMD64_PC64 = 24; 
-            switch (reloc.kind) {
-                case Reloc::REL8:
-                    offset -= 1;
-                    type = R_AMD64_PC8;
-                    addend = -1;
-                    break;
-                case Reloc::REL16_LE:
-                    offset -= 2;
-                    type = R_AMD64_PC16;
-                    addend = -2;
-                    break;
-                case Reloc::REL32_LE:
-                    offset -= 4;
-                    type = R_AMD64_PC32;
-                    addend = -4;
-                    break;
-                case Reloc::REL64_LE:
-                    offset -= 8;
-                    type = R_AMD64_PC64;
-                    addend = -8;
-                    break;
-                case Reloc::REL16_BE:
-                case Reloc::REL32_BE:
-                case Reloc::REL64_BE:
-                    unreachable("Shouldn't have big-endian relocations on amd64.");
-            }
+            constexpr u8 R_AMD64_PC32 = 2;
+            u8 type = R_AMD64_PC32;
         #else
             #error "Unsupported architecture for ELF relocations."
         #endif
-        buf->writeLE<uptr>(offset); // r_offset : uptr
-        buf->writeLE<u64>(u64(symbols[reloc.sym].index) << 32 | type); // r_info : u64
-        buf->writeLE<u64>(addend); // r_addend : u64
+        tables.writeLE<uptr>(pcFields[i]); // r_offset : uptr (relative to the start of .eh_frame)
+        tables.writeLE<u64>(u64(symbols[functions[i].sym].index) << 32 | type); // r_info : u64
+        tables.writeLE<u64>(0); // r_addend : u64 = 0 (pc_begin points at the function itself)
+    }
+    endTable(SECTION_RELA_EH_FRAME);
+
+    // Section header string table
+
+    beginTable(SECTION_SHSTRTAB);
+    tables.write("", 1); // string 0 must be the empty string
+    auto sectionName = [&](u32 section, const i8* name, u32 length) {
+        sections[section].name = tables.size() - sections[SECTION_SHSTRTAB].offset;
+        tables.write(name, length);
+    };
+    sectionName(SECTION_SHSTRTAB, ".shstrtab", 10);
+    sectionName(SECTION_TEXT, ".text", 6);
+    sectionName(SECTION_RODATA, ".rodata", 8);
+    sectionName(SECTION_DATA, ".data", 6);
+    sectionName(SECTION_STRTAB, ".strtab", 8);
+    sectionName(SECTION_SYMTAB, ".symtab", 8);
+    sectionName(SECTION_RELA_TEXT, ".rela.text", 11);
+    sectionName(SECTION_RELA_RODATA, ".rela.rodata", 13);
+    sectionName(SECTION_RELA_DATA, ".rela.data", 11);
+    sectionName(SECTION_EH_FRAME, ".eh_frame", 10);
+    sectionName(SECTION_RELA_EH_FRAME, ".rela.eh_frame", 15);
+    for (u32 i = 0; i < textSections.size(); i ++) {
+        auto name = symtab[functions[i].sym];
+        if (name.size() && name.last() == '\0')
+            name = { name.data(), name.size() - 1 };
+        sectionName(textSections[i] + 1, ".rela", 5); // .rela.text.<name> ends with .text.<name>, so they share a string
+        sections[textSections[i]].name = sections[textSections[i] + 1].name + 5;
+        tables.write(".text.", 6);
+        tables.write(name.data(), name.size());
+        tables.write<u8>(0);
+    }
+    endTable(SECTION_SHSTRTAB);
+
+    // Now that every section's size is known, assign file offsets. Sections
+    // with their own buffers come first, in order, then the table buffer.
+
+    u64 fileOffset = 64 + sections.size() * 64; // e_ehsize + e_shnum * e_shentsize
+    for (ELFSection& section : sections) if (section.contents) {
+        section.offset = fileOffset;
+        fileOffset += section.size + elfPadding(section.size);
+    }
+    u64 tablesOffset = fileOffset;
+    for (ELFSection& section : sections) if (!section.contents && section.type != SHT_NULL)
+        section.offset += tablesOffset;
+
+    // Overall ELF relocatable object header. Since we're relocatable, there's
+    // no entry point or program header table, and the section header table
+    // comes right after.
+
+    bytebuf header;
+    constexpr u16 ET_REL = 1;
+    writeELFHeader(header, ET_REL, 0, 0, 0, 64, sections.size(), SECTION_SHSTRTAB);
+
+    // Section header table
+
+    for (const ELFSection& section : sections) {
+        header.writeLE<u32>(section.name); // sh_name : u32 (offset in .shstrtab)
+        header.writeLE<u32>(section.type); // sh_type : u32
+        header.writeLE<u64>(section.flags); // sh_flags : u64
+        header.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
+        header.writeLE<u64>(section.offset); // sh_offset : u64
+        header.writeLE<u64>(section.size); // sh_size : u64
+        header.writeLE<u32>(section.link); // sh_link : u32
+        header.writeLE<u32>(section.info); // sh_info : u32
+        header.writeLE<u64>(section.align); // sh_addralign : u64
+        header.writeLE<u64>(section.entsize); // sh_entsize : u64
+    }
+    assert(header.size() == 64 + sections.size() * 64);
+
+    // Assemble the file in one buffer. Reading consumes our section buffers,
+    // so once every section is in place, we put their bytes back in order.
+
+    u64 fileSize = tablesOffset + tables.size();
+    i8* image = new i8[fileSize];
+    header.read(image, header.size());
+    for (const ELFSection& section : sections) if (section.contents) {
+        section.contents->read(image + section.offset, section.size);
+        for (u64 i = section.size; i < section.size + elfPadding(section.size); i ++)
+            image[section.offset + i] = 0;
     }
-    while (textRelocationTable.size() % 64) // pad to multiple of 64 bytes
-        textRelocationTable.write<u8>(0);
-    while (dataRelocationTable.size() % 64)
-        dataRelocationTable.write<u8>(0);
-    while (staticRelocationTable.size() % 64)
-        staticRelocationTable.write<u8>(0);
-    u32 textRelocationTableOffset = symbolTableOffset + symbolTable.size();
-    u32 dataRelocationTableOffset = textRelocationTableOffset + textRelocationTable.size();
-    u32 staticRelocationTableOffset = dataRelocationTableOffset + dataRelocationTable.size();
-    assert(textRelocationTableOffset % 64 == 0);
-    assert(dataRelocationTableOffset % 64 == 0);
-    assert(staticRelocationTableOffset % 64 == 0);
-
-    sectionHeaderTable.writeLE<u32>(textRelocationTableNameOffset); // sh_name : u32 (.rela.text in the section header string table)
-    sectionHeaderTable.writeLE<u32>(SHT_RELA); // sh_type : u32 = SHT_RELA
-    sectionHeaderTable.writeLE<u64>(SHF_MERGE | SHF_INFO_LINK); // sh_flags : u64 (it should be fine to merge our relocations with others)
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
-    sectionHeaderTable.writeLE<u64>(textRelocationTableOffset); // sh_offset : u64
-    sectionHeaderTable.writeLE<u64>(24 * numTextRelocs); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(6); // sh_link : u32 = 6 (.symtab)
-    sectionHeaderTable.writeLE<u32>(2); // sh_info : u32 = 2 (relocations apply to .text section)
-    sectionHeaderTable.writeLE<u64>(0); // sh_addralign : u64 = 8 (minimum alignment for relocation type)
-    sectionHeaderTable.writeLE<u64>(24); // sh_entsize : u64 = 24 (size of each relocation entry)
-    assert(sectionHeaderTable.size() == 512);
-
-    sectionHeaderTable.writeLE<u32>(dataRelocationTableNameOffset); // sh_name : u32 (.rela.rodata in the section header string table)
-    sectionHeaderTable.writeLE<u32>(SHT_RELA); // sh_type : u32 = SHT_RELA
-    sectionHeaderTable.writeLE<u64>(SHF_MERGE | SHF_INFO_LINK); // sh_flags : u64 (it should be fine to merge our relocations with others)
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
-    sectionHeaderTable.writeLE<u64>(dataRelocationTableOffset); // sh_offset : u64
-    sectionHeaderTable.writeLE<u64>(24 * numDataRelocs); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(6); // sh_link : u32 = 6 (.symtab)
-    sectionHeaderTable.writeLE<u32>(3); // sh_info : u32 = 3 (relocations apply to .rodata section)
-    sectionHeaderTable.writeLE<u64>(0); // sh_addralign : u64 = 8 (minimum alignment for relocation type)
-    sectionHeaderTable.writeLE<u64>(24); // sh_entsize : u64 = 24 (size of each relocation entry)
-    assert(sectionHeaderTable.size() == 576);
-
-    sectionHeaderTable.writeLE<u32>(staticRelocationTableNameOffset); // sh_name : u32 (.rela.data in the section header string table)
-    sectionHeaderTable.writeLE<u32>(SHT_RELA); // sh_type : u32 = SHT_RELA
-    sectionHeaderTable.writeLE<u64>(SHF_MERGE | SHF_INFO_LINK); // sh_flags : u64 (it should be fine to merge our relocations with others)
-    sectionHeaderTable.writeLE<uptr>(0); // sh_addr : uptr = 0 (we're relocatable; someone will fill this in later)
-    sectionHeaderTable.writeLE<u64>(staticRelocationTableOffset); // sh_offset : u64
-    sectionHeaderTable.writeLE<u64>(24 * numStaticRelocs); // sh_size : u64
-    sectionHeaderTable.writeLE<u32>(6); // sh_link : u32 = 6 (.symtab)
-    sectionHeaderTable.writeLE<u32>(4); // sh_info : u32 = 2 (relocations apply to .data section)
-    sectionHeaderTable.writeLE<u64>(0); // sh_addralign : u64 = 8 (minimum alignment for relocation type)
-    sectionHeaderTable.writeLE<u64>(24); // sh_entsize : u64 = 24 (size of each relocation entry)
-    assert(sectionHeaderTable.size() == 640);
-
-    write(file, objectHeader);
-    write(file, sectionHeaderTable);
-    write(file, sectionHeaderStringTable);
-    write(file, textSection);
-    write(file, dataSection);
-    write(file, staticSection);
-    write(file, stringTable);
-    write(file, symbolTable);
-    write(file, textRelocationTable);
-    write(file, dataRelocationTable);
-    write(file, staticRelocationTable);
+    for (const ELFSection& section : sections) if (section.contents)
+        section.contents->write(image + section.offset, section.size);
+    tables.read(image + tablesOffset, tables.size());
+    write(file, const_slice<i8>{ image, iword(fileSize) });
+    delete[] image;
+}
+
+void LinkedAssembly::writeELFExecutable(fd file, Symbol entry, bool pie) {
+    auto it = defs.find(entry);
+    if (it == defs.end())
+        panic("Undefined entry point!");
+
+    // By the time we're linked, code, data, and static sections are laid out
+    // back-to-back in page-aligned memory, and every relocation we support is
+    // pc-relative. So we can write the linked image out verbatim, as long as
+    // the segments keep the same placement relative to one another. The first
+    // page of the file is reserved for the ELF and program headers.
+
+    u64 base = pie ? 0 : 0x400000; // traditional non-PIE load address on amd64
+    u64 codeAddress = base + PAGESIZE;
+    u64 dataAddress = codeAddress + codesize;
+    u64 staticAddress = dataAddress + datasize;
+    u64 entryAddress = codeAddress + (it->value - iptr(code));
+
+    constexpr u32 PT_LOAD = 1, PT_GNU_STACK = 0x6474e551;
+    constexpr u32 PF_X = 1, PF_W = 2, PF_R = 4;
+    u16 numSegments = 1 + (codesize ? 1 : 0) + (datasize ? 1 : 0) + (statsize ? 1 : 0);
+    assert(64 + numSegments * 56 <= PAGESIZE);
+
+    // ET_DYN without an interpreter is a static PIE. We skip section headers
+    // entirely, since the loader only needs segments.
+
+    bytebuf image;
+    constexpr u16 ET_EXEC = 2, ET_DYN = 3;
+    writeELFHeader(image, pie ? ET_DYN : ET_EXEC, entryAddress, 64, numSegments, 0, 0, 0);
+
+    auto segment = [&](u32 flags, u64 offset, u64 address, u64 size) {
+        image.writeLE<u32>(PT_LOAD); // p_type : u32 = PT_LOAD
+        image.writeLE<u32>(flags); // p_flags : u32
+        image.writeLE<u64>(offset); // p_offset : u64 (file offset of the segment)
+        image.writeLE<uptr>(address); // p_vaddr : uptr
+        image.writeLE<uptr>(address); // p_paddr : uptr (unused, but conventionally the same as p_vaddr)
+        image.writeLE<u64>(size); // p_filesz : u64
+        image.writeLE<u64>(size); // p_memsz : u64 (no bss, everything is in the file)
+        image.writeLE<u64>(PAGESIZE); // p_align : u64
+    };
+
+    u64 codeOffset = PAGESIZE, dataOffset = codeOffset + codesize, staticOffset = dataOffset + datasize;
+    if (codesize) segment(PF_R | PF_X, codeOffset, codeAddress, codesize);
+    if (datasize) segment(PF_R, dataOffset, dataAddress, datasize);
+    if (statsize) segment(PF_R | PF_W, staticOffset, staticAddress, statsize);
+
+    image.writeLE<u32>(PT_GNU_STACK); // p_type : u32 = PT_GNU_STACK (request a non-executable stack)
+    image.writeLE<u32>(PF_R | PF_W); // p_flags : u32
+    for (u32 i = 0; i < 6; i ++)
+        image.writeLE<u64>(0); // p_offset, p_vaddr, p_paddr, p_filesz, p_memsz, p_align : all zero
+    assert(image.size() == 64 + 56 * numSegments);
+
+    while (image.size() < codeOffset) // pad out the header page
+        image.write<u8>(0);
+    image.write(code, codesize);
+    image.write(data, datasize);
+    image.write(stat, statsize);
+
+    write(file, image);
+}
+
+inline u32 elfHash(const_slice<i8> name) {
+    u32 h = 0;
+    for (i8 c : name) {
+        h = (h << 4) + u8(c);
+        u32 g = h & 0xf0000000u;
+        if (g)
+            h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+void Assembly::writeELFSharedObject(fd file) {
+    // Gather up exported symbols before linking, while we still know which
+    // definitions are global, and how big they are.
+
+    vec<u32, 16> sizes;
+    computeSymbolSizes(*this, sizes);
+    vec<u32, 16> exports;
+    for (u32 i = 0; i < defs.size(); i ++) if (defs[i].type == DEF_GLOBAL) {
+        bool duplicate = false;
+        for (u32 j : exports) if (defs[j].sym == defs[i].sym)
+            duplicate = true;
+        if (!duplicate)
+            exports.push(i);
+    }
+
+    // Since every relocation we support is pc-relative, linking in memory
+    // produces an image that's correct at any base address, so long as code,
+    // rodata, and static data keep their relative placement. There's no PLT,
+    // so everything referenced has to be defined here; linking panics if not.
+
+    LinkedAssembly linked;
+    linkInto(linked);
+
+    // Dynamic symbol and string tables, and a SysV hash table over them.
+
+    bytebuf dynstr, dynsym, hash;
+    dynstr.write<u8>(0); // First string is always empty.
+    vec<u32, 16> nameOffsets;
+    for (u32 i : exports) {
+        auto str = symtab[defs[i].sym];
+        nameOffsets.push(dynstr.size());
+        dynstr.write(str.data(), str.size());
+        if (str.last() != '\0')
+            dynstr.write<u8>(0);
+    }
+
+    u32 nsyms = exports.size() + 1, nbuckets = 1;
+    while (nbuckets * 2 < nsyms)
+        nbuckets *= 2;
+    vec<u32, 16> buckets, chains;
+    for (u32 i = 0; i < nbuckets; i ++)
+        buckets.push(0);
+    for (u32 i = 0; i < nsyms; i ++)
+        chains.push(0);
+    for (u32 i = 0; i < exports.size(); i ++) {
+        u32 bucket = elfHash(symtab[defs[exports[i]].sym]) % nbuckets;
+        chains[i + 1] = buckets[bucket];
+        buckets[bucket] = i + 1;
+    }
+    hash.writeLE<u32>(nbuckets); // nbucket : u32
+    hash.writeLE<u32>(nsyms); // nchain : u32 (one chain entry per dynamic symbol)
+    for (u32 bucket : buckets)
+        hash.writeLE<u32>(bucket);
+    for (u32 chain : chains)
+        hash.writeLE<u32>(chain);
+
+    // Layout. The first page holds the headers and dynamic symbol info, then
+    // code, rodata, and static data each get page-aligned segments, with the
+    // dynamic section placed directly after static data.
+
+    constexpr u32 PT_LOAD = 1, PT_DYNAMIC = 2, PT_GNU_STACK = 0x6474e551;
+    constexpr u32 PF_X = 1, PF_W = 2, PF_R = 4;
+    u16 numSegments = 4 + (linked.codesize ? 1 : 0) + (linked.datasize ? 1 : 0);
+
+    u64 hashOffset = 64 + numSegments * 56;
+    u64 dynsymOffset = (hashOffset + hash.size() + 7) & ~7ull;
+    u64 dynstrOffset = dynsymOffset + nsyms * 24;
+    u64 codeOffset = up_to_nearest_page(dynstrOffset + dynstr.size());
+    u64 dataOffset = codeOffset + linked.codesize;
+    u64 staticOffset = dataOffset + linked.datasize;
+    u64 dynamicOffset = staticOffset + linked.statsize;
+    u64 dynamicSize = 6 * 16;
+    u64 shstrtabOffset = dynamicOffset + dynamicSize;
+
+    constexpr u16 SHN_UNDEF = 0;
+    constexpr u32 SECTION_HASH = 1, SECTION_DYNSYM = 2, SECTION_DYNSTR = 3, SECTION_TEXT = 4, SECTION_RODATA = 5,
+        SECTION_DATA = 6, SECTION_DYNAMIC = 7, SECTION_SHSTRTAB = 8, NUM_SECTIONS = 9;
+
+    constexpr u8 STB_GLOBAL = 1;
+    constexpr u8 STT_NOTYPE = 0, STT_OBJECT = 1, STT_FUNC = 2;
+    constexpr u8 STV_DEFAULT = 0;
+
+    dynsym.writeLE<u32>(0); // st_name : u32, for the first symbol this is undefined
+    dynsym.write<u8>(0); // st_info : u8
+    dynsym.write<u8>(STV_DEFAULT); // st_other : u8
+    dynsym.writeLE<u16>(SHN_UNDEF); // st_shndx : u16
+    dynsym.writeLE<uptr>(0); // st_value : uptr = 0
+    dynsym.writeLE<u64>(0); // st_size : u64 = 0
+    for (u32 i = 0; i < exports.size(); i ++) {
+        const Def& def = defs[exports[i]];
+        u16 shndx;
+        u64 base;
+        switch (def.section) {
+            case CODE_SECTION: shndx = SECTION_TEXT, base = codeOffset; break;
+            case DATA_SECTION: shndx = SECTION_RODATA, base = dataOffset; break;
+            case STATIC_SECTION: shndx = SECTION_DATA, base = staticOffset; break;
+        }
+        dynsym.writeLE<u32>(nameOffsets[i]); // st_name : u32 (offset in .dynstr)
+        dynsym.write<u8>(STB_GLOBAL << 4 | (def.section == CODE_SECTION ? STT_FUNC : STT_OBJECT)); // st_info : u8
+        dynsym.write<u8>(STV_DEFAULT); // st_other : u8, we just use default visibility
+        dynsym.writeLE<u16>(shndx); // st_shndx : u16
+        dynsym.writeLE<uptr>(base + def.offset); // st_value : uptr (address relative to the load base)
+        dynsym.writeLE<u64>(sizes[exports[i]]); // st_size : u64
+    }
+
+    constexpr u64 DT_NULL = 0, DT_HASH = 4, DT_STRTAB = 5, DT_SYMTAB = 6, DT_STRSZ = 10, DT_SYMENT = 11;
+    bytebuf dynamic;
+    auto dynamicEntry = [&](u64 tag, u64 value) {
+        dynamic.writeLE<u64>(tag); // d_tag : u64
+        dynamic.writeLE<u64>(value); // d_val/d_ptr : u64
+    };
+    dynamicEntry(DT_HASH, hashOffset);
+    dynamicEntry(DT_STRTAB, dynstrOffset);
+    dynamicEntry(DT_SYMTAB, dynsymOffset);
+    dynamicEntry(DT_STRSZ, dynstr.size());
+    dynamicEntry(DT_SYMENT, 24);
+    dynamicEntry(DT_NULL, 0);
+    assert(dynamic.size() == dynamicSize);
+
+    bytebuf shstrtab;
+    u32 sectionNames[NUM_SECTIONS] = { 0 };
+    shstrtab.write("", 1); // string 0 must be the empty string
+    auto sectionName = [&](u32 section, const i8* name, u32 length) {
+        sectionNames[section] = shstrtab.size();
+        shstrtab.write(name, length);
+    };
+    sectionName(SECTION_HASH, ".hash", 6);
+    sectionName(SECTION_DYNSYM, ".dynsym", 8);
+    sectionName(SECTION_DYNSTR, ".dynstr", 8);
+    sectionName(SECTION_TEXT, ".text", 6);
+    sectionName(SECTION_RODATA, ".rodata", 8);
+    sectionName(SECTION_DATA, ".data", 6);
+    sectionName(SECTION_DYNAMIC, ".dynamic", 9);
+    sectionName(SECTION_SHSTRTAB, ".shstrtab", 10);
+    u64 sectionHeaderOffset = (shstrtabOffset + shstrtab.size() + 7) & ~7ull;
+
+    // ELF header. Libraries have no entry point, and the section header table
+    // comes at the very end of the file.
+
+    bytebuf image;
+    constexpr u16 ET_DYN = 3;
+    writeELFHeader(image, ET_DYN, 0, 64, numSegments, sectionHeaderOffset, NUM_SECTIONS, SECTION_SHSTRTAB);
+
+    // Program headers. Since the base address is zero, file offsets and
+    // virtual addresses coincide everywhere.
+
+    auto segment = [&](u32 type, u32 flags, u64 offset, u64 size, u64 align) {
+        image.writeLE<u32>(type); // p_type : u32
+        image.writeLE<u32>(flags); // p_flags : u32
+        image.writeLE<u64>(offset); // p_offset : u64
+        image.writeLE<uptr>(offset); // p_vaddr : uptr
+        image.writeLE<uptr>(offset); // p_paddr : uptr
+        image.writeLE<u64>(size); // p_filesz : u64
+        image.writeLE<u64>(size); // p_memsz : u64
+        image.writeLE<u64>(align); // p_align : u64
+    };
+
+    segment(PT_LOAD, PF_R, 0, dynstrOffset + dynstr.size(), PAGESIZE);
+    if (linked.codesize) segment(PT_LOAD, PF_R | PF_X, codeOffset, linked.codesize, PAGESIZE);
+    if (linked.datasize) segment(PT_LOAD, PF_R, dataOffset, linked.datasize, PAGESIZE);
+    segment(PT_LOAD, PF_R | PF_W, staticOffset, linked.statsize + dynamicSize, PAGESIZE);
+    segment(PT_DYNAMIC, PF_R | PF_W, dynamicOffset, dynamicSize, 8);
+    segment(PT_GNU_STACK, PF_R | PF_W, 0, 0, 0); // request a non-executable stack
+    assert(image.size() == hashOffset);
+
+    image.write(hash);
+    while (image.size() < dynsymOffset)
+        image.write<u8>(0);
+    image.write(dynsym);
+    image.write(dynstr);
+    while (image.size() < codeOffset) // pad out the header pages
+        image.write<u8>(0);
+    image.write(linked.code, linked.codesize);
+    image.write(linked.data, linked.datasize);
+    image.write(linked.stat, linked.statsize);
+    image.write(dynamic);
+    image.write(shstrtab);
+    while (image.size() < sectionHeaderOffset)
+        image.write<u8>(0);
+
+    // Section header table. Not needed to load the library, but it keeps
+    // tools like objdump and readelf happy.
+
+    auto sectionHeader = [&](u32 section, u32 type, u64 flags, u64 offset, u64 size, u32 link, u32 info, u64 align, u64 entsize) {
+        image.writeLE<u32>(sectionNames[section]); // sh_name : u32 (offset in .shstrtab)
+        image.writeLE<u32>(type); // sh_type : u32
+        image.writeLE<u64>(flags); // sh_flags : u64
+        image.writeLE<uptr>(flags & 2 ? offset : 0); // sh_addr : uptr (same as the offset for allocated sections)
+        image.writeLE<u64>(offset); // sh_offset : u64
+        image.writeLE<u64>(size); // sh_size : u64
+        image.writeLE<u32>(link); // sh_link : u32
+        image.writeLE<u32>(info); // sh_info : u32
+        image.writeLE<u64>(align); // sh_addralign : u64
+        image.writeLE<u64>(entsize); // sh_entsize : u64
+    };
+
+    constexpr u32 SHT_NULL = 0, SHT_PROGBITS = 1, SHT_STRTAB = 3, SHT_HASH = 5, SHT_DYNAMIC = 6, SHT_DYNSYM = 11;
+    constexpr u32 SHF_WRITE = 1, SHF_ALLOC = 2, SHF_EXECINSTR = 4;
+    sectionHeader(0, SHT_NULL, 0, 0, 0, SHN_UNDEF, 0, 0, 0);
+    sectionHeader(SECTION_HASH, SHT_HASH, SHF_ALLOC, hashOffset, hash.size(), SECTION_DYNSYM, 0, 8, 4);
+    sectionHeader(SECTION_DYNSYM, SHT_DYNSYM, SHF_ALLOC, dynsymOffset, nsyms * 24, SECTION_DYNSTR, 1, 8, 24); // sh_info is 1, since only the null symbol is local
+    sectionHeader(SECTION_DYNSTR, SHT_STRTAB, SHF_ALLOC, dynstrOffset, dynstr.size(), SHN_UNDEF, 0, 1, 0);
+    sectionHeader(SECTION_TEXT, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, codeOffset, linked.codesize, SHN_UNDEF, 0, 16, 0);
+    sectionHeader(SECTION_RODATA, SHT_PROGBITS, SHF_ALLOC, dataOffset, linked.datasize, SHN_UNDEF, 0, 16, 0);
+    sectionHeader(SECTION_DATA, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, staticOffset, linked.statsize, SHN_UNDEF, 0, 16, 0);
+    sectionHeader(SECTION_DYNAMIC, SHT_DYNAMIC, SHF_ALLOC | SHF_WRITE, dynamicOffset, dynamicSize, SECTION_DYNSTR, 0, 8, 16);
+    sectionHeader(SECTION_SHSTRTAB, SHT_STRTAB, 0, shstrtabOffset, shstrtab.size(), SHN_UNDEF, 0, 1, 0);
+    assert(image.size() == sectionHeaderOffset + NUM_SECTIONS * 64);
+
+    write(file, image);
+}
+
+inline u16 readU16LE(const i8* ptr) {
+    const u8* bytes = (const u8*)ptr;
+    return u16(bytes[0]) | u16(bytes[1]) << 8;
+}
+
+inline u64 readU64LE(const i8* ptr) {
+    return u64(readU32LE(ptr)) | u64(readU32LE(ptr + 4)) << 32;
+}
+
+// Stable merge sort of defs by section, then offset, so that defs taken from
+// an unordered symbol table read like ones emitted in order.
+static void sortDefs(slice<Def> defs, slice<Def> scratch) {
+    if (defs.size() < 2)
+        return;
+    iword mid = defs.size() / 2;
+    sortDefs({ defs.data(), mid }, scratch);
+    sortDefs({ defs.data() + mid, defs.size() - mid }, scratch);
+    auto before = [](const Def& a, const Def& b) -> bool {
+        return a.section < b.section || (a.section == b.section && a.offset < b.offset);
+    };
+    iword i = 0, j = mid, k = 0;
+    while (i < mid && j < defs.size())
+        scratch[k ++] = before(defs[j], defs[i]) ? defs[j ++] : defs[i ++];
+    while (i < mid)
+        scratch[k ++] = defs[i ++];
+    while (j < defs.size())
+        scratch[k ++] = defs[j ++];
+    for (k = 0; k < defs.size(); k ++)
+        defs[k] = scratch[k];
 }
 
-void LinkedAssembly::writeELFExecutable(fd file) {
-    unreachable("TODO: Executable generation");
+struct ELFInputSection {
+    bool mapped;
+    Section section;
+    u32 base; // offset of the section's contents within our buffer
+};
+
+struct ELFInputSymbol {
+    enum Kind : u8 { UNUSABLE, UNDEFINED, DEFINED, SECTION } kind;
+    Symbol sym;
+    DefType type;
+    Section section;
+    i64 offset;
+};
+
+void Assembly::readELFObject(const_slice<i8> bytes) {
+    constexpr u32 SHT_PROGBITS = 1, SHT_SYMTAB = 2, SHT_RELA = 4, SHT_NOBITS = 8, SHT_REL = 9;
+    constexpr u64 SHF_WRITE = 1, SHF_ALLOC = 2, SHF_EXECINSTR = 4, SHF_TLS = 1024;
+    constexpr u16 SHN_UNDEF = 0, SHN_LORESERVE = 0xff00, SHN_COMMON = 0xfff2;
+    constexpr u8 STB_LOCAL = 0;
+    constexpr u8 STT_SECTION = 3, STT_FILE = 4, STT_TLS = 6;
+    constexpr u8 ELFCLASS64 = 2, ELFDATALSB = 1;
+    constexpr u16 ET_REL = 1, EM_X86_64 = 62;
+
+    if (bytes.size() < 64 || memory::compare(bytes.data(), "\x7f" "ELF", 4))
+        panic("Failed to read ELF object!");
+    if (u8(bytes[4]) != ELFCLASS64 || u8(bytes[5]) != ELFDATALSB)
+        panic("Failed to read ELF object: only little-endian 64-bit objects are supported!");
+    if (readU16LE(bytes.data() + 16) != ET_REL)
+        panic("Failed to read ELF object: not a relocatable object!");
+    #ifdef RT_AMD64
+        if (readU16LE(bytes.data() + 18) != EM_X86_64)
+            panic("Failed to read ELF object: wrong machine type!");
+    #else
+        #error "Unsupported architecture for reading ELF objects."
+    #endif
+
+    u64 shoff = readU64LE(bytes.data() + 40);
+    u32 shentsize = readU16LE(bytes.data() + 58), shnum = readU16LE(bytes.data() + 60), shstrndx = readU16LE(bytes.data() + 62);
+    if (shentsize < 64 || shstrndx >= shnum || shoff + u64(shentsize) * shnum > u64(bytes.size()))
+        panic("Failed to read ELF object: section headers out of bounds!");
+
+    auto sectionHeader = [&](u32 i) -> const i8* {
+        return bytes.data() + shoff + i * shentsize;
+    };
+    auto sectionContents = [&](u32 i) -> const_slice<i8> {
+        const i8* header = sectionHeader(i);
+        u64 offset = readU64LE(header + 24), size = readU64LE(header + 32);
+        if (readU32LE(header + 4) != SHT_NOBITS && offset + size > u64(bytes.size()))
+            panic("Failed to read ELF object: section out of bounds!");
+        return { bytes.data() + offset, iword(size) };
+    };
+    auto stringAt = [&](u32 table, u32 offset) -> const_slice<i8> {
+        const_slice<i8> strings = sectionContents(table);
+        if (offset >= strings.size())
+            panic("Failed to read ELF object: string out of bounds!");
+        iword length = 0;
+        while (offset + length < strings.size() && strings[offset + length])
+            length ++;
+        return { strings.data() + offset, length };
+    };
+
+    // Sections are appended after anything already in the assembly, keeping
+    // their alignment relative to the start of the buffer - which linking
+    // places at the start of a page.
+
+    vec<ELFInputSection, 16> sections;
+    u32 symtabIndex = 0;
+    for (u32 i = 0; i < shnum; i ++) {
+        const i8* header = sectionHeader(i);
+        u32 type = readU32LE(header + 4);
+        u64 flags = readU64LE(header + 8), align = readU64LE(header + 48);
+        sections.push({ false, CODE_SECTION, 0 });
+        if (type == SHT_SYMTAB)
+            symtabIndex = i;
+        if (!(flags & SHF_ALLOC) || (type != SHT_PROGBITS && type != SHT_NOBITS))
+            continue;
+        const_slice<i8> name = stringAt(shstrndx, readU32LE(header));
+        if (name.size() == 9 && !memory::compare(name.data(), ".eh_frame", 9))
+            continue; // Unwind info for the object's own functions, which we don't carry over.
+        if (flags & SHF_TLS)
+            panic("Failed to read ELF object: thread-local sections aren't supported!");
+
+        Section section = flags & SHF_EXECINSTR ? CODE_SECTION : flags & SHF_WRITE ? STATIC_SECTION : DATA_SECTION;
+        bytebuf* buffer;
+        switch (section) {
+            case CODE_SECTION: buffer = &code; break;
+            case DATA_SECTION: buffer = &data; break;
+            case STATIC_SECTION: buffer = &stat; break;
+        }
+        if (align > PAGESIZE)
+            panic("Failed to read ELF object: section alignment is larger than a page!");
+        while (align > 1 && buffer->size() % align)
+            buffer->write<u8>(0);
+        sections.last() = { true, section, u32(buffer->size()) };
+        const_slice<i8> contents = sectionContents(i);
+        if (type == SHT_NOBITS) for (iword j = 0; j < contents.size(); j ++)
+            buffer->write<u8>(0);
+        else
+            buffer->write(contents.data(), contents.size());
+    }
+    if (!symtabIndex)
+        return; // Nothing can refer to anything, so there's nothing more to do.
+
+    // Symbols. Common symbols are allocated in static data here, since
+    // nothing else will do it for us.
+
+    vec<Def, 32> newDefs;
+    vec<ELFInputSymbol, 32> symbols;
+    const_slice<i8> symtabContents = sectionContents(symtabIndex);
+    u32 strtabIndex = readU32LE(sectionHeader(symtabIndex) + 40);
+    if (strtabIndex >= shnum)
+        panic("Failed to read ELF object: bad string table index!");
+    for (iword i = 0; i + 24 <= symtabContents.size(); i += 24) {
+        const i8* entry = symtabContents.data() + i;
+        u8 info = entry[4], binding = info >> 4, type = info & 0xf;
+        u16 shndx = readU16LE(entry + 6);
+        u64 value = readU64LE(entry + 8), size = readU64LE(entry + 16);
+        const_slice<i8> name = stringAt(strtabIndex, readU32LE(entry));
+
+        ELFInputSymbol symbol = { ELFInputSymbol::UNUSABLE, 0, binding == STB_LOCAL ? DEF_LOCAL : DEF_GLOBAL, CODE_SECTION, 0 };
+        if (i == 0 || type == STT_FILE)
+            ; // The null symbol and file names can't be referred to.
+        else if (type == STT_TLS)
+            panic("Failed to read ELF object: thread-local symbols aren't supported!");
+        else if (shndx == SHN_UNDEF)
+            symbol.kind = ELFInputSymbol::UNDEFINED, symbol.sym = symtab[name], symbol.type = DEF_GLOBAL;
+        else if (shndx == SHN_COMMON) {
+            while (value > 1 && stat.size() % value) // st_value is the alignment for common symbols
+                stat.write<u8>(0);
+            symbol.kind = ELFInputSymbol::DEFINED, symbol.section = STATIC_SECTION, symbol.offset = stat.size();
+            for (u64 j = 0; j < size; j ++)
+                stat.write<u8>(0);
+        }
+        else if (shndx < SHN_LORESERVE && shndx < shnum && sections[shndx].mapped) {
+            symbol.kind = type == STT_SECTION ? ELFInputSymbol::SECTION : ELFInputSymbol::DEFINED;
+            symbol.section = sections[shndx].section;
+            symbol.offset = sections[shndx].base + value;
+        }
+
+        if (symbol.kind == ELFInputSymbol::DEFINED) {
+            symbol.sym = symbol.type == DEF_GLOBAL ? symtab[name] : anon();
+            newDefs.push(Def(symbol.section, symbol.type, symbol.offset, symbol.sym));
+        }
+        symbols.push(symbol);
+    }
+
+    // Relocations. Ours always refer to the end of the relocated field, so a
+    // relocation against a symbol maps onto a Reloc with whatever is left of
+    // the addend once we account for that (addend + size). Section symbols
+    // have no Symbol of their own, so for those we define a new local symbol
+    // wherever the relocation actually points.
+
+    for (u32 i = 0; i < shnum; i ++) {
+        const i8* header = sectionHeader(i);
+        u32 type = readU32LE(header + 4), target = readU32LE(header + 44);
+        if ((type != SHT_RELA && type != SHT_REL) || target >= shnum || !sections[target].mapped)
+            continue;
+        if (type == SHT_REL)
+            panic("Failed to read ELF object: relocations without addends aren't supported!");
+        if (readU32LE(header + 40) != symtabIndex)
+            panic("Failed to read ELF object: relocations refer to an unknown symbol table!");
+
+        const ELFInputSection& section = sections[target];
+        const_slice<i8> entries = sectionContents(i);
+        for (iword j = 0; j + 24 <= entries.size(); j += 24) {
+            u64 offset = readU64LE(entries.data() + j), info = readU64LE(entries.data() + j + 8);
+            i64 addend = (i64)readU64LE(entries.data() + j + 16);
+            u32 symbolIndex = info >> 32;
+            Reloc::Kind kind;
+            i64 size;
+            #ifdef RT_AMD64
+                constexpr u32 R_AMD64_PC32 = 2, R_AMD64_PLT32 = 4, R_AMD64_PC16 = 13, R_AMD64_PC8 = 15, R_AMD64_PC64 = 24;
+                switch (u32(info)) {
+                    case R_AMD64_PC8: kind = Reloc::REL8, size = 1; break;
+                    case R_AMD64_PC16: kind = Reloc::REL16_LE, size = 2; break;
+                    case R_AMD64_PC32:
+                    case R_AMD64_PLT32: kind = Reloc::REL32_LE, size = 4; break; // Without a PLT, calls are just direct.
+                    case R_AMD64_PC64: kind = Reloc::REL64_LE, size = 8; break;
+                    default:
+                        panic("Failed to read ELF object: unsupported relocation type!");
+                }
+            #endif
+            if (symbolIndex >= symbols.size() || symbols[symbolIndex].kind == ELFInputSymbol::UNUSABLE)
+                panic("Failed to read ELF object: relocation against unknown symbol!");
+
+            const ELFInputSymbol& symbol = symbols[symbolIndex];
+            i32 end = section.base + offset + size;
+            if (symbol.kind != ELFInputSymbol::SECTION) {
+                if (addend + size != i32(addend + size))
+                    panic("Failed to read ELF object: relocation addend is out of range!");
+                relocs.push(Reloc(section.section, symbol.type, kind, end, symbol.sym, addend + size));
+            }
+            else {
+                Symbol sym = anon();
+                newDefs.push(Def(symbol.section, DEF_LOCAL, symbol.offset + addend + size, sym));
+                relocs.push(Reloc(section.section, DEF_LOCAL, kind, end, sym));
+            }
+        }
+    }
+
+    if (!newDefs.size())
+        return;
+    vec<Def, 32> scratch;
+    for (const Def& def : newDefs)
+        scratch.push(def);
+    sortDefs({ &newDefs[0], iword(newDefs.size()) }, { &scratch[0], iword(scratch.size()) });
+    for (const Def& def : newDefs)
+        defs.push(def);
 }
@@ -29,13 +29,29 @@ constexpr const i8* OS_NAMES[] = {
     "windows", "osx", "linux", "bsd", "wasi"
 };
 
+// Instruction set levels, each of which includes the ones before it. On
+// amd64 these are the x86-64 microarchitecture levels: v2 adds popcnt and
+// SSE4.2, v3 adds AVX2, BMI1/2, lzcnt and FMA, and v4 adds AVX-512. Other
+// architectures only have a baseline.
+enum ISALevel : u8 {
+    ISA_BASELINE,
+    ISA_V2,
+    ISA_V3,
+    ISA_V4
+};
+
+constexpr const i8* ISA_LEVEL_NAMES[] = {
+    "v1", "v2", "v3", "v4"
+};
+
 struct TargetDesc {
     OS os;
     Arch arch;
-    inline TargetDesc(OS os_in, Arch arch_in): os(os_in), arch(arch_in) {}
+    ISALevel level;
+    inline TargetDesc(OS os_in, Arch arch_in, ISALevel level_in = ISA_BASELINE): os(os_in), arch(arch_in), level(level_in) {}
 
     inline bool operator==(const TargetDesc& other) const {
-        return arch == other.arch && os == other.os;
+        return arch == other.arch && os == other.os && level == other.level;
     }
 
     inline bool operator!=(const TargetDesc& other) const {
@@ -47,19 +63,22 @@ using mreg = i8;   // Generic type of machine register.
 
 template<typename IO>
 inline IO format_impl(IO io, const TargetDesc& target) {
+    if (target.arch == ARCH_AMD64)
+        return format(io, OS_NAMES[target.os], '-', ARCH_NAMES[target.arch], '-', ISA_LEVEL_NAMES[target.level]);
     return format(io, OS_NAMES[target.os], '-', ARCH_NAMES[target.arch]);
 }
 
+// Set of up to 128 machine registers, as a bitmap split over two words.
 struct RegSet {
-    u64 regs;
+    u64 regs[2];
 
     inline constexpr void add(mreg r) {
-        regs |= u64(1) << r;
+        regs[r >> 6] |= u64(1) << (r & 63);
     }
 
     inline constexpr void add(const mreg* arr, i32 n) {
         for (i32 i = 0; i < n; i ++)
-            regs |= u64(1) << arr[i];
+            add(arr[i]);
     }
 
     template<typename... Args>
@@ -80,10 +99,10 @@ struct RegSet {
     }
 
     inline constexpr RegSet(): 
-        regs(0) {}
+        regs{0, 0} {}
 
     inline constexpr void remove(mreg r) {
-        regs &= ~(u64(1) << r);
+        regs[r >> 6] &= ~(u64(1) << (r & 63));
     }
 
     inline constexpr RegSet without(mreg r) {
@@ -93,17 +112,19 @@ struct RegSet {
     }
 
     inline constexpr bool operator[](mreg r) const {
-        return regs & u64(1) << r;
+        return regs[r >> 6] & u64(1) << (r & 63);
     }
 
     inline constexpr operator bool() const {
-        return regs;
+        return regs[0] | regs[1];
     }
 
     inline mreg next() const {
-        if (!regs)
-            return -1;
-        return ctz64(regs);
+        if (regs[0])
+            return ctz64(regs[0]);
+        if (regs[1])
+            return 64 + ctz64(regs[1]);
+        return -1;
     }
 
     inline mreg operator*() const {
@@ -111,11 +132,11 @@ struct RegSet {
     }
 
     inline constexpr bool operator==(const RegSet& other) const {
-        return regs == other.regs;
+        return regs[0] == other.regs[0] && regs[1] == other.regs[1];
     }
 
     inline constexpr bool operator!=(const RegSet& other) const {
-        return regs != other.regs;
+        return !(*this == other);
     }
 
     inline constexpr RegSet begin() const {
@@ -127,35 +148,35 @@ struct RegSet {
     }
 
     inline constexpr RegSet& operator++() {
-        if (regs) remove(next());
+        if (*this) remove(next());
         return *this;
     }
 
     inline constexpr bool empty() const {
-        return !regs;
+        return !(regs[0] | regs[1]);
     }
 
     inline u64 size() const {
-        return popcount64(regs);
+        return popcount64(regs[0]) + popcount64(regs[1]);
     }
 
     inline constexpr RegSet& operator|=(const RegSet& other) {
-        regs |= other.regs;
+        regs[0] |= other.regs[0], regs[1] |= other.regs[1];
         return *this;
     }
 
     inline constexpr RegSet& operator&=(const RegSet& other) {
-        regs &= other.regs;
+        regs[0] &= other.regs[0], regs[1] &= other.regs[1];
         return *this;
     }
 
     inline constexpr RegSet& operator^=(const RegSet& other) {
-        regs ^= other.regs;
+        regs[0] ^= other.regs[0], regs[1] ^= other.regs[1];
         return *this;
     }
 
     inline constexpr RegSet& operator-=(const RegSet& other) {
-        regs &= ~other.regs;
+        regs[0] &= ~other.regs[0], regs[1] &= ~other.regs[1];
         return *this;
     }
 
@@ -185,7 +206,7 @@ struct RegSet {
 
     inline constexpr RegSet operator~() const {
         RegSet set = *this;
-        set.regs = ~set.regs;
+        set.regs[0] = ~set.regs[0], set.regs[1] = ~set.regs[1];
         return set;
     }
 };
@@ -274,7 +295,8 @@ union ASMVal {
         GP, FP,
         IMM, IMM64,
         F32, F64,
-        MEM
+        MEM,
+        MASK
     };
 
     enum MemKind : u8 {
@@ -293,6 +315,7 @@ union ASMVal {
             double f64;
             mreg gp;
             mreg fp;
+            mreg mask;
             struct { MemKind memkind; mreg base; i32 offset; };
             struct { MemKind : 8;     mreg : 8;  i32 sym; };
             u64 uval;
@@ -309,7 +332,7 @@ union ASMVal {
     }
 
     inline bool is_reg() const {
-        return kind == GP || kind == FP;
+        return kind == GP || kind == FP || kind == MASK;
     }
 
     inline bool is_const() const {
@@ -340,6 +363,14 @@ inline static ASMVal GP(mreg r) {
     return m;
 }
 
+inline static ASMVal Mask(mreg r) {
+    ASMVal m;
+    m.uval = 0;
+    m.mask = r;
+    m.kind = ASMVal::MASK;
+    return m;
+}
+
 inline static ASMVal Imm(i32 imm) {
     ASMVal m;
     m.uval = 0;
@@ -458,29 +489,62 @@ struct Reloc : public Def {
     };
 
     Kind kind;
+    i32 addend; // Added to the symbol's address before taking the difference.
 
     inline Reloc() {}
 
-    inline Reloc(Section section_in, DefType type_in, Kind kind_in, i32 offset_in, Symbol sym_in):
-        Def(section_in, type_in, offset_in, sym_in), kind(kind_in) {}
+    inline Reloc(Section section_in, DefType type_in, Kind kind_in, i32 offset_in, Symbol sym_in, i32 addend_in = 0):
+        Def(section_in, type_in, offset_in, sym_in), kind(kind_in), addend(addend_in) {}
+};
+
+// Change to the call frame, taking effect at the given code offset. These
+// mirror DWARF call frame instructions, and registers are given in the
+// target's DWARF numbering.
+struct FrameOp {
+    enum Kind : u8 {
+        DEF_CFA,            // CFA is now reg + value.
+        DEF_CFA_OFFSET,     // CFA is now the current CFA register + value.
+        DEF_CFA_REGISTER,   // CFA is now reg + the current CFA offset.
+        SAVE,               // reg is saved at CFA - value.
+        RESTORE,            // reg holds the caller's value again.
+        REMEMBER_STATE,     // Push the current rules.
+        RESTORE_STATE       // Pop the most recently remembered rules.
+    };
+
+    i32 offset;
+    Kind kind;
+    u8 reg;
+    i32 value;
+};
+
+// Extent of a global function within linked code.
+struct LinkedFunction {
+    Symbol sym;
+    i32 offset, size;
 };
 
 // Unified buffer representing fully-linked code.
 struct LinkedAssembly {
     slice<memory::page> pages;
-    i8 *code, *data, *stat;
+    i8 *code, *data, *stat, *frames; // frames is .eh_frame data, registered with the unwinder while linked
     i32 codesize, datasize, statsize;
     ::map<Symbol, iptr> defs;
+    vec<LinkedFunction, 8> functions;
     SymbolTable* symtab;
 
+    // Opt-in profiler support. If set, each time a LinkedAssembly is loaded,
+    // perf map entries for its functions are appended to this file. Opening
+    // it (conventionally as /tmp/perf-<pid>.map) is left to the caller.
+    static fd* perfMap;
+
     inline LinkedAssembly() {}
 
     inline LinkedAssembly(LinkedAssembly&& other):
-        pages(other.pages), code(other.code), data(other.data), stat(other.stat),
+        pages(other.pages), code(other.code), data(other.data), stat(other.stat), frames(other.frames),
         codesize(other.codesize), datasize(other.datasize), statsize(other.statsize),
-        defs(move(other.defs)), symtab(other.symtab) {
+        defs(move(other.defs)), functions(move(other.functions)), symtab(other.symtab) {
         other.pages = { nullptr, iptr(0) };
-        other.code = other.data = other.stat = nullptr;
+        other.code = other.data = other.stat = other.frames = nullptr;
     }
 
     inline LinkedAssembly& operator=(LinkedAssembly&& other) {
@@ -491,13 +555,15 @@ struct LinkedAssembly {
             code = other.code;
             data = other.data;
             stat = other.stat;
+            frames = other.frames;
             codesize = other.codesize;
             datasize = other.datasize;
             statsize = other.statsize;
             defs = move(other.defs);
+            functions = move(other.functions);
             symtab = other.symtab;
             other.pages = { nullptr, iptr(0) };
-            other.code = other.data = other.stat = nullptr;
+            other.code = other.data = other.stat = other.frames = nullptr;
         }
         return *this;
     }
@@ -509,9 +575,7 @@ struct LinkedAssembly {
 
     void load();
 
-    inline void unload() {
-        memory::unmap(pages);
-    }
+    void unload();
 
     template<typename T>
     T* lookup(Symbol sym) const {
@@ -531,24 +595,58 @@ struct LinkedAssembly {
         return lookup<T>((*symtab)[name]);
     }
 
+    // Writes a perf map line ("START SIZE name", in hex) for each function.
+    void writePerfMap(fd file) const;
+
     inline void printCode() const {
         for (i8 i : const_slice<i8>{ code, codesize })
             print(hex((u8)i, 2), ' ');
         println();
     }
 
-    void writeELFExecutable(fd file);
+    // Writes a static executable that starts at the given entry symbol. No
+    // dynamic loader is involved; if pie is true, the kernel picks the base
+    // address, otherwise the image is loaded at a fixed address.
+    void writeELFExecutable(fd file, Symbol entry, bool pie = false);
 };
 
+inline u32 ulebSize(u64 value) {
+    u32 size = 1;
+    while (value >= 0x80)
+        value >>= 7, size ++;
+    return size;
+}
+
+inline u32 lebSize(i64 value) {
+    u32 size = 1;
+    while (value >= 0x40 || value < -0x40)
+        value >>= 7, size ++;
+    return size;
+}
+
 // Collection of buffers for target-specific code.
 struct Assembly {
     bytebuf code, data, stat;
     vec<Def, 16> defs;
     vec<Reloc, 16> relocs;
+    vec<FrameOp, 16> frameOps;
     SymbolTable& symtab;
+    ISALevel isa; // The instructions targets may emit. amd64 was written against v3, so that's the default.
+
+    // Call frame rules at the end of the code emitted so far. Targets reset
+    // these at each function entry, and record a FrameOp whenever an
+    // instruction they emit changes them.
+    struct FrameState {
+        u8 reg; // The CFA is reg + offset.
+        i32 offset;
+        i32 depth; // CFA - stack pointer, or -1 if it isn't statically known.
+    };
+    FrameState frame, bodyFrame; // bodyFrame holds the function body's rules during an epilogue.
+    bool inEpilogue;
+    bool dirtyUpper; // Whether the current function has written the upper half of a vector register.
 
-    inline Assembly(SymbolTable& symtab_in): 
-        symtab(symtab_in) {}
+    inline Assembly(SymbolTable& symtab_in, ISALevel isa_in = ISA_V3): 
+        symtab(symtab_in), isa(isa_in), frame({ 0, 0, -1 }), inEpilogue(false), dirtyUpper(false) {}
     
     inline void clear() {
         code.clear();
@@ -556,6 +654,10 @@ struct Assembly {
         stat.clear();
         defs.clear();
         relocs.clear();
+        frameOps.clear();
+        frame = { 0, 0, -1 };
+        inEpilogue = false;
+        dirtyUpper = false;
     }
 
     inline void def(Section section, DefType type, Symbol sym) {
@@ -578,6 +680,10 @@ struct Assembly {
         relocs.push(Reloc(section, type, kind, ptr->size(), sym));
     }
 
+    inline void frameOp(FrameOp::Kind kind, u8 reg = 0, i32 value = 0) {
+        frameOps.push({ i32(code.size()), kind, reg, value });
+    }
+
     void linkInto(LinkedAssembly& linked);
 
     inline LinkedAssembly link() {
@@ -590,76 +696,180 @@ struct Assembly {
         return symtab.anon();
     }
 
+    /*
+     * Serialized assemblies start with the magic "\0aob" and a little-endian
+     * u32 format version, followed by a fixed-size directory giving the offset
+     * and size (each a little-endian u32, offsets relative to the end of the
+     * directory) of the seven payload segments, in order: code, data, static,
+     * strings, defs, relocs, and frame ops. Files with any other version are
+     * rejected, since the layout of their segments may differ.
+     * Since every segment can be located without decoding the ones before it,
+     * a loader is free to decode them independently - see deserialize().
+     */
+    enum SerializedSegment : u8 {
+        SEGMENT_CODE, SEGMENT_DATA, SEGMENT_STATIC, SEGMENT_STRINGS, SEGMENT_DEFS, SEGMENT_RELOCS, SEGMENT_FRAMES,
+        NUM_SEGMENTS
+    };
+
+    constexpr static u32 SERIALIZED_VERSION = 2; // The original layout, with no directory, counts as version 1.
+    constexpr static u32 SERIALIZED_HEADER_SIZE = 8 + NUM_SEGMENTS * 8;
+
+    inline void serializedSegmentSizes(u32* sizes) const {
+        sizes[SEGMENT_CODE] = code.size();
+        sizes[SEGMENT_DATA] = data.size();
+        sizes[SEGMENT_STATIC] = stat.size();
+        sizes[SEGMENT_STRINGS] = ulebSize(symtab.strings.size());
+        for (const auto& s : symtab.strings)
+            sizes[SEGMENT_STRINGS] += ulebSize(s.size()) + s.size();
+        sizes[SEGMENT_DEFS] = ulebSize(defs.size());
+        for (const Def& def : defs)
+            sizes[SEGMENT_DEFS] += 2 + lebSize(def.offset) + ulebSize(def.sym);
+        sizes[SEGMENT_RELOCS] = ulebSize(relocs.size());
+        for (const Reloc& reloc : relocs)
+            sizes[SEGMENT_RELOCS] += 3 + lebSize(reloc.offset) + ulebSize(reloc.sym) + lebSize(reloc.addend);
+        sizes[SEGMENT_FRAMES] = ulebSize(frameOps.size());
+        for (const FrameOp& op : frameOps)
+            sizes[SEGMENT_FRAMES] += 2 + lebSize(op.offset) + lebSize(op.value);
+    }
+
+    // Total number of bytes serialize() will write for this assembly.
+    inline u32 serializedSize() const {
+        u32 sizes[NUM_SEGMENTS];
+        serializedSegmentSizes(sizes);
+        u32 total = SERIALIZED_HEADER_SIZE;
+        for (u32 size : sizes)
+            total += size;
+        return total;
+    }
+
     template<typename IO, typename Format = Formatter<IO>>
     inline IO serialize(IO io) {
-        u32 codeSize = code.size(), dataSize = data.size(), staticSize = stat.size();
+        u32 sizes[NUM_SEGMENTS];
+        serializedSegmentSizes(sizes);
+
         io = format(io, const_slice<i8>{ "\0aob", 4 });
-        io = format(io, uleb(codeSize), code);
-        io = format(io, uleb(dataSize), data);
-        io = format(io, uleb(staticSize), stat);
+        io = format(io, (u8)SERIALIZED_VERSION, (u8)(SERIALIZED_VERSION >> 8), (u8)(SERIALIZED_VERSION >> 16), (u8)(SERIALIZED_VERSION >> 24));
+        u32 offset = 0;
+        for (u32 i = 0; i < NUM_SEGMENTS; i ++) {
+            io = format(io, (u8)offset, (u8)(offset >> 8), (u8)(offset >> 16), (u8)(offset >> 24));
+            io = format(io, (u8)sizes[i], (u8)(sizes[i] >> 8), (u8)(sizes[i] >> 16), (u8)(sizes[i] >> 24));
+            offset += sizes[i];
+        }
+
+        io = format(io, code, data, stat);
         io = format(io, uleb(symtab.strings.size()));
         for (const auto& [i, s] : enumerate(symtab.strings))
             io = format(io, uleb(s.size()), s);
         io = format(io, uleb(defs.size()));
         for (Def def : defs)
-            io = format(io, (u8)def.section, leb(def.offset), uleb(def.sym));
+            io = format(io, (u8)def.section, (u8)def.type, leb(def.offset), uleb(def.sym));
         io = format(io, uleb(relocs.size()));
         for (Reloc reloc : relocs)
-            io = format(io, (u8)reloc.section, (u8)reloc.kind, leb(reloc.offset), uleb(reloc.sym));
+            io = format(io, (u8)reloc.section, (u8)reloc.type, (u8)reloc.kind, leb(reloc.offset), uleb(reloc.sym), leb(reloc.addend));
+        io = format(io, uleb(frameOps.size()));
+        for (FrameOp op : frameOps)
+            io = format(io, (u8)op.kind, op.reg, leb(op.offset), leb(op.value));
         return io;
     }
 
+    // Runs tasks 0 through n - 1, possibly concurrently, returning once all of
+    // them have finished. Used to fan out independent decoding work.
+    using TaskRunner = void(*)(u32 n, void(*task)(void* env, u32 i), void* env);
+
+    // Decodes a serialized assembly from memory. Each directory segment is
+    // decoded by a separate task, and tasks never touch the same buffer, so
+    // passing a concurrent runner lets the string table, def and reloc tables,
+    // and section payloads all be decoded at once. If no runner is provided,
+    // the segments are decoded in order on the calling thread.
+    void deserialize(const_slice<i8> bytes, TaskRunner runner = nullptr);
+
     template<typename IO, typename Format = Formatter<IO>>
-    inline IO deserialize(IO io) {
-        array<i8, 4> magic;
-        for (u32 i = 0; i < 4; i ++) magic[i] = get<i8>(io);
-        if (memory::compare(&magic[0], "\0aob", 4))
+    inline IO deserialize(IO io, TaskRunner runner = nullptr) {
+        array<i8, SERIALIZED_HEADER_SIZE> header;
+        for (u32 i = 0; i < SERIALIZED_HEADER_SIZE; i ++) header[i] = get<i8>(io);
+        if (memory::compare(&header[0], "\0aob", 4))
             panic("Failed to deserialize assembly!");
+        const u8* version = (const u8*)&header[4];
+        if ((version[0] | version[1] << 8 | version[2] << 16 | u32(version[3]) << 24) != SERIALIZED_VERSION)
+            panic("Failed to deserialize assembly: unsupported format version!");
+
+        // The last segment ends the payload, so the directory tells us exactly
+        // how much to read before handing everything off to the in-memory decoder.
+        const u8* last = (const u8*)&header[8 + (NUM_SEGMENTS - 1) * 8];
+        u32 payloadSize = (last[0] | last[1] << 8 | last[2] << 16 | last[3] << 24)
+            + (last[4] | last[5] << 8 | last[6] << 16 | last[7] << 24);
+        slice<i8> bytes = { new i8[SERIALIZED_HEADER_SIZE + payloadSize], SERIALIZED_HEADER_SIZE + payloadSize };
+        for (u32 i = 0; i < SERIALIZED_HEADER_SIZE; i ++)
+            bytes[i] = header[i];
+        for (u32 i = 0; i < payloadSize; i ++)
+            bytes[SERIALIZED_HEADER_SIZE + i] = get<i8>(io);
+        deserialize(const_slice<i8>(bytes), runner);
+        delete[] bytes.data();
+        return io;
+    }
 
-        u32 codeSize = get<uleb>(io).value;
-        for (u32 i = 0; i < codeSize; i ++)
-            code.write<i8>(get<i8>(io));
-        u32 dataSize = get<uleb>(io).value;
-        for (u32 i = 0; i < dataSize; i ++)
-            data.write<i8>(get<i8>(io));
-        u32 staticSize = get<uleb>(io).value;
-        for (u32 i = 0; i < staticSize; i ++)
-            stat.write<i8>(get<i8>(io));
-        
-        symtab.strings.clear();
-        symtab.strtab.clear();
-        u32 syms = get<uleb>(io).value;
-        for (u32 i = 0; i < syms; i ++) {
-            u32 size = get<uleb>(io).value;
-            slice<i8> newString = { new i8[size], size };
-            for (u32 j = 0; j < size; j ++) newString[j] = get<i8>(io);
-            symtab.strings.push(newString);
-            symtab.strtab.put(newString, i);
-        }
+    // Writes a relocatable object. Every global function is also described in
+    // .eh_frame, so unwinders can walk through it without a frame pointer. If
+    // functionSections is set, each global function is placed in its own
+    // .text.<name> section, which lets ld --gc-sections drop unused ones.
+    void writeELFObject(fd file, bool functionSections = false);
 
-        u32 ndefs = get<uleb>(io).value;
-        for (u32 i = 0; i < ndefs; i ++) {
-            Def def;
-            def.section = (Section)get<u8>(io);
-            def.offset = get<leb>(io).value;
-            def.sym = get<uleb>(io).value;
-            defs.push(def);
-        }
+    // Links this assembly and writes it out as a position-independent shared
+    // library, exporting every global symbol through the dynamic symbol table.
+    // All references must be resolvable within the assembly itself.
+    void writeELFSharedObject(fd file);
 
-        u32 nrelocs = get<uleb>(io).value;
-        for (u32 i = 0; i < nrelocs; i ++) {
-            Reloc reloc;
-            reloc.section = (Section)get<u8>(io);
-            reloc.kind = (Reloc::Kind)get<u8>(io);
-            reloc.offset = get<leb>(io).value;
-            reloc.sym = get<uleb>(io).value;
-            relocs.push(reloc);
-        }
+    // Appends the contents of an ELF64 relocatable object, like those written
+    // by writeELFObject or a C compiler, to this assembly. Allocated sections
+    // are mapped onto code, data, or static data according to their flags.
+    // Global symbols become global defs, while locals get fresh anonymous
+    // symbols so they can't collide with anything already here. Only
+    // pc-relative relocations are supported, and the object's own unwind and
+    // debug info is dropped.
+    void readELFObject(const_slice<i8> bytes);
 
+    template<typename IO, typename Format = Formatter<IO>>
+    inline IO readELFObject(IO io) {
+        // The section header table can be anywhere in the file, so we read up
+        // to its end first, and then up to the end of the furthest section.
+        auto field = [](const i8* ptr, u32 size) -> u64 {
+            u64 value = 0;
+            for (u32 i = 0; i < size; i ++)
+                value |= u64(u8(ptr[i])) << i * 8;
+            return value;
+        };
+        array<i8, 64> header;
+        for (u32 i = 0; i < 64; i ++) header[i] = get<i8>(io);
+        u64 shoff = field(&header[40], 8), shentsize = field(&header[58], 2), shnum = field(&header[60], 2);
+        u64 headersEnd = shoff + shentsize * shnum;
+        if (memory::compare(&header[0], "\x7f" "ELF", 4) || shoff < 64 || shentsize < 64 || headersEnd > 0x7fffffff)
+            panic("Failed to read ELF object!");
+
+        i8* headers = new i8[headersEnd];
+        for (u32 i = 0; i < 64; i ++)
+            headers[i] = header[i];
+        for (u64 i = 64; i < headersEnd; i ++)
+            headers[i] = get<i8>(io);
+        u64 total = headersEnd;
+        for (u64 i = 0; i < shnum; i ++) {
+            const i8* section = headers + shoff + i * shentsize;
+            u64 end = field(section + 24, 8) + field(section + 32, 8); // sh_offset + sh_size
+            if (field(section + 4, 4) != 8 && end > total) // SHT_NOBITS sections take up no space in the file
+                total = end;
+        }
+        if (total > 0x7fffffff)
+            panic("Failed to read ELF object!");
+
+        i8* bytes = new i8[total];
+        for (u64 i = 0; i < headersEnd; i ++)
+            bytes[i] = headers[i];
+        for (u64 i = headersEnd; i < total; i ++)
+            bytes[i] = get<i8>(io);
+        delete[] headers;
+        readELFObject(const_slice<i8>{ bytes, iword(total) });
+        delete[] bytes;
         return io;
     }
-
-    void writeELFObject(fd file);
 };
 
 struct Offsets {
@@ -688,6 +898,10 @@ inline Offsets joinAssembly(Assembly& dest, Offsets offsets, const Assembly& src
         ref.sym = dest.symtab[src.symtab[ref.sym]];
         dest.relocs.push(ref);
     }
+    for (FrameOp op : src.frameOps) {
+        op.offset += offsets.code;
+        dest.frameOps.push(op);
+    }
     offsets.code += src.code.size();
     offsets.data += src.data.size();
     offsets.stat += src.stat.size();
@@ -956,6 +1170,11 @@ inline IO format_impl(IO io, Repr repr) {
  *  - BINARY_MEM_FP_F64: The instruction takes a memory location, then an FP register or F64 constant.
  *  - BINARY_BRANCH_GP: The instruction takes a GP register or label, then a GP register.
  *  - BINARY_GP_IMM64: The instruction takes a GP register, followed by a 64-bit immediate.
+ *  - BINARY_VECTOR_MEM: The instruction takes an FP register to hold a vector, then a memory location.
+ *  - BINARY_MEM_VECTOR: The instruction takes a memory location, then an FP register holding a vector.
+ *  - BINARY_VECTOR_GP_IMM: The instruction takes an FP register to hold a vector, then a GP register or immediate.
+ *  - BINARY_MASK_GP: The instruction takes a mask register, then a GP register.
+ *  - BINARY_GP_MASK: The instruction takes a GP register, then a mask register.
  *
  *  - TERNARY_GP_IMM: The instruction takes a GP register, then two operands that can be either a GP register or immediate.
  *  - TERNARY_FP_F32: The instruction takes an FP register, then two operands that can be either an FP register or F32 constant.
@@ -966,11 +1185,35 @@ inline IO format_impl(IO io, Repr repr) {
  *  - TERNARY_STORE_INDEX_FP_F32: The instruction takes a memory location, then an FP register or F32 constant, then a GP register.
  *  - TERNARY_STORE_INDEX_FP_F64: The instruction takes a memory location, then an FP register or F64 constant, then a GP register.
  *  - TERNARY_MEMORY_OP: The instruction takes two memory locations, then a GP register or immediate.
+ *  - TERNARY_VECTOR: The instruction takes three FP registers, each holding a whole vector.
+ *  - TERNARY_VECTOR_IMM: The instruction takes two FP registers holding vectors, then an immediate.
+ *  - TERNARY_EXTRACT_GP: The instruction takes a GP register, then an FP register holding a vector, then an immediate lane index.
+ *  - TERNARY_EXTRACT_FP: The instruction takes an FP register, then an FP register holding a vector, then an immediate lane index.
+ *  - TERNARY_MASKED_LOAD: The instruction takes an FP register to hold a vector, then a memory location, then a mask register.
+ *  - TERNARY_MASKED_STORE: The instruction takes a memory location, then an FP register holding a vector, then a mask register.
+ *  - TERNARY_ATOMIC_GP_IMM: The instruction takes a GP register, then a memory location, then a GP register or immediate.
+ *
+ *  - QUATERNARY_GP_IMM: The instruction takes a GP register, then three operands that can be either a GP register or immediate.
+ *  - QUATERNARY_INSERT_GP: The instruction takes two FP registers holding vectors, then a GP register, then an immediate lane index.
+ *  - QUATERNARY_INSERT_FP: The instruction takes two FP registers holding vectors, then an FP register, then an immediate lane index.
+ *  - QUATERNARY_VECTOR_MASK: The instruction takes three FP registers holding vectors, then a mask register.
+ *  - QUATERNARY_FP_F32: The instruction takes an FP register, then three operands that can be either an FP register or F32 constant.
+ *  - QUATERNARY_FP_F64: The instruction takes an FP register, then three operands that can be either an FP register or F64 constant.
+ *  - QUATERNARY_ATOMIC_GP_IMM: The instruction takes a GP register, then a memory location, then two operands that can be either a GP register
+ *    or immediate.
+ *  - QUATERNARY_ATOMIC_MEM: The instruction takes a GP register, then three memory locations. The last two must be register-relative.
  * 
  *  - COMPARE_GP_IMM: The instruction takes an integer condition, then a GP register, then two operands which can be either a GP register or immediate.
  *  - COMPARE_FP_F32: The instruction takes a float condition, then an FP register, then two operands which can be either an FP register or F32 constant.
  *  - COMPARE_FP_F64: The instruction takes a float condition, then an FP register, then two operands which can be either an FP register or F64 constant.
  *  - COMPARE_MEMORY: The instruction takes a signed integer condition, then a GP register, then two memory locations, then either a GP register or immediate.
+ *  - COMPARE_VECTOR: The instruction takes an integer condition, then three FP registers holding vectors. Each lane of the first is set to all ones if
+ *    the condition holds for the corresponding lanes of the other two, and to zero otherwise.
+ *  - COMPARE_VECTOR_FLOAT: The instruction takes a float condition, then three FP registers holding vectors, and compares them like COMPARE_VECTOR.
+ *  - COMPARE_MASK: The instruction takes an integer condition, then a mask register, then two FP registers holding vectors. Each bit of the mask
+ *    is set if the condition holds for the corresponding lanes, and cleared otherwise.
+ *  - COMPARE_MASK_FLOAT: The instruction takes a float condition, then a mask register, then two FP registers holding vectors, and compares them
+ *    like COMPARE_MASK.
 
  *  - BRANCH_COMPARE_GP_IMM: The instruction takes a GP register or label, then two operands that can be either a GP register or immediate.
  *  - BRANCH_COMPARE_FP_F32: The instruction takes a GP register or label, then two operands that can be either a FP register or F32 constant.
@@ -1222,9 +1465,271 @@ inline IO format_impl(IO io, Repr repr) {
     macro(MMOV,         mmov,           0xdf,   Size::OTHER,    TERNARY_MEMORY_OP)          \
     macro(MSET,         mset,           0xe0,   Size::OTHER,    TERNARY_MEMORY_OP)          \
     macro(MCMPCC,       mcmpcc,         0xe1,   Size::OTHER,    COMPARE_MEMORY)             \
-    macro(MBRCC,        mbrcc,          0xe2,   Size::OTHER,    BRANCH_COMPARE_MEMORY)          
-
-constexpr static u32 NUM_ASM_OPCODES = 0xe3;
+    macro(MBRCC,        mbrcc,          0xe2,   Size::OTHER,    BRANCH_COMPARE_MEMORY)      \
+    \
+    /* Block 10: Division by loop-invariant divisors. */                                    \
+    macro(UDIVINFO32,   udivinfo32,     0xe3,   Size::BITS32,   BINARY_GP_IMM)              \
+    macro(UDIVBY32,     udivby32,       0xe4,   Size::BITS32,   TERNARY_GP_IMM)             \
+    macro(UREMBY32,     uremby32,       0xe5,   Size::BITS32,   QUATERNARY_GP_IMM)          \
+    \
+    /* Block 11: Packed vector arithmetic, on 128- or 256-bit vectors. */                   \
+    macro(VADD8X16,     vadd8x16,       0xe6,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD8X32,     vadd8x32,       0xe7,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD16X8,     vadd16x8,       0xe8,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD16X16,    vadd16x16,      0xe9,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD32X4,     vadd32x4,       0xea,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD32X8,     vadd32x8,       0xeb,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD64X2,     vadd64x2,       0xec,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD64X4,     vadd64x4,       0xed,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB8X16,     vsub8x16,       0xee,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB8X32,     vsub8x32,       0xef,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB16X8,     vsub16x8,       0xf0,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB16X16,    vsub16x16,      0xf1,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB32X4,     vsub32x4,       0xf2,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB32X8,     vsub32x8,       0xf3,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB64X2,     vsub64x2,       0xf4,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB64X4,     vsub64x4,       0xf5,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMUL16X8,     vmul16x8,       0xf6,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMUL16X16,    vmul16x16,      0xf7,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMUL32X4,     vmul32x4,       0xf8,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMUL32X8,     vmul32x8,       0xf9,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMUL64X2,     vmul64x2,       0xfa,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMUL64X4,     vmul64x4,       0xfb,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN8X16,     vmin8x16,       0xfc,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN8X32,     vmin8x32,       0xfd,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN16X8,     vmin16x8,       0xfe,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN16X16,    vmin16x16,      0xff,   Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN32X4,     vmin32x4,       0x100,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN32X8,     vmin32x8,       0x101,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN64X2,     vmin64x2,       0x102,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN64X4,     vmin64x4,       0x103,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX8X16,     vmax8x16,       0x104,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX8X32,     vmax8x32,       0x105,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX16X8,     vmax16x8,       0x106,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX16X16,    vmax16x16,      0x107,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX32X4,     vmax32x4,       0x108,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX32X8,     vmax32x8,       0x109,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX64X2,     vmax64x2,       0x10a,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX64X4,     vmax64x4,       0x10b,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VAND64X2,     vand64x2,       0x10c,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VAND64X4,     vand64x4,       0x10d,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VOR64X2,      vor64x2,        0x10e,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VOR64X4,      vor64x4,        0x10f,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VXOR64X2,     vxor64x2,       0x110,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VXOR64X4,     vxor64x4,       0x111,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSHL16X8,     vshl16x8,       0x112,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHL16X16,    vshl16x16,      0x113,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHL32X4,     vshl32x4,       0x114,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHL32X8,     vshl32x8,       0x115,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHL64X2,     vshl64x2,       0x116,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHL64X4,     vshl64x4,       0x117,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHR16X8,     vshr16x8,       0x118,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHR16X16,    vshr16x16,      0x119,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHR32X4,     vshr32x4,       0x11a,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHR32X8,     vshr32x8,       0x11b,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHR64X2,     vshr64x2,       0x11c,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHR64X4,     vshr64x4,       0x11d,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSAR16X8,     vsar16x8,       0x11e,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSAR16X16,    vsar16x16,      0x11f,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSAR32X4,     vsar32x4,       0x120,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSAR32X8,     vsar32x8,       0x121,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VCMPCC8X16,   vcmpcc8x16,     0x122,  Size::VECTOR,   COMPARE_VECTOR)             \
+    macro(VCMPCC8X32,   vcmpcc8x32,     0x123,  Size::VECTOR,   COMPARE_VECTOR)             \
+    macro(VCMPCC16X8,   vcmpcc16x8,     0x124,  Size::VECTOR,   COMPARE_VECTOR)             \
+    macro(VCMPCC16X16,  vcmpcc16x16,    0x125,  Size::VECTOR,   COMPARE_VECTOR)             \
+    macro(VCMPCC32X4,   vcmpcc32x4,     0x126,  Size::VECTOR,   COMPARE_VECTOR)             \
+    macro(VCMPCC32X8,   vcmpcc32x8,     0x127,  Size::VECTOR,   COMPARE_VECTOR)             \
+    macro(VCMPCC64X2,   vcmpcc64x2,     0x128,  Size::VECTOR,   COMPARE_VECTOR)             \
+    macro(VCMPCC64X4,   vcmpcc64x4,     0x129,  Size::VECTOR,   COMPARE_VECTOR)             \
+    macro(VFADD32X4,    vfadd32x4,      0x12a,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFADD32X8,    vfadd32x8,      0x12b,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFADD64X2,    vfadd64x2,      0x12c,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFADD64X4,    vfadd64x4,      0x12d,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFSUB32X4,    vfsub32x4,      0x12e,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFSUB32X8,    vfsub32x8,      0x12f,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFSUB64X2,    vfsub64x2,      0x130,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFSUB64X4,    vfsub64x4,      0x131,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMUL32X4,    vfmul32x4,      0x132,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMUL32X8,    vfmul32x8,      0x133,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMUL64X2,    vfmul64x2,      0x134,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMUL64X4,    vfmul64x4,      0x135,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFDIV32X4,    vfdiv32x4,      0x136,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFDIV32X8,    vfdiv32x8,      0x137,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFDIV64X2,    vfdiv64x2,      0x138,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFDIV64X4,    vfdiv64x4,      0x139,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMIN32X4,    vfmin32x4,      0x13a,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMIN32X8,    vfmin32x8,      0x13b,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMIN64X2,    vfmin64x2,      0x13c,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMIN64X4,    vfmin64x4,      0x13d,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMAX32X4,    vfmax32x4,      0x13e,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMAX32X8,    vfmax32x8,      0x13f,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMAX64X2,    vfmax64x2,      0x140,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMAX64X4,    vfmax64x4,      0x141,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFCMPCC32X4,  vfcmpcc32x4,    0x142,  Size::VECTOR,   COMPARE_VECTOR_FLOAT)       \
+    macro(VFCMPCC32X8,  vfcmpcc32x8,    0x143,  Size::VECTOR,   COMPARE_VECTOR_FLOAT)       \
+    macro(VFCMPCC64X2,  vfcmpcc64x2,    0x144,  Size::VECTOR,   COMPARE_VECTOR_FLOAT)       \
+    macro(VFCMPCC64X4,  vfcmpcc64x4,    0x145,  Size::VECTOR,   COMPARE_VECTOR_FLOAT)       \
+    \
+    /* Block 12: Vector data movement. */                                                   \
+    macro(VLD128,       vld128,         0x146,  Size::VECTOR,   BINARY_VECTOR_MEM)          \
+    macro(VLD256,       vld256,         0x147,  Size::VECTOR,   BINARY_VECTOR_MEM)          \
+    macro(VLDA128,      vlda128,        0x148,  Size::VECTOR,   BINARY_VECTOR_MEM)          \
+    macro(VLDA256,      vlda256,        0x149,  Size::VECTOR,   BINARY_VECTOR_MEM)          \
+    macro(VST128,       vst128,         0x14a,  Size::VECTOR,   BINARY_MEM_VECTOR)          \
+    macro(VST256,       vst256,         0x14b,  Size::VECTOR,   BINARY_MEM_VECTOR)          \
+    macro(VSTA128,      vsta128,        0x14c,  Size::VECTOR,   BINARY_MEM_VECTOR)          \
+    macro(VSTA256,      vsta256,        0x14d,  Size::VECTOR,   BINARY_MEM_VECTOR)          \
+    macro(VMOV128,      vmov128,        0x14e,  Size::VECTOR,   BINARY_FP)                  \
+    macro(VMOV256,      vmov256,        0x14f,  Size::VECTOR,   BINARY_FP)                  \
+    macro(VBCAST8X16,   vbcast8x16,     0x150,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST8X32,   vbcast8x32,     0x151,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST16X8,   vbcast16x8,     0x152,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST16X16,  vbcast16x16,    0x153,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST32X4,   vbcast32x4,     0x154,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST32X8,   vbcast32x8,     0x155,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST64X2,   vbcast64x2,     0x156,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST64X4,   vbcast64x4,     0x157,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VFBCAST32X4,  vfbcast32x4,    0x158,  Size::VECTOR,   BINARY_FP_F32)              \
+    macro(VFBCAST32X8,  vfbcast32x8,    0x159,  Size::VECTOR,   BINARY_FP_F32)              \
+    macro(VFBCAST64X2,  vfbcast64x2,    0x15a,  Size::VECTOR,   BINARY_FP_F64)              \
+    macro(VFBCAST64X4,  vfbcast64x4,    0x15b,  Size::VECTOR,   BINARY_FP_F64)              \
+    macro(VEXT8X16,     vext8x16,       0x15c,  Size::VECTOR,   TERNARY_EXTRACT_GP)         \
+    macro(VEXT8X32,     vext8x32,       0x15d,  Size::VECTOR,   TERNARY_EXTRACT_GP)         \
+    macro(VEXT16X8,     vext16x8,       0x15e,  Size::VECTOR,   TERNARY_EXTRACT_GP)         \
+    macro(VEXT16X16,    vext16x16,      0x15f,  Size::VECTOR,   TERNARY_EXTRACT_GP)         \
+    macro(VEXT32X4,     vext32x4,       0x160,  Size::VECTOR,   TERNARY_EXTRACT_GP)         \
+    macro(VEXT32X8,     vext32x8,       0x161,  Size::VECTOR,   TERNARY_EXTRACT_GP)         \
+    macro(VEXT64X2,     vext64x2,       0x162,  Size::VECTOR,   TERNARY_EXTRACT_GP)         \
+    macro(VEXT64X4,     vext64x4,       0x163,  Size::VECTOR,   TERNARY_EXTRACT_GP)         \
+    macro(VFEXT32X4,    vfext32x4,      0x164,  Size::VECTOR,   TERNARY_EXTRACT_FP)         \
+    macro(VFEXT32X8,    vfext32x8,      0x165,  Size::VECTOR,   TERNARY_EXTRACT_FP)         \
+    macro(VFEXT64X2,    vfext64x2,      0x166,  Size::VECTOR,   TERNARY_EXTRACT_FP)         \
+    macro(VFEXT64X4,    vfext64x4,      0x167,  Size::VECTOR,   TERNARY_EXTRACT_FP)         \
+    macro(VINS8X16,     vins8x16,       0x168,  Size::VECTOR,   QUATERNARY_INSERT_GP)       \
+    macro(VINS8X32,     vins8x32,       0x169,  Size::VECTOR,   QUATERNARY_INSERT_GP)       \
+    macro(VINS16X8,     vins16x8,       0x16a,  Size::VECTOR,   QUATERNARY_INSERT_GP)       \
+    macro(VINS16X16,    vins16x16,      0x16b,  Size::VECTOR,   QUATERNARY_INSERT_GP)       \
+    macro(VINS32X4,     vins32x4,       0x16c,  Size::VECTOR,   QUATERNARY_INSERT_GP)       \
+    macro(VINS32X8,     vins32x8,       0x16d,  Size::VECTOR,   QUATERNARY_INSERT_GP)       \
+    macro(VINS64X2,     vins64x2,       0x16e,  Size::VECTOR,   QUATERNARY_INSERT_GP)       \
+    macro(VINS64X4,     vins64x4,       0x16f,  Size::VECTOR,   QUATERNARY_INSERT_GP)       \
+    macro(VFINS32X4,    vfins32x4,      0x170,  Size::VECTOR,   QUATERNARY_INSERT_FP)       \
+    macro(VFINS32X8,    vfins32x8,      0x171,  Size::VECTOR,   QUATERNARY_INSERT_FP)       \
+    macro(VFINS64X2,    vfins64x2,      0x172,  Size::VECTOR,   QUATERNARY_INSERT_FP)       \
+    macro(VFINS64X4,    vfins64x4,      0x173,  Size::VECTOR,   QUATERNARY_INSERT_FP)       \
+    macro(VPERM8X16,    vperm8x16,      0x174,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VPERM8X32,    vperm8x32,      0x175,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VPERM32X8,    vperm32x8,      0x176,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSHUF32X4,    vshuf32x4,      0x177,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHUF32X8,    vshuf32x8,      0x178,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHUF64X2,    vshuf64x2,      0x179,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    macro(VSHUF64X4,    vshuf64x4,      0x17a,  Size::VECTOR,   TERNARY_VECTOR_IMM)         \
+    \
+    /* Block 13: 512-bit vectors and masks (AVX-512). */                                    \
+    macro(VLD512,       vld512,         0x17b,  Size::VECTOR,   BINARY_VECTOR_MEM)          \
+    macro(VST512,       vst512,         0x17c,  Size::VECTOR,   BINARY_MEM_VECTOR)          \
+    macro(VMOV512,      vmov512,        0x17d,  Size::VECTOR,   BINARY_FP)                  \
+    macro(VADD8X64,     vadd8x64,       0x17e,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD16X32,    vadd16x32,      0x17f,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD32X16,    vadd32x16,      0x180,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VADD64X8,     vadd64x8,       0x181,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB8X64,     vsub8x64,       0x182,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB16X32,    vsub16x32,      0x183,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB32X16,    vsub32x16,      0x184,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VSUB64X8,     vsub64x8,       0x185,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMUL16X32,    vmul16x32,      0x186,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMUL32X16,    vmul32x16,      0x187,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMUL64X8,     vmul64x8,       0x188,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN8X64,     vmin8x64,       0x189,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN16X32,    vmin16x32,      0x18a,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN32X16,    vmin32x16,      0x18b,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMIN64X8,     vmin64x8,       0x18c,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX8X64,     vmax8x64,       0x18d,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX16X32,    vmax16x32,      0x18e,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX32X16,    vmax32x16,      0x18f,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VMAX64X8,     vmax64x8,       0x190,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VAND64X8,     vand64x8,       0x191,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VOR64X8,      vor64x8,        0x192,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VXOR64X8,     vxor64x8,       0x193,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFADD32X16,   vfadd32x16,     0x194,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFADD64X8,    vfadd64x8,      0x195,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFSUB32X16,   vfsub32x16,     0x196,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFSUB64X8,    vfsub64x8,      0x197,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMUL32X16,   vfmul32x16,     0x198,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMUL64X8,    vfmul64x8,      0x199,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFDIV32X16,   vfdiv32x16,     0x19a,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFDIV64X8,    vfdiv64x8,      0x19b,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMIN32X16,   vfmin32x16,     0x19c,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMIN64X8,    vfmin64x8,      0x19d,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMAX32X16,   vfmax32x16,     0x19e,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VFMAX64X8,    vfmax64x8,      0x19f,  Size::VECTOR,   TERNARY_VECTOR)             \
+    macro(VBCAST8X64,   vbcast8x64,     0x1a0,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST16X32,  vbcast16x32,    0x1a1,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST32X16,  vbcast32x16,    0x1a2,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VBCAST64X8,   vbcast64x8,     0x1a3,  Size::VECTOR,   BINARY_VECTOR_GP_IMM)       \
+    macro(VFBCAST32X16, vfbcast32x16,   0x1a4,  Size::VECTOR,   BINARY_FP_F32)              \
+    macro(VFBCAST64X8,  vfbcast64x8,    0x1a5,  Size::VECTOR,   BINARY_FP_F64)              \
+    macro(I64TOK,       i64tok,         0x1a6,  Size::VECTOR,   BINARY_MASK_GP)             \
+    macro(KTOI64,       ktoi64,         0x1a7,  Size::VECTOR,   BINARY_GP_MASK)             \
+    macro(KCMPCC8X64,   kcmpcc8x64,     0x1a8,  Size::VECTOR,   COMPARE_MASK)               \
+    macro(KCMPCC16X32,  kcmpcc16x32,    0x1a9,  Size::VECTOR,   COMPARE_MASK)               \
+    macro(KCMPCC32X16,  kcmpcc32x16,    0x1aa,  Size::VECTOR,   COMPARE_MASK)               \
+    macro(KCMPCC64X8,   kcmpcc64x8,     0x1ab,  Size::VECTOR,   COMPARE_MASK)               \
+    macro(KFCMPCC32X16, kfcmpcc32x16,   0x1ac,  Size::VECTOR,   COMPARE_MASK_FLOAT)         \
+    macro(KFCMPCC64X8,  kfcmpcc64x8,    0x1ad,  Size::VECTOR,   COMPARE_MASK_FLOAT)         \
+    macro(VMLD8X64,     vmld8x64,       0x1ae,  Size::VECTOR,   TERNARY_MASKED_LOAD)        \
+    macro(VMLD16X32,    vmld16x32,      0x1af,  Size::VECTOR,   TERNARY_MASKED_LOAD)        \
+    macro(VMLD32X16,    vmld32x16,      0x1b0,  Size::VECTOR,   TERNARY_MASKED_LOAD)        \
+    macro(VMLD64X8,     vmld64x8,       0x1b1,  Size::VECTOR,   TERNARY_MASKED_LOAD)        \
+    macro(VMST8X64,     vmst8x64,       0x1b2,  Size::VECTOR,   TERNARY_MASKED_STORE)       \
+    macro(VMST16X32,    vmst16x32,      0x1b3,  Size::VECTOR,   TERNARY_MASKED_STORE)       \
+    macro(VMST32X16,    vmst32x16,      0x1b4,  Size::VECTOR,   TERNARY_MASKED_STORE)       \
+    macro(VMST64X8,     vmst64x8,       0x1b5,  Size::VECTOR,   TERNARY_MASKED_STORE)       \
+    macro(VBLENDM8X64,  vblendm8x64,    0x1b6,  Size::VECTOR,   QUATERNARY_VECTOR_MASK)     \
+    macro(VBLENDM16X32, vblendm16x32,   0x1b7,  Size::VECTOR,   QUATERNARY_VECTOR_MASK)     \
+    macro(VBLENDM32X16, vblendm32x16,   0x1b8,  Size::VECTOR,   QUATERNARY_VECTOR_MASK)     \
+    macro(VBLENDM64X8,  vblendm64x8,    0x1b9,  Size::VECTOR,   QUATERNARY_VECTOR_MASK)     \
+    \
+    /* Block 14: Fused multiply-add. */                                                     \
+    macro(FMADD32,      fmadd32,        0x1ba,  Size::FLOAT32,  QUATERNARY_FP_F32)          \
+    macro(FMADD64,      fmadd64,        0x1bb,  Size::FLOAT64,  QUATERNARY_FP_F64)          \
+    macro(FMSUB32,      fmsub32,        0x1bc,  Size::FLOAT32,  QUATERNARY_FP_F32)          \
+    macro(FMSUB64,      fmsub64,        0x1bd,  Size::FLOAT64,  QUATERNARY_FP_F64)          \
+    macro(FNMADD32,     fnmadd32,       0x1be,  Size::FLOAT32,  QUATERNARY_FP_F32)          \
+    macro(FNMADD64,     fnmadd64,       0x1bf,  Size::FLOAT64,  QUATERNARY_FP_F64)          \
+    \
+    /* Block 15: Atomic memory operations and fences. */                                    \
+    macro(AXCHG8,       axchg8,         0x1c0,  Size::BITS8,    TERNARY_ATOMIC_GP_IMM)      \
+    macro(AXCHG16,      axchg16,        0x1c1,  Size::BITS16,   TERNARY_ATOMIC_GP_IMM)      \
+    macro(AXCHG32,      axchg32,        0x1c2,  Size::BITS32,   TERNARY_ATOMIC_GP_IMM)      \
+    macro(AXCHG64,      axchg64,        0x1c3,  Size::BITS64,   TERNARY_ATOMIC_GP_IMM)      \
+    macro(AXADD8,       axadd8,         0x1c4,  Size::BITS8,    TERNARY_ATOMIC_GP_IMM)      \
+    macro(AXADD16,      axadd16,        0x1c5,  Size::BITS16,   TERNARY_ATOMIC_GP_IMM)      \
+    macro(AXADD32,      axadd32,        0x1c6,  Size::BITS32,   TERNARY_ATOMIC_GP_IMM)      \
+    macro(AXADD64,      axadd64,        0x1c7,  Size::BITS64,   TERNARY_ATOMIC_GP_IMM)      \
+    macro(ACAS8,        acas8,          0x1c8,  Size::BITS8,    QUATERNARY_ATOMIC_GP_IMM)   \
+    macro(ACAS16,       acas16,         0x1c9,  Size::BITS16,   QUATERNARY_ATOMIC_GP_IMM)   \
+    macro(ACAS32,       acas32,         0x1ca,  Size::BITS32,   QUATERNARY_ATOMIC_GP_IMM)   \
+    macro(ACAS64,       acas64,         0x1cb,  Size::BITS64,   QUATERNARY_ATOMIC_GP_IMM)   \
+    macro(ACAS128,      acas128,        0x1cc,  Size::MEMORY,   QUATERNARY_ATOMIC_MEM)      \
+    macro(AAND8,        aand8,          0x1cd,  Size::BITS8,    BINARY_MEM_GP_IMM)          \
+    macro(AAND16,       aand16,         0x1ce,  Size::BITS16,   BINARY_MEM_GP_IMM)          \
+    macro(AAND32,       aand32,         0x1cf,  Size::BITS32,   BINARY_MEM_GP_IMM)          \
+    macro(AAND64,       aand64,         0x1d0,  Size::BITS64,   BINARY_MEM_GP_IMM)          \
+    macro(AOR8,         aor8,           0x1d1,  Size::BITS8,    BINARY_MEM_GP_IMM)          \
+    macro(AOR16,        aor16,          0x1d2,  Size::BITS16,   BINARY_MEM_GP_IMM)          \
+    macro(AOR32,        aor32,          0x1d3,  Size::BITS32,   BINARY_MEM_GP_IMM)          \
+    macro(AOR64,        aor64,          0x1d4,  Size::BITS64,   BINARY_MEM_GP_IMM)          \
+    macro(AXOR8,        axor8,          0x1d5,  Size::BITS8,    BINARY_MEM_GP_IMM)          \
+    macro(AXOR16,       axor16,         0x1d6,  Size::BITS16,   BINARY_MEM_GP_IMM)          \
+    macro(AXOR32,       axor32,         0x1d7,  Size::BITS32,   BINARY_MEM_GP_IMM)          \
+    macro(AXOR64,       axor64,         0x1d8,  Size::BITS64,   BINARY_MEM_GP_IMM)          \
+    macro(MFENCE,       mfence,         0x1d9,  Size::OTHER,    NULLARY)                    \
+    macro(LFENCE,       lfence,         0x1da,  Size::OTHER,    NULLARY)                    \
+    macro(SFENCE,       sfence,         0x1db,  Size::OTHER,    NULLARY)                    \
+    macro(PAUSE,        pause,          0x1dc,  Size::OTHER,    NULLARY)
+
+constexpr static u32 NUM_ASM_OPCODES = 0x1dd;
 
 #define DEFINE_OPCODE_ENUM_CXX(upper, ...) upper,
 enum class ASMOpcode {
@@ -1247,13 +1752,14 @@ constexpr static const i8* ASM_REGISTER_NAMES[] = {
     "f8", "f9", "f10", "f11", "f12", "f13", "f14", "f15",
     "f16", "f17", "f18", "f19", "f20", "f21", "f22", "f23",
     "f24", "f25", "f26", "f27", "f28", "f29", "f30", "f31",
+    "k0", "k1", "k2", "k3", "k4", "k5", "k6", "k7",
 };
 
 struct Insn;
 
 // Not a real target, represents the abstract target properties of the virtual instruction set. Implements calling convention
-// and the register set for an abstract machine of 32 general-purpose and 32 floating-point registers. Can be used for platform-independent
-// instruction set purposes, such as validation or formatting.
+// and the register set for an abstract machine of 32 general-purpose and 32 floating-point registers, plus 8 mask registers for masked
+// vector operations. Can be used for platform-independent instruction set purposes, such as validation or formatting.
 struct FakeAssembler {
     constexpr static mreg GPREGS[] = { 
         0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
@@ -1263,6 +1769,7 @@ struct FakeAssembler {
         32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 
         48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63
     };
+    constexpr static mreg MASKREGS[] = { 64, 65, 66, 67, 68, 69, 70, 71 };
 
     constexpr static mreg fp = 30;
     constexpr static mreg sp = 31;
@@ -1300,6 +1807,10 @@ struct FakeAssembler {
         return RegSet(FPREGS, 32);
     }
 
+    static inline RegSet masks() {
+        return RegSet(MASKREGS, 8);
+    }
+
     static inline bool is_gp(mreg r) {
         return r < 32;
     }
@@ -1308,6 +1819,10 @@ struct FakeAssembler {
         return r >= 32 && r < 64;
     }
 
+    static inline bool is_mask(mreg r) {
+        return r >= 64 && r < 72;
+    }
+
     static inline const_slice<i8> reg_name(mreg r) {
         return const_slice<i8>{ ASM_REGISTER_NAMES[i32(r)], findc(ASM_REGISTER_NAMES[i32(r)], '\0') };
     }
@@ -1364,6 +1879,9 @@ struct Printer : public Assembler {
             case ASMVal::GP:
                 ::write(io, Assembler::reg_name(val.gp));
                 break;
+            case ASMVal::MASK:
+                ::write(io, Assembler::reg_name(val.mask));
+                break;
             case ASMVal::IMM:
                 ::write(io, val.imm);
                 break;
@@ -1576,6 +2094,11 @@ struct Printer : public Assembler {
     #define BINARY_MEM_GP_IMM(upper, lower) BINARY(upper, lower)
     #define BINARY_MEM_FP_F32(upper, lower) BINARY(upper, lower)
     #define BINARY_MEM_FP_F64(upper, lower) BINARY(upper, lower)
+    #define BINARY_VECTOR_MEM(upper, lower) BINARY(upper, lower)
+    #define BINARY_MEM_VECTOR(upper, lower) BINARY(upper, lower)
+    #define BINARY_VECTOR_GP_IMM(upper, lower) BINARY(upper, lower)
+    #define BINARY_MASK_GP(upper, lower) BINARY(upper, lower)
+    #define BINARY_GP_MASK(upper, lower) BINARY(upper, lower)
     #define BINARY_BRANCH_GP(upper, lower) static void lower(Assembly& as, ASMVal dst, ASMVal src) { write_binary(output, as, ASMOpcode::upper, dst, src); }
     #define BINARY_GP_IMM64(upper, lower) static void lower(Assembly& as, ASMVal dst, ASMVal src) { write_big_constant(output, as, ASMOpcode::upper, dst, src); }
 
@@ -1589,6 +2112,23 @@ struct Printer : public Assembler {
     #define TERNARY_STORE_INDEX_FP_F32(upper, lower) TERNARY(upper, lower)
     #define TERNARY_STORE_INDEX_FP_F64(upper, lower) TERNARY(upper, lower)
     #define TERNARY_MEMORY_OP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_VECTOR(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_VECTOR_IMM(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_EXTRACT_GP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_EXTRACT_FP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_MASKED_LOAD(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_MASKED_STORE(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_ATOMIC_GP_IMM(upper, lower) TERNARY(upper, lower)
+
+    #define QUATERNARY(upper, lower) static void lower(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) { write_quaternary(output, as, ASMOpcode::upper, dst, a, b, c); }
+    #define QUATERNARY_GP_IMM(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_INSERT_GP(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_INSERT_FP(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_VECTOR_MASK(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_FP_F32(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_FP_F64(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_ATOMIC_GP_IMM(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_ATOMIC_MEM(upper, lower) QUATERNARY(upper, lower)
 
     #define SELECT(upper, lower) static void lower(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) { write_select(output, as, ASMOpcode::upper, cond, dst, a, b, c, d); }
     #define SELECT_FLOAT(upper, lower) static void lower(Assembly& as, FloatCondition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) { write_float_select(output, as, ASMOpcode::upper, cond, dst, a, b, c, d); }
@@ -1602,6 +2142,10 @@ struct Printer : public Assembler {
     #define COMPARE_GP_IMM(upper, lower) COMPARE(upper, lower)
     #define COMPARE_FP_F32(upper, lower) COMPARE_FLOAT(upper, lower)
     #define COMPARE_FP_F64(upper, lower) COMPARE_FLOAT(upper, lower)
+    #define COMPARE_VECTOR(upper, lower) COMPARE(upper, lower)
+    #define COMPARE_VECTOR_FLOAT(upper, lower) COMPARE_FLOAT(upper, lower)
+    #define COMPARE_MASK(upper, lower) COMPARE(upper, lower)
+    #define COMPARE_MASK_FLOAT(upper, lower) COMPARE_FLOAT(upper, lower)
     #define BRANCH_COMPARE_GP_IMM(upper, lower) COMPARE(upper, lower)
     #define BRANCH_COMPARE_FP_F32(upper, lower) COMPARE_FLOAT(upper, lower)
     #define BRANCH_COMPARE_FP_F64(upper, lower) COMPARE_FLOAT(upper, lower)
@@ -1615,6 +2159,7 @@ struct Printer : public Assembler {
     #undef UNARY
     #undef BINARY
     #undef TERNARY
+    #undef QUATERNARY
     #undef COMPARE
     #undef COMPARE_FLOAT
     #undef SELECT
@@ -1636,6 +2181,11 @@ struct Printer : public Assembler {
     #undef BINARY_MEM_GP_IMM
     #undef BINARY_MEM_FP_F32
     #undef BINARY_MEM_FP_F64
+    #undef BINARY_VECTOR_MEM
+    #undef BINARY_MEM_VECTOR
+    #undef BINARY_VECTOR_GP_IMM
+    #undef BINARY_MASK_GP
+    #undef BINARY_GP_MASK
     #undef BINARY_BRANCH_GP
     #undef BINARY_GP_IMM64
     #undef TERNARY_GP_IMM
@@ -1647,10 +2197,29 @@ struct Printer : public Assembler {
     #undef TERNARY_STORE_INDEX_FP_F32
     #undef TERNARY_STORE_INDEX_FP_F64
     #undef TERNARY_MEMORY_OP
+    #undef TERNARY_VECTOR
+    #undef TERNARY_VECTOR_IMM
+    #undef TERNARY_EXTRACT_GP
+    #undef TERNARY_EXTRACT_FP
+    #undef TERNARY_MASKED_LOAD
+    #undef TERNARY_MASKED_STORE
+    #undef TERNARY_ATOMIC_GP_IMM
+    #undef QUATERNARY_GP_IMM
+    #undef QUATERNARY_INSERT_GP
+    #undef QUATERNARY_INSERT_FP
+    #undef QUATERNARY_VECTOR_MASK
+    #undef QUATERNARY_FP_F32
+    #undef QUATERNARY_FP_F64
+    #undef QUATERNARY_ATOMIC_GP_IMM
+    #undef QUATERNARY_ATOMIC_MEM
     #undef SELECT_GP_IMM
     #undef COMPARE_GP_IMM
     #undef COMPARE_FP_F32
     #undef COMPARE_FP_F64
+    #undef COMPARE_VECTOR
+    #undef COMPARE_VECTOR_FLOAT
+    #undef COMPARE_MASK
+    #undef COMPARE_MASK_FLOAT
     #undef COMPARE_MEMORY
     #undef BRANCH_COMPARE_GP_IMM
     #undef BRANCH_COMPARE_FP_F32
@@ -1698,6 +2267,11 @@ struct Compose {
     #define BINARY_MEM_GP_IMM(upper, lower) BINARY(upper, lower)
     #define BINARY_MEM_FP_F32(upper, lower) BINARY(upper, lower)
     #define BINARY_MEM_FP_F64(upper, lower) BINARY(upper, lower)
+    #define BINARY_VECTOR_MEM(upper, lower) BINARY(upper, lower)
+    #define BINARY_MEM_VECTOR(upper, lower) BINARY(upper, lower)
+    #define BINARY_VECTOR_GP_IMM(upper, lower) BINARY(upper, lower)
+    #define BINARY_MASK_GP(upper, lower) BINARY(upper, lower)
+    #define BINARY_GP_MASK(upper, lower) BINARY(upper, lower)
     #define BINARY_BRANCH_GP(upper, lower) static void lower(Assembly& as, ASMVal dst, ASMVal src) { A::lower(as, dst, src); B::lower(as, dst, src); }
     #define BINARY_GP_IMM64(upper, lower) BINARY(upper, lower)
 
@@ -1711,6 +2285,23 @@ struct Compose {
     #define TERNARY_STORE_INDEX_FP_F32(upper, lower) TERNARY(upper, lower)
     #define TERNARY_STORE_INDEX_FP_F64(upper, lower) TERNARY(upper, lower)
     #define TERNARY_MEMORY_OP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_VECTOR(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_VECTOR_IMM(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_EXTRACT_GP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_EXTRACT_FP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_MASKED_LOAD(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_MASKED_STORE(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_ATOMIC_GP_IMM(upper, lower) TERNARY(upper, lower)
+
+    #define QUATERNARY(upper, lower) static void lower(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) { A::lower(as, dst, a, b, c); B::lower(as, dst, a, b, c); }
+    #define QUATERNARY_GP_IMM(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_INSERT_GP(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_INSERT_FP(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_VECTOR_MASK(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_FP_F32(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_FP_F64(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_ATOMIC_GP_IMM(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_ATOMIC_MEM(upper, lower) QUATERNARY(upper, lower)
 
     #define SELECT(upper, lower) static void lower(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) { A::lower(as, cond, dst, a, b, c, d); B::lower(as, cond, dst, a, b, c, d); }
     #define SELECT_FLOAT(upper, lower) static void lower(Assembly& as, FloatCondition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) { A::lower(as, cond, dst, a, b, c, d); B::lower(as, cond, dst, a, b, c, d); }
@@ -1724,6 +2315,10 @@ struct Compose {
     #define COMPARE_GP_IMM(upper, lower) COMPARE(upper, lower)
     #define COMPARE_FP_F32(upper, lower) COMPARE_FLOAT(upper, lower)
     #define COMPARE_FP_F64(upper, lower) COMPARE_FLOAT(upper, lower)
+    #define COMPARE_VECTOR(upper, lower) COMPARE(upper, lower)
+    #define COMPARE_VECTOR_FLOAT(upper, lower) COMPARE_FLOAT(upper, lower)
+    #define COMPARE_MASK(upper, lower) COMPARE(upper, lower)
+    #define COMPARE_MASK_FLOAT(upper, lower) COMPARE_FLOAT(upper, lower)
     #define BRANCH_COMPARE_GP_IMM(upper, lower) COMPARE(upper, lower)
     #define BRANCH_COMPARE_FP_F32(upper, lower) COMPARE_FLOAT(upper, lower)
     #define BRANCH_COMPARE_FP_F64(upper, lower) COMPARE_FLOAT(upper, lower)
@@ -1737,6 +2332,7 @@ struct Compose {
     #undef UNARY
     #undef BINARY
     #undef TERNARY
+    #undef QUATERNARY
     #undef COMPARE
     #undef COMPARE_FLOAT
     #undef SELECT
@@ -1758,6 +2354,11 @@ struct Compose {
     #undef BINARY_MEM_GP_IMM
     #undef BINARY_MEM_FP_F32
     #undef BINARY_MEM_FP_F64
+    #undef BINARY_VECTOR_MEM
+    #undef BINARY_MEM_VECTOR
+    #undef BINARY_VECTOR_GP_IMM
+    #undef BINARY_MASK_GP
+    #undef BINARY_GP_MASK
     #undef BINARY_BRANCH_GP
     #undef BINARY_GP_IMM64
     #undef TERNARY_GP_IMM
@@ -1769,10 +2370,29 @@ struct Compose {
     #undef TERNARY_STORE_INDEX_FP_F32
     #undef TERNARY_STORE_INDEX_FP_F64
     #undef TERNARY_MEMORY_OP
+    #undef TERNARY_VECTOR
+    #undef TERNARY_VECTOR_IMM
+    #undef TERNARY_EXTRACT_GP
+    #undef TERNARY_EXTRACT_FP
+    #undef TERNARY_MASKED_LOAD
+    #undef TERNARY_MASKED_STORE
+    #undef TERNARY_ATOMIC_GP_IMM
+    #undef QUATERNARY_GP_IMM
+    #undef QUATERNARY_INSERT_GP
+    #undef QUATERNARY_INSERT_FP
+    #undef QUATERNARY_VECTOR_MASK
+    #undef QUATERNARY_FP_F32
+    #undef QUATERNARY_FP_F64
+    #undef QUATERNARY_ATOMIC_GP_IMM
+    #undef QUATERNARY_ATOMIC_MEM
     #undef SELECT_GP_IMM
     #undef COMPARE_GP_IMM
     #undef COMPARE_FP_F32
     #undef COMPARE_FP_F64
+    #undef COMPARE_VECTOR
+    #undef COMPARE_VECTOR_FLOAT
+    #undef COMPARE_MASK
+    #undef COMPARE_MASK_FLOAT
     #undef COMPARE_MEMORY
     #undef BRANCH_COMPARE_GP_IMM
     #undef BRANCH_COMPARE_FP_F32
@@ -1794,8 +2414,10 @@ struct Compose {
     static RegSet callee_saves() { return B::callee_saves(); }
     static RegSet gps() { return B::gps(); }
     static RegSet fps() { return B::fps(); }
+    static RegSet masks() { return B::masks(); }
     static bool is_gp(mreg r) { return B::is_gp(r); }
     static bool is_fp(mreg r) { return B::is_fp(r); }
+    static bool is_mask(mreg r) { return B::is_mask(r); }
     static const_slice<i8> reg_name(mreg r) { return B::reg_name(r); }
     static Size word_size() { return B::word_size(); }
     static Size ptr_size() { return B::ptr_size(); }
@@ -1833,6 +2455,11 @@ struct TargetInterface {
     #define BINARY_MEM_GP_IMM(upper, lower) BINARY(upper, lower)
     #define BINARY_MEM_FP_F32(upper, lower) BINARY(upper, lower)
     #define BINARY_MEM_FP_F64(upper, lower) BINARY(upper, lower)
+    #define BINARY_VECTOR_MEM(upper, lower) BINARY(upper, lower)
+    #define BINARY_MEM_VECTOR(upper, lower) BINARY(upper, lower)
+    #define BINARY_VECTOR_GP_IMM(upper, lower) BINARY(upper, lower)
+    #define BINARY_MASK_GP(upper, lower) BINARY(upper, lower)
+    #define BINARY_GP_MASK(upper, lower) BINARY(upper, lower)
     #define BINARY_BRANCH_GP(upper, lower) virtual void lower(Assembly& as, ASMVal dst, ASMVal src) const = 0;
     #define BINARY_GP_IMM64(upper, lower) BINARY(upper, lower)
 
@@ -1846,6 +2473,23 @@ struct TargetInterface {
     #define TERNARY_STORE_INDEX_FP_F32(upper, lower) TERNARY(upper, lower)
     #define TERNARY_STORE_INDEX_FP_F64(upper, lower) TERNARY(upper, lower)
     #define TERNARY_MEMORY_OP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_VECTOR(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_VECTOR_IMM(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_EXTRACT_GP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_EXTRACT_FP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_MASKED_LOAD(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_MASKED_STORE(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_ATOMIC_GP_IMM(upper, lower) TERNARY(upper, lower)
+
+    #define QUATERNARY(upper, lower) virtual void lower(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) const = 0;
+    #define QUATERNARY_GP_IMM(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_INSERT_GP(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_INSERT_FP(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_VECTOR_MASK(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_FP_F32(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_FP_F64(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_ATOMIC_GP_IMM(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_ATOMIC_MEM(upper, lower) QUATERNARY(upper, lower)
 
     #define SELECT(upper, lower) virtual void lower(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) const = 0;
     #define SELECT_FLOAT(upper, lower) virtual void lower(Assembly& as, FloatCondition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) const = 0;
@@ -1859,6 +2503,10 @@ struct TargetInterface {
     #define COMPARE_GP_IMM(upper, lower) COMPARE(upper, lower)
     #define COMPARE_FP_F32(upper, lower) COMPARE_FLOAT(upper, lower)
     #define COMPARE_FP_F64(upper, lower) COMPARE_FLOAT(upper, lower)
+    #define COMPARE_VECTOR(upper, lower) COMPARE(upper, lower)
+    #define COMPARE_VECTOR_FLOAT(upper, lower) COMPARE_FLOAT(upper, lower)
+    #define COMPARE_MASK(upper, lower) COMPARE(upper, lower)
+    #define COMPARE_MASK_FLOAT(upper, lower) COMPARE_FLOAT(upper, lower)
     #define BRANCH_COMPARE_GP_IMM(upper, lower) COMPARE(upper, lower)
     #define BRANCH_COMPARE_FP_F32(upper, lower) COMPARE_FLOAT(upper, lower)
     #define BRANCH_COMPARE_FP_F64(upper, lower) COMPARE_FLOAT(upper, lower)
@@ -1872,6 +2520,7 @@ struct TargetInterface {
     #undef UNARY
     #undef BINARY
     #undef TERNARY
+    #undef QUATERNARY
     #undef COMPARE
     #undef COMPARE_FLOAT
     #undef SELECT
@@ -1893,6 +2542,11 @@ struct TargetInterface {
     #undef BINARY_MEM_GP_IMM
     #undef BINARY_MEM_FP_F32
     #undef BINARY_MEM_FP_F64
+    #undef BINARY_VECTOR_MEM
+    #undef BINARY_MEM_VECTOR
+    #undef BINARY_VECTOR_GP_IMM
+    #undef BINARY_MASK_GP
+    #undef BINARY_GP_MASK
     #undef BINARY_BRANCH_GP
     #undef BINARY_GP_IMM64
     #undef TERNARY_GP_IMM
@@ -1904,10 +2558,29 @@ struct TargetInterface {
     #undef TERNARY_STORE_INDEX_FP_F32
     #undef TERNARY_STORE_INDEX_FP_F64
     #undef TERNARY_MEMORY_OP
+    #undef TERNARY_VECTOR
+    #undef TERNARY_VECTOR_IMM
+    #undef TERNARY_EXTRACT_GP
+    #undef TERNARY_EXTRACT_FP
+    #undef TERNARY_MASKED_LOAD
+    #undef TERNARY_MASKED_STORE
+    #undef TERNARY_ATOMIC_GP_IMM
+    #undef QUATERNARY_GP_IMM
+    #undef QUATERNARY_INSERT_GP
+    #undef QUATERNARY_INSERT_FP
+    #undef QUATERNARY_VECTOR_MASK
+    #undef QUATERNARY_FP_F32
+    #undef QUATERNARY_FP_F64
+    #undef QUATERNARY_ATOMIC_GP_IMM
+    #undef QUATERNARY_ATOMIC_MEM
     #undef SELECT_GP_IMM
     #undef COMPARE_GP_IMM
     #undef COMPARE_FP_F32
     #undef COMPARE_FP_F64
+    #undef COMPARE_VECTOR
+    #undef COMPARE_VECTOR_FLOAT
+    #undef COMPARE_MASK
+    #undef COMPARE_MASK_FLOAT
     #undef COMPARE_MEMORY
     #undef BRANCH_COMPARE_GP_IMM
     #undef BRANCH_COMPARE_FP_F32
@@ -1929,8 +2602,10 @@ struct TargetInterface {
     virtual RegSet callee_saves() const = 0;
     virtual RegSet gps() const = 0;
     virtual RegSet fps() const = 0;
+    virtual RegSet masks() const = 0;
     virtual bool is_gp(mreg r) const = 0;
     virtual bool is_fp(mreg r) const = 0;
+    virtual bool is_mask(mreg r) const = 0;
     virtual const_slice<i8> reg_name(mreg r) const = 0;
     virtual Size word_size() const = 0;
     virtual Size ptr_size() const = 0;
@@ -1944,13 +2619,23 @@ struct TargetInterface {
 
     virtual mreg framePtr() const = 0;
     virtual mreg stackPtr() const = 0;
+
+    // Assemblies emitted through this target must be created at desc().level.
+    virtual TargetDesc desc() const = 0;
 };
 
 template<typename Target>
 struct TargetImplementation : public TargetInterface {
-    #define NULLARY(upper, lower) virtual void lower(Assembly& as) const override { Target:: lower(as); }
+    // Encodings are picked by as.isa, but clobbers come from Target, so an
+    // assembly at any other level could emit instructions Target doesn't
+    // account for (or can't run).
+    static inline void checkLevel(const Assembly& as) {
+        assert(as.isa == Target::DESC.level);
+    }
+
+    #define NULLARY(upper, lower) virtual void lower(Assembly& as) const override { checkLevel(as); Target:: lower(as); }
     
-    #define UNARY(upper, lower) virtual void lower(Assembly& as, ASMVal dst) const override { Target:: lower(as, dst); }
+    #define UNARY(upper, lower) virtual void lower(Assembly& as, ASMVal dst) const override { checkLevel(as); Target:: lower(as, dst); }
     #define UNARY_GP(upper, lower) UNARY(upper, lower)
     #define UNARY_FP(upper, lower) UNARY(upper, lower)
     #define UNARY_JUMP(upper, lower) UNARY(upper, lower)
@@ -1958,7 +2643,7 @@ struct TargetImplementation : public TargetInterface {
     #define UNARY_FP_F32(upper, lower) UNARY(upper, lower)
     #define UNARY_FP_F64(upper, lower) UNARY(upper, lower)
 
-    #define BINARY(upper, lower) virtual void lower(Assembly& as, ASMVal dst, ASMVal src) const override { Target:: lower(as, dst, src); }
+    #define BINARY(upper, lower) virtual void lower(Assembly& as, ASMVal dst, ASMVal src) const override { checkLevel(as); Target:: lower(as, dst, src); }
     #define BINARY_GP(upper, lower) BINARY(upper, lower)
     #define BINARY_FP(upper, lower) BINARY(upper, lower)
     #define BINARY_FP_GP(upper, lower) BINARY(upper, lower)
@@ -1971,10 +2656,15 @@ struct TargetImplementation : public TargetInterface {
     #define BINARY_MEM_GP_IMM(upper, lower) BINARY(upper, lower)
     #define BINARY_MEM_FP_F32(upper, lower) BINARY(upper, lower)
     #define BINARY_MEM_FP_F64(upper, lower) BINARY(upper, lower)
-    #define BINARY_BRANCH_GP(upper, lower) virtual void lower(Assembly& as, ASMVal dst, ASMVal src) const override { Target:: lower(as, dst, src); }
+    #define BINARY_VECTOR_MEM(upper, lower) BINARY(upper, lower)
+    #define BINARY_MEM_VECTOR(upper, lower) BINARY(upper, lower)
+    #define BINARY_VECTOR_GP_IMM(upper, lower) BINARY(upper, lower)
+    #define BINARY_MASK_GP(upper, lower) BINARY(upper, lower)
+    #define BINARY_GP_MASK(upper, lower) BINARY(upper, lower)
+    #define BINARY_BRANCH_GP(upper, lower) virtual void lower(Assembly& as, ASMVal dst, ASMVal src) const override { checkLevel(as); Target:: lower(as, dst, src); }
     #define BINARY_GP_IMM64(upper, lower) BINARY(upper, lower)
 
-    #define TERNARY(upper, lower) virtual void lower(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) const override { Target:: lower(as, dst, a, b); }
+    #define TERNARY(upper, lower) virtual void lower(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) const override { checkLevel(as); Target:: lower(as, dst, a, b); }
     #define TERNARY_GP_IMM(upper, lower) TERNARY(upper, lower)
     #define TERNARY_FP_F32(upper, lower) TERNARY(upper, lower)
     #define TERNARY_FP_F64(upper, lower) TERNARY(upper, lower)
@@ -1984,19 +2674,40 @@ struct TargetImplementation : public TargetInterface {
     #define TERNARY_STORE_INDEX_FP_F32(upper, lower) TERNARY(upper, lower)
     #define TERNARY_STORE_INDEX_FP_F64(upper, lower) TERNARY(upper, lower)
     #define TERNARY_MEMORY_OP(upper, lower) TERNARY(upper, lower)
-
-    #define SELECT(upper, lower) virtual void lower(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) const override { Target:: lower(as, cond, dst, a, b, c, d); }
-    #define SELECT_FLOAT(upper, lower) virtual void lower(Assembly& as, FloatCondition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) const override { Target:: lower(as, cond, dst, a, b, c, d); }
+    #define TERNARY_VECTOR(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_VECTOR_IMM(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_EXTRACT_GP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_EXTRACT_FP(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_MASKED_LOAD(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_MASKED_STORE(upper, lower) TERNARY(upper, lower)
+    #define TERNARY_ATOMIC_GP_IMM(upper, lower) TERNARY(upper, lower)
+
+    #define QUATERNARY(upper, lower) virtual void lower(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) const override { checkLevel(as); Target:: lower(as, dst, a, b, c); }
+    #define QUATERNARY_GP_IMM(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_INSERT_GP(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_INSERT_FP(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_VECTOR_MASK(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_FP_F32(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_FP_F64(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_ATOMIC_GP_IMM(upper, lower) QUATERNARY(upper, lower)
+    #define QUATERNARY_ATOMIC_MEM(upper, lower) QUATERNARY(upper, lower)
+
+    #define SELECT(upper, lower) virtual void lower(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) const override { checkLevel(as); Target:: lower(as, cond, dst, a, b, c, d); }
+    #define SELECT_FLOAT(upper, lower) virtual void lower(Assembly& as, FloatCondition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) const override { checkLevel(as); Target:: lower(as, cond, dst, a, b, c, d); }
     #define SELECT_GP_IMM(upper, lower) SELECT(upper, lower)
     #define SELECT_FP_F32(upper, lower) SELECT_FLOAT(upper, lower)
     #define SELECT_FP_F64(upper, lower) SELECT_FLOAT(upper, lower)
 
-    #define COMPARE(upper, lower) virtual void lower(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b) const override { Target:: lower(as, cond, dst, a, b); }
-    #define COMPARE_FLOAT(upper, lower) virtual void lower(Assembly& as, FloatCondition cond, ASMVal dst, ASMVal a, ASMVal b) const override { Target:: lower(as, cond, dst, a, b); }
-    #define COMPARE_MEMORY(upper, lower) virtual void lower(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) const override { Target:: lower(as, cond, dst, a, b, c); }
+    #define COMPARE(upper, lower) virtual void lower(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b) const override { checkLevel(as); Target:: lower(as, cond, dst, a, b); }
+    #define COMPARE_FLOAT(upper, lower) virtual void lower(Assembly& as, FloatCondition cond, ASMVal dst, ASMVal a, ASMVal b) const override { checkLevel(as); Target:: lower(as, cond, dst, a, b); }
+    #define COMPARE_MEMORY(upper, lower) virtual void lower(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) const override { checkLevel(as); Target:: lower(as, cond, dst, a, b, c); }
     #define COMPARE_GP_IMM(upper, lower) COMPARE(upper, lower)
     #define COMPARE_FP_F32(upper, lower) COMPARE_FLOAT(upper, lower)
     #define COMPARE_FP_F64(upper, lower) COMPARE_FLOAT(upper, lower)
+    #define COMPARE_VECTOR(upper, lower) COMPARE(upper, lower)
+    #define COMPARE_VECTOR_FLOAT(upper, lower) COMPARE_FLOAT(upper, lower)
+    #define COMPARE_MASK(upper, lower) COMPARE(upper, lower)
+    #define COMPARE_MASK_FLOAT(upper, lower) COMPARE_FLOAT(upper, lower)
     #define BRANCH_COMPARE_GP_IMM(upper, lower) COMPARE(upper, lower)
     #define BRANCH_COMPARE_FP_F32(upper, lower) COMPARE_FLOAT(upper, lower)
     #define BRANCH_COMPARE_FP_F64(upper, lower) COMPARE_FLOAT(upper, lower)
@@ -2010,6 +2721,7 @@ struct TargetImplementation : public TargetInterface {
     #undef UNARY
     #undef BINARY
     #undef TERNARY
+    #undef QUATERNARY
     #undef COMPARE
     #undef COMPARE_FLOAT
     #undef SELECT
@@ -2031,6 +2743,11 @@ struct TargetImplementation : public TargetInterface {
     #undef BINARY_MEM_GP_IMM
     #undef BINARY_MEM_FP_F32
     #undef BINARY_MEM_FP_F64
+    #undef BINARY_VECTOR_MEM
+    #undef BINARY_MEM_VECTOR
+    #undef BINARY_VECTOR_GP_IMM
+    #undef BINARY_MASK_GP
+    #undef BINARY_GP_MASK
     #undef BINARY_BRANCH_GP
     #undef BINARY_GP_IMM64
     #undef TERNARY_GP_IMM
@@ -2042,10 +2759,29 @@ struct TargetImplementation : public TargetInterface {
     #undef TERNARY_STORE_INDEX_FP_F32
     #undef TERNARY_STORE_INDEX_FP_F64
     #undef TERNARY_MEMORY_OP
+    #undef TERNARY_VECTOR
+    #undef TERNARY_VECTOR_IMM
+    #undef TERNARY_EXTRACT_GP
+    #undef TERNARY_EXTRACT_FP
+    #undef TERNARY_MASKED_LOAD
+    #undef TERNARY_MASKED_STORE
+    #undef TERNARY_ATOMIC_GP_IMM
+    #undef QUATERNARY_GP_IMM
+    #undef QUATERNARY_INSERT_GP
+    #undef QUATERNARY_INSERT_FP
+    #undef QUATERNARY_VECTOR_MASK
+    #undef QUATERNARY_FP_F32
+    #undef QUATERNARY_FP_F64
+    #undef QUATERNARY_ATOMIC_GP_IMM
+    #undef QUATERNARY_ATOMIC_MEM
     #undef SELECT_GP_IMM
     #undef COMPARE_GP_IMM
     #undef COMPARE_FP_F32
     #undef COMPARE_FP_F64
+    #undef COMPARE_VECTOR
+    #undef COMPARE_VECTOR_FLOAT
+    #undef COMPARE_MASK
+    #undef COMPARE_MASK_FLOAT
     #undef COMPARE_MEMORY
     #undef BRANCH_COMPARE_GP_IMM
     #undef BRANCH_COMPARE_FP_F32
@@ -2067,8 +2803,10 @@ struct TargetImplementation : public TargetInterface {
     virtual RegSet callee_saves() const override { return Target::callee_saves(); };
     virtual RegSet gps() const override { return Target::gps(); }
     virtual RegSet fps() const override { return Target::fps(); }
+    virtual RegSet masks() const override { return Target::masks(); }
     virtual bool is_gp(mreg r) const override { return Target::is_gp(r); }
     virtual bool is_fp(mreg r) const override { return Target::is_fp(r); }
+    virtual bool is_mask(mreg r) const override { return Target::is_mask(r); }
     virtual const_slice<i8> reg_name(mreg r) const override { return Target::reg_name(r); }
     virtual Size word_size() const override { return Target::word_size(); }
     virtual Size ptr_size() const override { return Target::ptr_size(); }
@@ -2082,6 +2820,8 @@ struct TargetImplementation : public TargetInterface {
 
     virtual mreg framePtr() const override { return Target::fp; }
     virtual mreg stackPtr() const override { return Target::sp; }
+
+    virtual TargetDesc desc() const override { return Target::DESC; }
 };
 
 #endif
\ No newline at end of file
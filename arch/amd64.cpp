@@ -2,7 +2,72 @@
 #include "rt/def.h"
 #include "util/malloc.h"
 
-const TargetDesc AMD64LinuxAssembler::DESC = TargetDesc(OS_LINUX, ARCH_AMD64);
+const TargetDesc AMD64LinuxAssembler::DESC = TargetDesc(OS_LINUX, ARCH_AMD64, ISA_V3);
+
+#ifdef RT_AMD64
+static inline void cpuid(u32 leaf, u32 subleaf, u32 regs[4]) {
+    asm volatile("cpuid" : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3]) : "a"(leaf), "c"(subleaf));
+}
+
+static inline u64 xgetbv(u32 index) {
+    u32 lo, hi;
+    asm volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+    return u64(hi) << 32 | lo;
+}
+#endif
+
+u32 AMD64Assembler::host_features() {
+#ifdef RT_AMD64
+    u32 regs[4], features = 0;
+    cpuid(0, 0, regs);
+    u32 maxLeaf = regs[0];
+
+    cpuid(1, 0, regs);
+    u32 ecx = regs[2];
+    if (ecx & 1u << 0) features |= FEATURE_SSE3;
+    if (ecx & 1u << 9) features |= FEATURE_SSSE3;
+    if (ecx & 1u << 12) features |= FEATURE_FMA;
+    if (ecx & 1u << 13) features |= FEATURE_CMPXCHG16B;
+    if (ecx & 1u << 19) features |= FEATURE_SSE41;
+    if (ecx & 1u << 20) features |= FEATURE_SSE42;
+    if (ecx & 1u << 22) features |= FEATURE_MOVBE;
+    if (ecx & 1u << 23) features |= FEATURE_POPCNT;
+    if (ecx & 1u << 29) features |= FEATURE_F16C;
+
+    // XCR0 tells us which register files the OS saves: bits 1 and 2 for XMM
+    // and YMM, and bits 5 through 7 for the AVX-512 masks and upper halves.
+    u64 xcr0 = ecx & 1u << 27 ? xgetbv(0) : 0; // OSXSAVE
+    bool avxState = (xcr0 & 0x6) == 0x6, avx512State = (xcr0 & 0xe6) == 0xe6;
+    if (avxState && ecx & 1u << 28) features |= FEATURE_AVX;
+    if (!avxState)
+        features &= ~(FEATURE_FMA | FEATURE_F16C);
+
+    if (maxLeaf >= 7) {
+        cpuid(7, 0, regs);
+        u32 ebx = regs[1];
+        if (ebx & 1u << 3) features |= FEATURE_BMI1;
+        if (ebx & 1u << 8) features |= FEATURE_BMI2;
+        if (avxState && ebx & 1u << 5) features |= FEATURE_AVX2;
+        if (avx512State) {
+            if (ebx & 1u << 16) features |= FEATURE_AVX512F;
+            if (ebx & 1u << 17) features |= FEATURE_AVX512DQ;
+            if (ebx & 1u << 28) features |= FEATURE_AVX512CD;
+            if (ebx & 1u << 30) features |= FEATURE_AVX512BW;
+            if (ebx & 1u << 31) features |= FEATURE_AVX512VL;
+        }
+    }
+
+    cpuid(0x80000000, 0, regs);
+    if (regs[0] >= 0x80000001) {
+        cpuid(0x80000001, 0, regs);
+        if (regs[2] & 1u << 0) features |= FEATURE_LAHF;
+        if (regs[2] & 1u << 5) features |= FEATURE_LZCNT;
+    }
+    return features;
+#else
+    return 0;
+#endif
+}
 
 struct PlacementState {
     vec<mreg, 8> argumentGPs, argumentFPs;
@@ -8,16 +8,25 @@ struct AMD64Assembler {
         RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
         R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15,
         XMM0 = 32, XMM1 = 33, XMM2 = 34, XMM3 = 35, XMM4 = 36, XMM5 = 37, XMM6 = 38, XMM7 = 39,
-        XMM8 = 40, XMM9 = 41, XMM10 = 42, XMM11 = 43, XMM12 = 44, XMM13 = 45, XMM14 = 46, XMM15 = 47;
+        XMM8 = 40, XMM9 = 41, XMM10 = 42, XMM11 = 43, XMM12 = 44, XMM13 = 45, XMM14 = 46, XMM15 = 47,
+        XMM16 = 48, XMM17 = 49, XMM18 = 50, XMM19 = 51, XMM20 = 52, XMM21 = 53, XMM22 = 54, XMM23 = 55,
+        XMM24 = 56, XMM25 = 57, XMM26 = 58, XMM27 = 59, XMM28 = 60, XMM29 = 61, XMM30 = 62, XMM31 = 63,
+        K0 = 64, K1 = 65, K2 = 66, K3 = 67, K4 = 68, K5 = 69, K6 = 70, K7 = 71;
     static constexpr mreg GP_REGS[14] = { RAX, RCX, RDX, RSI, RDI, RBX, R8, R9, R10, R11, R12, R13, R14, R15 };
     static constexpr mreg FP_REGS[16] = { XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7, XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15 };
     static constexpr const i8* GP_REG_NAMES[16] = {
         "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", 
         "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
     };
-    static constexpr const i8* FP_REG_NAMES[16] = {
+    static constexpr mreg MASK_REGS[7] = { K1, K2, K3, K4, K5, K6, K7 }; // K0 can't be used as a write mask.
+    static constexpr const i8* FP_REG_NAMES[32] = {
         "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7", 
-        "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15" 
+        "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15",
+        "xmm16", "xmm17", "xmm18", "xmm19", "xmm20", "xmm21", "xmm22", "xmm23",
+        "xmm24", "xmm25", "xmm26", "xmm27", "xmm28", "xmm29", "xmm30", "xmm31"
+    };
+    static constexpr const i8* MASK_REG_NAMES[8] = {
+        "k0", "k1", "k2", "k3", "k4", "k5", "k6", "k7"
     };
     
     constexpr static mreg fp = RBP, sp = RSP;
@@ -27,21 +36,32 @@ struct AMD64Assembler {
         return RegSet(GP_REGS, 14);
     }
 
+    // XMM16-XMM31 can only be encoded with EVEX, which only the AVX-512
+    // opcodes use, so they're named but never allocated.
     static constexpr inline RegSet fps() {
         return RegSet(FP_REGS, 16);
     }
 
+    static constexpr inline RegSet masks() {
+        return RegSet(MASK_REGS, 7);
+    }
+
     static constexpr inline bool is_gp(mreg r) {
         return r < 16;
     }
 
     static constexpr inline bool is_fp(mreg r) {
-        return r >= 32 && r < 48;
+        return r >= 32 && r < 64;
+    }
+
+    static constexpr inline bool is_mask(mreg r) {
+        return r >= 64 && r < 72;
     }
 
     static constexpr inline const_slice<i8> reg_name(mreg r) {
         if (r < XMM0) return { GP_REG_NAMES[i32(r)], findc(GP_REG_NAMES[i32(r)], 0) };
-        else return { FP_REG_NAMES[i32(r - XMM0)], findc(FP_REG_NAMES[i32(r - XMM0)], 0) };
+        else if (r < K0) return { FP_REG_NAMES[i32(r - XMM0)], findc(FP_REG_NAMES[i32(r - XMM0)], 0) };
+        else return { MASK_REG_NAMES[i32(r - K0)], findc(MASK_REG_NAMES[i32(r - K0)], 0) };
     }
 
     static constexpr inline Size word_size() {
@@ -52,6 +72,52 @@ struct AMD64Assembler {
         return Size::BITS64;
     }
 
+    // The CPUID features that make up each ISA level, as one bitmask.
+    enum Feature : u32 {
+        FEATURE_CMPXCHG16B = 1u << 0,
+        FEATURE_LAHF = 1u << 1,
+        FEATURE_POPCNT = 1u << 2,
+        FEATURE_SSE3 = 1u << 3,
+        FEATURE_SSSE3 = 1u << 4,
+        FEATURE_SSE41 = 1u << 5,
+        FEATURE_SSE42 = 1u << 6,
+        FEATURE_AVX = 1u << 7,
+        FEATURE_AVX2 = 1u << 8,
+        FEATURE_BMI1 = 1u << 9,
+        FEATURE_BMI2 = 1u << 10,
+        FEATURE_LZCNT = 1u << 11,
+        FEATURE_FMA = 1u << 12,
+        FEATURE_MOVBE = 1u << 13,
+        FEATURE_F16C = 1u << 14,
+        FEATURE_AVX512F = 1u << 15,
+        FEATURE_AVX512BW = 1u << 16,
+        FEATURE_AVX512CD = 1u << 17,
+        FEATURE_AVX512DQ = 1u << 18,
+        FEATURE_AVX512VL = 1u << 19,
+
+        FEATURES_V2 = FEATURE_CMPXCHG16B | FEATURE_LAHF | FEATURE_POPCNT | FEATURE_SSE3 | FEATURE_SSSE3 | FEATURE_SSE41 | FEATURE_SSE42,
+        FEATURES_V3 = FEATURES_V2 | FEATURE_AVX | FEATURE_AVX2 | FEATURE_BMI1 | FEATURE_BMI2 | FEATURE_LZCNT | FEATURE_FMA | FEATURE_MOVBE | FEATURE_F16C,
+        FEATURES_V4 = FEATURES_V3 | FEATURE_AVX512F | FEATURE_AVX512BW | FEATURE_AVX512CD | FEATURE_AVX512DQ | FEATURE_AVX512VL
+    };
+
+    // Asks the processor we're running on which features it has. The AVX
+    // and AVX-512 ones only count if the OS saves their registers for us.
+    // Off amd64, this is always zero.
+    static u32 host_features();
+
+    static constexpr inline ISALevel level_of(u32 features) {
+        if ((features & FEATURES_V4) == FEATURES_V4) return ISA_V4;
+        if ((features & FEATURES_V3) == FEATURES_V3) return ISA_V3;
+        if ((features & FEATURES_V2) == FEATURES_V2) return ISA_V2;
+        return ISA_BASELINE;
+    }
+
+    // The highest level we can run here. This queries CPUID every time, so
+    // callers should hang on to it.
+    static inline ISALevel host_level() {
+        return level_of(host_features());
+    }
+
     static inline constexpr RegSet clobbers(ASMOpcode opcode) {
         switch (opcode) {
             case ASMOpcode::SDIV8:
@@ -72,6 +138,56 @@ struct AMD64Assembler {
             case ASMOpcode::UREM32:
             case ASMOpcode::UREM64:
                 return RegSet(RAX, RDX, RCX);
+            case ASMOpcode::UDIVBY32:
+                return RegSet(RAX, RDX);
+            case ASMOpcode::ACAS8:
+            case ASMOpcode::ACAS16:
+            case ASMOpcode::ACAS32:
+            case ASMOpcode::ACAS64:
+                return RegSet(RAX);
+            case ASMOpcode::ACAS128:
+                return RegSet(RAX, RBX, RCX, RDX);
+            case ASMOpcode::UDIVINFO32:
+            case ASMOpcode::UREMBY32:
+                return RegSet(RAX, RDX, RCX);
+            case ASMOpcode::FSELCC32:
+            case ASMOpcode::FSELCC64:
+                return RegSet(XMM0, XMM1);
+            case ASMOpcode::MCPY:
+                return RegSet(RAX, RCX, RSI, RDI, XMM0, XMM1);
+            case ASMOpcode::MSET:
+                return RegSet(RAX, RCX, RDI, XMM0);
+            case ASMOpcode::MMOV:
+                return RegSet(RAX, RCX, RSI, RDI, XMM0, XMM1, XMM2, XMM3);
+            case ASMOpcode::MCMPCC:
+            case ASMOpcode::MBRCC:
+                return RegSet(RAX, RCX, RDX, RSI, RDI, XMM0);
+            case ASMOpcode::VEXT8X32:
+            case ASMOpcode::VEXT16X16:
+            case ASMOpcode::VEXT32X8:
+            case ASMOpcode::VEXT64X4:
+            case ASMOpcode::VINS8X32:
+            case ASMOpcode::VINS16X16:
+            case ASMOpcode::VINS32X8:
+            case ASMOpcode::VINS64X4:
+            case ASMOpcode::VFINS32X8:
+            case ASMOpcode::VFINS64X4:
+            case ASMOpcode::VMIN64X2:
+            case ASMOpcode::VMIN64X4:
+            case ASMOpcode::VMAX64X2:
+            case ASMOpcode::VMAX64X4:
+                return RegSet(XMM0);
+            case ASMOpcode::VMUL64X2:
+            case ASMOpcode::VMUL64X4:
+            case ASMOpcode::VCMPCC8X16:
+            case ASMOpcode::VCMPCC8X32:
+            case ASMOpcode::VCMPCC16X8:
+            case ASMOpcode::VCMPCC16X16:
+            case ASMOpcode::VCMPCC32X4:
+            case ASMOpcode::VCMPCC32X8:
+            case ASMOpcode::VCMPCC64X2:
+            case ASMOpcode::VCMPCC64X4:
+                return RegSet(XMM0, XMM1);
             case ASMOpcode::FPUSH32:
             case ASMOpcode::FPUSH64:
             case ASMOpcode::FPOP32:
@@ -85,18 +201,6 @@ struct AMD64Assembler {
             case ASMOpcode::I8TOF64:
             case ASMOpcode::I16TOF64:
                 return RegSet(RAX);
-            case ASMOpcode::SHL8:
-            case ASMOpcode::SHL16:
-            case ASMOpcode::SHL32:
-            case ASMOpcode::SHL64:
-            case ASMOpcode::SHR8:
-            case ASMOpcode::SHR16:
-            case ASMOpcode::SHR32:
-            case ASMOpcode::SHR64:
-            case ASMOpcode::SAR8:
-            case ASMOpcode::SAR16:
-            case ASMOpcode::SAR32:
-            case ASMOpcode::SAR64:
             case ASMOpcode::ROL8:
             case ASMOpcode::ROL16:
             case ASMOpcode::ROL32:
@@ -116,12 +220,74 @@ struct AMD64Assembler {
             case ASMOpcode::FST64:
             case ASMOpcode::FSTI32:
             case ASMOpcode::FSTI64:
+            case ASMOpcode::FMADD32:
+            case ASMOpcode::FMADD64:
+            case ASMOpcode::FMSUB32:
+            case ASMOpcode::FMSUB64:
+            case ASMOpcode::FNMADD32:
+            case ASMOpcode::FNMADD64:
                 return RegSet(XMM0);
             default:
                 return RegSet();
         }
     }
 
+    // The fallbacks we use below ISA_V3 need a few more scratch registers.
+    static inline constexpr RegSet clobbers(ASMOpcode opcode, ISALevel level) {
+        RegSet regs = clobbers(opcode);
+        if (level >= ISA_V3)
+            return regs;
+        switch (opcode) {
+            case ASMOpcode::FSUB32:
+            case ASMOpcode::FSUB64:
+            case ASMOpcode::FNEG32:
+            case ASMOpcode::FNEG64:
+                regs.add(XMM0);
+                break;
+            case ASMOpcode::MCMPCC:
+            case ASMOpcode::MBRCC:
+                regs.add(XMM1);
+                break;
+            case ASMOpcode::FROUND32:
+            case ASMOpcode::FROUND64:
+            case ASMOpcode::FFLOOR32:
+            case ASMOpcode::FFLOOR64:
+            case ASMOpcode::FCEIL32:
+            case ASMOpcode::FCEIL64:
+            case ASMOpcode::FTRUNC32:
+            case ASMOpcode::FTRUNC64:
+            case ASMOpcode::FREM32:
+            case ASMOpcode::FREM64:
+                if (level < ISA_V2)
+                    regs.add(RAX, XMM0, XMM1);
+                break;
+            case ASMOpcode::POPC8:
+            case ASMOpcode::POPC16:
+            case ASMOpcode::POPC32:
+            case ASMOpcode::POPC64:
+                if (level < ISA_V2)
+                    regs.add(RAX, RCX);
+                break;
+            case ASMOpcode::SHL8:
+            case ASMOpcode::SHL16:
+            case ASMOpcode::SHL32:
+            case ASMOpcode::SHL64:
+            case ASMOpcode::SHR8:
+            case ASMOpcode::SHR16:
+            case ASMOpcode::SHR32:
+            case ASMOpcode::SHR64:
+            case ASMOpcode::SAR8:
+            case ASMOpcode::SAR16:
+            case ASMOpcode::SAR32:
+            case ASMOpcode::SAR64:
+                regs.add(RCX); // Without shlx and friends, the count goes in CL.
+                break;
+            default:
+                break;
+        }
+        return regs;
+    }
+
     enum AMD64Size {
         BYTE, WORD, DWORD, QWORD, SINGLE, DOUBLE
     };
@@ -339,7 +505,7 @@ struct AMD64Assembler {
     }
 
     static inline bool is_ext(ASMVal val) {
-        return (val.kind == ASMVal::FP && val.fp >= XMM8)
+        return (val.kind == ASMVal::FP && (val.fp - XMM0) & 8)
             || (val.kind == ASMVal::GP && val.gp >= R8);
     }
 
@@ -357,6 +523,7 @@ struct AMD64Assembler {
     };
 
     static inline void vexbinaryprefix(Assembly& as, VexPrefix prefix, bool rexX, bool wide, ASMVal dst, ASMVal& lhs, ASMVal& rhs, bool commutative, VexOpcode opclass) {
+        assert(as.isa >= ISA_V3);
         bool needs_three_byte = is_ext(rhs) || opclass != TwoByteOpcode || wide || rexX;
         if (needs_three_byte && !is_ext(lhs) && commutative) {
             swap(lhs, rhs);
@@ -387,6 +554,7 @@ struct AMD64Assembler {
     }
 
     static inline void vexunaryprefix(Assembly& as, VexPrefix prefix, bool rexX, bool wide, ASMVal dst, ASMVal src, VexOpcode opclass) {
+        assert(as.isa >= ISA_V3);
         bool needs_three_byte = is_ext(src) || opclass != TwoByteOpcode || wide || rexX;
 
         if (needs_three_byte) { // Needs three-byte VEX prefix
@@ -412,6 +580,53 @@ struct AMD64Assembler {
         }
     }
 
+    // Below ISA_V3 there's no VEX, so SSE instructions take their legacy
+    // encoding: the mandatory prefix, then REX, then the escape bytes. These
+    // only have two operands, and overwrite the first.
+    static inline void sseprefix(Assembly& as, VexPrefix prefix, bool rexX, bool wide, ASMVal reg, ASMVal rm, VexOpcode opclass) {
+        constexpr u8 prefixes[4] = { 0x00, 0x66, 0xf3, 0xf2 };
+        if (prefix != NoPrefix)
+            as.code.write<u8>(prefixes[prefix]);
+        bool extB = rm.kind == ASMVal::MEM ? rm.memkind == ASMVal::REG_OFFSET && rm.base >= R8 : is_ext(rm);
+        if (wide || rexX || is_ext(reg) || extB)
+            as.code.write<u8>(0x40 | wide << 3 | is_ext(reg) << 2 | rexX << 1 | extB);
+        as.code.write<u8>(0x0f);
+        if (opclass == ThreeByteOpcode38)
+            as.code.write<u8>(0x38);
+        else if (opclass == ThreeByteOpcode3A)
+            as.code.write<u8>(0x3a);
+    }
+
+    static inline void sseop(Assembly& as, VexPrefix prefix, bool wide, u8 opcode, ASMVal reg, ASMVal rm, VexOpcode opclass) {
+        if (rm.kind == ASMVal::F32)
+            rm = emitF32Constant(as, rm);
+        if (rm.kind == ASMVal::F64)
+            rm = emitF64Constant(as, rm);
+        sseprefix(as, prefix, false, wide, reg, rm, opclass);
+        as.code.write<u8>(opcode);
+        if (reg.kind == ASMVal::FP)
+            reg = GP(reg.fp - XMM0);
+        if (rm.kind == ASMVal::FP)
+            rm = GP(rm.fp - XMM0);
+        modrm(as, reg, rm);
+    }
+
+    // Copies all of src, which is cheaper than merging into dst with movss.
+    static inline void ssemove(Assembly& as, ASMVal dst, ASMVal src) {
+        if (dst != src)
+            sseop(as, NoPrefix, false, 0x28, dst, src, TwoByteOpcode); // movaps
+    }
+
+    // Shifts each lane of dst by an immediate, with the operation in the
+    // reg field.
+    static inline void sseshift(Assembly& as, u8 opcode, u8 ext, ASMVal dst, u8 imm) {
+        if (as.isa >= ISA_V3)
+            vexop(as, VexPrefix66, TwoByteOpcode, false, false, opcode, GP(ext), dst, dst);
+        else
+            sseop(as, VexPrefix66, false, opcode, GP(ext), dst, TwoByteOpcode);
+        as.code.write<u8>(imm);
+    }
+
     static inline void vexbinaryop(Assembly& as, VexPrefix prefix, bool wide, Opcode opcode, ASMVal dst, ASMVal lhs, ASMVal rhs, bool commutative, VexOpcode opclass) {
         if (lhs.kind == ASMVal::F32)
             lhs = emitF32Constant(as, lhs);
@@ -425,6 +640,14 @@ struct AMD64Assembler {
             swap(lhs, rhs);
         assert(lhs.kind != ASMVal::MEM);
 
+        if (as.isa < ISA_V3) {
+            if (dst != lhs && dst == rhs && commutative)
+                swap(lhs, rhs);
+            assert(dst == lhs || dst != rhs); // Otherwise, we'd overwrite rhs before reading it.
+            ssemove(as, dst, lhs);
+            return sseop(as, prefix, wide, opcode.base, dst, rhs, opclass);
+        }
+
         vexbinaryprefix(as, prefix, false, wide, dst, lhs, rhs, commutative, opclass);
         as.code.write<u8>(opcode.base);
         ASMVal reg = dst, rm = rhs;
@@ -446,10 +669,13 @@ struct AMD64Assembler {
             src = dst;
         }
 
-        vexunaryprefix(as, prefix, false, wide, dst, src, opclass);
-        as.code.write<u8>(opcode.base);
         ASMVal reg = dst, rm = src;
         if (reg.kind == ASMVal::MEM) swap(reg, rm);
+        if (as.isa < ISA_V3)
+            return sseop(as, prefix, wide, opcode.base, reg, rm, opclass);
+
+        vexunaryprefix(as, prefix, false, wide, dst, src, opclass);
+        as.code.write<u8>(opcode.base);
         if (reg.kind == ASMVal::FP)
             reg = GP(reg.fp - XMM0);
         if (rm.kind == ASMVal::FP)
@@ -457,9 +683,94 @@ struct AMD64Assembler {
         modrm(as, reg, rm);
     }
 
-    // TODO: Make adds and subtracts into leas
+    // Encodes a packed VEX instruction, with reg in the ModRM reg field, src
+    // in vvvv (or nothing, if it's neither a GP nor FP register) and rm in the
+    // ModRM rm field. Unlike the scalar helpers above, this one can set the
+    // vector length, and takes the B bit from the base of a memory operand.
+    static inline void vexop(Assembly& as, VexPrefix prefix, VexOpcode opclass, bool wide, bool ymm, u8 opcode, ASMVal reg, ASMVal src, ASMVal rm) {
+        assert(as.isa >= ISA_V3);
+        if (ymm) as.dirtyUpper = true;
+        assert(!(reg.kind == ASMVal::FP && reg.fp >= XMM16) && !(src.kind == ASMVal::FP && src.fp >= XMM16) && !(rm.kind == ASMVal::FP && rm.fp >= XMM16));
+        u8 vvvv = 0;
+        if (src.kind == ASMVal::FP) vvvv = src.fp - XMM0;
+        else if (src.kind == ASMVal::GP) vvvv = src.gp;
+        bool extB = rm.kind == ASMVal::MEM ? rm.memkind == ASMVal::REG_OFFSET && rm.base >= R8 : is_ext(rm);
+
+        if (extB || wide || opclass != TwoByteOpcode) { // Needs three-byte VEX prefix
+            as.code.write<u8>(0xc4);
+            u8 vex1 = opclass, vex2 = prefix;
+            if (!is_ext(reg)) vex1 |= 0b10000000; // ~R bit
+            vex1 |= 0b01000000; // ~X bit, we never use an index.
+            if (!extB) vex1 |= 0b00100000; // ~B bit
+            vex2 |= (~vvvv & 0b1111) << 3;
+            if (ymm) vex2 |= 0b00000100; // Vector length
+            if (wide) vex2 |= 0b10000000; // Wide
+            as.code.write<u8>(vex1);
+            as.code.write<u8>(vex2);
+        }
+        else { // Two-byte VEX prefix
+            as.code.write<u8>(0xc5);
+            u8 vex = prefix;
+            if (!is_ext(reg)) vex |= 0b10000000; // ~R bit
+            vex |= (~vvvv & 0b1111) << 3;
+            if (ymm) vex |= 0b00000100; // Vector length
+            as.code.write<u8>(vex);
+        }
+        as.code.write<u8>(opcode);
+        if (reg.kind == ASMVal::FP)
+            reg = GP(reg.fp - XMM0);
+        if (rm.kind == ASMVal::FP)
+            rm = GP(rm.fp - XMM0);
+        modrm(as, reg, rm);
+    }
+
+    static inline void vexop(Assembly& as, VexPrefix prefix, VexOpcode opclass, bool wide, bool ymm, u8 opcode, ASMVal reg, ASMVal rm) {
+        vexop(as, prefix, opclass, wide, ymm, opcode, reg, Imm(0), rm);
+    }
+
+    // Mixing legacy SSE with dirty upper halves is slow on many cores, and
+    // callers may not expect it, so ret and call emit this if anything in
+    // the function wrote a YMM or ZMM register.
+    static inline void vzeroupper(Assembly& as) {
+        if (as.isa < ISA_V3)
+            return; // Nothing wrote a YMM register, and there's no instruction to do it with.
+        as.code.write<u8>(0xc5);
+        as.code.write<u8>(0xf8);
+        as.code.write<u8>(0x77);
+    }
+
+    // Lowers dst = a + b to a single lea when dst is distinct from both
+    // operands, saving the mov that add would need first. Returns false if
+    // the sum has no address form. Unlike add, lea leaves the flags alone,
+    // which is fine since nothing reads the flags after an add or sub.
+    // Results narrower than 64 bits use a 32-bit lea, which computes the same
+    // low bits without a partial register write.
+    static inline bool lea_add(Assembly& as, AMD64Size size, ASMVal dst, ASMVal a, ASMVal b) {
+        if (dst.kind != ASMVal::GP || dst == a || dst == b)
+            return false;
+        if (a.kind == ASMVal::IMM) swap(a, b);
+        if (a.kind != ASMVal::GP)
+            return false;
+        AMD64Size leaSize = size == QWORD ? QWORD : DWORD;
+        if (b.kind == ASMVal::IMM) {
+            binaryop(as, leaSize, Opcode::literal(0x8d), dst, Mem(a.gp, b.imm));
+            return true;
+        }
+        if (b.kind != ASMVal::GP)
+            return false;
+        mreg base = a.gp, index = b.gp;
+        if (index == RSP) swap(base, index);
+        if (index == RSP)
+            return false; // rsp can't be an index, so rsp + rsp can't be an address.
+        index_prefix(as, leaSize, dst.gp, base, index, BYTE, 0);
+        as.code.write<u8>(0x8d);
+        index_args(as, dst.gp, base, index, BYTE, 0);
+        return true;
+    }
 
     static inline void add8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (lea_add(as, BYTE, dst, a, b))
+            return;
         if (dst == b) swap(a, b);
         if (a.kind == ASMVal::IMM) swap(a, b);
         Opcode op = b.kind == ASMVal::IMM ? Opcode::withExt(0x80, 0x00) : Opcode::from(0x00);
@@ -474,6 +785,8 @@ struct AMD64Assembler {
     }
 
     static inline void add16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (lea_add(as, WORD, dst, a, b))
+            return;
         if (dst == b) swap(a, b);
         if (a.kind == ASMVal::IMM) swap(a, b);
         Opcode op = b.kind == ASMVal::IMM ? Opcode::withExt(0x80, 0x00) : Opcode::from(0x00);
@@ -488,6 +801,8 @@ struct AMD64Assembler {
     }
 
     static inline void add32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (lea_add(as, DWORD, dst, a, b))
+            return;
         if (dst == b) swap(a, b);
         if (a.kind == ASMVal::IMM) swap(a, b);
         Opcode op = b.kind == ASMVal::IMM ? Opcode::withExt(0x80, 0x00) : Opcode::from(0x00);
@@ -502,17 +817,9 @@ struct AMD64Assembler {
     }
 
     static inline void add64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (lea_add(as, QWORD, dst, a, b))
+            return;
         if (dst == b) swap(a, b);
-
-        if (a != dst) {
-            if (a.kind == ASMVal::IMM && b.kind == ASMVal::GP)
-                return la(as, dst, Mem(b.gp, a.imm));
-            if (b.kind == ASMVal::IMM && a.kind == ASMVal::GP)
-                return la(as, dst, Mem(a.gp, b.imm));
-            if (a.kind == ASMVal::GP && b.kind == ASMVal::GP)
-                return lai8(as, dst, Mem(a.gp, 0), b);
-        }
-
         if (a.kind == ASMVal::IMM) swap(a, b);
         Opcode op = b.kind == ASMVal::IMM ? Opcode::withExt(0x80, 0x00) : Opcode::from(0x00);
         mov64(as, dst, a);
@@ -528,8 +835,10 @@ struct AMD64Assembler {
     static inline void sub8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
         if (a == b)
             return xor8(as, dst, dst, dst);
+        if (b.kind == ASMVal::IMM && i64(b.imm) != -0x80000000l && lea_add(as, BYTE, dst, a, Imm(-b.imm)))
+            return;
         if (a.kind == ASMVal::IMM || dst == b)
-            return neg8(as, b, b), add8(as, dst, a, b);
+            return neg8(as, dst, b), add8(as, dst, dst, a);
 
         Opcode op = b.kind == ASMVal::IMM ? Opcode::withExt(0x80, 0x05) : Opcode::from(0x28);
         mov8(as, dst, a);
@@ -545,8 +854,10 @@ struct AMD64Assembler {
     static inline void sub16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
         if (a == b)
             return xor16(as, dst, dst, dst);
+        if (b.kind == ASMVal::IMM && i64(b.imm) != -0x80000000l && lea_add(as, WORD, dst, a, Imm(-b.imm)))
+            return;
         if (a.kind == ASMVal::IMM || dst == b)
-            return neg16(as, b, b), add16(as, dst, a, b);
+            return neg16(as, dst, b), add16(as, dst, dst, a);
 
         Opcode op = b.kind == ASMVal::IMM ? Opcode::withExt(0x80, 0x05) : Opcode::from(0x28);
         mov16(as, dst, a);
@@ -562,8 +873,10 @@ struct AMD64Assembler {
     static inline void sub32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
         if (a == b)
             return xor32(as, dst, dst, dst);
+        if (b.kind == ASMVal::IMM && i64(b.imm) != -0x80000000l && lea_add(as, DWORD, dst, a, Imm(-b.imm)))
+            return;
         if (a.kind == ASMVal::IMM || dst == b)
-            return neg32(as, b, b), add32(as, dst, a, b);
+            return neg32(as, dst, b), add32(as, dst, dst, a);
 
         Opcode op = b.kind == ASMVal::IMM ? Opcode::withExt(0x80, 0x05) : Opcode::from(0x28);
         mov32(as, dst, a);
@@ -579,8 +892,10 @@ struct AMD64Assembler {
     static inline void sub64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
         if (a == b)
             return xor64(as, dst, dst, dst);
+        if (b.kind == ASMVal::IMM && i64(b.imm) != -0x80000000l && lea_add(as, QWORD, dst, a, Imm(-b.imm)))
+            return;
         if (a.kind == ASMVal::IMM || dst == b)
-            return neg64(as, b, b), add64(as, dst, a, b);
+            return neg64(as, dst, b), add64(as, dst, dst, a);
 
         Opcode op = b.kind == ASMVal::IMM ? Opcode::withExt(0x80, 0x05) : Opcode::from(0x28);
         mov64(as, dst, a);
@@ -593,8 +908,287 @@ struct AMD64Assembler {
         binaryop(as, QWORD, op, dst, b);
     }
 
+    // Constant Multiplication and Division
+
+    // Immediates are read at the width of the operation, so Imm(-1) is 255
+    // to a byte op, but 2^64 - 1 to a qword one.
+    static inline u64 imm_bits(AMD64Size size, i32 imm) {
+        switch (size) {
+            case BYTE: return u8(imm);
+            case WORD: return u16(imm);
+            case DWORD: return u32(imm);
+            default: return u64(i64(imm));
+        }
+    }
+
+    static inline i64 imm_value(AMD64Size size, i32 imm) {
+        switch (size) {
+            case BYTE: return i8(imm);
+            case WORD: return i16(imm);
+            default: return imm;
+        }
+    }
+
+    static inline void move(Assembly& as, AMD64Size size, ASMVal dst, ASMVal src) {
+        switch (size) {
+            case BYTE: return mov8(as, dst, src);
+            case WORD: return mov16(as, dst, src);
+            case DWORD: return mov32(as, dst, src);
+            default: return mov64(as, dst, src);
+        }
+    }
+
+    // Loads an integer of the given width into all 64 bits of dst.
+    static inline void widen(Assembly& as, AMD64Size size, bool sign, mreg dst, ASMVal src) {
+        if (src.kind == ASMVal::IMM) {
+            if (sign || size == QWORD)
+                return mov64(as, GP(dst), Imm(imm_value(size, src.imm)));
+            return mov32(as, GP(dst), Imm(imm_bits(size, src.imm)));
+        }
+        switch (size) {
+            case BYTE: return sign ? sxt8(as, GP(dst), src) : zxt8(as, GP(dst), src);
+            case WORD: return sign ? sxt16(as, GP(dst), src) : zxt16(as, GP(dst), src);
+            case DWORD:
+                if (sign) return sxt32(as, GP(dst), src);
+                return binaryop(as, DWORD, Opcode::from(0x88), GP(dst), src); // Not mov32, which skips dst == src.
+            default: return mov64(as, GP(dst), src);
+        }
+    }
+
+    static inline void shift_imm(Assembly& as, AMD64Size size, i8 ext, mreg dst, u32 amount) {
+        if (!amount)
+            return;
+        unaryop(as, size, Opcode::litExt(size == BYTE ? 0xc0 : 0xc1, ext), GP(dst));
+        as.code.write<i8>(amount);
+    }
+
+    static inline void imul_imm(Assembly& as, mreg dst, mreg src, i32 imm) {
+        binaryop(as, QWORD, Opcode::literal(0x69), GP(src), GP(dst));
+        as.code.writeLE<i32>(imm);
+    }
+
+    // Lowers dst = a * m to shifts and leas when m, or -m, is 1, 3, 5 or 9
+    // times a power of two. Returns false if imul is the better choice.
+    static inline bool mul_imm(Assembly& as, AMD64Size size, ASMVal dst, ASMVal a, i32 imm) {
+        if (dst.kind != ASMVal::GP || a.kind != ASMVal::GP)
+            return false;
+        u64 mask = size == QWORD ? ~0ull : (1ull << (8 << size)) - 1;
+        u64 m = imm_bits(size, imm);
+        if (m == 0)
+            return move(as, size, dst, Imm(0)), true;
+
+        u32 k = ctz64(m);
+        u64 odd = m >> k;
+        bool negate = false;
+        if (odd != 1 && odd != 3 && odd != 5 && odd != 9) {
+            m = -m & mask, negate = true;
+            k = ctz64(m), odd = m >> k;
+            if (odd != 1 && k != 0)
+                return false; // lea, shl and neg would be no faster than imul.
+            if (odd != 1 && odd != 3 && odd != 5 && odd != 9)
+                return false;
+        }
+        if (odd != 1 && a.gp == RSP)
+            return false; // rsp can't be an index.
+
+        if (odd == 1)
+            move(as, size, dst, a);
+        else {
+            AMD64Size leaSize = size == QWORD ? QWORD : DWORD, scale = odd == 3 ? WORD : odd == 5 ? DWORD : QWORD;
+            index_prefix(as, leaSize, dst.gp, a.gp, a.gp, scale, 0);
+            as.code.write<u8>(0x8d);
+            index_args(as, dst.gp, a.gp, a.gp, scale, 0);
+        }
+        shift_imm(as, size, 0x04, dst.gp, k);
+        if (negate)
+            unaryop(as, size, Opcode::withExt(0xf6, 0x03), dst);
+        return true;
+    }
+
+    // Division by a constant multiplies by a fixed-point reciprocal and keeps
+    // the high half of the product, avoiding div entirely. For operands of 32
+    // bits or less we use a 64-bit reciprocal, which is exact for every
+    // dividend (Lemire, Kaser and Kurz, "Faster Remainder by Direct
+    // Computation"); 64-bit operands use the magic numbers of Hacker's Delight
+    // (section 10). Remainders are then x - q * d. We only touch rax and rdx,
+    // plus rcx past 16 bits, which are exactly what div would have clobbered.
+    struct UnsignedMagic {
+        u64 mul;
+        u32 shift;
+        bool add;
+    };
+
+    static inline UnsignedMagic unsigned_magic(u64 d) {
+        const u64 two63 = 1ull << 63;
+        bool add = false;
+        u64 nc = ~0ull - (-d) % d;
+        u32 p = 63;
+        u64 q1 = two63 / nc, r1 = two63 - q1 * nc;
+        u64 q2 = (two63 - 1) / d, r2 = (two63 - 1) - q2 * d;
+        u64 delta;
+        do {
+            p ++;
+            if (r1 >= nc - r1)
+                q1 = 2 * q1 + 1, r1 = 2 * r1 - nc;
+            else
+                q1 = 2 * q1, r1 = 2 * r1;
+            if (r2 + 1 >= d - r2) {
+                if (q2 >= two63 - 1) add = true;
+                q2 = 2 * q2 + 1, r2 = 2 * r2 + 1 - d;
+            } else {
+                if (q2 >= two63) add = true;
+                q2 = 2 * q2, r2 = 2 * r2 + 1;
+            }
+            delta = d - 1 - r2;
+        } while (p < 128 && (q1 < delta || (q1 == delta && r1 == 0)));
+        return { q2 + 1, p - 64, add };
+    }
+
+    struct SignedMagic {
+        i64 mul;
+        u32 shift;
+    };
+
+    // Only for positive divisors; we divide by |d| and negate.
+    static inline SignedMagic signed_magic(u64 d) {
+        const u64 two63 = 1ull << 63;
+        u64 anc = two63 - 1 - two63 % d;
+        u32 p = 63;
+        u64 q1 = two63 / anc, r1 = two63 - q1 * anc;
+        u64 q2 = two63 / d, r2 = two63 - q2 * d;
+        u64 delta;
+        do {
+            p ++;
+            q1 *= 2, r1 *= 2;
+            if (r1 >= anc) q1 ++, r1 -= anc;
+            q2 *= 2, r2 *= 2;
+            if (r2 >= d) q2 ++, r2 -= d;
+            delta = d - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+        return { i64(q2 + 1), p - 64 };
+    }
+
+    static inline bool udiv_imm(Assembly& as, AMD64Size size, ASMVal dst, ASMVal a, i32 imm, bool rem) {
+        u64 d = imm_bits(size, imm);
+        if (d == 0)
+            return false; // Leave it to div to trap.
+
+        if ((d & (d - 1)) == 0) {
+            widen(as, size, false, RAX, a);
+            if (rem)
+                binaryop(as, QWORD, Opcode::withExt(0x80, 0x04), GP(RAX), Imm(d - 1)); // and
+            else
+                shift_imm(as, QWORD, 0x05, RAX, ctz64(d)); // shr
+            return move(as, size, dst, GP(RAX)), true;
+        }
+
+        mreg x;
+        if (size <= WORD) { // x * ceil(2^32 / d) fits in 64 bits.
+            widen(as, size, false, x = RAX, a);
+            imul_imm(as, RDX, RAX, ((1ull << 32) / d) + 1);
+            shift_imm(as, QWORD, 0x05, RDX, 32);
+        }
+        else if (size == DWORD) {
+            widen(as, size, false, x = RCX, a);
+            mov64(as, GP(RAX), Imm64(~0ull / d + 1));
+            unaryop(as, QWORD, Opcode::withExt(0xf6, 0x04), GP(RCX)); // mul
+        }
+        else {
+            UnsignedMagic magic = unsigned_magic(d);
+            widen(as, size, false, x = RCX, a);
+            mov64(as, GP(RAX), Imm64(magic.mul));
+            unaryop(as, QWORD, Opcode::withExt(0xf6, 0x04), GP(RCX)); // mul
+            if (magic.add) { // The multiplier needed 65 bits, so add back the missing x.
+                mov64(as, GP(RAX), GP(RCX));
+                sub64(as, GP(RAX), GP(RAX), GP(RDX));
+                shift_imm(as, QWORD, 0x05, RAX, 1);
+                add64(as, GP(RDX), GP(RDX), GP(RAX));
+                shift_imm(as, QWORD, 0x05, RDX, magic.shift - 1);
+            }
+            else shift_imm(as, QWORD, 0x05, RDX, magic.shift);
+        }
+
+        if (!rem)
+            return move(as, size, dst, GP(RDX)), true;
+        imul_imm(as, RDX, RDX, imm);
+        sub64(as, GP(x), GP(x), GP(RDX));
+        return move(as, size, dst, GP(x)), true;
+    }
+
+    static inline bool sdiv_imm(Assembly& as, AMD64Size size, ASMVal dst, ASMVal a, i32 imm, bool rem) {
+        i64 d = imm_value(size, imm);
+        if (d == 0)
+            return false; // Leave it to div to trap.
+        u64 ad = d < 0 ? -u64(d) : u64(d);
+
+        if ((ad & (ad - 1)) == 0) {
+            u32 k = ctz64(ad);
+            widen(as, size, true, RAX, a);
+            if (k == 0) {
+                if (rem)
+                    xor32(as, GP(RAX), GP(RAX), GP(RAX));
+                else if (d < 0)
+                    unaryop(as, QWORD, Opcode::withExt(0xf6, 0x03), GP(RAX)); // neg
+                return move(as, size, dst, GP(RAX)), true;
+            }
+
+            // Bias negative dividends by |d| - 1, so the shift rounds toward zero.
+            mov64(as, GP(RDX), GP(RAX));
+            shift_imm(as, QWORD, 0x07, RDX, 63);
+            shift_imm(as, QWORD, 0x05, RDX, 64 - k);
+            add64(as, GP(RDX), GP(RDX), GP(RAX));
+            if (rem) {
+                binaryop(as, QWORD, Opcode::withExt(0x80, 0x04), GP(RDX), Imm(-i64(ad))); // and
+                sub64(as, GP(RAX), GP(RAX), GP(RDX));
+                return move(as, size, dst, GP(RAX)), true;
+            }
+            shift_imm(as, QWORD, 0x07, RDX, k);
+            if (d < 0)
+                unaryop(as, QWORD, Opcode::withExt(0xf6, 0x03), GP(RDX)); // neg
+            return move(as, size, dst, GP(RDX)), true;
+        }
+
+        // Each case leaves floor(x / |d|) in rdx, which is off by one from
+        // the truncated quotient exactly when x is negative.
+        mreg x;
+        if (size <= WORD) {
+            widen(as, size, true, x = RAX, a);
+            imul_imm(as, RDX, RAX, ((1ull << 32) / ad) + 1);
+            shift_imm(as, QWORD, 0x07, RDX, 32);
+        }
+        else if (size == DWORD) {
+            widen(as, size, true, x = RCX, a);
+            mov64(as, GP(RAX), Imm64(~0ull / ad + 1));
+            unaryop(as, QWORD, Opcode::withExt(0xf6, 0x05), GP(RCX)); // imul
+        }
+        else {
+            SignedMagic magic = signed_magic(ad);
+            widen(as, size, true, x = RCX, a);
+            mov64(as, GP(RAX), Imm64(magic.mul));
+            unaryop(as, QWORD, Opcode::withExt(0xf6, 0x05), GP(RCX)); // imul
+            if (magic.mul < 0)
+                add64(as, GP(RDX), GP(RDX), GP(RCX));
+            shift_imm(as, QWORD, 0x07, RDX, magic.shift);
+        }
+        unaryop(as, QWORD, Opcode::litExt(0x0f, 0xba, 0x04), GP(RDX)); // bt rdx, 63
+        as.code.write<u8>(63);
+        unaryop(as, QWORD, Opcode::litExt(0x83, 0x02), GP(RDX)); // adc rdx, 0
+        as.code.write<u8>(0);
+
+        if (!rem) {
+            if (d < 0)
+                unaryop(as, QWORD, Opcode::withExt(0xf6, 0x03), GP(RDX)); // neg
+            return move(as, size, dst, GP(RDX)), true;
+        }
+        imul_imm(as, RDX, RDX, ad);
+        sub64(as, GP(x), GP(x), GP(RDX));
+        return move(as, size, dst, GP(x)), true;
+    }
+
     static inline void mul8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
         if (a.kind == ASMVal::IMM) swap(a, b);
+        if (b.kind == ASMVal::IMM && mul_imm(as, BYTE, dst, a, b.imm))
+            return;
         if (b.kind == ASMVal::IMM) {
             binaryop(as, WORD, Opcode::literal(0x6b), a, dst); // WORD because no byte multiply exists.
             as.code.write<i8>(b.imm);
@@ -606,6 +1200,8 @@ struct AMD64Assembler {
 
     static inline void mul16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
         if (a.kind == ASMVal::IMM) swap(a, b);
+        if (b.kind == ASMVal::IMM && mul_imm(as, WORD, dst, a, b.imm))
+            return;
         if (b.kind == ASMVal::IMM) {
             binaryop(as, WORD, Opcode::literal(0x69), a, dst);
             as.code.writeLE<i16>(b.imm);
@@ -617,6 +1213,8 @@ struct AMD64Assembler {
 
     static inline void mul32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
         if (a.kind == ASMVal::IMM) swap(a, b);
+        if (b.kind == ASMVal::IMM && mul_imm(as, DWORD, dst, a, b.imm))
+            return;
         if (b.kind == ASMVal::IMM) {
             binaryop(as, DWORD, Opcode::literal(0x69), a, dst);
             as.code.writeLE<i32>(b.imm);
@@ -628,6 +1226,8 @@ struct AMD64Assembler {
 
     static inline void mul64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
         if (a.kind == ASMVal::IMM) swap(a, b);
+        if (b.kind == ASMVal::IMM && mul_imm(as, QWORD, dst, a, b.imm))
+            return;
         if (b.kind == ASMVal::IMM) {
             binaryop(as, QWORD, Opcode::literal(0x69), a, dst);
             as.code.writeLE<i32>(b.imm);
@@ -638,6 +1238,8 @@ struct AMD64Assembler {
     }
 
     static inline void sdiv8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && sdiv_imm(as, BYTE, dst, a, b.imm, false))
+            return;
         mov8(as, GP(RAX), a);
         as.code.write<u8>(0x66); // cbw
         as.code.write<u8>(0x98);
@@ -648,6 +1250,8 @@ struct AMD64Assembler {
     }
 
     static inline void sdiv16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && sdiv_imm(as, WORD, dst, a, b.imm, false))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov16(as, GP(RCX), b), b = GP(RCX);
         mov16(as, GP(RAX), a);
@@ -660,6 +1264,8 @@ struct AMD64Assembler {
     }
 
     static inline void sdiv32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && sdiv_imm(as, DWORD, dst, a, b.imm, false))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov32(as, GP(RCX), b), b = GP(RCX);
         mov32(as, GP(RAX), a);
@@ -671,6 +1277,8 @@ struct AMD64Assembler {
     }
 
     static inline void sdiv64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && sdiv_imm(as, QWORD, dst, a, b.imm, false))
+            return;
         if (b.gp == RAX || b.gp == RDX)
             mov64(as, GP(RCX), b), b = GP(RCX);
         mov64(as, GP(RAX), a);
@@ -683,6 +1291,8 @@ struct AMD64Assembler {
     }
 
     static inline void udiv8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && udiv_imm(as, BYTE, dst, a, b.imm, false))
+            return;
         if (a.kind == ASMVal::IMM)
             mov16(as, GP(RAX), a);
         else
@@ -694,6 +1304,8 @@ struct AMD64Assembler {
     }
 
     static inline void udiv16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && udiv_imm(as, WORD, dst, a, b.imm, false))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov16(as, GP(RCX), b), b = GP(RCX);
         mov16(as, GP(RAX), a), a = GP(RAX);
@@ -705,6 +1317,8 @@ struct AMD64Assembler {
     }
 
     static inline void udiv32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && udiv_imm(as, DWORD, dst, a, b.imm, false))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov32(as, GP(RCX), b), b = GP(RCX);
         mov32(as, GP(RAX), a);
@@ -716,6 +1330,8 @@ struct AMD64Assembler {
     }
 
     static inline void udiv64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && udiv_imm(as, QWORD, dst, a, b.imm, false))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov64(as, GP(RCX), b), b = GP(RCX);
         mov64(as, GP(RAX), a);
@@ -727,6 +1343,8 @@ struct AMD64Assembler {
     }
 
     static inline void srem8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && sdiv_imm(as, BYTE, dst, a, b.imm, true))
+            return;
         mov8(as, GP(RAX), a);
         as.code.write<u8>(0x66); // cbw
         as.code.write<u8>(0x98);
@@ -738,6 +1356,8 @@ struct AMD64Assembler {
     }
 
     static inline void srem16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && sdiv_imm(as, WORD, dst, a, b.imm, true))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov16(as, GP(RCX), b), b = GP(RCX);
         mov16(as, GP(RAX), a);
@@ -750,6 +1370,8 @@ struct AMD64Assembler {
     }
 
     static inline void srem32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && sdiv_imm(as, DWORD, dst, a, b.imm, true))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov32(as, GP(RCX), b), b = GP(RCX);
         mov32(as, GP(RAX), a);
@@ -761,6 +1383,8 @@ struct AMD64Assembler {
     }
 
     static inline void srem64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && sdiv_imm(as, QWORD, dst, a, b.imm, true))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov64(as, GP(RCX), b), b = GP(RCX);
         mov64(as, GP(RAX), a);
@@ -773,6 +1397,8 @@ struct AMD64Assembler {
     }
 
     static inline void urem8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && udiv_imm(as, BYTE, dst, a, b.imm, true))
+            return;
         zxt8(as, GP(RAX), a);
         if (b.kind == ASMVal::IMM)
             mov8(as, GP(RDX), b), b = GP(RDX);
@@ -782,6 +1408,8 @@ struct AMD64Assembler {
     }
 
     static inline void urem16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && udiv_imm(as, WORD, dst, a, b.imm, true))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov16(as, GP(RCX), b), b = GP(RCX);
         zxt16(as, GP(RAX), a);
@@ -793,6 +1421,8 @@ struct AMD64Assembler {
     }
 
     static inline void urem32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && udiv_imm(as, DWORD, dst, a, b.imm, true))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov32(as, GP(RCX), b), b = GP(RCX);
         zxt32(as, GP(RAX), a);
@@ -804,6 +1434,8 @@ struct AMD64Assembler {
     }
 
     static inline void urem64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && udiv_imm(as, QWORD, dst, a, b.imm, true))
+            return;
         if (b.gp == RAX || b.gp == RDX) 
             mov64(as, GP(RCX), b), b = GP(RCX);
         mov64(as, GP(RAX), a);
@@ -850,6 +1482,10 @@ struct AMD64Assembler {
             fadd32(as, dst, dst, a);
             return;
         }
+        if (as.isa < ISA_V3 && dst == b && dst != a) {
+            vexbinaryop(as, VexPrefixF3, false, Opcode::from(0x5c), FP(XMM0), a, b, false, TwoByteOpcode);
+            return ssemove(as, dst, FP(XMM0));
+        }
         vexbinaryop(as, VexPrefixF3, false, Opcode::from(0x5c), dst, a, b, false, TwoByteOpcode);
     }
 
@@ -859,6 +1495,10 @@ struct AMD64Assembler {
             fadd64(as, dst, dst, a);
             return;
         }
+        if (as.isa < ISA_V3 && dst == b && dst != a) {
+            vexbinaryop(as, VexPrefixF2, false, Opcode::from(0x5c), FP(XMM0), a, b, false, TwoByteOpcode);
+            return ssemove(as, dst, FP(XMM0));
+        }
         vexbinaryop(as, VexPrefixF2, false, Opcode::from(0x5c), dst, a, b, false, TwoByteOpcode);
     }
 
@@ -870,6 +1510,88 @@ struct AMD64Assembler {
         vexbinaryop(as, VexPrefixF2, false, Opcode::from(0x59), dst, a, b, true, TwoByteOpcode);
     }
 
+    // Fused multiply-add comes with FMA3, alongside AVX2. Each instruction
+    // has three forms, named for the order they take their operands in: 132
+    // computes dst * rm + vvvv, 213 computes dst * vvvv + rm, and 231
+    // computes vvvv * rm + dst. We use whichever form suits the operand
+    // already in dst, or otherwise load dst with one that leaves a register
+    // for vvvv. Only rm can be a constant, so any other constant goes in
+    // XMM0. Below ISA_V3 we multiply, then add, rounding twice, with the
+    // product in XMM0 if c is in dst.
+    static inline void fused_multiply_add(Assembly& as, bool wide, u8 opcode, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+        auto constant = [](ASMVal v) -> bool { return v.kind == ASMVal::F32 || v.kind == ASMVal::F64; };
+        if (as.isa < ISA_V3) {
+            ASMVal product = dst == c ? FP(XMM0) : dst;
+            if (constant(a) && constant(b)) {
+                wide ? fmov64(as, product, a) : fmov32(as, product, a);
+                a = product;
+            }
+            wide ? fmul64(as, product, a, b) : fmul32(as, product, a, b);
+            if (opcode == 0x99) // vfmadd
+                wide ? fadd64(as, dst, product, c) : fadd32(as, dst, product, c);
+            else if (opcode == 0x9b) // vfmsub
+                wide ? fsub64(as, dst, product, c) : fsub32(as, dst, product, c);
+            else // vfnmadd
+                wide ? fsub64(as, dst, c, product) : fsub32(as, dst, c, product);
+            return;
+        }
+
+        if (dst == b)
+            swap(a, b);
+        if (dst != a && dst != c) {
+            if (constant(a) && constant(b)) {
+                wide ? fmov64(as, dst, a) : fmov32(as, dst, a);
+                a = dst;
+            } else {
+                wide ? fmov64(as, dst, c) : fmov32(as, dst, c);
+                c = dst;
+            }
+        }
+        ASMVal src, rm;
+        if (dst == c) {
+            if (constant(a))
+                swap(a, b);
+            src = a, rm = b, opcode += 0x20; // 231
+        }
+        else if (!constant(c))
+            src = c, rm = b; // 132
+        else
+            src = b, rm = c, opcode += 0x10; // 213
+        if (constant(src)) {
+            wide ? fmov64(as, FP(XMM0), src) : fmov32(as, FP(XMM0), src);
+            src = FP(XMM0);
+        }
+        if (rm.kind == ASMVal::F32)
+            rm = emitF32Constant(as, rm);
+        if (rm.kind == ASMVal::F64)
+            rm = emitF64Constant(as, rm);
+        vexop(as, VexPrefix66, ThreeByteOpcode38, wide, false, opcode, dst, src, rm);
+    }
+
+    static inline void fmadd32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+        fused_multiply_add(as, false, 0x99, dst, a, b, c);
+    }
+
+    static inline void fmadd64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+        fused_multiply_add(as, true, 0x99, dst, a, b, c);
+    }
+
+    static inline void fmsub32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+        fused_multiply_add(as, false, 0x9b, dst, a, b, c);
+    }
+
+    static inline void fmsub64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+        fused_multiply_add(as, true, 0x9b, dst, a, b, c);
+    }
+
+    static inline void fnmadd32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+        fused_multiply_add(as, false, 0x9d, dst, a, b, c);
+    }
+
+    static inline void fnmadd64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+        fused_multiply_add(as, true, 0x9d, dst, a, b, c);
+    }
+
     static inline void fdiv32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
         if (a.kind == ASMVal::F32) {
             if (dst != b) {
@@ -880,6 +1602,10 @@ struct AMD64Assembler {
                 a = FP(XMM0);
             }
         }
+        if (as.isa < ISA_V3 && dst == b && dst != a) {
+            vexbinaryop(as, VexPrefixF3, false, Opcode::from(0x5e), FP(XMM0), a, b, false, TwoByteOpcode);
+            return ssemove(as, dst, FP(XMM0));
+        }
         vexbinaryop(as, VexPrefixF3, false, Opcode::from(0x5e), dst, a, b, false, TwoByteOpcode);
     }
 
@@ -893,6 +1619,10 @@ struct AMD64Assembler {
                 a = FP(XMM0);
             }
         }
+        if (as.isa < ISA_V3 && dst == b && dst != a) {
+            vexbinaryop(as, VexPrefixF2, false, Opcode::from(0x5e), FP(XMM0), a, b, false, TwoByteOpcode);
+            return ssemove(as, dst, FP(XMM0));
+        }
         vexbinaryop(as, VexPrefixF2, false, Opcode::from(0x5e), dst, a, b, false, TwoByteOpcode);
     }
 
@@ -918,52 +1648,114 @@ struct AMD64Assembler {
         vexunaryop(as, VexPrefixF2, false, Opcode::from(0x51), dst, src, TwoByteOpcode);
     }
 
+    // roundss and roundsd are SSE4.1, so at the baseline we convert to an
+    // integer and back. That's exact while |x| is below 2^23 (or 2^52), and
+    // anything bigger is already whole, as are infinities and NaNs. Floor and
+    // ceil truncate, then step towards x if they went the wrong way, and a
+    // zero result takes the sign of x by multiplying it by zero.
+    static void fround(Assembly& as, bool wide, u8 mode, ASMVal dst, ASMVal src) {
+        if (as.isa >= ISA_V2) {
+            vexunaryop(as, VexPrefix66, false, Opcode::from(wide ? 0x0b : 0x0a), dst, src, ThreeByteOpcode3A);
+            return as.code.write<u8>(mode);
+        }
+        auto fmov = wide ? fmov64 : fmov32;
+        auto fadd = wide ? fadd64 : fadd32;
+        auto fsub = wide ? fsub64 : fsub32;
+        auto fmul = wide ? fmul64 : fmul32;
+        auto fcmp = wide ? fcmp64 : fcmp32;
+        ASMVal one = wide ? F64(1.0) : F32(1.0f), zero = wide ? F64(0.0) : F32(0.0f);
+        ASMVal t = dst == FP(XMM0) ? FP(XMM1) : FP(XMM0);
+        Symbol done = as.symtab.anon(), stepped = as.symtab.anon(), nonzero = as.symtab.anon();
+
+        fmov(as, dst, src);
+        if (wide) {
+            f64tobits(as, GP(RAX), dst);
+            shl64(as, GP(RAX), GP(RAX), Imm(1));
+            shr64(as, GP(RAX), GP(RAX), Imm(53));
+        } else {
+            f32tobits(as, GP(RAX), dst);
+            shl32(as, GP(RAX), GP(RAX), Imm(1));
+            shr32(as, GP(RAX), GP(RAX), Imm(24));
+        }
+        brcc64(as, COND_AE, Label(done), GP(RAX), Imm(wide ? 1023 + 52 : 127 + 23)); // The biased exponent.
+
+        sseop(as, wide ? VexPrefixF2 : VexPrefixF3, true, mode ? 0x2c : 0x2d, GP(RAX), dst, TwoByteOpcode); // cvttss2si/cvtss2si
+        vexbinaryop(as, wide ? VexPrefixF2 : VexPrefixF3, true, Opcode::from(0x2a), t, t, GP(RAX), false, TwoByteOpcode); // cvtsi2ss/sd
+        if (mode == 1 || mode == 2) {
+            fcmp(as, t, dst);
+            jcc(as, mode == 1 ? COND_BE : COND_AE, Label(stepped));
+            (mode == 1 ? fsub : fadd)(as, t, t, one);
+            local(as, stepped);
+        }
+        fcmp(as, t, zero);
+        jcc(as, COND_NE, Label(nonzero));
+        fmul(as, t, dst, zero);
+        local(as, nonzero);
+        ssemove(as, dst, t);
+        local(as, done);
+    }
+
     static void fround32(Assembly& as, ASMVal dst, ASMVal src) {
-        vexunaryop(as, VexPrefix66, false, Opcode::from(0x0a), dst, src, ThreeByteOpcode3A);
-        as.code.write<u8>(0x00); // Round up or down, breaking ties using banker's rounding.
+        fround(as, false, 0x00, dst, src); // Round up or down, breaking ties using banker's rounding.
     }
 
     static void fround64(Assembly& as, ASMVal dst, ASMVal src) {
-        vexunaryop(as, VexPrefix66, false, Opcode::from(0x0b), dst, src, ThreeByteOpcode3A);
-        as.code.write<u8>(0x00); // Round up or down, breaking ties using banker's rounding.
+        fround(as, true, 0x00, dst, src); // Round up or down, breaking ties using banker's rounding.
     }
 
     static void ffloor32(Assembly& as, ASMVal dst, ASMVal src) {
-        vexunaryop(as, VexPrefix66, false, Opcode::from(0x0a), dst, src, ThreeByteOpcode3A);
-        as.code.write<u8>(0x01); // Round towards negative infinity.
+        fround(as, false, 0x01, dst, src); // Round towards negative infinity.
     }
 
     static void ffloor64(Assembly& as, ASMVal dst, ASMVal src) {
-        vexunaryop(as, VexPrefix66, false, Opcode::from(0x0b), dst, src, ThreeByteOpcode3A);
-        as.code.write<u8>(0x01); // Round towards negative infinity.
+        fround(as, true, 0x01, dst, src); // Round towards negative infinity.
     }
 
     static void fceil32(Assembly& as, ASMVal dst, ASMVal src) {
-        vexunaryop(as, VexPrefix66, false, Opcode::from(0x0a), dst, src, ThreeByteOpcode3A);
-        as.code.write<u8>(0x02); // Round towards positive infinity.
+        fround(as, false, 0x02, dst, src); // Round towards positive infinity.
     }
 
     static void fceil64(Assembly& as, ASMVal dst, ASMVal src) {
-        vexunaryop(as, VexPrefix66, false, Opcode::from(0x0b), dst, src, ThreeByteOpcode3A);
-        as.code.write<u8>(0x02); // Round towards positive infinity.
+        fround(as, true, 0x02, dst, src); // Round towards positive infinity.
     }
 
     static void ftrunc32(Assembly& as, ASMVal dst, ASMVal src) {
-        vexunaryop(as, VexPrefix66, false, Opcode::from(0x0a), dst, src, ThreeByteOpcode3A);
-        as.code.write<u8>(0x03); // Round towards zero.
+        fround(as, false, 0x03, dst, src); // Round towards zero.
     }
 
     static void ftrunc64(Assembly& as, ASMVal dst, ASMVal src) {
-        vexunaryop(as, VexPrefix66, false, Opcode::from(0x0b), dst, src, ThreeByteOpcode3A);
-        as.code.write<u8>(0x03); // Round towards zero.
+        fround(as, true, 0x03, dst, src); // Round towards zero.
+    }
+
+    // Legacy SSE faults on packed operands that aren't 16-byte aligned, which
+    // our constants needn't be, so below ISA_V3 we make sign masks in a
+    // register instead, shifting all ones left or right by one.
+    static inline void fsignmask(Assembly& as, bool wide, bool invert, ASMVal dst) {
+        vexbinaryop(as, VexPrefix66, false, Opcode::from(0x76), dst, dst, dst, true, TwoByteOpcode); // pcmpeqd => all 1s
+        if (invert)
+            sseshift(as, wide ? 0x73 : 0x72, 2, dst, 1); // psrlq/psrld => all but the sign
+        else
+            sseshift(as, wide ? 0x73 : 0x72, 6, dst, wide ? 63 : 31); // psllq/pslld => just the sign
     }
 
     static inline void fneg32(Assembly& as, ASMVal dst, ASMVal src) {
-        vexbinaryop(as, NoPrefix, false, Opcode::from(0x57), dst, src, F32(-0.0f), true, TwoByteOpcode);
+        if (src.kind == ASMVal::F32)
+            return fmov32(as, dst, F32(-src.f32));
+        if (as.isa >= ISA_V3)
+            return vexbinaryop(as, NoPrefix, false, Opcode::from(0x57), dst, src, F32(-0.0f), true, TwoByteOpcode);
+        ASMVal mask = dst == src ? FP(XMM0) : dst;
+        fsignmask(as, false, false, mask);
+        vexbinaryop(as, NoPrefix, false, Opcode::from(0x57), dst, mask, src, true, TwoByteOpcode); // xorps
     }
 
     static inline void fneg64(Assembly& as, ASMVal dst, ASMVal src) {
-        vexbinaryop(as, VexPrefix66, false, Opcode::from(0x57), dst, src, F64(-0.0), true, TwoByteOpcode);
+        if (src.kind == ASMVal::F64)
+            return fmov64(as, dst, F64(-src.f64));
+        if (as.isa >= ISA_V3)
+            return vexbinaryop(as, VexPrefix66, false, Opcode::from(0x57), dst, src, F64(-0.0), true, TwoByteOpcode);
+        ASMVal mask = dst == src ? FP(XMM0) : dst;
+        fsignmask(as, true, false, mask);
+        vexbinaryop(as, VexPrefix66, false, Opcode::from(0x57), dst, mask, src, true, TwoByteOpcode); // xorpd
     }
 
     static void fmin32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
@@ -983,16 +1775,20 @@ struct AMD64Assembler {
     }
 
     static void fabs32(Assembly& as, ASMVal dst, ASMVal src) {
-        vexbinaryop(as, VexPrefix66, false, Opcode::from(0x76), FP(XMM0), FP(XMM0), FP(XMM0), true, TwoByteOpcode); // pcmpeqd => all 1s
-        vexbinaryop(as, VexPrefix66, false, Opcode::from(0x72), FP(XMM0), FP(XMM0), FP(XMM0), true, TwoByteOpcode); // psrld => mask
-        as.code.write<u8>(1); // imm8 for shift
+        if (src.kind == ASMVal::F32) {
+            i32 bits = *(i32*)&src.f32 & 0x7fffffff;
+            return fmov32(as, dst, F32(*(f32*)&bits));
+        }
+        fsignmask(as, false, true, FP(XMM0));
         vexbinaryop(as, NoPrefix, false, Opcode::from(0x54), dst, FP(XMM0), src, true, TwoByteOpcode); // andps
     }
 
     static void fabs64(Assembly& as, ASMVal dst, ASMVal src) {
-        vexbinaryop(as, VexPrefix66, false, Opcode::from(0x29), FP(XMM0), FP(XMM0), FP(XMM0), true, ThreeByteOpcode38); // pcmpeqq => all 1s
-        vexbinaryop(as, VexPrefix66, false, Opcode::from(0x73), FP(XMM0), FP(XMM0), FP(XMM0), true, TwoByteOpcode); // psrld => mask
-        as.code.write<u8>(1); // imm8 for shift
+        if (src.kind == ASMVal::F64) {
+            i64 bits = *(i64*)&src.f64 & 0x7fffffffffffffffll;
+            return fmov64(as, dst, F64(*(f64*)&bits));
+        }
+        fsignmask(as, true, true, FP(XMM0));
         vexbinaryop(as, VexPrefix66, false, Opcode::from(0x54), dst, FP(XMM0), src, true, TwoByteOpcode); // andpd
     }
 
@@ -1102,7 +1898,76 @@ struct AMD64Assembler {
         unaryop(as, QWORD, Opcode::withExt(0xf6, 0x02), dst);
     }
 
+    // With BMI2, shlx, shrx and sarx take their count from any register and
+    // leave the flags alone, so variable shifts don't have to go through CL.
+    // They only come in 32 and 64 bits, so narrower shifts work on a 32-bit
+    // copy of a, extended to suit the shift. Counts are masked to five bits
+    // either way, so the low bits come out the same. The count, and that
+    // copy or an immediate a, need registers: we use dst when a and b allow
+    // it, and otherwise borrow one, saving it on the stack around the shift.
+    // Returns false if there's no BMI2 or the count is an immediate.
+    static inline bool bmi2_shift(Assembly& as, AMD64Size size, VexPrefix prefix, ASMVal dst, ASMVal a, ASMVal b) {
+        if (as.isa < ISA_V3 || b.kind == ASMVal::IMM)
+            return false;
+        assert(dst.kind == ASMVal::GP);
+        bool sar = prefix == VexPrefixF3;
+        auto uses = [](ASMVal v, mreg r) -> bool {
+            return v == GP(r) || (v.kind == ASMVal::MEM && v.memkind == ASMVal::REG_OFFSET && v.base == r);
+        };
+        if (a.kind == ASMVal::IMM && size == BYTE)
+            a.imm = sar ? i64(i8(a.imm)) : i64(u8(a.imm));
+        else if (a.kind == ASMVal::IMM && size == WORD)
+            a.imm = sar ? i64(i16(a.imm)) : i64(u16(a.imm));
+
+        bool loadA = size < DWORD && a.kind != ASMVal::IMM && (a.kind == ASMVal::MEM || prefix != VexPrefix66);
+        bool loadB = b.kind != ASMVal::GP;
+        bool loadImm = a.kind == ASMVal::IMM;
+        bool borrow = ((loadA || loadImm) && (loadB || b == dst)) || (loadB && uses(a, dst.gp));
+        mreg scratch = RAX;
+        while (scratch == dst.gp || uses(a, scratch) || uses(b, scratch))
+            scratch = mreg(scratch + 1);
+        if (borrow) {
+            push64(as, GP(scratch));
+            if (uses(a, RSP)) a.offset += 8;
+            if (uses(b, RSP)) b.offset += 8;
+        }
+        if (loadB) {
+            ASMVal count = borrow ? GP(scratch) : dst;
+            zxt8(as, count, b);
+            b = count;
+        }
+        if (loadA) {
+            ASMVal copy = borrow && !loadB ? GP(scratch) : dst;
+            if (size == BYTE) sar ? sxt8(as, copy, a) : zxt8(as, copy, a);
+            else sar ? sxt16(as, copy, a) : zxt16(as, copy, a);
+            a = copy;
+        }
+        if (loadImm) {
+            ASMVal copy = b == dst ? GP(scratch) : dst;
+            size == QWORD ? mov64(as, copy, a) : mov32(as, copy, a);
+            a = copy;
+        }
+        vexop(as, prefix, ThreeByteOpcode38, size == QWORD, false, 0xf7, dst, b, a); // shlx, shrx, sarx
+        if (borrow)
+            pop64(as, GP(scratch));
+        return true;
+    }
+
+    // rorx also comes with BMI2, and rotates a copy of its source by an
+    // immediate. Rotating left is rotating right by the rest of the width.
+    // We don't use it on RIP-relative sources, since the immediate would
+    // follow the displacement we patch at link time.
+    static inline bool bmi2_rotate(Assembly& as, AMD64Size size, ASMVal dst, ASMVal a, i64 right) {
+        if (as.isa < ISA_V3 || !(a.kind == ASMVal::GP || (a.kind == ASMVal::MEM && a.memkind == ASMVal::REG_OFFSET)))
+            return false;
+        vexop(as, VexPrefixF2, ThreeByteOpcode3A, size == QWORD, false, 0xf0, dst, a); // rorx
+        as.code.write<u8>(right & (size == QWORD ? 63 : 31));
+        return true;
+    }
+
     static void shl8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, BYTE, VexPrefix66, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC0, 0x04) : Opcode::litExt(0xD2, 0x04);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1115,6 +1980,8 @@ struct AMD64Assembler {
     }
 
     static void shl16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, WORD, VexPrefix66, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x04) : Opcode::litExt(0xD3, 0x04);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1127,8 +1994,11 @@ struct AMD64Assembler {
     }
 
     static void shl32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, DWORD, VexPrefix66, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x04) : Opcode::litExt(0xD3, 0x04);
-        mov8(as, GP(RCX), b);
+        if (b.kind != ASMVal::IMM)
+            mov8(as, GP(RCX), b);
         mov32(as, dst, a);
         if (b.kind == ASMVal::IMM && b.imm % 32 == 0)
             return;
@@ -1138,6 +2008,8 @@ struct AMD64Assembler {
     }
 
     static void shl64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, QWORD, VexPrefix66, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x04) : Opcode::litExt(0xD3, 0x04);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1150,6 +2022,8 @@ struct AMD64Assembler {
     }
 
     static void shr8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, BYTE, VexPrefixF2, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC0, 0x05) : Opcode::litExt(0xD2, 0x05);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1162,6 +2036,8 @@ struct AMD64Assembler {
     }
 
     static void shr16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, WORD, VexPrefixF2, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x05) : Opcode::litExt(0xD3, 0x05);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1174,6 +2050,8 @@ struct AMD64Assembler {
     }
 
     static void shr32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, DWORD, VexPrefixF2, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x05) : Opcode::litExt(0xD3, 0x05);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1186,6 +2064,8 @@ struct AMD64Assembler {
     }
 
     static void shr64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, QWORD, VexPrefixF2, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x05) : Opcode::litExt(0xD3, 0x05);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1198,6 +2078,8 @@ struct AMD64Assembler {
     }
 
     static void sar8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, BYTE, VexPrefixF3, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC0, 0x07) : Opcode::litExt(0xD2, 0x07);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1210,6 +2092,8 @@ struct AMD64Assembler {
     }
 
     static void sar16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, WORD, VexPrefixF3, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x07) : Opcode::litExt(0xD3, 0x07);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1222,6 +2106,8 @@ struct AMD64Assembler {
     }
 
     static void sar32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, DWORD, VexPrefixF3, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x07) : Opcode::litExt(0xD3, 0x07);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1234,6 +2120,8 @@ struct AMD64Assembler {
     }
 
     static void sar64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (bmi2_shift(as, QWORD, VexPrefixF3, dst, a, b))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x07) : Opcode::litExt(0xD3, 0x07);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1270,6 +2158,8 @@ struct AMD64Assembler {
     }
 
     static void rol32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && b.imm % 32 != 0 && bmi2_rotate(as, DWORD, dst, a, 32 - b.imm))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x00) : Opcode::litExt(0xD3, 0x00);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1282,6 +2172,8 @@ struct AMD64Assembler {
     }
 
     static void rol64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && b.imm % 64 != 0 && bmi2_rotate(as, QWORD, dst, a, 64 - b.imm))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x00) : Opcode::litExt(0xD3, 0x00);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1318,6 +2210,8 @@ struct AMD64Assembler {
     }
 
     static void ror32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && b.imm % 32 != 0 && bmi2_rotate(as, DWORD, dst, a, b.imm))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x01) : Opcode::litExt(0xD3, 0x01);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1330,6 +2224,8 @@ struct AMD64Assembler {
     }
 
     static void ror64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && b.imm % 64 != 0 && bmi2_rotate(as, QWORD, dst, a, b.imm))
+            return;
         Opcode op = b.kind == ASMVal::IMM ? Opcode::litExt(0xC1, 0x01) : Opcode::litExt(0xD3, 0x01);
         if (b.kind != ASMVal::IMM)
             mov8(as, GP(RCX), b);
@@ -1341,66 +2237,163 @@ struct AMD64Assembler {
             as.code.write<i8>(b.imm);
     }
 
+    // popcnt arrived with SSE4.2, so at the baseline we count bits in
+    // parallel: pairs, then nibbles, then bytes, which a multiply sums into
+    // the top byte. We work in RAX and RCX, and only write dst at the end.
+    // The 64-bit masks don't fit in an immediate, so they go in the data
+    // section.
+    static void popc_swar(Assembly& as, i32 bits, ASMVal dst, ASMVal src) {
+        if (src.kind == ASMVal::IMM)
+            mov64(as, GP(RAX), Imm(bits == 64 ? src.imm : src.imm & ((1ll << bits) - 1)));
+        else if (bits == 8 && src.kind == ASMVal::MEM)
+            ldz8(as, GP(RAX), src);
+        else if (bits == 16 && src.kind == ASMVal::MEM)
+            ldz16(as, GP(RAX), src);
+        else if (bits == 64)
+            mov64(as, GP(RAX), src);
+        else {
+            mov32(as, GP(RAX), src);
+            if (bits < 32)
+                and32(as, GP(RAX), GP(RAX), Imm(bits == 8 ? 0xff : 0xffff));
+        }
+
+        if (bits == 64) {
+            auto mask = [&](i64 bits) -> ASMVal { return emitF64Constant(as, F64(*(double*)&bits)); };
+            shr64(as, GP(RCX), GP(RAX), Imm(1));
+            and64(as, GP(RCX), GP(RCX), mask(0x5555555555555555ll));
+            sub64(as, GP(RAX), GP(RAX), GP(RCX));
+            ASMVal pairs = mask(0x3333333333333333ll);
+            and64(as, GP(RCX), GP(RAX), pairs);
+            shr64(as, GP(RAX), GP(RAX), Imm(2));
+            and64(as, GP(RAX), GP(RAX), pairs);
+            add64(as, GP(RAX), GP(RAX), GP(RCX));
+            shr64(as, GP(RCX), GP(RAX), Imm(4));
+            add64(as, GP(RAX), GP(RAX), GP(RCX));
+            and64(as, GP(RAX), GP(RAX), mask(0x0f0f0f0f0f0f0f0fll));
+            mul64(as, GP(RAX), GP(RAX), mask(0x0101010101010101ll));
+            shr64(as, GP(RAX), GP(RAX), Imm(56));
+            return mov64(as, dst, GP(RAX));
+        }
+        shr32(as, GP(RCX), GP(RAX), Imm(1));
+        and32(as, GP(RCX), GP(RCX), Imm(0x55555555));
+        sub32(as, GP(RAX), GP(RAX), GP(RCX));
+        and32(as, GP(RCX), GP(RAX), Imm(0x33333333));
+        shr32(as, GP(RAX), GP(RAX), Imm(2));
+        and32(as, GP(RAX), GP(RAX), Imm(0x33333333));
+        add32(as, GP(RAX), GP(RAX), GP(RCX));
+        shr32(as, GP(RCX), GP(RAX), Imm(4));
+        add32(as, GP(RAX), GP(RAX), GP(RCX));
+        and32(as, GP(RAX), GP(RAX), Imm(0x0f0f0f0f));
+        mul32(as, GP(RAX), GP(RAX), Imm(0x01010101));
+        shr32(as, GP(RAX), GP(RAX), Imm(24));
+        if (bits == 32)
+            mov32(as, dst, GP(RAX));
+        else
+            mov16(as, dst, GP(RAX));
+    }
+
     static void popc8(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V2)
+            return popc_swar(as, 8, dst, src);
         and16(as, dst, src, Imm(255));
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, WORD, Opcode::literal(0x0f, 0xb8), dst, dst);
     }
 
     static void popc16(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V2)
+            return popc_swar(as, 16, dst, src);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, WORD, Opcode::literal(0x0f, 0xb8), src, dst);
     }
 
     static void popc32(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V2)
+            return popc_swar(as, 32, dst, src);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, DWORD, Opcode::literal(0x0f, 0xb8), src, dst);
     }
 
     static void popc64(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V2)
+            return popc_swar(as, 64, dst, src);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, QWORD, Opcode::literal(0x0f, 0xb8), src, dst);
     }
 
+    // lzcnt and tzcnt need BMI, so below ISA_V3 we use bsr and bsf. Those
+    // share their encodings minus the F3 prefix, but leave dst alone for a
+    // zero source, and bsr counts from the bottom. So we write the answer
+    // for zero ourselves, and flip bsr's index into a count with an xor,
+    // which maps 2 * bits - 1 to bits as well.
+    static void bitscan(Assembly& as, AMD64Size size, bool reverse, ASMVal dst, ASMVal src) {
+        i32 bits = size == QWORD ? 64 : size == DWORD ? 32 : 16;
+        auto mov = size == QWORD ? mov64 : size == DWORD ? mov32 : mov16;
+        auto xorop = size == QWORD ? xor64 : size == DWORD ? xor32 : xor16;
+        Symbol nonzero = as.symtab.anon();
+        binaryop(as, size, Opcode::literal(0x0f, reverse ? 0xbd : 0xbc), src, dst);
+        jcc(as, COND_NE, Label(nonzero));
+        mov(as, dst, Imm(reverse ? 2 * bits - 1 : bits));
+        local(as, nonzero);
+        if (reverse)
+            xorop(as, dst, dst, Imm(bits - 1));
+    }
+
     static void lzc8(Assembly& as, ASMVal dst, ASMVal src) {
         shl16(as, dst, src, Imm(8));
         or16(as, dst, dst, Imm(255));
+        if (as.isa < ISA_V3)
+            return bitscan(as, WORD, true, dst, dst);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, WORD, Opcode::literal(0x0f, 0xbd), dst, dst);
     }
 
     static void lzc16(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V3)
+            return bitscan(as, WORD, true, dst, src);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, WORD, Opcode::literal(0x0f, 0xbd), src, dst);
     }
 
     static void lzc32(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V3)
+            return bitscan(as, DWORD, true, dst, src);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, DWORD, Opcode::literal(0x0f, 0xbd), src, dst);
     }
 
     static void lzc64(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V3)
+            return bitscan(as, QWORD, true, dst, src);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, QWORD, Opcode::literal(0x0f, 0xbd), src, dst);
     }
 
     static void tzc8(Assembly& as, ASMVal dst, ASMVal src) {
         or16(as, dst, src, Imm(0xff00));
+        if (as.isa < ISA_V3)
+            return bitscan(as, WORD, false, dst, dst);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, WORD, Opcode::literal(0x0f, 0xbc), dst, dst);
     }
 
     static void tzc16(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V3)
+            return bitscan(as, WORD, false, dst, src);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, WORD, Opcode::literal(0x0f, 0xbc), src, dst);
     }
 
     static void tzc32(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V3)
+            return bitscan(as, DWORD, false, dst, src);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, DWORD, Opcode::literal(0x0f, 0xbc), src, dst);
     }
 
     static void tzc64(Assembly& as, ASMVal dst, ASMVal src) {
+        if (as.isa < ISA_V3)
+            return bitscan(as, QWORD, false, dst, src);
         as.code.write<u8>(0xf3); // Extra prefix byte before operand size override.
         binaryop(as, QWORD, Opcode::literal(0x0f, 0xbc), src, dst);
     }
@@ -1463,10 +2456,14 @@ struct AMD64Assembler {
     }
 
     static inline void fcmp32(Assembly& as, ASMVal a, ASMVal b) {
+        if (as.isa < ISA_V3)
+            return sseop(as, NoPrefix, false, 0x2f, a, b, TwoByteOpcode); // comiss
         vexbinaryop(as, NoPrefix, false, Opcode::from(0x2f), a, FP(XMM0), b, false, TwoByteOpcode);
     }
 
     static inline void fcmp64(Assembly& as, ASMVal a, ASMVal b) {
+        if (as.isa < ISA_V3)
+            return sseop(as, VexPrefix66, false, 0x2f, a, b, TwoByteOpcode); // comisd
         vexbinaryop(as, VexPrefix66, false, Opcode::from(0x2f), a, FP(XMM0), b, false, TwoByteOpcode);
     }
 
@@ -1556,21 +2553,148 @@ struct AMD64Assembler {
         binaryop(as, QWORD, Opcode::literal(0x0f, 0x40 + CCodes[cc]), c, dst);
     }
 
-    static void fselcc32(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) {
-        unreachable("TODO: Implement floating-point selection on amd64");
+    // Float selection compares a and b into an all-ones or all-zeroes mask in
+    // XMM0 with vcmpss/vcmpsd, then picks between c and d with vblendvps/pd,
+    // so there's no branch to mispredict. Unlike comiss, vcmp has a predicate
+    // for each condition, each of which is false on NaN except for NE.
+    // Constant a and b are compared ahead of time. A constant c or d is loaded
+    // into XMM1, since neither instruction can take a RIP-relative operand
+    // with its trailing immediate.
+    //
+    // Below ISA_V3, cmpss only has the first eight predicates, so GT and GE
+    // swap their operands, and overwrites its first operand, which we copy
+    // into XMM0 first. SSE4.1 blendvps reads its mask from XMM0, and takes d
+    // in the register it writes. Without SSE4.1, we select with
+    // d ^ ((c ^ d) & mask) instead.
+
+    static inline u8 float_predicate(FloatCondition cc) {
+        switch (cc) {
+            case FCOND_EQ: return 0x00; // EQ_OQ
+            case FCOND_NE: return 0x04; // NEQ_UQ
+            case FCOND_LT: return 0x01; // LT_OS
+            case FCOND_LE: return 0x02; // LE_OS
+            case FCOND_GT: return 0x0e; // GT_OS
+            case FCOND_GE: return 0x0d; // GE_OS
+        }
     }
 
-    static void fselcc64(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) {
-        unreachable("TODO: Implement floating-point selection on amd64");
+    template<typename T>
+    static inline bool float_condition_holds(FloatCondition cc, T a, T b) {
+        switch (cc) {
+            case FCOND_EQ: return a == b;
+            case FCOND_NE: return a != b;
+            case FCOND_LT: return a < b;
+            case FCOND_LE: return a <= b;
+            case FCOND_GT: return a > b;
+            case FCOND_GE: return a >= b;
+        }
     }
 
-    // Memory
-
-    static inline void push8(Assembly& as, ASMVal src) {
+    static void fselcc(Assembly& as, bool wide, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) {
+        ASMVal::Kind constant = wide ? ASMVal::F64 : ASMVal::F32;
+        auto fmov = wide ? fmov64 : fmov32;
+        if (a.kind == constant && b.kind == constant) {
+            bool holds = wide ? float_condition_holds(cc, a.f64, b.f64) : float_condition_holds(cc, a.f32, b.f32);
+            return fmov(as, dst, holds ? c : d);
+        }
+        if (a.kind == constant) {
+            swap(a, b);
+            if (cc == FCOND_LT) cc = FCOND_GT;
+            else if (cc == FCOND_LE) cc = FCOND_GE;
+            else if (cc == FCOND_GT) cc = FCOND_LT;
+            else if (cc == FCOND_GE) cc = FCOND_LE;
+        }
+        if (as.isa < ISA_V3)
+            return fselcc_sse(as, wide, cc, dst, a, b, c, d);
+        if (b.kind == constant)
+            fmov(as, FP(XMM0), b), b = FP(XMM0);
+        vexop(as, wide ? VexPrefixF2 : VexPrefixF3, TwoByteOpcode, false, false, 0xc2, FP(XMM0), a, b); // vcmpss/sd
+        as.code.write<u8>(float_predicate(cc));
+
+        if (c.kind == constant && d.kind == constant)
+            fmov(as, dst, d), d = dst;
+        if (c.kind == constant)
+            fmov(as, FP(XMM1), c), c = FP(XMM1);
+        if (d.kind == constant)
+            fmov(as, FP(XMM1), d), d = FP(XMM1);
+        vexop(as, VexPrefix66, ThreeByteOpcode3A, false, false, wide ? 0x4b : 0x4a, dst, d, c); // vblendvps/pd
+        as.code.write<u8>(0x00); // Mask register in the top four bits, so XMM0.
+    }
+
+    static void fselcc_sse(Assembly& as, bool wide, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) {
+        ASMVal::Kind constant = wide ? ASMVal::F64 : ASMVal::F32;
+        auto fmov = wide ? fmov64 : fmov32;
+        VexPrefix prefix = wide ? VexPrefix66 : NoPrefix;
+        if (cc == FCOND_GT || cc == FCOND_GE) {
+            swap(a, b);
+            cc = cc == FCOND_GT ? FCOND_LT : FCOND_LE;
+        }
+        if (b.kind == constant)
+            fmov(as, FP(XMM1), b), b = FP(XMM1);
+        fmov(as, FP(XMM0), a);
+        sseop(as, wide ? VexPrefixF2 : VexPrefixF3, false, 0xc2, FP(XMM0), b, TwoByteOpcode); // cmpss/sd
+        as.code.write<u8>(float_predicate(cc));
+
+        if (as.isa >= ISA_V2) {
+            ASMVal result = d.kind == constant || (dst == c && dst != d) ? FP(XMM1) : dst;
+            fmov(as, result, d);
+            if (c.kind == constant)
+                fmov(as, result == dst ? FP(XMM1) : dst, c), c = result == dst ? FP(XMM1) : dst;
+            sseop(as, VexPrefix66, false, wide ? 0x15 : 0x14, result, c, ThreeByteOpcode38); // blendvps/pd
+            return ssemove(as, dst, result);
+        }
+        fmov(as, FP(XMM1), c); // From here on, dst only matters if it's d.
+        if (d.kind == constant)
+            fmov(as, dst, d), d = dst;
+        sseop(as, prefix, false, 0x57, FP(XMM1), d, TwoByteOpcode); // xorps/pd
+        sseop(as, prefix, false, 0x54, FP(XMM1), FP(XMM0), TwoByteOpcode); // andps/pd
+        sseop(as, prefix, false, 0x57, FP(XMM1), d, TwoByteOpcode); // xorps/pd
+        ssemove(as, dst, FP(XMM1));
+    }
+
+    static void fselcc32(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) {
+        fselcc(as, false, cc, dst, a, b, c, d);
+    }
+
+    static void fselcc64(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b, ASMVal c, ASMVal d) {
+        fselcc(as, true, cc, dst, a, b, c, d);
+    }
+
+    // Memory
+
+    // Frame info
+
+    // DWARF numbers the legacy registers in a different order than their encodings.
+    static constexpr u8 DWARF_REGS[16] = { 0, 2, 1, 3, 7, 6, 4, 5, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+    static inline bool saved_in_frame(mreg r) {
+        return r == RBX || r == RBP || (r >= R12 && r <= R15); // SysV callee-saved registers
+    }
+
+    // Updates the frame rules after the stack pointer moves down by the given
+    // number of bytes (or up, if negative).
+    static inline void grow_frame(Assembly& as, i32 bytes) {
+        if (as.frame.depth >= 0)
+            as.frame.depth += bytes;
+        if (as.frame.reg == DWARF_REGS[RSP]) {
+            as.frame.offset += bytes;
+            as.frameOp(FrameOp::DEF_CFA_OFFSET, 0, as.frame.offset);
+        }
+    }
+
+    // Called when the stack pointer moves by an amount we can't know ahead
+    // of time. Only functions with a frame pointer can do this and still be
+    // unwound, since the CFA no longer has a fixed offset from the stack.
+    static inline void unknown_frame(Assembly& as) {
+        as.frame.depth = -1;
+    }
+
+    static inline void push8(Assembly& as, ASMVal src) {
         assert(src.kind == ASMVal::GP);
         as.code.write<u8>(0x66);
         if (needsREX(BYTE, src)) as.code.write<u8>(0x41);
         as.code.write<u8>(0x50 + (src.gp & 0b111));
+        grow_frame(as, 2);
     }
 
     static inline void push16(Assembly& as, ASMVal src) {
@@ -1578,18 +2702,23 @@ struct AMD64Assembler {
         as.code.write<u8>(0x66);
         if (needsREX(BYTE, src)) as.code.write<u8>(0x41);
         as.code.write<u8>(0x50 + (src.gp & 0b111));
+        grow_frame(as, 2);
     }
 
     static inline void push32(Assembly& as, ASMVal src) {
         assert(src.kind == ASMVal::GP);
         if (needsREX(BYTE, src)) as.code.write<u8>(0x41);
         as.code.write<u8>(0x50 + (src.gp & 0b111));
+        grow_frame(as, 8);
     }
 
     static inline void push64(Assembly& as, ASMVal src) {
         assert(src.kind == ASMVal::GP);
         if (needsREX(BYTE, src)) as.code.write<u8>(0x41);
         as.code.write<u8>(0x50 + (src.gp & 0b111));
+        grow_frame(as, 8);
+        if (saved_in_frame(src.gp) && as.frame.depth >= 0)
+            as.frameOp(FrameOp::SAVE, DWARF_REGS[src.gp], as.frame.depth);
     }
 
     static inline void pop8(Assembly& as, ASMVal dst) {
@@ -1597,6 +2726,7 @@ struct AMD64Assembler {
         as.code.write<u8>(0x66);
         if (needsREX(BYTE, dst)) as.code.write<u8>(0x41);
         as.code.write<u8>(0x58 + (dst.gp & 0b111));
+        grow_frame(as, -2);
     }
 
     static inline void pop16(Assembly& as, ASMVal dst) {
@@ -1604,18 +2734,23 @@ struct AMD64Assembler {
         as.code.write<u8>(0x66);
         if (needsREX(BYTE, dst)) as.code.write<u8>(0x41);
         as.code.write<u8>(0x58 + (dst.gp & 0b111));
+        grow_frame(as, -2);
     }
 
     static inline void pop32(Assembly& as, ASMVal dst) {
         assert(dst.kind == ASMVal::GP);
         if (needsREX(BYTE, dst)) as.code.write<u8>(0x41);
         as.code.write<u8>(0x58 + (dst.gp & 0b111));
+        grow_frame(as, -8);
     }
 
     static inline void pop64(Assembly& as, ASMVal dst) {
         assert(dst.kind == ASMVal::GP);
         if (needsREX(BYTE, dst)) as.code.write<u8>(0x41);
         as.code.write<u8>(0x58 + (dst.gp & 0b111));
+        grow_frame(as, -8);
+        if (saved_in_frame(dst.gp))
+            as.frameOp(FrameOp::RESTORE, DWARF_REGS[dst.gp]);
     }
 
     static inline void fpush32(Assembly& as, ASMVal src) {
@@ -1675,6 +2810,16 @@ struct AMD64Assembler {
 
     static inline void mov64(Assembly& as, ASMVal dst, ASMVal src) {
         if (dst == src) return;
+        if (src.kind == ASMVal::IMM64) {
+            if (src.imm64 == i32(src.imm64))
+                return mov64(as, dst, Imm(src.imm64));
+            if (src.imm64 == i64(u32(src.imm64)))
+                return mov32(as, dst, Imm(src.imm64)); // Implicitly zero-extended.
+            unary_prefix(as, QWORD, dst);
+            as.code.write<u8>(0xB8 + (dst.gp & 0b111)); // movabs
+            as.code.writeLE<i64>(src.imm64);
+            return;
+        }
         if (src.kind == ASMVal::IMM) {
             if (src.imm == 0) return xor64(as, dst, dst, dst);
 
@@ -2023,7 +3168,10 @@ struct AMD64Assembler {
             base = dst.gp;
             offset = 0;
         }
-        vexunaryprefix(as, VexPrefixF3, index >= R8, false, dst, src, TwoByteOpcode);
+        if (as.isa < ISA_V3)
+            sseprefix(as, VexPrefixF3, index >= R8, false, dst, GP(base), TwoByteOpcode);
+        else
+            vexunaryprefix(as, VexPrefixF3, index >= R8, false, dst, src, TwoByteOpcode);
         as.code.write<u8>(0x10);
         index_args(as, dst.fp - XMM0, base, index, DWORD, offset);
     }
@@ -2036,7 +3184,10 @@ struct AMD64Assembler {
             base = dst.gp;
             offset = 0;
         }
-        vexunaryprefix(as, VexPrefixF2, index >= R8, false, dst, src, TwoByteOpcode);
+        if (as.isa < ISA_V3)
+            sseprefix(as, VexPrefixF2, index >= R8, false, dst, GP(base), TwoByteOpcode);
+        else
+            vexunaryprefix(as, VexPrefixF2, index >= R8, false, dst, src, TwoByteOpcode);
         as.code.write<u8>(0x10);
         index_args(as, dst.fp - XMM0, base, index, QWORD, offset);
     }
@@ -2053,7 +3204,10 @@ struct AMD64Assembler {
             fmov32(as, FP(XMM0), dst);
             src = FP(XMM0);
         }
-        vexunaryprefix(as, VexPrefixF3, index >= R8, false, dst, src, TwoByteOpcode);
+        if (as.isa < ISA_V3)
+            sseprefix(as, VexPrefixF3, index >= R8, false, src, GP(base), TwoByteOpcode);
+        else
+            vexunaryprefix(as, VexPrefixF3, index >= R8, false, dst, src, TwoByteOpcode);
         as.code.write<u8>(0x11);
         index_args(as, src.fp - XMM0, base, index, DWORD, offset);
     }
@@ -2070,7 +3224,10 @@ struct AMD64Assembler {
             fmov64(as, FP(XMM0), dst);
             src = FP(XMM0);
         }
-        vexunaryprefix(as, VexPrefixF2, index >= R8, false, dst, src, TwoByteOpcode);
+        if (as.isa < ISA_V3)
+            sseprefix(as, VexPrefixF2, index >= R8, false, src, GP(base), TwoByteOpcode);
+        else
+            vexunaryprefix(as, VexPrefixF2, index >= R8, false, dst, src, TwoByteOpcode);
         as.code.write<u8>(0x11);
         index_args(as, src.fp - XMM0, base, index, QWORD, offset);
     }
@@ -2089,6 +3246,9 @@ struct AMD64Assembler {
 
     static inline void global(Assembly& as, Symbol sym) {
         as.def(CODE_SECTION, DEF_GLOBAL, sym);
+        as.frame = { DWARF_REGS[RSP], 8, 8 }; // Only the return address is on the stack.
+        as.inEpilogue = false;
+        as.dirtyUpper = false;
     }
 
     static inline void local(Assembly& as, Symbol sym) {
@@ -2196,10 +3356,14 @@ struct AMD64Assembler {
     static void enter(Assembly& as) {
         push64(as, GP(RBP));
         mov64(as, GP(RBP), GP(RSP));
+        as.frame.reg = DWARF_REGS[RBP];
+        as.frameOp(FrameOp::DEF_CFA_REGISTER, DWARF_REGS[RBP]);
     }
 
     static void stack(Assembly& as, ASMVal dst) {
         sub64(as, GP(RSP), GP(RSP), dst);
+        if (dst.kind == ASMVal::IMM) grow_frame(as, dst.imm);
+        else unknown_frame(as);
     }
 
     static void alloca(Assembly& as, ASMVal dst, ASMVal src) {
@@ -2209,14 +3373,27 @@ struct AMD64Assembler {
 
     static void unstack(Assembly& as, ASMVal dst) {
         add64(as, GP(RSP), GP(RSP), dst);
+        if (dst.kind == ASMVal::IMM) grow_frame(as, -dst.imm);
+        else unknown_frame(as);
     }
 
+    // The rules in effect before leave are remembered, and restored after the
+    // following ret, so that any code placed after the epilogue is still
+    // described correctly.
     static void leave(Assembly& as) {
+        as.frameOp(FrameOp::REMEMBER_STATE);
+        as.bodyFrame = as.frame;
+        as.inEpilogue = true;
         mov64(as, GP(RSP), GP(RBP));
+        as.frame.depth = as.frame.offset;
         pop64(as, GP(RBP));
+        as.frame = { DWARF_REGS[RSP], 8, 8 };
+        as.frameOp(FrameOp::DEF_CFA, DWARF_REGS[RSP], 8);
     }
 
     static inline void call(Assembly& as, ASMVal dst) {
+        if (as.dirtyUpper)
+            vzeroupper(as); // Every vector register is caller-saved, so nothing live is lost.
         if (dst.kind == ASMVal::GP) unaryop(as, DWORD, Opcode::litExt(0xff, 0x02), dst);
         else {
             as.code.write<u8>(0xe8);
@@ -2227,7 +3404,14 @@ struct AMD64Assembler {
     }
 
     static inline void ret(Assembly& as) {
+        if (as.dirtyUpper)
+            vzeroupper(as);
         as.code.write<i8>(0xc3);
+        if (as.inEpilogue) {
+            as.frame = as.bodyFrame;
+            as.inEpilogue = false;
+            as.frameOp(FrameOp::RESTORE_STATE);
+        }
     }
 
     // Conversions
@@ -2378,137 +3562,2285 @@ struct AMD64Assembler {
         vexunaryop(as, VexPrefix66, true, Opcode::from(0x7e), src, dst, TwoByteOpcode);
     }
 
+    // Division by Loop-Invariant Divisors
+
+    // Moves each source into the corresponding register, reading every source
+    // before anything can overwrite it, and breaking cycles with xchg.
+    static inline void gather(Assembly& as, ASMVal* srcs, const mreg* dsts, u32 n) {
+        bool done[4] = { false, false, false, false };
+        u32 remaining = n;
+        assert(n <= 4);
+        while (remaining) {
+            bool progress = false;
+            for (u32 i = 0; i < n; i ++) if (!done[i]) {
+                bool blocked = false;
+                for (u32 j = 0; j < n; j ++)
+                    if (j != i && !done[j] && srcs[j] == GP(dsts[i]))
+                        blocked = true;
+                if (blocked)
+                    continue;
+                mov64(as, GP(dsts[i]), srcs[i]);
+                done[i] = true, remaining --, progress = true;
+            }
+            if (!progress) { // Only cycles are left, so every pending source is a pending destination.
+                u32 i = 0;
+                while (done[i]) i ++;
+                mreg other = srcs[i].gp;
+                binaryop(as, QWORD, Opcode::from(0x86), GP(dsts[i]), GP(other)); // xchg
+                done[i] = true, remaining --;
+                for (u32 j = 0; j < n; j ++) if (!done[j] && srcs[j] == GP(dsts[i]))
+                    srcs[j] = GP(other);
+            }
+        }
+    }
+
+    // udivinfo32 computes a descriptor m = floor((2^64 - 1) / d) for a nonzero
+    // divisor d, which is enough to divide any 32-bit x with one mul:
+    //
+    //   x / d = floor((x + 1) * m / 2^64)
+    //   x % d = floor((x * (m + 1) mod 2^64) * d / 2^64)
+    //
+    // The first is the round-down method of Robison ("N-Bit Unsigned Division
+    // via N-Bit Multiply-Add"), with 32 bits of headroom to spare; the second
+    // is the direct remainder of Lemire, Kaser and Kurz. Both are exact for
+    // every 32-bit x and d, so there is no shift or fixup to store.
+
+    static inline void udivinfo32(Assembly& as, ASMVal dst, ASMVal d) {
+        if (d.kind == ASMVal::IMM && d.imm != 0)
+            return mov64(as, dst, Imm64(~0ull / u32(d.imm)));
+        widen(as, DWORD, false, RCX, d);
+        mov64(as, GP(RAX), Imm(-1));
+        xor32(as, GP(RDX), GP(RDX), GP(RDX));
+        unaryop(as, QWORD, Opcode::withExt(0xf6, 0x06), GP(RCX)); // div
+        mov64(as, dst, GP(RAX));
+    }
+
+    static inline void udivby32(Assembly& as, ASMVal dst, ASMVal x, ASMVal info) {
+        ASMVal srcs[2] = { x, info };
+        const mreg dsts[2] = { RAX, RDX };
+        gather(as, srcs, dsts, 2);
+        widen(as, DWORD, false, RAX, GP(RAX));
+        add64(as, GP(RAX), GP(RAX), Imm(1));
+        unaryop(as, QWORD, Opcode::withExt(0xf6, 0x04), GP(RDX)); // mul
+        mov32(as, dst, GP(RDX));
+    }
+
+    static inline void uremby32(Assembly& as, ASMVal dst, ASMVal x, ASMVal info, ASMVal d) {
+        ASMVal srcs[3] = { x, info, d };
+        const mreg dsts[3] = { RAX, RDX, RCX };
+        gather(as, srcs, dsts, 3);
+        widen(as, DWORD, false, RAX, GP(RAX));
+        widen(as, DWORD, false, RCX, GP(RCX));
+        add64(as, GP(RDX), GP(RDX), Imm(1));
+        binaryop(as, QWORD, Opcode::literal(0x0f, 0xaf), GP(RDX), GP(RAX)); // imul
+        unaryop(as, QWORD, Opcode::withExt(0xf6, 0x04), GP(RCX)); // mul
+        mov32(as, dst, GP(RDX));
+    }
+
     // Memory
 
     static inline void mpush16(Assembly& as, ASMVal src) {
         unaryop(as, WORD, Opcode::litExt(0xff, 0x06), src);
+        grow_frame(as, 2);
     }
 
     static inline void mpush64(Assembly& as, ASMVal src) {
         unaryop(as, DWORD, Opcode::litExt(0xff, 0x06), src);
+        grow_frame(as, 8);
     }
 
     static inline void mpop16(Assembly& as, ASMVal dst) {
         unaryop(as, WORD, Opcode::litExt(0x8f, 0x00), dst);
+        grow_frame(as, -2);
     }
 
     static inline void mpop64(Assembly& as, ASMVal dst) {
         unaryop(as, DWORD, Opcode::litExt(0x8f, 0x00), dst);
+        grow_frame(as, -8);
+    }
+
+    // Moves the base registers of dst and src into RDI and RSI, and the
+    // count, if there is one, into RCX. Afterwards dst and src are based on
+    // RDI and RSI, with their offsets intact unless fold is set, in which
+    // case RDI and RSI hold the addresses themselves.
+    static void gather_addresses(Assembly& as, ASMVal& dst, ASMVal& src, const ASMVal* count, bool fold) {
+        ASMVal srcs[3];
+        mreg dsts[3];
+        u32 n = 0;
+        if (dst.memkind == ASMVal::REG_OFFSET)
+            srcs[n] = GP(dst.base), dsts[n ++] = RDI;
+        if (src.memkind == ASMVal::REG_OFFSET)
+            srcs[n] = GP(src.base), dsts[n ++] = RSI;
+        if (count)
+            srcs[n] = *count, dsts[n ++] = RCX;
+        gather(as, srcs, dsts, n);
+
+        if (dst.memkind != ASMVal::REG_OFFSET || (fold && dst.offset))
+            la(as, GP(RDI), dst.memkind == ASMVal::REG_OFFSET ? Mem(RDI, dst.offset) : dst), dst = Mem(RDI, 0);
+        else dst.base = RDI;
+        if (src.memkind != ASMVal::REG_OFFSET || (fold && src.offset))
+            la(as, GP(RSI), src.memkind == ASMVal::REG_OFFSET ? Mem(RSI, src.offset) : src), src = Mem(RSI, 0);
+        else src.base = RSI;
+    }
+
+    // Without AVX, these only take XMM registers, with movdqu.
+    static inline void vload(Assembly& as, bool ymm, mreg dst, ASMVal src, i32 offset) {
+        src.offset += offset;
+        if (as.isa < ISA_V3) {
+            assert(!ymm);
+            return sseop(as, VexPrefixF3, false, 0x6f, FP(dst), src, TwoByteOpcode); // movdqu
+        }
+        vexop(as, VexPrefixF3, TwoByteOpcode, false, ymm, 0x6f, FP(dst), src); // vmovdqu
+    }
+
+    static inline void lea_index(Assembly& as, mreg dst, mreg base, mreg index, i32 offset) {
+        index_prefix(as, QWORD, dst, base, index, BYTE, offset);
+        as.code.write<u8>(0x8d);
+        index_args(as, dst, base, index, BYTE, offset);
+    }
+
+    // Copies RCX bytes from RSI to RDI when RCX is below 32, by loading a
+    // pair of overlapping chunks, one at each end, before storing either.
+    // This works whichever way the ranges overlap.
+    static void copy_small(Assembly& as, Symbol done) {
+        Symbol next = as.symtab.anon();
+        brcc64(as, COND_BELOW, Label(next), GP(RCX), Imm(16));
+        vload(as, false, XMM0, Mem(RSI, 0), 0);
+        lea_index(as, RAX, RSI, RCX, -16);
+        vload(as, false, XMM1, Mem(RAX, 0), 0);
+        vstore(as, false, Mem(RDI, 0), 0);
+        lea_index(as, RAX, RDI, RCX, -16);
+        vstore(as, false, Mem(RAX, 0), 0, XMM1);
+        br(as, Label(done));
+
+        for (i32 size = 8; size >= 2; size /= 2) {
+            local(as, next);
+            next = as.symtab.anon();
+            brcc64(as, COND_BELOW, Label(next), GP(RCX), Imm(size));
+            load_index(as, size, RAX, RSI, -1, 0);
+            load_index(as, size, RSI, RSI, RCX, -size);
+            switch (size) {
+                case 8: st64(as, Mem(RDI, 0), GP(RAX)); break;
+                case 4: st32(as, Mem(RDI, 0), GP(RAX)); break;
+                case 2: st16(as, Mem(RDI, 0), GP(RAX)); break;
+            }
+            lea_index(as, RDI, RDI, RCX, -size);
+            switch (size) {
+                case 8: st64(as, Mem(RDI, 0), GP(RSI)); break;
+                case 4: st32(as, Mem(RDI, 0), GP(RSI)); break;
+                case 2: st16(as, Mem(RDI, 0), GP(RSI)); break;
+            }
+            br(as, Label(done));
+        }
+
+        local(as, next);
+        brcc64(as, COND_EQ, Label(done), GP(RCX), Imm(0));
+        ldz8(as, GP(RAX), Mem(RSI, 0));
+        st8(as, Mem(RDI, 0), GP(RAX));
+        br(as, Label(done));
+    }
+
+    // Copies RCX bytes, at least 32, from RSI to RDI, starting from the
+    // beginning. Below COPY_LOOP_LIMIT bytes, this loads the last block
+    // first and stores it last, so the YMM loop needs no tail and a
+    // destination below an overlapping source comes out right. Past that,
+    // rep movsb is faster on processors with ERMS. A constant count picks
+    // one of the two ahead of time. Without AVX, blocks are 16 bytes.
+    static constexpr i32 COPY_LOOP_LIMIT = 2048;
+
+    static void copy_forward(Assembly& as, ASMVal count, Symbol done) {
+        Symbol rep = as.symtab.anon(), loop = as.symtab.anon();
+        if (count.kind != ASMVal::IMM)
+            brcc64(as, COND_AE, Label(rep), GP(RCX), Imm(COPY_LOOP_LIMIT));
+        if (count.kind != ASMVal::IMM || count.imm < COPY_LOOP_LIMIT) {
+            bool ymm = as.isa >= ISA_V3;
+            i32 block = ymm ? 32 : 16;
+            lea_index(as, RAX, RSI, RCX, -block);
+            vload(as, ymm, XMM1, Mem(RAX, 0), 0);
+            lea_index(as, RCX, RDI, RCX, -block); // The last block, which ends the loop.
+            local(as, loop);
+            vload(as, ymm, XMM0, Mem(RSI, 0), 0);
+            vstore(as, ymm, Mem(RDI, 0), 0);
+            add64(as, GP(RSI), GP(RSI), Imm(block));
+            add64(as, GP(RDI), GP(RDI), Imm(block));
+            brcc64(as, COND_BELOW, Label(loop), GP(RDI), GP(RCX));
+            vstore(as, ymm, Mem(RCX, 0), 0, XMM1);
+            br(as, Label(done));
+        }
+        if (count.kind != ASMVal::IMM || count.imm >= COPY_LOOP_LIMIT) {
+            local(as, rep);
+            as.code.write<u8>(0xf3);    // rep movsb
+            as.code.write<u8>(0xa4);
+            br(as, Label(done));
+        }
     }
 
+    // mcpy copies b bytes from a to dst, which must not overlap. Constant
+    // sizes up to MCPY_UNROLL_LIMIT are unrolled, using overlapping GP moves
+    // below 16 bytes and XMM or YMM moves above, so any tail is covered by one
+    // final move ending at dst + b. Anything bigger is dispatched on size:
+    // copy_small below 32 bytes, then copy_forward.
+
+    static constexpr i32 MCPY_UNROLL_LIMIT = 256;
+
     static void mcpy_fixed(Assembly& as, ASMVal dst, ASMVal src, i32 n) {
-        if (dst.memkind != ASMVal::REG_OFFSET)
-            la(as, GP(RDI), dst), dst = Mem(RDI, 0);
-        if (src.memkind != ASMVal::REG_OFFSET)
-            la(as, GP(RSI), src), src = Mem(RSI, 0);
-        i32 i = 0;
-        while (n >= 8) { // Use push/pop to do 64-bit memory-to-memory moves.
-            ASMVal src_offset = src;
-            ASMVal dst_offset = dst;
-            src_offset.offset += i;
-            dst_offset.offset += i;
-            mpush64(as, src_offset);
-            mpop64(as, dst_offset);
-            i += 8;
-            n -= 8;
-        }
-        if (n >= 4) {
-            ASMVal src_offset = src;
-            ASMVal dst_offset = dst;
-            src_offset.offset += i;
-            dst_offset.offset += i;
-            ldz32(as, GP(RCX), src_offset);
-            st32(as, dst_offset, GP(RCX));
-            n -= 4;
-            i += 4;
-        }
-        if (n >= 2) {
-            ASMVal src_offset = src;
-            ASMVal dst_offset = dst;
-            src_offset.offset += i;
-            dst_offset.offset += i;
-            ldz16(as, GP(RCX), src_offset);
-            st16(as, dst_offset, GP(RCX));
-            n -= 2;
-            i += 2;
-        }
-        if (n) {
+        if (n <= 0)
+            return;
+        if ((dst.memkind == ASMVal::REG_OFFSET && dst.base == RCX)
+            || (src.memkind == ASMVal::REG_OFFSET && src.base == RCX))
+            gather_addresses(as, dst, src, nullptr, false);
+
+        bool ymm = n >= 32 && as.isa >= ISA_V3;
+        i32 chunk = ymm ? 32 : n >= 16 ? 16 : n >= 8 ? 8 : n >= 4 ? 4 : n >= 2 ? 2 : 1;
+        for (i32 i = 0; i < n; i += chunk) {
             ASMVal src_offset = src;
             ASMVal dst_offset = dst;
-            src_offset.offset += i;
-            dst_offset.offset += i;
-            ldz8(as, GP(RCX), src_offset);
-            st8(as, dst_offset, GP(RCX));
+            src_offset.offset += i < n - chunk ? i : n - chunk;
+            dst_offset.offset += i < n - chunk ? i : n - chunk;
+            switch (chunk) {
+                case 32:
+                case 16:
+                    vload(as, ymm, XMM0, src_offset, 0);
+                    vstore(as, ymm, dst_offset, 0);
+                    break;
+                case 8:
+                    ld64(as, GP(RCX), src_offset);
+                    st64(as, dst_offset, GP(RCX));
+                    break;
+                case 4:
+                    ldz32(as, GP(RCX), src_offset);
+                    st32(as, dst_offset, GP(RCX));
+                    break;
+                case 2:
+                    ldz16(as, GP(RCX), src_offset);
+                    st16(as, dst_offset, GP(RCX));
+                    break;
+                case 1:
+                    ldz8(as, GP(RCX), src_offset);
+                    st8(as, dst_offset, GP(RCX));
+                    break;
+            }
         }
     }
-    
+
     static void mcpy(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
-        if (b.kind == ASMVal::IMM) {
-            mcpy_fixed(as, dst, a, b.imm);
+        if (b.kind == ASMVal::IMM && b.imm <= MCPY_UNROLL_LIMIT)
+            return mcpy_fixed(as, dst, a, b.imm);
+
+        gather_addresses(as, dst, a, &b, true);
+        Symbol done = as.symtab.anon();
+        if (b.kind != ASMVal::IMM) {
+            Symbol large = as.symtab.anon();
+            brcc64(as, COND_AE, Label(large), GP(RCX), Imm(32));
+            copy_small(as, done);
+            local(as, large);
         }
-        else {
-            la(as, GP(RDI), dst);
-            la(as, GP(RSI), a);
-            mov64(as, GP(RCX), b);
+        copy_forward(as, b, done);
+        local(as, done);
+    }
+
+    // mmov copies b bytes from a to dst, which may overlap. Constant sizes up
+    // to MMOV_FIXED_LIMIT load every byte into registers before storing any,
+    // using at most two GP or four vector loads, with the last one overlapping
+    // the rest. Otherwise, we compare dst - a against the size to see whether
+    // dst starts within the source, and if so copy from the end backwards,
+    // mirroring copy_forward. Past COPY_LOOP_LIMIT bytes we use rep movsb
+    // with the direction flag set. Without AVX, the vector loads only take 16
+    // bytes, so the fixed limit is halved.
+
+    static constexpr i32 MMOV_FIXED_LIMIT = 128;
+
+    static void mmov_fixed(Assembly& as, ASMVal dst, ASMVal src, i32 n) {
+        if (n <= 0)
+            return;
+        if ((dst.memkind == ASMVal::REG_OFFSET && (dst.base == RAX || dst.base == RCX))
+            || (src.memkind == ASMVal::REG_OFFSET && (src.base == RAX || src.base == RCX)))
+            gather_addresses(as, dst, src, nullptr, false);
+
+        if (n < 16) {
+            const mreg temps[2] = { RAX, RCX };
+            i32 chunk = n >= 8 ? 8 : n >= 4 ? 4 : n >= 2 ? 2 : 1;
+            for (i32 i = 0; i * chunk < n; i ++) {
+                ASMVal src_offset = src;
+                src_offset.offset += i * chunk < n - chunk ? i * chunk : n - chunk;
+                switch (chunk) {
+                    case 8: ld64(as, GP(temps[i]), src_offset); break;
+                    case 4: ldz32(as, GP(temps[i]), src_offset); break;
+                    case 2: ldz16(as, GP(temps[i]), src_offset); break;
+                    case 1: ldz8(as, GP(temps[i]), src_offset); break;
+                }
+            }
+            for (i32 i = 0; i * chunk < n; i ++) {
+                ASMVal dst_offset = dst;
+                dst_offset.offset += i * chunk < n - chunk ? i * chunk : n - chunk;
+                switch (chunk) {
+                    case 8: st64(as, dst_offset, GP(temps[i])); break;
+                    case 4: st32(as, dst_offset, GP(temps[i])); break;
+                    case 2: st16(as, dst_offset, GP(temps[i])); break;
+                    case 1: st8(as, dst_offset, GP(temps[i])); break;
+                }
+            }
+            return;
+        }
+
+        bool ymm = n >= 32 && as.isa >= ISA_V3;
+        i32 chunk = ymm ? 32 : 16;
+        for (i32 i = 0; i * chunk < n; i ++)
+            vload(as, ymm, XMM0 + i, src, i * chunk < n - chunk ? i * chunk : n - chunk);
+        for (i32 i = 0; i * chunk < n; i ++)
+            vstore(as, ymm, dst, i * chunk < n - chunk ? i * chunk : n - chunk, XMM0 + i);
+    }
+
+    static void mmov(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && b.imm <= (as.isa >= ISA_V3 ? MMOV_FIXED_LIMIT : MMOV_FIXED_LIMIT / 2))
+            return mmov_fixed(as, dst, a, b.imm);
+
+        gather_addresses(as, dst, a, &b, true);
+        Symbol done = as.symtab.anon(), backward = as.symtab.anon();
+        if (b.kind != ASMVal::IMM) {
+            Symbol large = as.symtab.anon();
+            brcc64(as, COND_AE, Label(large), GP(RCX), Imm(32));
+            copy_small(as, done);
+            local(as, large);
+        }
+
+        mov64(as, GP(RAX), GP(RDI));
+        sub64(as, GP(RAX), GP(RAX), GP(RSI));
+        brcc64(as, COND_BELOW, Label(backward), GP(RAX), GP(RCX));
+        copy_forward(as, b, done);
+
+        // Backwards, from the end of the source.
+        local(as, backward);
+        Symbol backwardRep = as.symtab.anon(), backwardLoop = as.symtab.anon();
+        if (b.kind != ASMVal::IMM)
+            brcc64(as, COND_AE, Label(backwardRep), GP(RCX), Imm(COPY_LOOP_LIMIT));
+        if (b.kind != ASMVal::IMM || b.imm < COPY_LOOP_LIMIT) {
+            bool ymm = as.isa >= ISA_V3;
+            i32 block = ymm ? 32 : 16;
+            vload(as, ymm, XMM1, Mem(RSI, 0), 0);
+            la(as, GP(RAX), Mem(RDI, block)); // The end of the first block, which ends the loop.
+            add64(as, GP(RSI), GP(RSI), GP(RCX));
+            add64(as, GP(RDI), GP(RDI), GP(RCX));
+            local(as, backwardLoop);
+            sub64(as, GP(RSI), GP(RSI), Imm(block));
+            sub64(as, GP(RDI), GP(RDI), Imm(block));
+            vload(as, ymm, XMM0, Mem(RSI, 0), 0);
+            vstore(as, ymm, Mem(RDI, 0), 0);
+            brcc64(as, COND_ABOVE, Label(backwardLoop), GP(RDI), GP(RAX));
+            vstore(as, ymm, Mem(RAX, -block), 0, XMM1);
+            br(as, Label(done));
+        }
+        if (b.kind != ASMVal::IMM || b.imm >= COPY_LOOP_LIMIT) {
+            local(as, backwardRep);
+            lea_index(as, RSI, RSI, RCX, -1);
+            lea_index(as, RDI, RDI, RCX, -1);
+            as.code.write<u8>(0xfd);    // std
             as.code.write<u8>(0xf3);    // rep movsb
             as.code.write<u8>(0xa4);
+            as.code.write<u8>(0xfc);    // cld
         }
+
+        local(as, done);
     }
 
-    static void mmov(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+    // mset fills b bytes at dst with the low byte of a. Constant sizes up to
+    // MSET_UNROLL_LIMIT are unrolled into overlapping stores, GP stores below
+    // 16 bytes and XMM or YMM stores above, so any tail is covered by one
+    // final store ending at dst + b. Constant sizes up to MSET_LOOP_LIMIT
+    // use a loop of YMM stores, and anything else uses rep stosb, which is
+    // faster than a loop for large sizes on processors with ERMS.
+
+    static constexpr i32 MSET_UNROLL_LIMIT = 256, MSET_LOOP_LIMIT = 2048;
+
+    // A fill value in memory is loaded up front, since only its low byte
+    // counts, into a scratch register that neither dst nor b uses.
+    static inline ASMVal mset_value(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (a.kind != ASMVal::MEM)
+            return a;
+        mreg r = RAX;
+        while ((dst.memkind == ASMVal::REG_OFFSET && dst.base == r) || b == GP(r))
+            r = r == RAX ? RCX : RDI;
+        ldz8(as, GP(r), a);
+        return GP(r);
+    }
+
+    static inline void vstore(Assembly& as, bool ymm, ASMVal dst, i32 offset, mreg src = XMM0) {
+        dst.offset += offset;
+        if (as.isa < ISA_V3) {
+            assert(!ymm);
+            return sseop(as, VexPrefixF3, false, 0x7f, FP(src), dst, TwoByteOpcode); // movdqu
+        }
+        vexop(as, VexPrefixF3, TwoByteOpcode, false, ymm, 0x7f, FP(src), dst); // vmovdqu
+    }
+
+    static void mset_fixed(Assembly& as, ASMVal dst, ASMVal a, i32 n) {
+        if (n <= 0)
+            return;
+        a = mset_value(as, dst, a, Imm(n));
+        bool loop = n > MSET_UNROLL_LIMIT, ymm = n > 32 && as.isa >= ISA_V3;
+        if (loop || dst.memkind != ASMVal::REG_OFFSET || dst.base == RAX || dst.base == RCX) {
+            // Our base register would be clobbered, or we need one to bump.
+            if (dst.memkind == ASMVal::REG_OFFSET) {
+                ASMVal srcs[2] = { GP(dst.base), a };
+                const mreg dsts[2] = { RDI, RCX };
+                gather(as, srcs, dsts, 2);
+                if (loop && dst.offset)
+                    la(as, GP(RDI), Mem(RDI, dst.offset)), dst.offset = 0;
+                dst.base = RDI;
+            }
+            else {
+                mov64(as, GP(RCX), a);
+                la(as, GP(RDI), dst);
+                dst = Mem(RDI, 0);
+            }
+            if (a.kind == ASMVal::GP)
+                a = GP(RCX);
+        }
 
+        if (n < 16) {
+            i64 pattern = i64(u8(a.imm)) * 0x0101010101010101ll;
+            ASMVal value = Imm(i32(pattern));
+            if (a.kind == ASMVal::GP) {
+                binaryop(as, QWORD, Opcode::literal(0x0f, 0xb6), a, GP(RCX)); // movzx
+                mov64(as, GP(RAX), Imm64(0x0101010101010101ll));
+                binaryop(as, QWORD, Opcode::literal(0x0f, 0xaf), GP(RCX), GP(RAX)); // imul
+                value = GP(RAX);
+            }
+            else if (n >= 8 && pattern != i32(pattern)) {
+                mov64(as, GP(RAX), Imm64(pattern));
+                value = GP(RAX);
+            }
+            i32 chunk = n >= 8 ? 8 : n >= 4 ? 4 : n >= 2 ? 2 : 1;
+            for (i32 i = 0; i < n; i += chunk) {
+                ASMVal dst_offset = dst;
+                dst_offset.offset += i < n - chunk ? i : n - chunk;
+                switch (chunk) {
+                    case 8: st64(as, dst_offset, value); break;
+                    case 4: st32(as, dst_offset, value); break;
+                    case 2: st16(as, dst_offset, value); break;
+                    case 1: st8(as, dst_offset, value); break;
+                }
+            }
+            return;
+        }
+
+        if (a.kind == ASMVal::IMM && u8(a.imm) == 0 && as.isa < ISA_V3)
+            sseop(as, VexPrefix66, false, 0xef, FP(XMM0), FP(XMM0), TwoByteOpcode); // pxor
+        else if (a.kind == ASMVal::IMM && u8(a.imm) == 0)
+            vexop(as, VexPrefix66, TwoByteOpcode, false, false, 0xef, FP(XMM0), FP(XMM0), FP(XMM0)); // vpxor
+        else if (as.isa < ISA_V3) {
+            // No vpbroadcastb, so we spread the byte across RAX and then
+            // duplicate the low quadword.
+            if (a.kind == ASMVal::GP) {
+                binaryop(as, QWORD, Opcode::literal(0x0f, 0xb6), a, GP(RCX)); // movzx
+                mov64(as, GP(RAX), Imm64(0x0101010101010101ll));
+                binaryop(as, QWORD, Opcode::literal(0x0f, 0xaf), GP(RCX), GP(RAX)); // imul
+            }
+            else mov64(as, GP(RAX), Imm64(i64(u8(a.imm)) * 0x0101010101010101ll));
+            sseop(as, VexPrefix66, true, 0x6e, FP(XMM0), GP(RAX), TwoByteOpcode); // movq
+            sseop(as, VexPrefix66, false, 0x6c, FP(XMM0), FP(XMM0), TwoByteOpcode); // punpcklqdq
+        }
+        else {
+            if (a.kind == ASMVal::IMM)
+                mov32(as, GP(RCX), Imm(u8(a.imm)));
+            vexop(as, VexPrefix66, TwoByteOpcode, false, false, 0x6e, FP(XMM0), a.kind == ASMVal::GP ? a : GP(RCX)); // vmovd
+            vexop(as, VexPrefix66, ThreeByteOpcode38, false, ymm, 0x78, FP(XMM0), FP(XMM0)); // vpbroadcastb
+        }
+
+        i32 chunk = ymm ? 32 : 16;
+        if (loop) {
+            Symbol start = as.symtab.anon();
+            la(as, GP(RCX), Mem(RDI, n & -chunk)); // End of the whole chunks.
+            local(as, start);
+            vstore(as, ymm, dst, 0);
+            add64(as, GP(RDI), GP(RDI), Imm(chunk));
+            brcc64(as, COND_BELOW, Label(start), GP(RDI), GP(RCX));
+            if (n % chunk)
+                vstore(as, ymm, dst, n % chunk - chunk);
+        }
+        else for (i32 i = 0; i < n; i += chunk)
+            vstore(as, ymm, dst, i < n - chunk ? i : n - chunk);
     }
 
     static void mset(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        if (b.kind == ASMVal::IMM && b.imm <= MSET_LOOP_LIMIT)
+            return mset_fixed(as, dst, a, b.imm);
+
+        a = mset_value(as, dst, a, b);
+        if (dst.memkind == ASMVal::REG_OFFSET) {
+            ASMVal srcs[3] = { GP(dst.base), a, b };
+            const mreg dsts[3] = { RDI, RAX, RCX };
+            gather(as, srcs, dsts, 3);
+            if (dst.offset)
+                la(as, GP(RDI), Mem(RDI, dst.offset));
+        }
+        else {
+            ASMVal srcs[2] = { a, b };
+            const mreg dsts[2] = { RAX, RCX };
+            gather(as, srcs, dsts, 2);
+            la(as, GP(RDI), dst);
+        }
+        as.code.write<u8>(0xf3);    // rep stosb
+        as.code.write<u8>(0xaa);
+    }
+
+    // mcmp compares c bytes at a and b like memcmp, leaving the flags as if
+    // we had done an unsigned cmp of the first differing pair of bytes, or
+    // set to equal if there isn't one. Vector chunks find the first difference
+    // with vpcmpeqb and vpmovmskb, then compare the bytes at its index. GP
+    // chunks are byte-swapped so one unsigned cmp orders the whole chunk.
+    // As in mset and mmov, the last chunk may overlap the one before it,
+    // which is fine since everything before it compared equal.
+
+    static constexpr i32 MCMP_UNROLL_LIMIT = 128;
+
+    static inline Condition memory_condition(Condition cc) {
+        switch (cc) {
+            case COND_LT: return COND_BELOW;
+            case COND_LE: return COND_BE;
+            case COND_GT: return COND_ABOVE;
+            case COND_GE: return COND_AE;
+            case COND_TEST_ZERO:
+            case COND_TEST_NONZERO:
+                unreachable("Can't test memory against a mask.");
+            default: return cc;
+        }
+    }
 
+    // Loads size bytes at base + index + offset into dst, zero-extended. An
+    // index of -1 means there is none.
+    static inline void load_index(Assembly& as, i32 size, mreg dst, mreg base, mreg index, i32 offset) {
+        if (index < 0) switch (size) {
+            case 8: return ld64(as, GP(dst), Mem(base, offset));
+            case 4: return ldz32(as, GP(dst), Mem(base, offset));
+            case 2: return ldz16(as, GP(dst), Mem(base, offset));
+            default: return ldz8(as, GP(dst), Mem(base, offset));
+        }
+        index_prefix(as, size == 8 ? QWORD : DWORD, dst, base, index, BYTE, offset);
+        if (size < 4) {
+            as.code.write<u8>(0x0f);
+            as.code.write<u8>(size == 2 ? 0xb7 : 0xb6); // movzx
+        }
+        else as.code.write<u8>(0x8b); // mov
+        index_args(as, dst, base, index, BYTE, offset);
     }
 
-    static void mcmpcc(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+    static inline void bswap(Assembly& as, i32 size, mreg r) {
+        unary_prefix(as, size == 8 ? QWORD : DWORD, GP(r));
+        as.code.write<u8>(0x0f);
+        as.code.write<u8>(0xc8 + (r & 0b111));
+    }
+
+    static inline void mcmp_gp_chunk(Assembly& as, i32 size, ASMVal a, ASMVal b, mreg index, i32 offset) {
+        load_index(as, size, RAX, a.base, index, a.offset + offset);
+        load_index(as, size, RDX, b.base, index, b.offset + offset);
+        if (size > 1)
+            bswap(as, size, RAX), bswap(as, size, RDX);
+        if (size == 8) cmp64(as, GP(RAX), GP(RDX));
+        else cmp32(as, GP(RAX), GP(RDX));
+    }
+
+    // Leaves the mask of differing bytes in RAX, and ZF set if there are none.
+    static inline void mcmp_vector_chunk(Assembly& as, bool ymm, ASMVal a, ASMVal b) {
+        if (as.isa < ISA_V3) {
+            // pcmpeqb faults on unaligned memory, so both sides go in registers.
+            vload(as, false, XMM0, a, 0);
+            vload(as, false, XMM1, b, 0);
+            sseop(as, VexPrefix66, false, 0x74, FP(XMM0), FP(XMM1), TwoByteOpcode); // pcmpeqb
+            sseop(as, VexPrefix66, false, 0xd7, GP(RAX), FP(XMM0), TwoByteOpcode); // pmovmskb
+            return xor32(as, GP(RAX), GP(RAX), Imm(0xffff));
+        }
+        vexop(as, VexPrefixF3, TwoByteOpcode, false, ymm, 0x6f, FP(XMM0), a); // vmovdqu
+        vexop(as, VexPrefix66, TwoByteOpcode, false, ymm, 0x74, FP(XMM0), FP(XMM0), b); // vpcmpeqb
+        vexop(as, VexPrefix66, TwoByteOpcode, false, ymm, 0xd7, GP(RAX), FP(XMM0)); // vpmovmskb
+        xor32(as, GP(RAX), GP(RAX), Imm(ymm ? -1 : 0xffff));
+    }
+
+    // Compares the bytes at the lowest index set in the mask in RAX.
+    static inline void mcmp_difference(Assembly& as, ASMVal a, ASMVal b, i32 offset) {
+        binaryop(as, DWORD, Opcode::literal(0x0f, 0xbc), GP(RAX), GP(RAX)); // bsf
+        load_index(as, 1, RCX, a.base, RAX, a.offset + offset);
+        index_prefix(as, BYTE, RCX, b.base, RAX, BYTE, b.offset + offset);
+        as.code.write<u8>(0x3a); // cmp
+        index_args(as, RCX, b.base, RAX, BYTE, b.offset + offset);
+    }
+
+    static void mcmp_fixed(Assembly& as, ASMVal a, ASMVal b, i32 n) {
+        if (n <= 0)
+            return cmp32(as, GP(RAX), GP(RAX)); // Empty ranges are equal.
+        if (a.memkind != ASMVal::REG_OFFSET || a.base == RAX || a.base == RCX || a.base == RDX
+            || b.memkind != ASMVal::REG_OFFSET || b.base == RAX || b.base == RCX || b.base == RDX)
+            gather_addresses(as, a, b, nullptr, false);
+
+        Symbol done = as.symtab.anon();
+        if (n < 16) {
+            i32 chunk = n >= 8 ? 8 : n >= 4 ? 4 : n >= 2 ? 2 : 1;
+            mcmp_gp_chunk(as, chunk, a, b, -1, 0);
+            if (n > chunk) {
+                jcc(as, COND_NE, Label(done));
+                mcmp_gp_chunk(as, chunk, a, b, -1, n - chunk);
+            }
+            local(as, done);
+            return;
+        }
+
+        bool ymm = n >= 32 && as.isa >= ISA_V3;
+        i32 chunk = ymm ? 32 : 16;
+        Symbol differences[MCMP_UNROLL_LIMIT / 16];
+        i32 offsets[MCMP_UNROLL_LIMIT / 16];
+        i32 chunks = 0;
+        for (i32 i = 0; i < n; i += chunk) {
+            offsets[chunks] = i < n - chunk ? i : n - chunk;
+            ASMVal a_offset = a, b_offset = b;
+            a_offset.offset += offsets[chunks];
+            b_offset.offset += offsets[chunks];
+            mcmp_vector_chunk(as, ymm, a_offset, b_offset);
+            differences[chunks] = as.symtab.anon();
+            jcc(as, COND_NE, Label(differences[chunks ++]));
+        }
+        cmp32(as, GP(RAX), GP(RAX));
+        br(as, Label(done));
+        for (i32 i = 0; i < chunks; i ++) {
+            local(as, differences[i]);
+            mcmp_difference(as, a, b, offsets[i]);
+            if (i < chunks - 1)
+                br(as, Label(done));
+        }
+        local(as, done);
+    }
+
+    static void mcmp(Assembly& as, ASMVal a, ASMVal b, ASMVal c) {
+        if (c.kind == ASMVal::IMM && c.imm <= MCMP_UNROLL_LIMIT)
+            return mcmp_fixed(as, a, b, c.imm);
+
+        // From here on, RDI and RSI point to the current block, and RCX holds
+        // the number of bytes left.
+        gather_addresses(as, a, b, &c, true);
+        Symbol loop = as.symtab.anon(), equal = as.symtab.anon(), difference = as.symtab.anon(),
+            done = as.symtab.anon(), small = as.symtab.anon();
+        bool ymm = as.isa >= ISA_V3;
+        i32 block = ymm ? 32 : 16;
+        if (c.kind != ASMVal::IMM)
+            brcc64(as, COND_BELOW, Label(small), GP(RCX), Imm(32));
+        local(as, loop);
+        mcmp_vector_chunk(as, ymm, Mem(RDI, 0), Mem(RSI, 0));
+        jcc(as, COND_NE, Label(difference));
+        add64(as, GP(RDI), GP(RDI), Imm(block));
+        add64(as, GP(RSI), GP(RSI), Imm(block));
+        sub64(as, GP(RCX), GP(RCX), Imm(block));
+        brcc64(as, COND_AE, Label(loop), GP(RCX), Imm(block));
+        if (c.kind != ASMVal::IMM || c.imm % block) {
+            // Finish with the block ending at the end of the range.
+            if (c.kind != ASMVal::IMM)
+                brcc64(as, COND_EQ, Label(equal), GP(RCX), Imm(0));
+            lea_index(as, RDI, RDI, RCX, -block);
+            lea_index(as, RSI, RSI, RCX, -block);
+            mcmp_vector_chunk(as, ymm, Mem(RDI, 0), Mem(RSI, 0));
+            jcc(as, COND_NE, Label(difference));
+        }
+        local(as, equal);
+        cmp32(as, GP(RAX), GP(RAX));
+        br(as, Label(done));
+        local(as, difference);
+        mcmp_difference(as, Mem(RDI, 0), Mem(RSI, 0), 0);
+
+        if (c.kind != ASMVal::IMM) {
+            // Sizes below 32 bytes compare a pair of overlapping chunks, the
+            // first at the start of the range and the second at the end.
+            br(as, Label(done));
+            local(as, small);
+            Symbol next = as.symtab.anon();
+            brcc64(as, COND_BELOW, Label(next), GP(RCX), Imm(16));
+            mcmp_vector_chunk(as, false, Mem(RDI, 0), Mem(RSI, 0));
+            jcc(as, COND_NE, Label(difference));
+            lea_index(as, RDI, RDI, RCX, -16);
+            lea_index(as, RSI, RSI, RCX, -16);
+            mcmp_vector_chunk(as, false, Mem(RDI, 0), Mem(RSI, 0));
+            jcc(as, COND_NE, Label(difference));
+            br(as, Label(equal));
+            for (i32 size = 8; size >= 1; size /= 2) {
+                local(as, next);
+                next = as.symtab.anon();
+                brcc64(as, COND_BELOW, Label(next), GP(RCX), Imm(size));
+                mcmp_gp_chunk(as, size, Mem(RDI, 0), Mem(RSI, 0), -1, 0);
+                jcc(as, COND_NE, Label(done));
+                mcmp_gp_chunk(as, size, Mem(RDI, 0), Mem(RSI, 0), RCX, -size);
+                br(as, Label(done));
+            }
+            local(as, next);
+            br(as, Label(equal)); // Nothing to compare.
+        }
+        local(as, done);
+    }
 
+    static void mcmpcc(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+        mcmp(as, a, b, c);
+        unaryop(as, BYTE, Opcode::withExt(0x0f, 0x90 + CCodes[memory_condition(cond)], 0x00), dst);
+        zxt8(as, dst, dst);
     }
 
     static void mbrcc(Assembly& as, Condition cond, ASMVal dst, ASMVal a, ASMVal b, ASMVal c) {
+        mcmp(as, a, b, c);
+        jcc(as, memory_condition(cond), dst);
+    }
+    // Packed Vector Arithmetic
 
+    // Vectors live in FP registers, as XMM registers for 128-bit opcodes and
+    // YMM registers for 256-bit ones, and are lowered to AVX2. Every operand
+    // must be a register, except the count of a shift, which is an immediate.
+    // Anything x86 has no instruction for (64-bit multiplies, min, max and
+    // unsigned comparisons) is built out of the others using XMM0 and XMM1.
+
+    static inline void vbinary(Assembly& as, VexPrefix prefix, VexOpcode opclass, bool ymm, u8 opcode, ASMVal dst, ASMVal a, ASMVal b) {
+        assert(dst.kind == ASMVal::FP && a.kind == ASMVal::FP && b.kind == ASMVal::FP);
+        vexop(as, prefix, opclass, false, ymm, opcode, dst, a, b);
     }
-};
 
-struct AMD64LinuxAssembler : public AMD64Assembler {
-    static constexpr mreg GP_ARGS[6] = { RDI, RSI, RDX, RCX, R8, R9 };
-    static constexpr mreg FP_ARGS[8] = { XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7 };
-    static const TargetDesc DESC;
-    
-    static inline constexpr RegSet caller_saved_gps() {
-        return RegSet(RAX, RCX, RDX, RDI, RSI, R8, R9, R10, R11);
+    // Shifts by an immediate encode the operation in the reg field, and the
+    // destination in vvvv.
+    static inline void vshift(Assembly& as, bool ymm, u8 opcode, u8 ext, ASMVal dst, ASMVal a, ASMVal b) {
+        assert(dst.kind == ASMVal::FP && a.kind == ASMVal::FP && b.kind == ASMVal::IMM);
+        vexop(as, VexPrefix66, TwoByteOpcode, false, ymm, opcode, GP(ext), dst, a);
+        as.code.write<u8>(b.imm);
     }
 
-    static inline constexpr RegSet caller_saved_fps() {
-        return fps();
+    static inline void vpcmpeq(Assembly& as, bool ymm, u32 lane, ASMVal dst, ASMVal a, ASMVal b) {
+        if (lane == 64)
+            vbinary(as, VexPrefix66, ThreeByteOpcode38, ymm, 0x29, dst, a, b);
+        else
+            vbinary(as, VexPrefix66, TwoByteOpcode, ymm, lane == 8 ? 0x74 : lane == 16 ? 0x75 : 0x76, dst, a, b);
     }
 
-    static inline constexpr RegSet caller_saves() {
-        return caller_saved_gps() | caller_saved_fps();
+    static inline void vpcmpgt(Assembly& as, bool ymm, u32 lane, ASMVal dst, ASMVal a, ASMVal b) {
+        if (lane == 64)
+            vbinary(as, VexPrefix66, ThreeByteOpcode38, ymm, 0x37, dst, a, b);
+        else
+            vbinary(as, VexPrefix66, TwoByteOpcode, ymm, lane == 8 ? 0x64 : lane == 16 ? 0x65 : 0x66, dst, a, b);
     }
 
-    static inline constexpr RegSet callee_saved_gps() {
-        return RegSet(RBX, RBP, RSP, R12, R13, R14, R15);
+    static inline void vpmaxu(Assembly& as, bool ymm, u32 lane, ASMVal dst, ASMVal a, ASMVal b) {
+        if (lane == 8)
+            vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xde, dst, a, b);
+        else
+            vbinary(as, VexPrefix66, ThreeByteOpcode38, ymm, lane == 16 ? 0x3e : 0x3f, dst, a, b);
     }
 
-    static inline constexpr RegSet callee_saved_fps() {
-        return RegSet();
+    static inline void vpminu(Assembly& as, bool ymm, u32 lane, ASMVal dst, ASMVal a, ASMVal b) {
+        if (lane == 8)
+            vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xda, dst, a, b);
+        else
+            vbinary(as, VexPrefix66, ThreeByteOpcode38, ymm, lane == 16 ? 0x3a : 0x3b, dst, a, b);
     }
 
-    static inline constexpr RegSet callee_saves() {
-        return callee_saved_gps() | callee_saved_fps();
+    static inline void vnot(Assembly& as, bool ymm, ASMVal dst) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0x76, FP(XMM0), FP(XMM0), FP(XMM0)); // All ones.
+        vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xef, dst, dst, FP(XMM0));
     }
 
-    static void* start_placing_parameters();
-    static MaybePair<ASMVal> place_scalar_parameter(void* state, Repr scalar);
-    static MaybePair<ASMVal> place_aggregate_parameter(void* state, const_slice<Repr> members);
-    static void finish_placing_parameters(void* state);
+    // The low 64 bits of a * b are lo(a) * lo(b) + ((hi(a) * lo(b) + lo(a) * hi(b)) << 32),
+    // each product of which vpmuludq can compute.
+    static inline void vmul64(Assembly& as, bool ymm, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, ymm, 0x73, 2, FP(XMM0), a, Imm(32));
+        vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xf4, FP(XMM0), FP(XMM0), b);
+        vshift(as, ymm, 0x73, 2, FP(XMM1), b, Imm(32));
+        vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xf4, FP(XMM1), FP(XMM1), a);
+        vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xd4, FP(XMM0), FP(XMM0), FP(XMM1));
+        vshift(as, ymm, 0x73, 6, FP(XMM0), FP(XMM0), Imm(32));
+        vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xf4, dst, a, b);
+        vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xd4, dst, dst, FP(XMM0));
+    }
 
-    static MaybePair<ASMVal> place_scalar_return_value(void* state, Repr scalar);
-    static MaybePair<ASMVal> place_aggregate_return_value(void* state, const_slice<Repr> members);
-};
+    // There's no vpminsq or vpmaxsq before AVX-512, so we compare into XMM0
+    // and blend.
+    static inline void vminmax64(Assembly& as, bool ymm, bool max, ASMVal dst, ASMVal a, ASMVal b) {
+        vpcmpgt(as, ymm, 64, FP(XMM0), a, b);
+        if (max)
+            swap(a, b);
+        vbinary(as, VexPrefix66, ThreeByteOpcode3A, ymm, 0x4b, dst, a, b); // vblendvpd
+        as.code.write<u8>(0x00); // Mask register in the top four bits, so XMM0.
+    }
+
+    // Only equality and signed greater-than exist as instructions. Less-than
+    // swaps the operands, and the other signed conditions are the inverse of
+    // one of these. Unsigned lanes up to 32 bits compare a against the
+    // unsigned max or min of both, since a >= b exactly when max(a, b) == a.
+    // Unsigned 64-bit lanes have no max or min either, so we flip their sign
+    // bits and compare them as signed.
+    static void vcmpcc(Assembly& as, bool ymm, u32 lane, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        bool invert = false;
+        switch (cc) {
+            case COND_EQ:
+            case COND_NE:
+                vpcmpeq(as, ymm, lane, dst, a, b);
+                invert = cc == COND_NE;
+                break;
+            case COND_GT:
+            case COND_LE:
+                vpcmpgt(as, ymm, lane, dst, a, b);
+                invert = cc == COND_LE;
+                break;
+            case COND_LT:
+            case COND_GE:
+                vpcmpgt(as, ymm, lane, dst, b, a);
+                invert = cc == COND_GE;
+                break;
+            case COND_ABOVE:
+            case COND_AE:
+            case COND_BELOW:
+            case COND_BE:
+                if (lane == 64) {
+                    vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0x76, FP(XMM0), FP(XMM0), FP(XMM0));
+                    vshift(as, ymm, 0x73, 6, FP(XMM0), FP(XMM0), Imm(63));
+                    vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xef, FP(XMM1), a, FP(XMM0));
+                    vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xef, FP(XMM0), b, FP(XMM0));
+                    if (cc == COND_ABOVE || cc == COND_BE)
+                        vpcmpgt(as, ymm, lane, dst, FP(XMM1), FP(XMM0));
+                    else
+                        vpcmpgt(as, ymm, lane, dst, FP(XMM0), FP(XMM1));
+                    invert = cc == COND_BE || cc == COND_AE;
+                }
+                else {
+                    if (cc == COND_AE || cc == COND_BELOW)
+                        vpmaxu(as, ymm, lane, FP(XMM0), a, b);
+                    else
+                        vpminu(as, ymm, lane, FP(XMM0), a, b);
+                    vpcmpeq(as, ymm, lane, dst, FP(XMM0), a);
+                    invert = cc == COND_BELOW || cc == COND_ABOVE;
+                }
+                break;
+            case COND_TEST_ZERO:
+            case COND_TEST_NONZERO:
+                vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xef, FP(XMM0), FP(XMM0), FP(XMM0));
+                vbinary(as, VexPrefix66, TwoByteOpcode, ymm, 0xdb, dst, a, b);
+                vpcmpeq(as, ymm, lane, dst, dst, FP(XMM0));
+                invert = cc == COND_TEST_NONZERO;
+                break;
+        }
+        if (invert)
+            vnot(as, ymm, dst);
+    }
+
+    static inline void vfcmpcc(Assembly& as, VexPrefix prefix, bool ymm, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, prefix, TwoByteOpcode, ymm, 0xc2, dst, a, b); // vcmpps/pd
+        as.code.write<u8>(float_predicate(cc));
+    }
+
+    static void vadd8x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xfc, dst, a, b); // vpaddb
+    }
+
+    static void vadd8x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xfc, dst, a, b); // vpaddb
+    }
+
+    static void vadd16x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xfd, dst, a, b); // vpaddw
+    }
+
+    static void vadd16x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xfd, dst, a, b); // vpaddw
+    }
+
+    static void vadd32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xfe, dst, a, b); // vpaddd
+    }
+
+    static void vadd32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xfe, dst, a, b); // vpaddd
+    }
+
+    static void vadd64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xd4, dst, a, b); // vpaddq
+    }
+
+    static void vadd64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xd4, dst, a, b); // vpaddq
+    }
+
+    static void vsub8x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xf8, dst, a, b); // vpsubb
+    }
+
+    static void vsub8x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xf8, dst, a, b); // vpsubb
+    }
+
+    static void vsub16x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xf9, dst, a, b); // vpsubw
+    }
+
+    static void vsub16x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xf9, dst, a, b); // vpsubw
+    }
+
+    static void vsub32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xfa, dst, a, b); // vpsubd
+    }
+
+    static void vsub32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xfa, dst, a, b); // vpsubd
+    }
+
+    static void vsub64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xfb, dst, a, b); // vpsubq
+    }
+
+    static void vsub64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xfb, dst, a, b); // vpsubq
+    }
+
+    static void vmul16x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xd5, dst, a, b); // vpmullw
+    }
+
+    static void vmul16x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xd5, dst, a, b); // vpmullw
+    }
+
+    static void vmul32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, false, 0x40, dst, a, b); // vpmulld
+    }
+
+    static void vmul32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, true, 0x40, dst, a, b); // vpmulld
+    }
+
+    static void vmul64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vmul64(as, false, dst, a, b);
+    }
+
+    static void vmul64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vmul64(as, true, dst, a, b);
+    }
+
+    static void vmin8x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, false, 0x38, dst, a, b); // vpminsb
+    }
+
+    static void vmin8x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, true, 0x38, dst, a, b); // vpminsb
+    }
+
+    static void vmin16x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xea, dst, a, b); // vpminsw
+    }
+
+    static void vmin16x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xea, dst, a, b); // vpminsw
+    }
+
+    static void vmin32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, false, 0x39, dst, a, b); // vpminsd
+    }
+
+    static void vmin32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, true, 0x39, dst, a, b); // vpminsd
+    }
+
+    static void vmin64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vminmax64(as, false, false, dst, a, b);
+    }
+
+    static void vmin64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vminmax64(as, true, false, dst, a, b);
+    }
+
+    static void vmax8x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, false, 0x3c, dst, a, b); // vpmaxsb
+    }
+
+    static void vmax8x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, true, 0x3c, dst, a, b); // vpmaxsb
+    }
+
+    static void vmax16x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xee, dst, a, b); // vpmaxsw
+    }
+
+    static void vmax16x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xee, dst, a, b); // vpmaxsw
+    }
+
+    static void vmax32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, false, 0x3d, dst, a, b); // vpmaxsd
+    }
+
+    static void vmax32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, true, 0x3d, dst, a, b); // vpmaxsd
+    }
+
+    static void vmax64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vminmax64(as, false, true, dst, a, b);
+    }
+
+    static void vmax64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vminmax64(as, true, true, dst, a, b);
+    }
+
+    static void vand64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xdb, dst, a, b); // vpand
+    }
+
+    static void vand64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xdb, dst, a, b); // vpand
+    }
+
+    static void vor64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xeb, dst, a, b); // vpor
+    }
+
+    static void vor64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xeb, dst, a, b); // vpor
+    }
+
+    static void vxor64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0xef, dst, a, b); // vpxor
+    }
+
+    static void vxor64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0xef, dst, a, b); // vpxor
+    }
+
+    static void vshl16x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, false, 0x71, 6, dst, a, b); // vpsllw
+    }
+
+    static void vshl16x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, true, 0x71, 6, dst, a, b); // vpsllw
+    }
+
+    static void vshl32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, false, 0x72, 6, dst, a, b); // vpslld
+    }
+
+    static void vshl32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, true, 0x72, 6, dst, a, b); // vpslld
+    }
+
+    static void vshl64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, false, 0x73, 6, dst, a, b); // vpsllq
+    }
+
+    static void vshl64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, true, 0x73, 6, dst, a, b); // vpsllq
+    }
+
+    static void vshr16x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, false, 0x71, 2, dst, a, b); // vpsrlw
+    }
+
+    static void vshr16x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, true, 0x71, 2, dst, a, b); // vpsrlw
+    }
+
+    static void vshr32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, false, 0x72, 2, dst, a, b); // vpsrld
+    }
+
+    static void vshr32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, true, 0x72, 2, dst, a, b); // vpsrld
+    }
+
+    static void vshr64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, false, 0x73, 2, dst, a, b); // vpsrlq
+    }
+
+    static void vshr64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, true, 0x73, 2, dst, a, b); // vpsrlq
+    }
+
+    static void vsar16x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, false, 0x71, 4, dst, a, b); // vpsraw
+    }
+
+    static void vsar16x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, true, 0x71, 4, dst, a, b); // vpsraw
+    }
+
+    static void vsar32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, false, 0x72, 4, dst, a, b); // vpsrad
+    }
+
+    static void vsar32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshift(as, true, 0x72, 4, dst, a, b); // vpsrad
+    }
+
+    static void vcmpcc8x16(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vcmpcc(as, false, 8, cc, dst, a, b);
+    }
+
+    static void vcmpcc8x32(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vcmpcc(as, true, 8, cc, dst, a, b);
+    }
+
+    static void vcmpcc16x8(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vcmpcc(as, false, 16, cc, dst, a, b);
+    }
+
+    static void vcmpcc16x16(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vcmpcc(as, true, 16, cc, dst, a, b);
+    }
+
+    static void vcmpcc32x4(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vcmpcc(as, false, 32, cc, dst, a, b);
+    }
+
+    static void vcmpcc32x8(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vcmpcc(as, true, 32, cc, dst, a, b);
+    }
+
+    static void vcmpcc64x2(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vcmpcc(as, false, 64, cc, dst, a, b);
+    }
+
+    static void vcmpcc64x4(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vcmpcc(as, true, 64, cc, dst, a, b);
+    }
+
+    static void vfadd32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, false, 0x58, dst, a, b); // vaddps
+    }
+
+    static void vfadd32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, true, 0x58, dst, a, b); // vaddps
+    }
+
+    static void vfadd64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0x58, dst, a, b); // vaddpd
+    }
+
+    static void vfadd64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0x58, dst, a, b); // vaddpd
+    }
+
+    static void vfsub32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, false, 0x5c, dst, a, b); // vsubps
+    }
+
+    static void vfsub32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, true, 0x5c, dst, a, b); // vsubps
+    }
+
+    static void vfsub64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0x5c, dst, a, b); // vsubpd
+    }
+
+    static void vfsub64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0x5c, dst, a, b); // vsubpd
+    }
+
+    static void vfmul32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, false, 0x59, dst, a, b); // vmulps
+    }
+
+    static void vfmul32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, true, 0x59, dst, a, b); // vmulps
+    }
+
+    static void vfmul64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0x59, dst, a, b); // vmulpd
+    }
+
+    static void vfmul64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0x59, dst, a, b); // vmulpd
+    }
+
+    static void vfdiv32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, false, 0x5e, dst, a, b); // vdivps
+    }
+
+    static void vfdiv32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, true, 0x5e, dst, a, b); // vdivps
+    }
+
+    static void vfdiv64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0x5e, dst, a, b); // vdivpd
+    }
+
+    static void vfdiv64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0x5e, dst, a, b); // vdivpd
+    }
+
+    static void vfmin32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, false, 0x5d, dst, a, b); // vminps
+    }
+
+    static void vfmin32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, true, 0x5d, dst, a, b); // vminps
+    }
+
+    static void vfmin64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0x5d, dst, a, b); // vminpd
+    }
+
+    static void vfmin64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0x5d, dst, a, b); // vminpd
+    }
+
+    static void vfmax32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, false, 0x5f, dst, a, b); // vmaxps
+    }
+
+    static void vfmax32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, NoPrefix, TwoByteOpcode, true, 0x5f, dst, a, b); // vmaxps
+    }
+
+    static void vfmax64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, false, 0x5f, dst, a, b); // vmaxpd
+    }
+
+    static void vfmax64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, TwoByteOpcode, true, 0x5f, dst, a, b); // vmaxpd
+    }
+
+    static void vfcmpcc32x4(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vfcmpcc(as, NoPrefix, false, cc, dst, a, b);
+    }
+
+    static void vfcmpcc32x8(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vfcmpcc(as, NoPrefix, true, cc, dst, a, b);
+    }
+
+    static void vfcmpcc64x2(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vfcmpcc(as, VexPrefix66, false, cc, dst, a, b);
+    }
+
+    static void vfcmpcc64x4(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        vfcmpcc(as, VexPrefix66, true, cc, dst, a, b);
+    }
+
+    // Vector Data Movement
+
+    // Loads and stores take a REG_OFFSET or label address, and the aligned
+    // forms fault unless it's a multiple of the vector size. Lanes are picked
+    // by immediate index. Those in the upper half of a YMM register are
+    // reached by moving that half into XMM0 and back, since every insert and
+    // extract instruction works on 128 bits.
+
+    static inline void vmem(Assembly& as, VexPrefix prefix, bool ymm, u8 opcode, ASMVal reg, ASMVal mem) {
+        assert(reg.kind == ASMVal::FP && mem.kind == ASMVal::MEM);
+        vexop(as, prefix, TwoByteOpcode, false, ymm, opcode, reg, mem);
+    }
+
+    static void vld128(Assembly& as, ASMVal dst, ASMVal src) {
+        vmem(as, VexPrefixF3, false, 0x6f, dst, src); // vmovdqu
+    }
+
+    static void vld256(Assembly& as, ASMVal dst, ASMVal src) {
+        vmem(as, VexPrefixF3, true, 0x6f, dst, src); // vmovdqu
+    }
+
+    static void vlda128(Assembly& as, ASMVal dst, ASMVal src) {
+        vmem(as, VexPrefix66, false, 0x6f, dst, src); // vmovdqa
+    }
+
+    static void vlda256(Assembly& as, ASMVal dst, ASMVal src) {
+        vmem(as, VexPrefix66, true, 0x6f, dst, src); // vmovdqa
+    }
+
+    static void vst128(Assembly& as, ASMVal dst, ASMVal src) {
+        vmem(as, VexPrefixF3, false, 0x7f, src, dst); // vmovdqu
+    }
+
+    static void vst256(Assembly& as, ASMVal dst, ASMVal src) {
+        vmem(as, VexPrefixF3, true, 0x7f, src, dst); // vmovdqu
+    }
+
+    static void vsta128(Assembly& as, ASMVal dst, ASMVal src) {
+        vmem(as, VexPrefix66, false, 0x7f, src, dst); // vmovdqa
+    }
+
+    static void vsta256(Assembly& as, ASMVal dst, ASMVal src) {
+        vmem(as, VexPrefix66, true, 0x7f, src, dst); // vmovdqa
+    }
+
+    static void vmov128(Assembly& as, ASMVal dst, ASMVal src) {
+        if (dst != src)
+            vexop(as, VexPrefix66, TwoByteOpcode, false, false, 0x6f, dst, src); // vmovdqa
+    }
+
+    static void vmov256(Assembly& as, ASMVal dst, ASMVal src) {
+        if (dst != src)
+            vexop(as, VexPrefix66, TwoByteOpcode, false, true, 0x6f, dst, src); // vmovdqa
+    }
+
+    // Broadcasts a GP register by moving it into the bottom of dst first. An
+    // immediate is sign-extended into the constant pool and broadcast from
+    // there.
+    static inline void vbcast(Assembly& as, bool ymm, u32 lane, ASMVal dst, ASMVal src) {
+        u8 opcode = lane == 8 ? 0x78 : lane == 16 ? 0x79 : lane == 32 ? 0x58 : 0x59;
+        assert(dst.kind == ASMVal::FP);
+        if (src.kind == ASMVal::IMM || src.kind == ASMVal::IMM64) {
+            Symbol label = as.symtab.anon();
+            as.def(DATA_SECTION, DEF_LOCAL, label);
+            as.data.writeLE<i64>(src.kind == ASMVal::IMM ? i64(src.imm) : src.imm64);
+            return vexop(as, VexPrefix66, ThreeByteOpcode38, false, ymm, opcode, dst, Data(label)); // vpbroadcast
+        }
+        assert(src.kind == ASMVal::GP);
+        vexop(as, VexPrefix66, TwoByteOpcode, lane == 64, false, 0x6e, dst, src); // vmovd/vmovq
+        vexop(as, VexPrefix66, ThreeByteOpcode38, false, ymm, opcode, dst, dst); // vpbroadcast
+    }
+
+    static inline void vfbcast(Assembly& as, bool ymm, bool wide, ASMVal dst, ASMVal src) {
+        assert(dst.kind == ASMVal::FP);
+        if (src.kind == ASMVal::F32)
+            src = emitF32Constant(as, src);
+        if (src.kind == ASMVal::F64)
+            src = emitF64Constant(as, src);
+        if (wide && !ymm)
+            vexop(as, VexPrefixF2, TwoByteOpcode, false, false, 0x12, dst, src); // vmovddup
+        else
+            vexop(as, VexPrefix66, ThreeByteOpcode38, false, ymm, wide ? 0x19 : 0x18, dst, src); // vbroadcastss/sd
+    }
+
+    static inline void vextracti128(Assembly& as, ASMVal dst, ASMVal src, u8 half) {
+        vexop(as, VexPrefix66, ThreeByteOpcode3A, false, true, 0x39, src, dst);
+        as.code.write<u8>(half);
+    }
+
+    static inline void vinserti128(Assembly& as, ASMVal dst, ASMVal a, ASMVal src, u8 half) {
+        vexop(as, VexPrefix66, ThreeByteOpcode3A, false, true, 0x38, dst, a, src);
+        as.code.write<u8>(half);
+    }
+
+    static inline void vext(Assembly& as, bool ymm, u32 lane, ASMVal dst, ASMVal src, ASMVal index) {
+        assert(dst.kind == ASMVal::GP && src.kind == ASMVal::FP && index.kind == ASMVal::IMM);
+        u32 perhalf = 128 / lane, i = index.imm % (ymm ? perhalf * 2 : perhalf);
+        if (i >= perhalf)
+            vextracti128(as, FP(XMM0), src, 1), src = FP(XMM0);
+        u8 opcode = lane == 8 ? 0x14 : lane == 16 ? 0x15 : 0x16;
+        vexop(as, VexPrefix66, ThreeByteOpcode3A, lane == 64, false, opcode, src, dst); // vpextrb/w/d/q
+        as.code.write<u8>(i % perhalf);
+    }
+
+    static inline void vfext(Assembly& as, bool ymm, bool wide, ASMVal dst, ASMVal src, ASMVal index) {
+        assert(dst.kind == ASMVal::FP && src.kind == ASMVal::FP && index.kind == ASMVal::IMM);
+        u32 perhalf = wide ? 2 : 4, i = index.imm % (ymm ? perhalf * 2 : perhalf);
+        if (i >= perhalf)
+            vextracti128(as, dst, src, 1), src = dst;
+        vexop(as, VexPrefix66, ThreeByteOpcode3A, false, false, wide ? 0x05 : 0x04, dst, src); // vpermilps/pd
+        as.code.write<u8>(i % perhalf);
+    }
+
+    // Inserts into a 128-bit half, then puts the half back if the vector is
+    // any bigger. VEX.128 instructions zero the upper half of their
+    // destination, so even the lower half can't be updated in place.
+    template<typename Insert>
+    static inline void vinsert_lane(Assembly& as, bool ymm, u32 perhalf, ASMVal dst, ASMVal a, ASMVal index, const Insert& insert) {
+        assert(dst.kind == ASMVal::FP && a.kind == ASMVal::FP && index.kind == ASMVal::IMM);
+        u32 i = index.imm % (ymm ? perhalf * 2 : perhalf);
+        if (!ymm)
+            return insert(dst, a, i);
+        u8 half = i / perhalf;
+        ASMVal src = a;
+        if (half)
+            vextracti128(as, FP(XMM0), a, 1), src = FP(XMM0);
+        insert(FP(XMM0), src, i % perhalf);
+        vinserti128(as, dst, a, FP(XMM0), half);
+    }
+
+    static inline void vins(Assembly& as, bool ymm, u32 lane, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        assert(b.kind == ASMVal::GP);
+        vinsert_lane(as, ymm, 128 / lane, dst, a, index, [&](ASMVal dst, ASMVal a, u32 i) {
+            if (lane == 16)
+                vexop(as, VexPrefix66, TwoByteOpcode, false, false, 0xc4, dst, a, b); // vpinsrw
+            else
+                vexop(as, VexPrefix66, ThreeByteOpcode3A, lane == 64, false, lane == 8 ? 0x20 : 0x22, dst, a, b); // vpinsrb/d/q
+            as.code.write<u8>(i);
+        });
+    }
+
+    static inline void vfins(Assembly& as, bool ymm, bool wide, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        assert(b.kind == ASMVal::FP);
+        vinsert_lane(as, ymm, wide ? 2 : 4, dst, a, index, [&](ASMVal dst, ASMVal a, u32 i) {
+            if (!wide) {
+                vexop(as, VexPrefix66, ThreeByteOpcode3A, false, false, 0x21, dst, a, b); // vinsertps
+                as.code.write<u8>(i << 4);
+            }
+            else if (i == 0) {
+                vexop(as, VexPrefix66, ThreeByteOpcode3A, false, false, 0x0d, dst, a, b); // vblendpd
+                as.code.write<u8>(0x01);
+            }
+            else
+                vexop(as, VexPrefix66, TwoByteOpcode, false, false, 0x14, dst, a, b); // vunpcklpd
+        });
+    }
+
+    // Shuffles by immediate take two bits per lane, picking a lane from the
+    // same 128-bit half, or one bit per lane for vshuf64x2. Only vshuf64x4
+    // crosses halves.
+    static inline void vshuf(Assembly& as, VexOpcode opclass, bool wide, bool ymm, u8 opcode, ASMVal dst, ASMVal a, ASMVal b) {
+        assert(dst.kind == ASMVal::FP && a.kind == ASMVal::FP && b.kind == ASMVal::IMM);
+        vexop(as, VexPrefix66, opclass, wide, ymm, opcode, dst, a);
+        as.code.write<u8>(b.imm);
+    }
+
+    static void vbcast8x16(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast(as, false, 8, dst, src);
+    }
+
+    static void vbcast8x32(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast(as, true, 8, dst, src);
+    }
+
+    static void vbcast16x8(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast(as, false, 16, dst, src);
+    }
+
+    static void vbcast16x16(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast(as, true, 16, dst, src);
+    }
+
+    static void vbcast32x4(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast(as, false, 32, dst, src);
+    }
+
+    static void vbcast32x8(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast(as, true, 32, dst, src);
+    }
+
+    static void vbcast64x2(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast(as, false, 64, dst, src);
+    }
+
+    static void vbcast64x4(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast(as, true, 64, dst, src);
+    }
+
+    static void vfbcast32x4(Assembly& as, ASMVal dst, ASMVal src) {
+        vfbcast(as, false, false, dst, src);
+    }
+
+    static void vfbcast32x8(Assembly& as, ASMVal dst, ASMVal src) {
+        vfbcast(as, true, false, dst, src);
+    }
+
+    static void vfbcast64x2(Assembly& as, ASMVal dst, ASMVal src) {
+        vfbcast(as, false, true, dst, src);
+    }
+
+    static void vfbcast64x4(Assembly& as, ASMVal dst, ASMVal src) {
+        vfbcast(as, true, true, dst, src);
+    }
+
+    static void vext8x16(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vext(as, false, 8, dst, src, index);
+    }
+
+    static void vext8x32(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vext(as, true, 8, dst, src, index);
+    }
+
+    static void vext16x8(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vext(as, false, 16, dst, src, index);
+    }
+
+    static void vext16x16(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vext(as, true, 16, dst, src, index);
+    }
+
+    static void vext32x4(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vext(as, false, 32, dst, src, index);
+    }
+
+    static void vext32x8(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vext(as, true, 32, dst, src, index);
+    }
+
+    static void vext64x2(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vext(as, false, 64, dst, src, index);
+    }
+
+    static void vext64x4(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vext(as, true, 64, dst, src, index);
+    }
+
+    static void vfext32x4(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vfext(as, false, false, dst, src, index);
+    }
+
+    static void vfext32x8(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vfext(as, true, false, dst, src, index);
+    }
+
+    static void vfext64x2(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vfext(as, false, true, dst, src, index);
+    }
+
+    static void vfext64x4(Assembly& as, ASMVal dst, ASMVal src, ASMVal index) {
+        vfext(as, true, true, dst, src, index);
+    }
+
+    static void vins8x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vins(as, false, 8, dst, a, b, index);
+    }
+
+    static void vins8x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vins(as, true, 8, dst, a, b, index);
+    }
+
+    static void vins16x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vins(as, false, 16, dst, a, b, index);
+    }
+
+    static void vins16x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vins(as, true, 16, dst, a, b, index);
+    }
+
+    static void vins32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vins(as, false, 32, dst, a, b, index);
+    }
+
+    static void vins32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vins(as, true, 32, dst, a, b, index);
+    }
+
+    static void vins64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vins(as, false, 64, dst, a, b, index);
+    }
+
+    static void vins64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vins(as, true, 64, dst, a, b, index);
+    }
+
+    static void vfins32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vfins(as, false, false, dst, a, b, index);
+    }
+
+    static void vfins32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vfins(as, true, false, dst, a, b, index);
+    }
+
+    static void vfins64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vfins(as, false, true, dst, a, b, index);
+    }
+
+    static void vfins64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal index) {
+        vfins(as, true, true, dst, a, b, index);
+    }
+
+    static void vperm8x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, false, 0x00, dst, a, b); // vpshufb
+    }
+
+    static void vperm8x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, true, 0x00, dst, a, b); // vpshufb, within each half
+    }
+
+    static void vperm32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary(as, VexPrefix66, ThreeByteOpcode38, true, 0x36, dst, b, a); // vpermd, which takes the indices first
+    }
+
+    static void vshuf32x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshuf(as, TwoByteOpcode, false, false, 0x70, dst, a, b); // vpshufd
+    }
+
+    static void vshuf32x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshuf(as, TwoByteOpcode, false, true, 0x70, dst, a, b); // vpshufd
+    }
+
+    static void vshuf64x2(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        assert(b.kind == ASMVal::IMM);
+        u8 lo = b.imm & 1 ? 0x0e : 0x04, hi = b.imm & 2 ? 0xe0 : 0x40;
+        vshuf(as, TwoByteOpcode, false, false, 0x70, dst, a, Imm(lo | hi)); // vpshufd, each lane as a pair of dwords
+    }
+
+    static void vshuf64x4(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vshuf(as, ThreeByteOpcode3A, true, true, 0x00, dst, a, b); // vpermq
+    }
+
+    // AVX-512
+
+    // The 512-bit opcodes are encoded with EVEX, which reaches XMM16-XMM31
+    // and can mask each lane with K1-K7. A masked lane is either left alone
+    // or zeroed. Memory operands are always whole vectors, and EVEX scales
+    // 8-bit displacements by the vector size, so any other displacement
+    // takes 32 bits. All of this needs ISA_V4, including kmovq, which is
+    // VEX-encoded.
+
+    static inline u8 evex_index(ASMVal val) {
+        switch (val.kind) {
+            case ASMVal::FP: return val.fp - XMM0;
+            case ASMVal::GP: return val.gp;
+            case ASMVal::MASK: return val.mask - K0;
+            default: return 0;
+        }
+    }
+
+    static inline void evexop(Assembly& as, VexPrefix prefix, VexOpcode opclass, bool wide, u8 opcode, ASMVal reg, ASMVal src, ASMVal rm, mreg mask = K0, bool zero = false) {
+        assert(as.isa >= ISA_V4);
+        as.dirtyUpper = true;
+        u8 r = evex_index(reg), v = evex_index(src), b = evex_index(rm);
+        if (rm.kind == ASMVal::MEM)
+            b = rm.memkind == ASMVal::REG_OFFSET ? rm.base : 0;
+
+        as.code.write<u8>(0x62);
+        u8 p0 = opclass, p1 = prefix | 0b00000100, p2 = 0b01000000 | (mask - K0); // Vector length is always 512.
+        if (!(r & 8)) p0 |= 0b10000000; // ~R bit
+        if (!(b & 16)) p0 |= 0b01000000; // ~X bit, which extends a register rm to 32.
+        if (!(b & 8)) p0 |= 0b00100000; // ~B bit
+        if (!(r & 16)) p0 |= 0b00010000; // ~R' bit
+        p1 |= (~v & 0b1111) << 3;
+        if (wide) p1 |= 0b10000000; // Wide
+        if (!(v & 16)) p2 |= 0b00001000; // ~V' bit
+        if (zero) p2 |= 0b10000000; // Zero masked lanes instead of merging.
+        as.code.write<u8>(p0);
+        as.code.write<u8>(p1);
+        as.code.write<u8>(p2);
+        as.code.write<u8>(opcode);
+
+        if (rm.kind != ASMVal::MEM)
+            return modrm(as, GP(r), GP(b));
+        if (rm.memkind != ASMVal::REG_OFFSET || (rm.offset % 64 == 0 && rm.offset / 64 < 128 && rm.offset / 64 > -129)) {
+            if (rm.memkind == ASMVal::REG_OFFSET)
+                rm.offset /= 64;
+            return modrm(as, GP(r), rm);
+        }
+        as.code.write<u8>(0b10000000 | (r & 0b111) << 3 | (rm.base & 0b111));
+        if ((rm.base & 0b111) == RSP) as.code.write<u8>(RSP << 3 | RSP);
+        as.code.writeLE<i32>(rm.offset);
+    }
+
+    static inline void vbinary512(Assembly& as, VexPrefix prefix, VexOpcode opclass, bool wide, u8 opcode, ASMVal dst, ASMVal a, ASMVal b) {
+        assert(dst.kind == ASMVal::FP && a.kind == ASMVal::FP && b.kind == ASMVal::FP);
+        evexop(as, prefix, opclass, wide, opcode, dst, a, b);
+    }
+
+    static void vld512(Assembly& as, ASMVal dst, ASMVal src) {
+        assert(dst.kind == ASMVal::FP && src.kind == ASMVal::MEM);
+        evexop(as, VexPrefixF3, TwoByteOpcode, true, 0x6f, dst, Imm(0), src); // vmovdqu64
+    }
+
+    static void vst512(Assembly& as, ASMVal dst, ASMVal src) {
+        assert(dst.kind == ASMVal::MEM && src.kind == ASMVal::FP);
+        evexop(as, VexPrefixF3, TwoByteOpcode, true, 0x7f, src, Imm(0), dst); // vmovdqu64
+    }
+
+    static void vmov512(Assembly& as, ASMVal dst, ASMVal src) {
+        assert(dst.kind == ASMVal::FP && src.kind == ASMVal::FP);
+        if (dst != src)
+            evexop(as, VexPrefix66, TwoByteOpcode, true, 0x6f, dst, Imm(0), src); // vmovdqa64
+    }
+
+    // Unlike AVX2, AVX-512 can broadcast straight from a GP register.
+    static inline void vbcast512(Assembly& as, u32 lane, ASMVal dst, ASMVal src) {
+        assert(dst.kind == ASMVal::FP);
+        if (src.kind == ASMVal::IMM || src.kind == ASMVal::IMM64) {
+            Symbol label = as.symtab.anon();
+            as.def(DATA_SECTION, DEF_LOCAL, label);
+            as.data.writeLE<i64>(src.kind == ASMVal::IMM ? i64(src.imm) : src.imm64);
+            u8 opcode = lane == 8 ? 0x78 : lane == 16 ? 0x79 : lane == 32 ? 0x58 : 0x59;
+            return evexop(as, VexPrefix66, ThreeByteOpcode38, lane == 64, opcode, dst, Imm(0), Data(label)); // vpbroadcast
+        }
+        assert(src.kind == ASMVal::GP);
+        u8 opcode = lane == 8 ? 0x7a : lane == 16 ? 0x7b : 0x7c;
+        evexop(as, VexPrefix66, ThreeByteOpcode38, lane == 64, opcode, dst, Imm(0), src); // vpbroadcast
+    }
+
+    static inline void vfbcast512(Assembly& as, bool wide, ASMVal dst, ASMVal src) {
+        assert(dst.kind == ASMVal::FP);
+        if (src.kind == ASMVal::F32)
+            src = emitF32Constant(as, src);
+        if (src.kind == ASMVal::F64)
+            src = emitF64Constant(as, src);
+        evexop(as, VexPrefix66, ThreeByteOpcode38, wide, wide ? 0x19 : 0x18, dst, Imm(0), src); // vbroadcastss/sd
+    }
+
+    static void i64tok(Assembly& as, ASMVal dst, ASMVal src) {
+        assert(dst.kind == ASMVal::MASK && src.kind == ASMVal::GP);
+        assert(as.isa >= ISA_V4);
+        vexop(as, VexPrefixF2, TwoByteOpcode, true, false, 0x92, GP(dst.mask - K0), src); // kmovq
+    }
+
+    static void ktoi64(Assembly& as, ASMVal dst, ASMVal src) {
+        assert(dst.kind == ASMVal::GP && src.kind == ASMVal::MASK);
+        assert(as.isa >= ISA_V4);
+        vexop(as, VexPrefixF2, TwoByteOpcode, true, false, 0x93, dst, GP(src.mask - K0)); // kmovq
+    }
+
+    // vpcmp takes the condition as a predicate, and has an unsigned form.
+    static void kcmpcc(Assembly& as, u32 lane, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        assert(dst.kind == ASMVal::MASK && a.kind == ASMVal::FP && b.kind == ASMVal::FP);
+        bool wide = lane == 16 || lane == 64;
+        if (cc == COND_TEST_ZERO || cc == COND_TEST_NONZERO) {
+            VexPrefix prefix = cc == COND_TEST_ZERO ? VexPrefixF3 : VexPrefix66;
+            return evexop(as, prefix, ThreeByteOpcode38, wide, lane <= 16 ? 0x26 : 0x27, dst, a, b); // vptestnm/vptestm
+        }
+        u8 predicate;
+        switch (cc) {
+            case COND_EQ: predicate = 0; break;
+            case COND_NE: predicate = 4; break;
+            case COND_LT: case COND_BELOW: predicate = 1; break;
+            case COND_LE: case COND_BE: predicate = 2; break;
+            case COND_GT: case COND_ABOVE: predicate = 6; break;
+            case COND_GE: case COND_AE: predicate = 5; break;
+            default: unreachable("Unexpected condition.");
+        }
+        bool isunsigned = cc == COND_ABOVE || cc == COND_AE || cc == COND_BELOW || cc == COND_BE;
+        u8 opcode = (lane <= 16 ? 0x3e : 0x1e) + !isunsigned;
+        evexop(as, VexPrefix66, ThreeByteOpcode3A, wide, opcode, dst, a, b); // vpcmp/vpcmpu
+        as.code.write<u8>(predicate);
+    }
+
+    static void kfcmpcc(Assembly& as, bool wide, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        assert(dst.kind == ASMVal::MASK && a.kind == ASMVal::FP && b.kind == ASMVal::FP);
+        evexop(as, wide ? VexPrefix66 : NoPrefix, TwoByteOpcode, wide, 0xc2, dst, a, b); // vcmpps/pd
+        as.code.write<u8>(float_predicate(cc));
+    }
+
+    // vmovdqu8/16/32/64, which differ only in which mask bit covers each byte.
+    static inline void vmasked_move(Assembly& as, u32 lane, u8 opcode, ASMVal reg, ASMVal mem, ASMVal mask, bool zero) {
+        assert(reg.kind == ASMVal::FP && mem.kind == ASMVal::MEM && mask.kind == ASMVal::MASK && mask.mask != K0);
+        evexop(as, lane <= 16 ? VexPrefixF2 : VexPrefixF3, TwoByteOpcode, lane == 16 || lane == 64, opcode, reg, Imm(0), mem, mask.mask, zero);
+    }
+
+    static inline void vblendm(Assembly& as, u32 lane, ASMVal dst, ASMVal a, ASMVal b, ASMVal mask) {
+        assert(dst.kind == ASMVal::FP && a.kind == ASMVal::FP && b.kind == ASMVal::FP);
+        assert(mask.kind == ASMVal::MASK && mask.mask != K0);
+        evexop(as, VexPrefix66, ThreeByteOpcode38, lane == 16 || lane == 64, lane <= 16 ? 0x66 : 0x64, dst, a, b, mask.mask); // vpblendm
+    }
+
+    static void vadd8x64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, false, 0xfc, dst, a, b); // vpaddb
+    }
+
+    static void vadd16x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, false, 0xfd, dst, a, b); // vpaddw
+    }
+
+    static void vadd32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, false, 0xfe, dst, a, b); // vpaddd
+    }
+
+    static void vadd64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0xd4, dst, a, b); // vpaddq
+    }
+
+    static void vsub8x64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, false, 0xf8, dst, a, b); // vpsubb
+    }
+
+    static void vsub16x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, false, 0xf9, dst, a, b); // vpsubw
+    }
+
+    static void vsub32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, false, 0xfa, dst, a, b); // vpsubd
+    }
+
+    static void vsub64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0xfb, dst, a, b); // vpsubq
+    }
+
+    static void vmul16x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, false, 0xd5, dst, a, b); // vpmullw
+    }
+
+    static void vmul32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, ThreeByteOpcode38, false, 0x40, dst, a, b); // vpmulld
+    }
+
+    static void vmul64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, ThreeByteOpcode38, true, 0x40, dst, a, b); // vpmullq
+    }
+
+    static void vmin8x64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, ThreeByteOpcode38, false, 0x38, dst, a, b); // vpminsb
+    }
+
+    static void vmin16x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, false, 0xea, dst, a, b); // vpminsw
+    }
+
+    static void vmin32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, ThreeByteOpcode38, false, 0x39, dst, a, b); // vpminsd
+    }
+
+    static void vmin64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, ThreeByteOpcode38, true, 0x39, dst, a, b); // vpminsq
+    }
+
+    static void vmax8x64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, ThreeByteOpcode38, false, 0x3c, dst, a, b); // vpmaxsb
+    }
+
+    static void vmax16x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, false, 0xee, dst, a, b); // vpmaxsw
+    }
+
+    static void vmax32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, ThreeByteOpcode38, false, 0x3d, dst, a, b); // vpmaxsd
+    }
+
+    static void vmax64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, ThreeByteOpcode38, true, 0x3d, dst, a, b); // vpmaxsq
+    }
+
+    static void vand64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0xdb, dst, a, b); // vpandq
+    }
+
+    static void vor64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0xeb, dst, a, b); // vporq
+    }
+
+    static void vxor64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0xef, dst, a, b); // vpxorq
+    }
+
+    static void vfadd32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, NoPrefix, TwoByteOpcode, false, 0x58, dst, a, b); // vaddps
+    }
+
+    static void vfadd64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0x58, dst, a, b); // vaddpd
+    }
+
+    static void vfsub32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, NoPrefix, TwoByteOpcode, false, 0x5c, dst, a, b); // vsubps
+    }
+
+    static void vfsub64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0x5c, dst, a, b); // vsubpd
+    }
+
+    static void vfmul32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, NoPrefix, TwoByteOpcode, false, 0x59, dst, a, b); // vmulps
+    }
+
+    static void vfmul64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0x59, dst, a, b); // vmulpd
+    }
+
+    static void vfdiv32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, NoPrefix, TwoByteOpcode, false, 0x5e, dst, a, b); // vdivps
+    }
+
+    static void vfdiv64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0x5e, dst, a, b); // vdivpd
+    }
+
+    static void vfmin32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, NoPrefix, TwoByteOpcode, false, 0x5d, dst, a, b); // vminps
+    }
+
+    static void vfmin64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0x5d, dst, a, b); // vminpd
+    }
+
+    static void vfmax32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, NoPrefix, TwoByteOpcode, false, 0x5f, dst, a, b); // vmaxps
+    }
+
+    static void vfmax64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b) {
+        vbinary512(as, VexPrefix66, TwoByteOpcode, true, 0x5f, dst, a, b); // vmaxpd
+    }
+
+    static void vbcast8x64(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast512(as, 8, dst, src);
+    }
+
+    static void vbcast16x32(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast512(as, 16, dst, src);
+    }
+
+    static void vbcast32x16(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast512(as, 32, dst, src);
+    }
+
+    static void vbcast64x8(Assembly& as, ASMVal dst, ASMVal src) {
+        vbcast512(as, 64, dst, src);
+    }
+
+    static void vfbcast32x16(Assembly& as, ASMVal dst, ASMVal src) {
+        vfbcast512(as, false, dst, src);
+    }
+
+    static void vfbcast64x8(Assembly& as, ASMVal dst, ASMVal src) {
+        vfbcast512(as, true, dst, src);
+    }
+
+    static void kcmpcc8x64(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        kcmpcc(as, 8, cc, dst, a, b);
+    }
+
+    static void kcmpcc16x32(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        kcmpcc(as, 16, cc, dst, a, b);
+    }
+
+    static void kcmpcc32x16(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        kcmpcc(as, 32, cc, dst, a, b);
+    }
+
+    static void kcmpcc64x8(Assembly& as, Condition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        kcmpcc(as, 64, cc, dst, a, b);
+    }
+
+    static void kfcmpcc32x16(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        kfcmpcc(as, false, cc, dst, a, b);
+    }
+
+    static void kfcmpcc64x8(Assembly& as, FloatCondition cc, ASMVal dst, ASMVal a, ASMVal b) {
+        kfcmpcc(as, true, cc, dst, a, b);
+    }
+
+    static void vmld8x64(Assembly& as, ASMVal dst, ASMVal src, ASMVal mask) {
+        vmasked_move(as, 8, 0x6f, dst, src, mask, true);
+    }
+
+    static void vmld16x32(Assembly& as, ASMVal dst, ASMVal src, ASMVal mask) {
+        vmasked_move(as, 16, 0x6f, dst, src, mask, true);
+    }
+
+    static void vmld32x16(Assembly& as, ASMVal dst, ASMVal src, ASMVal mask) {
+        vmasked_move(as, 32, 0x6f, dst, src, mask, true);
+    }
+
+    static void vmld64x8(Assembly& as, ASMVal dst, ASMVal src, ASMVal mask) {
+        vmasked_move(as, 64, 0x6f, dst, src, mask, true);
+    }
+
+    static void vmst8x64(Assembly& as, ASMVal dst, ASMVal src, ASMVal mask) {
+        vmasked_move(as, 8, 0x7f, src, dst, mask, false);
+    }
+
+    static void vmst16x32(Assembly& as, ASMVal dst, ASMVal src, ASMVal mask) {
+        vmasked_move(as, 16, 0x7f, src, dst, mask, false);
+    }
+
+    static void vmst32x16(Assembly& as, ASMVal dst, ASMVal src, ASMVal mask) {
+        vmasked_move(as, 32, 0x7f, src, dst, mask, false);
+    }
+
+    static void vmst64x8(Assembly& as, ASMVal dst, ASMVal src, ASMVal mask) {
+        vmasked_move(as, 64, 0x7f, src, dst, mask, false);
+    }
+
+    static void vblendm8x64(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal mask) {
+        vblendm(as, 8, dst, a, b, mask);
+    }
+
+    static void vblendm16x32(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal mask) {
+        vblendm(as, 16, dst, a, b, mask);
+    }
+
+    static void vblendm32x16(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal mask) {
+        vblendm(as, 32, dst, a, b, mask);
+    }
+
+    static void vblendm64x8(Assembly& as, ASMVal dst, ASMVal a, ASMVal b, ASMVal mask) {
+        vblendm(as, 64, dst, a, b, mask);
+    }
+    // Atomics
+
+    // Every read-modify-write here is a single locked instruction, which
+    // also orders it against all other loads and stores, as a full fence.
+    // xchg, xadd and cmpxchg want their source in a register. For xchg and
+    // xadd, that's where the old value comes back too, so we copy the
+    // source into dst unless dst is part of the address. Registers we need
+    // beyond dst and the fixed ones are borrowed, and saved on the stack
+    // around the operation.
+    static inline mreg borrow(Assembly& as, RegSet& avoid, ASMVal* mems, u32 n) {
+        mreg scratch = RAX;
+        while (avoid[scratch] || scratch == RSP || scratch == RBP)
+            scratch = mreg(scratch + 1);
+        avoid.add(scratch);
+        push64(as, GP(scratch));
+        for (u32 i = 0; i < n; i ++) if (mems[i].memkind == ASMVal::REG_OFFSET && mems[i].base == RSP)
+            mems[i].offset += 8; // The push moved the stack pointer.
+        return scratch;
+    }
+
+    static inline void atomic_exchange(Assembly& as, AMD64Size size, Opcode op, bool lock, ASMVal dst, ASMVal mem, ASMVal src) {
+        assert(dst.kind == ASMVal::GP && mem.kind == ASMVal::MEM);
+        ASMVal reg = src;
+        mreg scratch = -1;
+        if (src != dst) {
+            if (mem.memkind == ASMVal::REG_OFFSET && mem.base == dst.gp) {
+                RegSet avoid(dst.gp);
+                if (src.kind == ASMVal::GP)
+                    avoid.add(src.gp);
+                scratch = borrow(as, avoid, &mem, 1);
+                reg = GP(scratch);
+            }
+            else reg = dst;
+            move(as, size, reg, src);
+        }
+        if (lock)
+            as.code.write<u8>(0xf0);
+        binaryop(as, size, op, mem, reg);
+        move(as, size, dst, reg);
+        if (scratch >= 0)
+            pop64(as, GP(scratch));
+    }
+
+    static void axchg8(Assembly& as, ASMVal dst, ASMVal mem, ASMVal src) {
+        atomic_exchange(as, BYTE, Opcode::from(0x86), false, dst, mem, src); // xchg is locked anyway
+    }
+
+    static void axchg16(Assembly& as, ASMVal dst, ASMVal mem, ASMVal src) {
+        atomic_exchange(as, WORD, Opcode::from(0x86), false, dst, mem, src); // xchg is locked anyway
+    }
+
+    static void axchg32(Assembly& as, ASMVal dst, ASMVal mem, ASMVal src) {
+        atomic_exchange(as, DWORD, Opcode::from(0x86), false, dst, mem, src); // xchg is locked anyway
+    }
+
+    static void axchg64(Assembly& as, ASMVal dst, ASMVal mem, ASMVal src) {
+        atomic_exchange(as, QWORD, Opcode::from(0x86), false, dst, mem, src); // xchg is locked anyway
+    }
+
+    static void axadd8(Assembly& as, ASMVal dst, ASMVal mem, ASMVal src) {
+        atomic_exchange(as, BYTE, Opcode::from(0x0f, 0xc0), true, dst, mem, src);
+    }
+
+    static void axadd16(Assembly& as, ASMVal dst, ASMVal mem, ASMVal src) {
+        atomic_exchange(as, WORD, Opcode::from(0x0f, 0xc0), true, dst, mem, src);
+    }
+
+    static void axadd32(Assembly& as, ASMVal dst, ASMVal mem, ASMVal src) {
+        atomic_exchange(as, DWORD, Opcode::from(0x0f, 0xc0), true, dst, mem, src);
+    }
+
+    static void axadd64(Assembly& as, ASMVal dst, ASMVal mem, ASMVal src) {
+        atomic_exchange(as, QWORD, Opcode::from(0x0f, 0xc0), true, dst, mem, src);
+    }
+
+    // cmpxchg compares with RAX, and leaves the old value there either way,
+    // so dst gets the old value and the swap happened if it's the expected
+    // one. desired and the address base may be in RAX too, so they move out
+    // of it in the same gather that moves expected in, into dst if it's free
+    // and a borrowed register otherwise.
+    static inline void atomic_compare_exchange(Assembly& as, AMD64Size size, ASMVal dst, ASMVal mem, ASMVal expected, ASMVal desired) {
+        assert(dst.kind == ASMVal::GP && mem.kind == ASMVal::MEM);
+        bool baseInRAX = mem.memkind == ASMVal::REG_OFFSET && mem.base == RAX;
+        bool dstFree = dst.gp != RAX && !(mem.memkind == ASMVal::REG_OFFSET && mem.base == dst.gp);
+        RegSet avoid(RAX, dst.gp);
+        if (mem.memkind == ASMVal::REG_OFFSET)
+            avoid.add(mem.base);
+        if (expected.kind == ASMVal::GP)
+            avoid.add(expected.gp);
+        if (desired.kind == ASMVal::GP)
+            avoid.add(desired.gp);
+
+        ASMVal srcs[3] = { expected };
+        mreg dsts[3] = { RAX }, borrowed[2];
+        u32 n = 1, nborrowed = 0;
+        ASMVal reg = desired;
+        if (desired.kind != ASMVal::GP || desired == GP(RAX)) {
+            mreg r = dstFree ? dst.gp : (borrowed[nborrowed ++] = borrow(as, avoid, &mem, 1));
+            dstFree = dstFree && r != dst.gp;
+            srcs[n] = desired, dsts[n ++] = r, reg = GP(r);
+        }
+        if (baseInRAX) {
+            mreg r = dstFree ? dst.gp : (borrowed[nborrowed ++] = borrow(as, avoid, &mem, 1));
+            srcs[n] = GP(RAX), dsts[n ++] = r, mem.base = r;
+        }
+        gather(as, srcs, dsts, n);
+
+        as.code.write<u8>(0xf0); // lock
+        binaryop(as, size, Opcode::from(0x0f, 0xb0), mem, reg);
+        move(as, size, dst, GP(RAX));
+        while (nborrowed)
+            pop64(as, GP(borrowed[-- nborrowed]));
+    }
+
+    static void acas8(Assembly& as, ASMVal dst, ASMVal mem, ASMVal expected, ASMVal desired) {
+        atomic_compare_exchange(as, BYTE, dst, mem, expected, desired);
+    }
+
+    static void acas16(Assembly& as, ASMVal dst, ASMVal mem, ASMVal expected, ASMVal desired) {
+        atomic_compare_exchange(as, WORD, dst, mem, expected, desired);
+    }
+
+    static void acas32(Assembly& as, ASMVal dst, ASMVal mem, ASMVal expected, ASMVal desired) {
+        atomic_compare_exchange(as, DWORD, dst, mem, expected, desired);
+    }
+
+    static void acas64(Assembly& as, ASMVal dst, ASMVal mem, ASMVal expected, ASMVal desired) {
+        atomic_compare_exchange(as, QWORD, dst, mem, expected, desired);
+    }
+
+    // cmpxchg16b works on RDX:RAX and RCX:RBX, so it needs ISA_V2 and all four
+    // of those. Like C's compare-exchange, dst gets whether the swap
+    // happened, and expected gets the old value. If the swap happened, that
+    // is the value it already held. mem must be 16-byte aligned.
+    //
+    // mem and expected are still needed once all four registers are loaded,
+    // so a base among them moves to a borrowed register first. desired is
+    // loaded before expected, with its own base register last if it's RBX or
+    // RCX.
+    static void acas128(Assembly& as, ASMVal dst, ASMVal mem, ASMVal expected, ASMVal desired) {
+        assert(as.isa >= ISA_V2);
+        assert(expected.memkind == ASMVal::REG_OFFSET && desired.memkind == ASMVal::REG_OFFSET);
+        const RegSet fixed(RAX, RBX, RCX, RDX);
+        RegSet avoid(RAX, RBX, RCX, RDX);
+        avoid.add(dst.gp, expected.base, desired.base);
+        if (mem.memkind == ASMVal::REG_OFFSET)
+            avoid.add(mem.base);
+        ASMVal mems[3] = { mem, expected, desired };
+        mreg borrowed[2];
+        u32 nborrowed = 0;
+        for (u32 i = 0; i < 2; i ++) if (mems[i].memkind == ASMVal::REG_OFFSET && fixed[mems[i].base]) {
+            mreg from = mems[i].base, r = borrow(as, avoid, mems, 3);
+            borrowed[nborrowed ++] = r;
+            mov64(as, GP(r), GP(from));
+            for (u32 j = i; j < 2; j ++) if (mems[j].memkind == ASMVal::REG_OFFSET && mems[j].base == from)
+                mems[j].base = r;
+        }
+
+        ASMVal expectedLow = mems[1], expectedHigh = Mem(mems[1].base, mems[1].offset + 8);
+        ASMVal desiredLow = mems[2], desiredHigh = Mem(mems[2].base, mems[2].offset + 8);
+        if (desiredLow.base == RBX)
+            mov64(as, GP(RCX), desiredHigh), mov64(as, GP(RBX), desiredLow);
+        else
+            mov64(as, GP(RBX), desiredLow), mov64(as, GP(RCX), desiredHigh);
+        mov64(as, GP(RAX), expectedLow);
+        mov64(as, GP(RDX), expectedHigh);
+        as.code.write<u8>(0xf0); // lock
+        unaryop(as, QWORD, Opcode::litExt(0x0f, 0xc7, 0x01), mems[0]);
+        mov64(as, expectedLow, GP(RAX));
+        mov64(as, expectedHigh, GP(RDX));
+        unaryop(as, BYTE, Opcode::withExt(0x0f, 0x94, 0x00), dst); // sete
+        zxt8(as, dst, dst);
+        while (nborrowed)
+            pop64(as, GP(borrowed[-- nborrowed]));
+    }
+
+    static inline void atomic_bitwise(Assembly& as, AMD64Size size, u8 opcode, i8 ext, ASMVal mem, ASMVal src) {
+        as.code.write<u8>(0xf0); // lock
+        binaryop(as, size, src.kind == ASMVal::IMM ? Opcode::withExt(0x80, ext) : Opcode::from(opcode), mem, src);
+    }
+
+    static void aand8(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, BYTE, 0x20, 0x04, dst, src);
+    }
+
+    static void aand16(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, WORD, 0x20, 0x04, dst, src);
+    }
+
+    static void aand32(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, DWORD, 0x20, 0x04, dst, src);
+    }
+
+    static void aand64(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, QWORD, 0x20, 0x04, dst, src);
+    }
+
+    static void aor8(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, BYTE, 0x08, 0x01, dst, src);
+    }
+
+    static void aor16(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, WORD, 0x08, 0x01, dst, src);
+    }
+
+    static void aor32(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, DWORD, 0x08, 0x01, dst, src);
+    }
+
+    static void aor64(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, QWORD, 0x08, 0x01, dst, src);
+    }
+
+    static void axor8(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, BYTE, 0x30, 0x06, dst, src);
+    }
+
+    static void axor16(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, WORD, 0x30, 0x06, dst, src);
+    }
+
+    static void axor32(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, DWORD, 0x30, 0x06, dst, src);
+    }
+
+    static void axor64(Assembly& as, ASMVal dst, ASMVal src) {
+        atomic_bitwise(as, QWORD, 0x30, 0x06, dst, src);
+    }
+
+    static void mfence(Assembly& as) {
+        as.code.write<u8>(0x0f);
+        as.code.write<u8>(0xae);
+        as.code.write<u8>(0xf0);
+    }
+
+    static void lfence(Assembly& as) {
+        as.code.write<u8>(0x0f);
+        as.code.write<u8>(0xae);
+        as.code.write<u8>(0xe8);
+    }
+
+    static void sfence(Assembly& as) {
+        as.code.write<u8>(0x0f);
+        as.code.write<u8>(0xae);
+        as.code.write<u8>(0xf8);
+    }
+
+    static void pause(Assembly& as) {
+        as.code.write<u8>(0xf3);
+        as.code.write<u8>(0x90);
+    }
+};
+
+struct AMD64LinuxAssembler : public AMD64Assembler {
+    static constexpr mreg GP_ARGS[6] = { RDI, RSI, RDX, RCX, R8, R9 };
+    static constexpr mreg FP_ARGS[8] = { XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7 };
+    static const TargetDesc DESC;
+    
+    static inline constexpr RegSet caller_saved_gps() {
+        return RegSet(RAX, RCX, RDX, RDI, RSI, R8, R9, R10, R11);
+    }
+
+    static inline constexpr RegSet caller_saved_fps() {
+        return fps();
+    }
+
+    static inline constexpr RegSet caller_saves() {
+        return caller_saved_gps() | caller_saved_fps();
+    }
+
+    static inline constexpr RegSet callee_saved_gps() {
+        return RegSet(RBX, RBP, RSP, R12, R13, R14, R15);
+    }
+
+    static inline constexpr RegSet callee_saved_fps() {
+        return RegSet();
+    }
+
+    static inline constexpr RegSet callee_saves() {
+        return callee_saved_gps() | callee_saved_fps();
+    }
+
+    static void* start_placing_parameters();
+    static MaybePair<ASMVal> place_scalar_parameter(void* state, Repr scalar);
+    static MaybePair<ASMVal> place_aggregate_parameter(void* state, const_slice<Repr> members);
+    static void finish_placing_parameters(void* state);
+
+    static MaybePair<ASMVal> place_scalar_return_value(void* state, Repr scalar);
+    static MaybePair<ASMVal> place_aggregate_return_value(void* state, const_slice<Repr> members);
+};
+
+// The Linux target at a particular ISA level. Assemblies used with one of
+// these must be created at DESC.level, since that's what picks the
+// encodings, and the clobbers here only cover what that level emits.
+// TargetImplementation asserts as much.
+template<ISALevel Level>
+struct AMD64LinuxLevelAssembler : public AMD64LinuxAssembler {
+    static const TargetDesc DESC;
+
+    static inline constexpr RegSet clobbers(ASMOpcode opcode) {
+        return AMD64Assembler::clobbers(opcode, Level);
+    }
+};
+
+template<ISALevel Level>
+const TargetDesc AMD64LinuxLevelAssembler<Level>::DESC = TargetDesc(OS_LINUX, ARCH_AMD64, Level);
+
+using AMD64LinuxV1Assembler = AMD64LinuxLevelAssembler<ISA_BASELINE>;
+using AMD64LinuxV2Assembler = AMD64LinuxLevelAssembler<ISA_V2>;
+using AMD64LinuxV4Assembler = AMD64LinuxLevelAssembler<ISA_V4>;
 
 struct AMD64DarwinAssembler : public AMD64LinuxAssembler {};
 
@@ -0,0 +1,214 @@
+#include "asm/archive.h"
+#include "util/io.h"
+#include "util/hash.h"
+
+struct ArchiveEntry {
+    const_slice<i8> name;
+    u32 member;
+};
+
+void ArchiveBuilder::write(fd file) {
+    // Collect the exported names of every member, keeping only the first
+    // definition of each.
+
+    vec<ArchiveEntry, 64> entries;
+    ::map<const_slice<i8>, u32> seen;
+    u32 poolSize = 0;
+    for (u32 i = 0; i < members.size(); i ++) {
+        const Assembly& as = *members[i];
+        for (const Def& def : as.defs) if (def.type == DEF_GLOBAL) {
+            const_slice<i8> name = as.symtab[def.sym];
+            if (seen.contains(name))
+                continue;
+            seen.put(name, i);
+            entries.push({ name, i });
+            poolSize += name.size();
+        }
+    }
+
+    u32 nbuckets = 1;
+    while (nbuckets < entries.size() * 2)
+        nbuckets *= 2;
+
+    u32 memberTableOffset = ARCHIVE_HEADER_SIZE;
+    u32 bucketsOffset = memberTableOffset + members.size() * 8;
+    u32 entriesOffset = bucketsOffset + nbuckets * 4;
+    u32 poolOffset = entriesOffset + entries.size() * 12;
+    u32 membersOffset = poolOffset + poolSize;
+
+    vec<u32, 16> memberSizes;
+    u32 totalSize = membersOffset;
+    for (Assembly* as : members) {
+        memberSizes.push(as->serializedSize());
+        totalSize += memberSizes.last();
+    }
+
+    bytebuf header;
+    header.write("\0aar", 4);
+    header.writeLE<u32>(totalSize);
+    header.writeLE<u32>(members.size());
+    header.writeLE<u32>(nbuckets);
+    header.writeLE<u32>(entries.size());
+    header.writeLE<u32>(poolSize);
+    assert(header.size() == memberTableOffset);
+
+    u32 offset = membersOffset;
+    for (u32 size : memberSizes) {
+        header.writeLE<u32>(offset);
+        header.writeLE<u32>(size);
+        offset += size;
+    }
+    assert(header.size() == bucketsOffset);
+
+    vec<u32, 64> buckets;
+    for (u32 i = 0; i < nbuckets; i ++)
+        buckets.push(0);
+    for (u32 i = 0; i < entries.size(); i ++) {
+        u32 bucket = archiveHash(entries[i].name) & (nbuckets - 1);
+        while (buckets[bucket])
+            bucket = (bucket + 1) & (nbuckets - 1);
+        buckets[bucket] = i + 1;
+    }
+    for (u32 bucket : buckets)
+        header.writeLE<u32>(bucket);
+    assert(header.size() == entriesOffset);
+
+    u32 nameOffset = 0;
+    for (const ArchiveEntry& entry : entries) {
+        header.writeLE<u32>(nameOffset);
+        header.writeLE<u32>(entry.name.size());
+        header.writeLE<u32>(entry.member);
+        nameOffset += entry.name.size();
+    }
+    assert(header.size() == poolOffset);
+
+    for (const ArchiveEntry& entry : entries)
+        header.write(entry.name.data(), entry.name.size());
+    assert(header.size() == membersOffset);
+
+    ::write(file, header);
+    for (Assembly* as : members)
+        as->serialize(file);
+}
+
+inline u32 readArchiveU32(const i8* ptr) {
+    const u8* bytes = (const u8*)ptr;
+    return u32(bytes[0]) | u32(bytes[1]) << 8 | u32(bytes[2]) << 16 | u32(bytes[3]) << 24;
+}
+
+void Archive::validate() const {
+    if (bytes.size() < ARCHIVE_HEADER_SIZE || memory::compare(bytes.data(), "\0aar", 4))
+        panic("Failed to deserialize archive!");
+    if (readArchiveU32(bytes.data() + 4) != bytes.size())
+        panic("Failed to deserialize archive: size mismatch!");
+
+    u32 nmembers = readArchiveU32(bytes.data() + 8);
+    u32 nbuckets = readArchiveU32(bytes.data() + 12);
+    u32 nentries = readArchiveU32(bytes.data() + 16);
+    u32 poolSize = readArchiveU32(bytes.data() + 20);
+    if (!nbuckets || (nbuckets & (nbuckets - 1)) || nentries > nbuckets)
+        panic("Failed to deserialize archive: malformed index!");
+    u64 membersOffset = u64(ARCHIVE_HEADER_SIZE) + u64(nmembers) * 8 + u64(nbuckets) * 4 + u64(nentries) * 12 + poolSize;
+    if (membersOffset > u64(bytes.size()))
+        panic("Failed to deserialize archive: index out of bounds!");
+    for (u32 i = 0; i < nmembers; i ++) {
+        const i8* entry = bytes.data() + ARCHIVE_HEADER_SIZE + i * 8;
+        if (u64(readArchiveU32(entry)) + readArchiveU32(entry + 4) > u64(bytes.size()))
+            panic("Failed to deserialize archive: member out of bounds!");
+    }
+
+    // Lookups trust the index, so every bucket must name a real entry, and
+    // every entry a real member and a name within the pool.
+    const i8* buckets = bytes.data() + ARCHIVE_HEADER_SIZE + nmembers * 8;
+    const i8* entries = buckets + nbuckets * 4;
+    for (u32 i = 0; i < nbuckets; i ++)
+        if (readArchiveU32(buckets + i * 4) > nentries)
+            panic("Failed to deserialize archive: bucket out of bounds!");
+    for (u32 i = 0; i < nentries; i ++) {
+        const i8* entry = entries + i * 12;
+        if (u64(readArchiveU32(entry)) + readArchiveU32(entry + 4) > poolSize || readArchiveU32(entry + 8) >= nmembers)
+            panic("Failed to deserialize archive: entry out of bounds!");
+    }
+}
+
+u32 Archive::members() const {
+    return readArchiveU32(bytes.data() + 8);
+}
+
+const_slice<i8> Archive::member(u32 i) const {
+    assert(i < members());
+    const i8* entry = bytes.data() + ARCHIVE_HEADER_SIZE + i * 8;
+    return { bytes.data() + readArchiveU32(entry), iword(readArchiveU32(entry + 4)) };
+}
+
+i32 Archive::find(const_slice<i8> name) const {
+    u32 nmembers = members();
+    u32 nbuckets = readArchiveU32(bytes.data() + 12);
+    u32 nentries = readArchiveU32(bytes.data() + 16);
+    const i8* buckets = bytes.data() + ARCHIVE_HEADER_SIZE + nmembers * 8;
+    const i8* entries = buckets + nbuckets * 4;
+    const i8* pool = entries + nentries * 12;
+
+    u32 bucket = archiveHash(name) & (nbuckets - 1);
+    for (u32 probes = 0; probes < nbuckets; probes ++) {
+        u32 index = readArchiveU32(buckets + bucket * 4);
+        if (!index)
+            return -1;
+        const i8* entry = entries + (index - 1) * 12;
+        u32 nameSize = readArchiveU32(entry + 4);
+        if (nameSize == name.size() && !memory::compare(pool + readArchiveU32(entry), name.data(), nameSize))
+            return readArchiveU32(entry + 8);
+        bucket = (bucket + 1) & (nbuckets - 1);
+    }
+    return -1;
+}
+
+void Archive::loadInto(Assembly& dest, const_slice<Symbol> roots, Assembly::TaskRunner runner) const {
+    vec<bool, 64> loaded;
+    for (u32 i = 0; i < members(); i ++)
+        loaded.push(false);
+
+    // Every global name defined so far, either by dest or by a member we've
+    // pulled in. These never need another member, even if the index says a
+    // different one exports them.
+    ::map<const_slice<i8>, bool> defined;
+    for (const Def& def : dest.defs) if (def.type == DEF_GLOBAL)
+        defined.put(dest.symtab[def.sym], true);
+
+    vec<SymbolTable*, 16> tables;
+    vec<Assembly*, 16> assemblies;
+    vec<const_slice<i8>, 64> worklist;
+    for (Symbol root : roots)
+        worklist.push(dest.symtab[root]);
+
+    while (worklist.size()) {
+        const_slice<i8> name = worklist.pop();
+        if (defined.contains(name))
+            continue;
+        i32 i = find(name);
+        if (i < 0 || loaded[i])
+            continue; // Either not in the archive, or already pulled in.
+        loaded[i] = true;
+
+        SymbolTable* table = new SymbolTable();
+        Assembly* as = new Assembly(*table);
+        as->deserialize(member(i), runner);
+        tables.push(table);
+        assemblies.push(as);
+        for (const Def& def : as->defs) if (def.type == DEF_GLOBAL)
+            defined.put((*table)[def.sym], true);
+
+        // Local references are always satisfied within the member itself, so
+        // only global ones can pull in more of the archive.
+        for (const Reloc& reloc : as->relocs) if (reloc.type == DEF_GLOBAL)
+            worklist.push((*table)[reloc.sym]);
+    }
+
+    Offsets offsets = { u32(dest.code.size()), u32(dest.data.size()), u32(dest.stat.size()) };
+    for (Assembly* as : assemblies) {
+        offsets = joinAssembly(dest, offsets, *as);
+        delete as;
+    }
+    for (SymbolTable* table : tables)
+        delete table;
+}
@@ -0,0 +1,105 @@
+#ifndef ASM_ARCHIVE_H
+#define ASM_ARCHIVE_H
+
+#include "asm/arch.h"
+
+/*
+ * Archives bundle many serialized assemblies ("members") into a single blob,
+ * along with a global index mapping each exported (DEF_GLOBAL) symbol name to
+ * the member that defines it. All header fields are little-endian u32s.
+ *
+ *   magic          "\0aar"
+ *   totalSize      Size of the whole archive in bytes, including this header.
+ *   nmembers       Number of members.
+ *   nbuckets       Number of index hash buckets (always a power of two).
+ *   nentries       Number of index entries.
+ *   poolSize       Size of the name pool in bytes.
+ *   members        nmembers * { offset, size }, relative to the start of the archive.
+ *   buckets        nbuckets * { entry + 1 }, or 0 if the bucket is empty. Collisions
+ *                  are resolved by linear probing.
+ *   entries        nentries * { nameOffset, nameSize, member }, with names stored
+ *                  in the name pool.
+ *   pool           Concatenated symbol names.
+ *   ...            Serialized member assemblies, in order.
+ *
+ * If more than one member exports the same name, the first one added wins.
+ */
+
+constexpr u32 ARCHIVE_HEADER_SIZE = 24;
+
+inline u32 archiveHash(const_slice<i8> name) {
+    u32 hash = 2166136261u; // FNV-1a
+    for (i8 c : name)
+        hash = (hash ^ u8(c)) * 16777619u;
+    return hash;
+}
+
+// Accumulates assemblies to be written out together as one archive.
+struct ArchiveBuilder {
+    vec<Assembly*, 16> members;
+
+    inline void add(Assembly& as) {
+        members.push(&as);
+    }
+
+    void write(fd file);
+};
+
+// Read-only view of an archive, either borrowed or read from a stream.
+struct Archive {
+    const_slice<i8> bytes;
+    bool owned;
+
+    inline Archive():
+        bytes({ (const i8*)nullptr, iword(0) }), owned(false) {}
+
+    inline Archive(const_slice<i8> bytes_in):
+        bytes(bytes_in), owned(false) {
+        validate();
+    }
+
+    inline ~Archive() {
+        if (owned)
+            delete[] bytes.data();
+    }
+
+    Archive(const Archive&) = delete;
+    Archive& operator=(const Archive&) = delete;
+
+    template<typename IO, typename Format = Formatter<IO>>
+    inline IO deserialize(IO io) {
+        array<i8, 8> start;
+        for (u32 i = 0; i < 8; i ++) start[i] = get<i8>(io);
+        const u8* sizeBytes = (const u8*)&start[4];
+        u32 totalSize = sizeBytes[0] | sizeBytes[1] << 8 | sizeBytes[2] << 16 | sizeBytes[3] << 24;
+        if (totalSize < ARCHIVE_HEADER_SIZE)
+            panic("Failed to deserialize archive!");
+
+        if (owned)
+            delete[] bytes.data();
+        i8* buffer = new i8[totalSize];
+        for (u32 i = 0; i < 8; i ++)
+            buffer[i] = start[i];
+        for (u32 i = 8; i < totalSize; i ++)
+            buffer[i] = get<i8>(io);
+        bytes = { buffer, iword(totalSize) };
+        owned = true;
+        validate();
+        return io;
+    }
+
+    void validate() const;
+
+    u32 members() const;
+    const_slice<i8> member(u32 i) const;
+
+    // Returns the index of the member exporting the given name, or -1 if none does.
+    i32 find(const_slice<i8> name) const;
+
+    // Appends to dest every member needed to define the given root symbols,
+    // transitively following each loaded member's references to other
+    // exported names. Members that are never reached are not decoded.
+    void loadInto(Assembly& dest, const_slice<Symbol> roots, Assembly::TaskRunner runner = nullptr) const;
+};
+
+#endif
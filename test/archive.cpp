@@ -0,0 +1,82 @@
+#include "util/test/harness.h"
+#include "asm/archive.h"
+#include "asm/arch/amd64.h"
+#include "util/io.h"
+
+// Writes an archive of three members: a(x) = b(x) + 1, b(x) = x * 2, and c,
+// which nothing refers to.
+static void writeTestArchive(const i8* path) {
+    using ASM = AMD64LinuxAssembler;
+
+    SymbolTable tableA, tableB, tableC;
+    Assembly a(tableA), b(tableB), c(tableC);
+
+    ASM::global(a, a.symtab["a"]);
+    ASM::call(a, Func(a.symtab["b"]));
+    ASM::add64(a, GP(ASM::RAX), GP(ASM::RAX), Imm(1));
+    ASM::ret(a);
+
+    ASM::global(b, b.symtab["b"]);
+    ASM::add64(b, GP(ASM::RAX), GP(ASM::RDI), GP(ASM::RDI));
+    ASM::ret(b);
+
+    ASM::global(c, c.symtab["c"]);
+    ASM::mov64(c, GP(ASM::RAX), Imm(42));
+    ASM::ret(c);
+
+    ArchiveBuilder builder;
+    builder.add(c);
+    builder.add(a);
+    builder.add(b);
+    file::fd output = file::open(path, file::WRITE);
+    builder.write(output);
+    file::close(output);
+}
+
+TEST(archive_selective_load) {
+    writeTestArchive(cstring("bin/test.aar"));
+    Archive archive;
+    file::fd input = file::open(cstring("bin/test.aar"), file::READ);
+    archive.deserialize(input);
+    file::close(input);
+
+    ASSERT_EQUAL(archive.members(), 3);
+    ASSERT_EQUAL(archive.find(const_slice<i8>{ "a", 1 }), 1);
+    ASSERT_EQUAL(archive.find(const_slice<i8>{ "c", 1 }), 0);
+    ASSERT_EQUAL(archive.find(const_slice<i8>{ "d", 1 }), -1);
+
+    SymbolTable table;
+    Assembly as(table);
+    Symbol root = as.symtab["a"];
+    archive.loadInto(as, { &root, 1 });
+    ASSERT_EQUAL(as.defs.size(), 2);
+
+    auto linked = as.link();
+    linked.load();
+    ASSERT(!linked.lookup<i64(i64)>(as.symtab["c"]));
+    auto fn = linked.lookup<i64(i64)>(as.symtab["a"]);
+    ASSERT_EQUAL(fn(20), 41);
+}
+
+TEST(archive_load_skips_defined_names) {
+    using ASM = AMD64LinuxAssembler;
+    writeTestArchive(cstring("bin/defined.aar"));
+    Archive archive;
+    file::fd input = file::open(cstring("bin/defined.aar"), file::READ);
+    archive.deserialize(input);
+    file::close(input);
+
+    // We already define b, so only a should come from the archive.
+    SymbolTable table;
+    Assembly as(table);
+    ASM::global(as, as.symtab["b"]);
+    ASM::mul64(as, GP(ASM::RAX), GP(ASM::RDI), Imm(3));
+    ASM::ret(as);
+    Symbol root = as.symtab["a"];
+    archive.loadInto(as, { &root, 1 });
+    ASSERT_EQUAL(as.defs.size(), 2);
+
+    auto linked = as.link();
+    linked.load();
+    ASSERT_EQUAL(linked.lookup<i64(i64)>(as.symtab["a"])(20), 61);
+}
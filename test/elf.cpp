@@ -2,6 +2,52 @@
 #include "asm/arch/amd64.h"
 #include "util/io.h"
 
+#ifdef RT_LINUX
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Reads a whole ELF file, going by its section and program headers to find
+// where it ends. test/unwind.cpp uses this too.
+slice<i8> readELFFile(const i8* path) {
+    auto field = [](const i8* ptr, u32 size) -> u64 {
+        u64 value = 0;
+        for (u32 i = 0; i < size; i ++)
+            value |= u64(u8(ptr[i])) << i * 8;
+        return value;
+    };
+    file::fd input = file::open(path, file::READ);
+    vec<i8, 64> bytes;
+    for (u32 i = 0; i < 64; i ++)
+        bytes.push(get<i8>(input));
+    u64 phoff = field(&bytes[32], 8), phnum = field(&bytes[56], 2);
+    u64 shoff = field(&bytes[40], 8), shnum = field(&bytes[60], 2);
+    u64 headersEnd = phoff + phnum * 56 > shoff + shnum * 64 ? phoff + phnum * 56 : shoff + shnum * 64;
+    while (bytes.size() < headersEnd)
+        bytes.push(get<i8>(input));
+    u64 total = bytes.size();
+    for (u64 i = 0; i < phnum; i ++) {
+        const i8* segment = &bytes[phoff + i * 56];
+        if (field(segment + 8, 8) + field(segment + 32, 8) > total) // p_offset + p_filesz
+            total = field(segment + 8, 8) + field(segment + 32, 8);
+    }
+    for (u64 i = 0; i < shnum; i ++) {
+        const i8* section = &bytes[shoff + i * 64];
+        if (field(section + 24, 8) + field(section + 32, 8) > total) // sh_offset + sh_size
+            total = field(section + 24, 8) + field(section + 32, 8);
+    }
+    while (bytes.size() < total)
+        bytes.push(get<i8>(input));
+    file::close(input);
+
+    slice<i8> result = { new i8[total], iword(total) };
+    for (u64 i = 0; i < total; i ++)
+        result[i] = bytes[i];
+    return result;
+}
+
 TEST(assembly_serialize_hello_world_to_elf) {
     SymbolTable table;
     Assembly as(table);
@@ -22,4 +68,288 @@ TEST(assembly_serialize_hello_world_to_elf) {
     file::fd output = file::open(cstring("bin/hello.o"), file::WRITE);
     as.writeELFObject(output);
     file::close(output);
-}
\ No newline at end of file
+}
+
+TEST(linked_assembly_write_static_executable) {
+    SymbolTable table;
+    Assembly as(table);
+    using ASM = AMD64LinuxAssembler;
+
+    ASM::global(as, as.symtab["_start"]);
+    ASM::mov64(as, GP(ASM::RDI), Imm(1)); // stdout
+    ASM::la(as, GP(ASM::RSI), Data(as.symtab["msg"]));
+    ASM::mov64(as, GP(ASM::RDX), Imm(12));
+    ASM::mov64(as, GP(ASM::RAX), Imm(1)); // write
+    as.code.write<u8>(0x0f);
+    as.code.write<u8>(0x05);
+    ASM::mov64(as, GP(ASM::RDI), Imm(0));
+    ASM::mov64(as, GP(ASM::RAX), Imm(60)); // exit
+    as.code.write<u8>(0x0f);
+    as.code.write<u8>(0x05);
+
+    as.def(DATA_SECTION, DEF_GLOBAL, as.symtab["msg"]);
+    as.data.write("hello world\n", 12);
+
+    auto linked = as.link();
+    file::fd output = file::open(cstring("bin/hello"), file::WRITE);
+    linked.writeELFExecutable(output, as.symtab["_start"]);
+    file::close(output);
+
+    file::fd pieOutput = file::open(cstring("bin/hello-pie"), file::WRITE);
+    linked.writeELFExecutable(pieOutput, as.symtab["_start"], true);
+    file::close(pieOutput);
+
+    // Both should be static: no interpreter, no dynamic section, and an entry
+    // point at _start, in an executable segment.
+    constexpr u16 ET_EXEC = 2, ET_DYN = 3;
+    constexpr u32 PT_LOAD = 1, PT_DYNAMIC = 2, PT_INTERP = 3, PF_X = 1;
+    const char* paths[2] = { "bin/hello", "bin/hello-pie" };
+    for (u32 pie = 0; pie < 2; pie ++) {
+        slice<i8> bytes = readELFFile(cstring(paths[pie]));
+        auto field = [&](u64 offset, u32 size) -> u64 {
+            u64 value = 0;
+            for (u32 i = 0; i < size; i ++)
+                value |= u64(u8(bytes[offset + i])) << i * 8;
+            return value;
+        };
+        u64 entry = field(24, 8), phoff = field(32, 8), phnum = field(56, 2);
+        ASSERT_EQUAL(field(16, 2), pie ? ET_DYN : ET_EXEC); // e_type
+        ASSERT_EQUAL(entry, (pie ? 0 : 0x400000) + 0x1000); // _start is the first thing in the code page.
+        bool executable = false;
+        for (u64 i = 0; i < phnum; i ++) {
+            u64 header = phoff + i * 56;
+            u32 type = field(header, 4);
+            ASSERT(type != PT_INTERP && type != PT_DYNAMIC);
+            u64 address = field(header + 16, 8), size = field(header + 40, 8);
+            if (type == PT_LOAD && (field(header + 4, 4) & PF_X) && entry >= address && entry < address + size)
+                executable = true;
+        }
+        ASSERT(executable);
+        delete[] bytes.data();
+
+        #ifdef RT_LINUX
+        chmod(paths[pie], 0755);
+        pid_t child = fork();
+        if (!child) {
+            execl(paths[pie], paths[pie], (char*)nullptr);
+            _exit(127);
+        }
+        int status;
+        ASSERT_EQUAL(waitpid(child, &status, 0), child);
+        ASSERT(WIFEXITED(status));
+        ASSERT_EQUAL(WEXITSTATUS(status), 0);
+        #endif
+    }
+}
+
+TEST(assembly_elf_function_symbols) {
+    SymbolTable table;
+    Assembly as(table);
+    using ASM = AMD64LinuxAssembler;
+
+    ASM::global(as, as.symtab["inc"]);
+    ASM::add64(as, GP(ASM::RAX), GP(ASM::RDI), Imm(1));
+    ASM::ret(as);
+    u64 incSize = as.code.size();
+
+    ASM::global(as, as.symtab["abs"]);
+    ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDI));
+    ASM::brcc64(as, COND_GE, Label(as.symtab["done"]), GP(ASM::RAX), Imm(0));
+    ASM::neg64(as, GP(ASM::RAX), GP(ASM::RAX));
+    ASM::local(as, as.symtab["done"]);
+    ASM::ret(as);
+    u64 absSize = as.code.size() - incSize;
+
+    as.def(DATA_SECTION, DEF_GLOBAL, as.symtab["table"]);
+    as.data.writeLE<u64>(1);
+    as.data.writeLE<u64>(2);
+
+    file::fd output = file::open(cstring("bin/funcs.o"), file::WRITE);
+    as.writeELFObject(output);
+    file::close(output);
+
+    // Find .symtab and its string table, then check each symbol we defined.
+    constexpr u8 STT_NOTYPE = 0, STT_OBJECT = 1, STT_FUNC = 2;
+    slice<i8> bytes = readELFFile(cstring("bin/funcs.o"));
+    auto field = [&](u64 offset, u32 size) -> u64 {
+        u64 value = 0;
+        for (u32 i = 0; i < size; i ++)
+            value |= u64(u8(bytes[offset + i])) << i * 8;
+        return value;
+    };
+    u64 shoff = field(40, 8), shnum = field(60, 2), symtab = 0;
+    for (u64 i = 0; i < shnum; i ++) if (field(shoff + i * 64 + 4, 4) == 2) // SHT_SYMTAB
+        symtab = shoff + i * 64;
+    ASSERT(symtab);
+    u64 strtab = shoff + field(symtab + 40, 4) * 64; // sh_link
+    u64 symbols = field(symtab + 24, 8), nsymbols = field(symtab + 32, 8) / 24, strings = field(strtab + 24, 8);
+
+    auto find = [&](const char* name) -> u64 {
+        for (u64 i = 0; i < nsymbols; i ++) {
+            const i8* symbolName = &bytes[strings + field(symbols + i * 24, 4)];
+            u32 j = 0;
+            while (name[j] && symbolName[j] == name[j])
+                j ++;
+            if (!name[j] && !symbolName[j])
+                return symbols + i * 24;
+        }
+        return 0;
+    };
+    u64 inc = find("inc"), abs = find("abs"), data = find("table"), done = find("done");
+    ASSERT(inc && abs && data && done);
+    ASSERT_EQUAL(field(inc + 4, 1) & 0xf, STT_FUNC); // st_info
+    ASSERT_EQUAL(field(inc + 16, 8), incSize); // st_size
+    ASSERT_EQUAL(field(abs + 4, 1) & 0xf, STT_FUNC);
+    ASSERT_EQUAL(field(abs + 16, 8), absSize);
+    ASSERT_EQUAL(field(data + 4, 1) & 0xf, STT_OBJECT);
+    ASSERT_EQUAL(field(data + 16, 8), 16);
+    ASSERT_EQUAL(field(done + 4, 1) & 0xf, STT_NOTYPE); // Labels within a function are just positions.
+    ASSERT_EQUAL(field(done + 16, 8), 0);
+    delete[] bytes.data();
+}
+
+TEST(assembly_write_shared_object) {
+    SymbolTable table;
+    Assembly as(table);
+    using ASM = AMD64LinuxAssembler;
+
+    ASM::global(as, as.symtab["scale"]);
+    ASM::ld64(as, GP(ASM::RAX), Static(as.symtab["factor"]));
+    ASM::mul64(as, GP(ASM::RAX), GP(ASM::RAX), GP(ASM::RDI));
+    ASM::ret(as);
+
+    as.def(STATIC_SECTION, DEF_GLOBAL, as.symtab["factor"]);
+    as.stat.writeLE<i64>(3);
+
+    file::fd output = file::open(cstring("bin/libscale.so"), file::WRITE);
+    as.writeELFSharedObject(output);
+    file::close(output);
+
+    #ifdef RT_LINUX
+    void* library = dlopen("bin/libscale.so", RTLD_NOW | RTLD_LOCAL);
+    ASSERT(library);
+    auto scale = (i64(*)(i64))dlsym(library, "scale");
+    auto factor = (i64*)dlsym(library, "factor");
+    ASSERT(scale && factor);
+    ASSERT_EQUAL(scale(5), 15);
+    *factor = 4; // Static data should be writable, and scale should see it.
+    ASSERT_EQUAL(scale(5), 20);
+    dlclose(library);
+    #endif
+}
+
+TEST(assembly_read_elf_object) {
+    using ASM = AMD64LinuxAssembler;
+    {
+        SymbolTable table;
+        Assembly as(table);
+        ASM::global(as, as.symtab["scale3"]);
+        ASM::call(as, Label(as.symtab["load3"]));
+        ASM::mul64(as, GP(ASM::RAX), GP(ASM::RAX), GP(ASM::RDI));
+        ASM::ret(as);
+        ASM::local(as, as.symtab["load3"]);
+        ASM::ld64(as, GP(ASM::RAX), Data(as.symtab["three"]));
+        ASM::ret(as);
+
+        as.def(DATA_SECTION, DEF_LOCAL, as.symtab["three"]);
+        as.data.writeLE<i64>(3);
+
+        file::fd output = file::open(cstring("bin/scale3.o"), file::WRITE);
+        as.writeELFObject(output);
+        file::close(output);
+    }
+
+    SymbolTable table;
+    Assembly as(table);
+    ASM::global(as, as.symtab["scale3_plus1"]);
+    ASM::call(as, Func(as.symtab["scale3"]));
+    ASM::add64(as, GP(ASM::RAX), GP(ASM::RAX), Imm(1));
+    ASM::ret(as);
+
+    file::fd input = file::open(cstring("bin/scale3.o"), file::READ);
+    as.readELFObject(input);
+    file::close(input);
+
+    auto linked = as.link();
+    linked.load();
+    auto scale3_plus1 = linked.lookup<i64(i64)>("scale3_plus1");
+    ASSERT_EQUAL(scale3_plus1(5), 16);
+}
+
+TEST(assembly_read_elf_object_undefined_addend) {
+    using ASM = AMD64LinuxAssembler;
+    {
+        SymbolTable table;
+        Assembly as(table);
+        ASM::global(as, as.symtab["second"]);
+        ASM::ld64(as, GP(ASM::RAX), Data(as.symtab["pair"]));
+        ASM::ret(as);
+        as.relocs.last().addend = 8; // Like a compiler's pair+8(%rip), against a symbol defined elsewhere.
+
+        file::fd output = file::open(cstring("bin/second.o"), file::WRITE);
+        as.writeELFObject(output);
+        file::close(output);
+    }
+
+    SymbolTable table;
+    Assembly as(table);
+    as.def(DATA_SECTION, DEF_GLOBAL, as.symtab["pair"]);
+    as.data.writeLE<i64>(1);
+    as.data.writeLE<i64>(2);
+
+    file::fd input = file::open(cstring("bin/second.o"), file::READ);
+    as.readELFObject(input);
+    file::close(input);
+
+    auto linked = as.link();
+    linked.load();
+    ASSERT_EQUAL(linked.lookup<i64()>("second")(), 2);
+}
+
+TEST(assembly_elf_function_sections) {
+    SymbolTable table;
+    Assembly as(table);
+    using ASM = AMD64LinuxAssembler;
+
+    ASM::global(as, as.symtab["used"]);
+    ASM::call(as, Func(as.symtab["helper"]));
+    ASM::add64(as, GP(ASM::RAX), GP(ASM::RAX), Imm(1));
+    ASM::ret(as);
+
+    ASM::global(as, as.symtab["unused"]);
+    ASM::ld64(as, GP(ASM::RAX), Data(as.symtab["value"]));
+    ASM::ret(as);
+
+    ASM::global(as, as.symtab["helper"]);
+    ASM::mov64(as, GP(ASM::RAX), Imm(41));
+    ASM::brcc64(as, COND_NE, Label(as.symtab["done"]), GP(ASM::RDI), Imm(0));
+    ASM::mov64(as, GP(ASM::RAX), Imm(0));
+    ASM::local(as, as.symtab["done"]);
+    ASM::ret(as);
+
+    as.def(DATA_SECTION, DEF_LOCAL, as.symtab["value"]);
+    as.data.writeLE<i64>(7);
+
+    file::fd output = file::open(cstring("bin/sections.o"), file::WRITE);
+    as.writeELFObject(output, true);
+    file::close(output);
+
+    // Writing shouldn't use up our own buffers, either.
+    auto original = as.link();
+    original.load();
+    ASSERT_EQUAL(original.lookup<i64(i64)>("used")(1), 42);
+
+    // The object should still carry everything, so reading it back and
+    // linking it in memory gives us working code.
+    SymbolTable table2;
+    Assembly as2(table2);
+    file::fd input = file::open(cstring("bin/sections.o"), file::READ);
+    as2.readELFObject(input);
+    file::close(input);
+
+    auto linked = as2.link();
+    linked.load();
+    ASSERT_EQUAL(linked.lookup<i64(i64)>("used")(1), 42);
+    ASSERT_EQUAL(linked.lookup<i64(i64)>("used")(0), 1);
+    ASSERT_EQUAL(linked.lookup<i64()>("unused")(), 7);
+}
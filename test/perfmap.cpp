@@ -0,0 +1,71 @@
+#include "util/test/harness.h"
+#include "asm/arch/amd64.h"
+#include "util/io.h"
+
+#ifdef RT_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+TEST(linked_assembly_perf_map) {
+    SymbolTable table;
+    Assembly as(table);
+    using ASM = AMD64LinuxAssembler;
+
+    ASM::global(as, as.symtab["first"]);
+    ASM::mov64(as, GP(ASM::RAX), Imm(1));
+    ASM::ret(as);
+    ASM::global(as, as.symtab["second"]);
+    ASM::local(as, as.symtab["loop"]);
+    ASM::mov64(as, GP(ASM::RAX), Imm(2));
+    ASM::ret(as);
+
+    auto linked = as.link();
+    ASSERT_EQUAL(linked.functions.size(), 2);
+    ASSERT_EQUAL(linked.functions[0].offset, 0);
+    ASSERT_EQUAL(linked.functions[0].size, linked.functions[1].offset);
+    ASSERT_EQUAL(linked.functions[1].sym, as.symtab["second"]);
+
+    file::fd output = file::open(cstring("bin/perf-test.map"), file::WRITE);
+    LinkedAssembly::perfMap = &output;
+    linked.load();
+    LinkedAssembly::perfMap = nullptr;
+    file::close(output);
+
+    auto second = linked.lookup<i64()>(as.symtab["second"]);
+    ASSERT_EQUAL(second(), 2);
+
+    #ifdef RT_LINUX
+    // Each line should be "START SIZE name", with START and SIZE in hex and
+    // no 0x, as perf expects.
+    i8 text[256];
+    int input = ::open("bin/perf-test.map", O_RDONLY);
+    ASSERT(input >= 0);
+    iword length = ::read(input, text, sizeof(text));
+    ::close(input);
+    ASSERT(length > 0 && length < iword(sizeof(text)));
+
+    const char* names[2] = { "first", "second" };
+    iword pos = 0;
+    auto hexField = [&]() -> u64 {
+        u64 value = 0;
+        iword start = pos;
+        for (; pos < length && text[pos] != ' '; pos ++) {
+            i8 c = text[pos];
+            ASSERT((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'));
+            value = value * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+        }
+        ASSERT(pos > start && pos < length);
+        pos ++; // The space.
+        return value;
+    };
+    for (u32 i = 0; i < 2; i ++) {
+        ASSERT_EQUAL(hexField(), u64(linked.code + linked.functions[i].offset));
+        ASSERT_EQUAL(hexField(), linked.functions[i].size);
+        for (u32 j = 0; names[i][j]; j ++, pos ++)
+            ASSERT(pos < length && text[pos] == names[i][j]);
+        ASSERT(pos < length && text[pos ++] == '\n');
+    }
+    ASSERT_EQUAL(pos, length); // Nothing after the two lines.
+    #endif
+}
@@ -61,4 +61,38 @@ TEST(assembly_serialize_hello_world) {
     linked.load();
     auto hello = linked.lookup<void()>("hello");
     hello();
-}
\ No newline at end of file
+}
+
+TEST(assembly_deserialize_segments_out_of_order) {
+    SymbolTable table;
+    Assembly as(table);
+    using ASM = AMD64LinuxAssembler;
+
+    ASM::global(as, as.symtab["sub"]);
+    ASM::sub64(as, GP(ASM::RAX), GP(ASM::RDI), GP(ASM::RSI));
+    ASM::ret(as);
+
+    file::fd output = file::open(cstring("bin/sub.as"), file::WRITE);
+    as.serialize(output);
+    file::close(output);
+
+    // Segments must decode correctly regardless of the order the runner picks.
+    Assembly::TaskRunner reversed = [](u32 n, void(*task)(void*, u32), void* env) {
+        for (u32 i = n; i > 0; i --)
+            task(env, i - 1);
+    };
+
+    SymbolTable loadedTable;
+    Assembly loaded(loadedTable);
+    file::fd input = file::open(cstring("bin/sub.as"), file::READ);
+    loaded.deserialize(input, reversed);
+    file::close(input);
+
+    ASSERT_EQUAL(loaded.defs.size(), 1);
+    ASSERT_EQUAL(loaded.defs[0].type, DEF_GLOBAL);
+
+    auto linked = loaded.link();
+    linked.load();
+    auto sub = linked.lookup<i64(i64, i64)>(loadedTable["sub"]);
+    ASSERT_EQUAL(sub(7, 3), 4);
+}
@@ -25,7 +25,7 @@ struct TestContext {
     SymbolTable table;
     Assembly as;
 
-    inline TestContext(): as(table) {
+    inline TestContext(ISALevel isa = ISA_V3): as(table, isa) {
         Printer<AMD64LinuxAssembler>::write_to(io_stdout);
     }
 };
@@ -126,7 +126,7 @@ void restore_callee_saved_fps(Assembly& as, Args... args) {
 template<typename MoveType, typename OpType>
 void gen_binary_int(TestContext& ctx, BinaryFuncs<MoveType, OpType> funcs, ASMVal operand) {
     Assembly& as = ctx.as;
-    RegSet allowed = Assembler::gps() - Assembler::clobbers(funcs.opcode);
+    RegSet allowed = Assembler::gps() - Assembler::clobbers(funcs.opcode, as.isa);
 
     for (mreg l : allowed) {
         for (mreg d : allowed) {
@@ -146,7 +146,7 @@ void gen_binary_int(TestContext& ctx, BinaryFuncs<MoveType, OpType> funcs, ASMVa
 template<typename MoveType, typename OpType>
 void gen_ternary_int(TestContext& ctx, TernaryFuncs<MoveType, OpType> funcs, ASMVal left, ASMVal right) {
     Assembly& as = ctx.as;
-    RegSet allowed = Assembler::gps() - Assembler::clobbers(funcs.opcode);
+    RegSet allowed = Assembler::gps() - Assembler::clobbers(funcs.opcode, as.isa);
     
     // Both in registers.
     for (mreg l : allowed) {
@@ -202,7 +202,7 @@ void gen_ternary_int(TestContext& ctx, TernaryFuncs<MoveType, OpType> funcs, ASM
 template<typename MoveType, typename OpType>
 void gen_binary_float(TestContext& ctx, BinaryFuncs<MoveType, OpType> funcs, ASMVal operand) {
     Assembly& as = ctx.as;
-    RegSet allowed = Assembler::fps() - Assembler::clobbers(funcs.opcode);
+    RegSet allowed = Assembler::fps() - Assembler::clobbers(funcs.opcode, as.isa);
 
     for (mreg l : allowed) {
         for (mreg d : allowed) {
@@ -222,7 +222,7 @@ void gen_binary_float(TestContext& ctx, BinaryFuncs<MoveType, OpType> funcs, ASM
 template<typename MoveType, typename OpType>
 void gen_ternary_float(TestContext& ctx, TernaryFuncs<MoveType, OpType> funcs, ASMVal left, ASMVal right) {
     Assembly& as = ctx.as;
-    RegSet allowed = Assembler::fps() - Assembler::clobbers(funcs.opcode);
+    RegSet allowed = Assembler::fps() - Assembler::clobbers(funcs.opcode, as.isa);
     
     // Both in registers.
     for (mreg l : allowed) {
@@ -346,6 +346,7 @@ MAKE_TERNARY_INT_TEST_FOR_WIDTH(SUB, sub, 32, overflow, 0x7fffffff, -1, -0x80000
 MAKE_TERNARY_INT_TEST_FOR_WIDTH(SUB, sub, 8, underflow, -0x80, 1, 0x7f);
 MAKE_TERNARY_INT_TEST_FOR_WIDTH(SUB, sub, 16, underflow, -0x8000, 1, 0x7fff);
 MAKE_TERNARY_INT_TEST_FOR_WIDTH(SUB, sub, 32, underflow, -0x80000000, 1, 0x7fffffff);
+MAKE_TERNARY_INT_TEST_FOR_WIDTH(SUB, sub, 64, most_negative_immediate, 1, -0x80000000, 0x80000001);
 
 MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(MUL, mul, one_times_one, 1, 1, 1);
 MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(MUL, mul, one_times_number, 1, 81, 81);
@@ -361,6 +362,10 @@ MAKE_TERNARY_INT_TEST_FOR_WIDTH(MUL, mul, 32, overflow, 78857, 90715, -143642183
 MAKE_TERNARY_INT_TEST_FOR_WIDTH(MUL, mul, 8, underflow, 21, -42, -114);
 MAKE_TERNARY_INT_TEST_FOR_WIDTH(MUL, mul, 16, underflow, 793, -232, 12632);
 MAKE_TERNARY_INT_TEST_FOR_WIDTH(MUL, mul, 32, underflow, 1340452, -88703, 1356970532);
+MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(MUL, mul, times_lea_constant, 11, 9, 99);
+MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(MUL, mul, times_shifted_lea_constant, 7, 12, 84);
+MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(MUL, mul, times_negative_po2, 7, -8, -56);
+MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(MUL, mul, times_negative_lea_constant, 7, -5, -35);
 
 MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(SDIV, sdiv, two_divided_by_one, 2, 1, 2);
 MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(SDIV, sdiv, zero_divided_by_number, 0, 42, 0);
@@ -408,6 +413,1910 @@ MAKE_TERNARY_INT_TEST_FOR_WIDTH(UREM, urem, 8, check_unsigned, 0xbf, 16, 0xf);
 MAKE_TERNARY_INT_TEST_FOR_WIDTH(UREM, urem, 16, check_unsigned, 0xbfff, 16, 0xf);
 MAKE_TERNARY_INT_TEST_FOR_WIDTH(UREM, urem, 32, check_unsigned, 0xbfffffff, 16, 0xf);
 
+MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(SHL, shl, number_shl_two, 3, 2, 12);
+MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(SHR, shr, number_shr_three, 100, 3, 12);
+MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(SAR, sar, negative_sar_two, -16, 2, -4);
+MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(ROL, rol, one_rol_three, 1, 3, 8);
+MAKE_TERNARY_INT_TESTS_FOR_EACH_WIDTH(ROR, ror, eight_ror_three, 8, 3, 1);
+
+// Division by an immediate never reaches div, so check each lowering against
+// the compiler's own division over a spread of divisors and dividends.
+
+static const i64 constantDivisors[] = {
+    1, -1, 2, -2, 3, -3, 5, 6, 7, -7, 10, 12, 25, 100, 125, 127, -128, 255, 641, 1000,
+    32767, -32768, 65535, 1000000007, 0x7fffffff, -0x80000000l
+};
+
+static const i64 constantDividends[] = {
+    0, 1, -1, 2, 6, 7, -7, 99, 100, -100, 127, -128, 255, 1000, 32767, -32768, 65535,
+    0x12345678, 0x7fffffff, -0x80000000l, 0xffffffff, 0x123456789abcdef, 0x7fffffffffffffff,
+    -0x7fffffffffffffffl - 1, -1000000007, -0x123456789abcdefl
+};
+
+using TernaryOp = void(*)(Assembly&, ASMVal, ASMVal, ASMVal);
+
+template<typename S, typename U>
+u32 check_constant_division(TernaryOp sdiv, TernaryOp udiv, TernaryOp srem, TernaryOp urem) {
+    TestContext ctx;
+    TernaryOp ops[4] = { sdiv, udiv, srem, urem };
+    for (i64 d : constantDivisors) for (TernaryOp op : ops) {
+        Symbol sym = anon(ctx.as);
+        ctx.funcList.push(sym);
+        Assembler::global(ctx.as, sym);
+        op(ctx.as, GP(returnRegister), GP(Assembler::RDI), Imm(d));
+        Assembler::ret(ctx.as);
+    }
+
+    LinkedAssembly linked = ctx.as.link();
+    linked.load();
+    u32 i = 0, failures = 0;
+    for (i64 d : constantDivisors) for (u32 op = 0; op < 4; op ++) {
+        i64(*fun)(i64) = linked.lookup<i64(i64)>(ctx.funcList[i ++]);
+        S sd = S(d);
+        U ud = U(d);
+        if (!sd)
+            continue; // Truncated to zero at this width.
+        for (i64 x : constantDividends) {
+            S sx = S(x);
+            U ux = U(x);
+            if (sd == -1 && sx == S(U(1) << (sizeof(S) * 8 - 1)))
+                continue; // Overflows.
+            U expected = op == 0 ? U(S(sx / sd)) : op == 1 ? U(ux / ud) : op == 2 ? U(S(sx % sd)) : U(ux % ud);
+            if (U(fun(x)) != expected) {
+                println("  Operation ", op, " of ", x, " by ", d, " returned ", U(fun(x)), ", correct answer was ", expected);
+                failures ++;
+            }
+        }
+    }
+    return failures;
+}
+
+TEST(asm_divide_by_constant8) {
+    ASSERT_EQUAL((check_constant_division<i8, u8>(Assembler::sdiv8, Assembler::udiv8, Assembler::srem8, Assembler::urem8)), 0);
+}
+
+TEST(asm_divide_by_constant16) {
+    ASSERT_EQUAL((check_constant_division<i16, u16>(Assembler::sdiv16, Assembler::udiv16, Assembler::srem16, Assembler::urem16)), 0);
+}
+
+TEST(asm_divide_by_constant32) {
+    ASSERT_EQUAL((check_constant_division<i32, u32>(Assembler::sdiv32, Assembler::udiv32, Assembler::srem32, Assembler::urem32)), 0);
+}
+
+TEST(asm_divide_by_constant64) {
+    ASSERT_EQUAL((check_constant_division<i64, u64>(Assembler::sdiv64, Assembler::udiv64, Assembler::srem64, Assembler::urem64)), 0);
+}
+
+static const u32 invariantDivisors[] = {
+    1, 2, 3, 7, 10, 641, 65536, 1000000007, 0x7fffffff, 0x80000000, 0xfffffffe, 0xffffffff
+};
+
+static const u32 invariantDividends[] = {
+    0, 1, 2, 6, 7, 100, 65535, 123456789, 0x7fffffff, 0x80000000, 4000000000u, 0xfffffffe, 0xffffffff
+};
+
+TEST(asm_divide_by_invariant32) {
+    using ASM = Assembler;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+
+    // Operands in ordinary registers, with the divisor dirtied above bit 31.
+    Symbol quotient = anon(as), remainder = anon(as);
+    ASM::global(as, quotient);
+    ASM::udivinfo32(as, GP(ASM::R8), GP(ASM::RSI));
+    ASM::udivby32(as, GP(returnRegister), GP(ASM::RDI), GP(ASM::R8));
+    ASM::ret(as);
+    ASM::global(as, remainder);
+    ASM::not64(as, GP(ASM::R9), Imm(0));
+    ASM::mov32(as, GP(ASM::R9), GP(ASM::RSI));
+    ASM::udivinfo32(as, GP(ASM::R8), GP(ASM::RSI));
+    ASM::uremby32(as, GP(returnRegister), GP(ASM::RDI), GP(ASM::R8), GP(ASM::R9));
+    ASM::ret(as);
+
+    // Operands in each other's scratch registers.
+    Symbol swappedQuotient = anon(as), rotatedRemainder = anon(as);
+    ASM::global(as, swappedQuotient);
+    ASM::udivinfo32(as, GP(ASM::RAX), GP(ASM::RSI));
+    ASM::mov64(as, GP(ASM::RDX), GP(ASM::RDI));
+    ASM::udivby32(as, GP(returnRegister), GP(ASM::RDX), GP(ASM::RAX));
+    ASM::ret(as);
+    ASM::global(as, rotatedRemainder);
+    ASM::udivinfo32(as, GP(ASM::RAX), GP(ASM::RSI));
+    ASM::mov64(as, GP(ASM::RCX), GP(ASM::RDI));
+    ASM::mov64(as, GP(ASM::RDX), GP(ASM::RSI));
+    ASM::uremby32(as, GP(returnRegister), GP(ASM::RCX), GP(ASM::RAX), GP(ASM::RDX));
+    ASM::ret(as);
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    auto div = linked.lookup<u32(u32, u32)>(quotient);
+    auto rem = linked.lookup<u32(u32, u32)>(remainder);
+    auto swappedDiv = linked.lookup<u32(u32, u32)>(swappedQuotient);
+    auto rotatedRem = linked.lookup<u32(u32, u32)>(rotatedRemainder);
+    for (u32 d : invariantDivisors) for (u32 x : invariantDividends) {
+        ASSERT_EQUAL(div(x, d), x / d);
+        ASSERT_EQUAL(rem(x, d), x % d);
+        ASSERT_EQUAL(swappedDiv(x, d), x / d);
+        ASSERT_EQUAL(rotatedRem(x, d), x % d);
+    }
+}
+
+static const i32 msetSizes[] = {
+    0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 100, 255, 256, 257, 1000, 2048, 2049, 5000
+};
+
+// Fills a guarded buffer through mset, checking that exactly the requested
+// bytes were written.
+static i32 check_mset(void (*fill)(u8*, u8), i32 n, u8 value) {
+    static u8 buffer[5100];
+    i32 failures = 0;
+    for (i32 i = 0; i < n + 64; i ++)
+        buffer[i] = ~value;
+    fill(buffer + 32, value);
+    for (i32 i = 0; i < n + 64; i ++)
+        if (buffer[i] != (i >= 32 && i < n + 32 ? value : u8(~value)))
+            failures ++;
+    return failures;
+}
+
+TEST(asm_mset) {
+    using ASM = Assembler;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+
+    // Each size is filled once with a constant byte, once with a register
+    // through a base register we otherwise clobber, once with a register
+    // through a base we can use as it is, and once with a byte in memory,
+    // with both addresses in registers we otherwise clobber.
+    constexpr u32 count = sizeof(msetSizes) / sizeof(msetSizes[0]);
+    Symbol constant[count], variable[count], direct[count], loaded[count];
+    for (u32 i = 0; i < count; i ++) {
+        constant[i] = anon(as);
+        ASM::global(as, constant[i]);
+        ASM::mset(as, Mem(ASM::RDI, 0), Imm(0x5a), Imm(msetSizes[i]));
+        ASM::ret(as);
+        variable[i] = anon(as);
+        ASM::global(as, variable[i]);
+        ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDI));
+        ASM::mset(as, Mem(ASM::RAX, 16), GP(ASM::RSI), Imm(msetSizes[i]));
+        ASM::ret(as);
+        direct[i] = anon(as);
+        ASM::global(as, direct[i]);
+        ASM::mov64(as, GP(ASM::R8), GP(ASM::RDI));
+        ASM::mset(as, Mem(ASM::R8, 0), GP(ASM::RSI), Imm(msetSizes[i]));
+        ASM::ret(as);
+        loaded[i] = anon(as);
+        ASM::global(as, loaded[i]);
+        ASM::push64(as, GP(ASM::RSI));
+        ASM::mov64(as, GP(ASM::RAX), GP(ASM::RSP));
+        ASM::mov64(as, GP(ASM::RCX), GP(ASM::RDI));
+        ASM::mset(as, Mem(ASM::RCX, 0), Mem(ASM::RAX, 0), Imm(msetSizes[i]));
+        ASM::pop64(as, GP(ASM::RSI));
+        ASM::ret(as);
+    }
+    Symbol zero = anon(as), unknown = anon(as), unknownLoaded = anon(as);
+    ASM::global(as, zero);
+    ASM::mset(as, Mem(ASM::RDI, 0), Imm(0), Imm(100));
+    ASM::ret(as);
+    ASM::global(as, unknown);
+    ASM::mset(as, Mem(ASM::RDI, 0), GP(ASM::RSI), GP(ASM::RDX));
+    ASM::ret(as);
+    ASM::global(as, unknownLoaded);
+    ASM::push64(as, GP(ASM::RSI));
+    ASM::mov64(as, GP(ASM::RCX), GP(ASM::RSP));
+    ASM::mset(as, Mem(ASM::RDI, 0), Mem(ASM::RCX, 0), GP(ASM::RDX));
+    ASM::pop64(as, GP(ASM::RSI));
+    ASM::ret(as);
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    for (u32 i = 0; i < count; i ++) {
+        i32 n = msetSizes[i];
+        ASSERT_EQUAL(check_mset(linked.lookup<void(u8*, u8)>(constant[i]), n, 0x5a), 0);
+        ASSERT_EQUAL(check_mset(linked.lookup<void(u8*, u8)>(direct[i]), n, 0x96), 0);
+        ASSERT_EQUAL(check_mset(linked.lookup<void(u8*, u8)>(loaded[i]), n, 0x69), 0);
+        auto fill = linked.lookup<void(u8*, u8)>(variable[i]);
+        static u8 buffer[5100];
+        for (i32 j = 0; j < n + 64; j ++)
+            buffer[j] = 0;
+        fill(buffer, 0xc3);
+        for (i32 j = 0; j < n + 64; j ++)
+            ASSERT_EQUAL(buffer[j], j >= 16 && j < n + 16 ? 0xc3 : 0);
+    }
+    ASSERT_EQUAL(check_mset(linked.lookup<void(u8*, u8)>(zero), 100, 0), 0);
+
+    auto fill = linked.lookup<void(u8*, u8, i64)>(unknown), fillLoaded = linked.lookup<void(u8*, u8, i64)>(unknownLoaded);
+    for (i32 n : msetSizes) {
+        static u8 buffer[5100];
+        for (i32 j = 0; j < n + 64; j ++)
+            buffer[j] = 0;
+        fill(buffer + 8, 0x7e, n);
+        for (i32 j = 0; j < n + 64; j ++)
+            ASSERT_EQUAL(buffer[j], j >= 8 && j < n + 8 ? 0x7e : 0);
+        fillLoaded(buffer + 8, 0xe7, n);
+        for (i32 j = 0; j < n + 64; j ++)
+            ASSERT_EQUAL(buffer[j], j >= 8 && j < n + 8 ? 0xe7 : 0);
+    }
+}
+
+static const i32 mmovSizes[] = {
+    0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 100, 127, 128, 129, 255, 1000, 2047, 2048, 3000
+};
+
+static const i32 mmovDistances[] = {
+    -3000, -100, -33, -32, -31, -16, -8, -1, 0, 1, 8, 16, 31, 32, 33, 100, 3000
+};
+
+// Moves n bytes within a patterned buffer, from the middle to the middle plus
+// distance, and compares the result against a byte-by-byte reference.
+static i32 check_mmov(void (*move)(u8*, u8*, i64), i32 n, i32 distance) {
+    static u8 buffer[10000], expected[10000];
+    for (i32 i = 0; i < 10000; i ++)
+        buffer[i] = expected[i] = u8(i * 7 + i / 251);
+    u8* src = buffer + 3500;
+    if (distance > 0) for (i32 i = n - 1; i >= 0; i --)
+        expected[3500 + distance + i] = expected[3500 + i];
+    else for (i32 i = 0; i < n; i ++)
+        expected[3500 + distance + i] = expected[3500 + i];
+    move(src + distance, src, n);
+    i32 failures = 0;
+    for (i32 i = 0; i < 10000; i ++)
+        if (buffer[i] != expected[i])
+            failures ++;
+    return failures;
+}
+
+TEST(asm_mmov) {
+    using ASM = Assembler;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+
+    // Constant sizes, through base registers we otherwise clobber.
+    constexpr u32 count = sizeof(mmovSizes) / sizeof(mmovSizes[0]);
+    Symbol constant[count];
+    for (u32 i = 0; i < count; i ++) {
+        constant[i] = anon(as);
+        ASM::global(as, constant[i]);
+        ASM::la(as, GP(ASM::RAX), Mem(ASM::RSI, 8));
+        ASM::la(as, GP(ASM::RCX), Mem(ASM::RDI, 8));
+        ASM::mmov(as, Mem(ASM::RCX, -8), Mem(ASM::RAX, -8), Imm(mmovSizes[i]));
+        ASM::ret(as);
+    }
+    Symbol variable = anon(as), swapped = anon(as);
+    ASM::global(as, variable);
+    ASM::mov64(as, GP(ASM::R8), GP(ASM::RDX));
+    ASM::mmov(as, Mem(ASM::RDI, 0), Mem(ASM::RSI, 0), GP(ASM::R8));
+    ASM::ret(as);
+    ASM::global(as, swapped); // Each address is in the other's register, and the size in a third.
+    ASM::mov64(as, GP(ASM::RCX), GP(ASM::RDX));
+    ASM::la(as, GP(ASM::RAX), Mem(ASM::RDI, -16));
+    ASM::la(as, GP(ASM::RDI), Mem(ASM::RSI, -16));
+    ASM::mov64(as, GP(ASM::RSI), GP(ASM::RAX));
+    ASM::mmov(as, Mem(ASM::RSI, 16), Mem(ASM::RDI, 16), GP(ASM::RCX));
+    ASM::ret(as);
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    auto var = linked.lookup<void(u8*, u8*, i64)>(variable);
+    auto swap = linked.lookup<void(u8*, u8*, i64)>(swapped);
+    for (u32 i = 0; i < count; i ++) for (i32 distance : mmovDistances) {
+        auto move = linked.lookup<void(u8*, u8*, i64)>(constant[i]);
+        ASSERT_EQUAL(check_mmov(move, mmovSizes[i], distance), 0);
+        ASSERT_EQUAL(check_mmov(var, mmovSizes[i], distance), 0);
+        ASSERT_EQUAL(check_mmov(swap, mmovSizes[i], distance), 0);
+    }
+}
+
+TEST(asm_mcpy) {
+    using ASM = Assembler;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+
+    // Constant sizes through a base register mcpy uses as a temporary, and
+    // variable sizes.
+    constexpr u32 count = sizeof(mmovSizes) / sizeof(mmovSizes[0]);
+    Symbol constant[count];
+    for (u32 i = 0; i < count; i ++) {
+        constant[i] = anon(as);
+        ASM::global(as, constant[i]);
+        ASM::la(as, GP(ASM::RCX), Mem(ASM::RSI, 24));
+        ASM::mcpy(as, Mem(ASM::RDI, 0), Mem(ASM::RCX, -24), Imm(mmovSizes[i]));
+        ASM::ret(as);
+    }
+    Symbol variable = anon(as);
+    ASM::global(as, variable);
+    ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDI));
+    ASM::mov64(as, GP(ASM::RDI), GP(ASM::RDX));
+    ASM::mcpy(as, Mem(ASM::RAX, 0), Mem(ASM::RSI, 0), GP(ASM::RDI));
+    ASM::ret(as);
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    auto var = linked.lookup<void(u8*, u8*, i64)>(variable);
+    for (u32 i = 0; i < count; i ++) {
+        i32 n = mmovSizes[i];
+        auto copy = linked.lookup<void(u8*, u8*, i64)>(constant[i]);
+        const i32 distances[] = { -3000, -n, n, 3000 };
+        for (i32 distance : distances) {
+            ASSERT_EQUAL(check_mmov(copy, n, distance), 0);
+            ASSERT_EQUAL(check_mmov(var, n, distance), 0);
+        }
+    }
+}
+
+static const i32 mcmpSizes[] = {
+    0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 100, 128, 129, 160, 1000
+};
+
+static const Condition mcmpConditions[] = {
+    COND_EQ, COND_NE, COND_LT, COND_LE, COND_GT, COND_GE
+};
+
+static bool memory_order_holds(Condition cond, i32 order) {
+    switch (cond) {
+        case COND_EQ: return order == 0;
+        case COND_NE: return order != 0;
+        case COND_LT: return order < 0;
+        case COND_LE: return order <= 0;
+        case COND_GT: return order > 0;
+        case COND_GE: return order >= 0;
+        default: return false;
+    }
+}
+
+// Compares n bytes of two buffers, first equal and then with a difference at
+// the start, middle and end, in each direction. A second, later difference
+// makes sure only the first one counts.
+template<typename Compare>
+static i32 check_mcmp(const Compare& compare, Condition cond, i32 n) {
+    static u8 a[1100], b[1100];
+    i32 failures = 0;
+    for (i32 i = 0; i < n; i ++)
+        a[i] = b[i] = u8(i * 13);
+    if (compare(a, b, n) != memory_order_holds(cond, 0))
+        failures ++;
+    const i32 positions[] = { 0, n / 2, n - 1 };
+    for (i32 position : positions) if (position >= 0 && position < n) {
+        for (i32 order = -1; order <= 1; order += 2) {
+            for (i32 i = 0; i < n; i ++)
+                a[i] = b[i] = u8(i * 13);
+            a[position] = order < 0 ? 0x10 : 0x90;
+            b[position] = order < 0 ? 0x90 : 0x10;
+            if (position + 1 < n)
+                a[n - 1] = order < 0 ? 0xff : 0;
+            if (compare(a, b, n) != memory_order_holds(cond, order))
+                failures ++;
+        }
+    }
+    return failures;
+}
+
+TEST(asm_mcmpcc) {
+    using ASM = Assembler;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+
+    // Constant sizes through bases we otherwise clobber, and variable sizes
+    // as both a compare and a branch.
+    constexpr u32 nsizes = sizeof(mcmpSizes) / sizeof(mcmpSizes[0]);
+    constexpr u32 nconds = sizeof(mcmpConditions) / sizeof(mcmpConditions[0]);
+    Symbol constant[nsizes][nconds], variable[nconds], branch[nconds];
+    for (u32 i = 0; i < nsizes; i ++) for (u32 j = 0; j < nconds; j ++) {
+        constant[i][j] = anon(as);
+        ASM::global(as, constant[i][j]);
+        ASM::la(as, GP(ASM::RCX), Mem(ASM::RDI, 8));
+        ASM::la(as, GP(ASM::RDX), Mem(ASM::RSI, -8));
+        ASM::mcmpcc(as, mcmpConditions[j], GP(returnRegister), Mem(ASM::RCX, -8), Mem(ASM::RDX, 8), Imm(mcmpSizes[i]));
+        ASM::ret(as);
+    }
+    for (u32 j = 0; j < nconds; j ++) {
+        variable[j] = anon(as);
+        ASM::global(as, variable[j]);
+        ASM::mcmpcc(as, mcmpConditions[j], GP(ASM::R8), Mem(ASM::RSI, 0), Mem(ASM::RDI, 0), GP(ASM::RDX));
+        ASM::mov64(as, GP(returnRegister), GP(ASM::R8));
+        ASM::ret(as);
+        branch[j] = anon(as);
+        Symbol taken = anon(as);
+        ASM::global(as, branch[j]);
+        ASM::mbrcc(as, mcmpConditions[j], Label(taken), Mem(ASM::RDI, 0), Mem(ASM::RSI, 0), GP(ASM::RDX));
+        ASM::mov64(as, GP(returnRegister), Imm(0));
+        ASM::ret(as);
+        ASM::local(as, taken);
+        ASM::mov64(as, GP(returnRegister), Imm(1));
+        ASM::ret(as);
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    for (u32 j = 0; j < nconds; j ++) {
+        Condition cond = mcmpConditions[j];
+        auto var = linked.lookup<i64(u8*, u8*, i64)>(variable[j]);
+        auto br = linked.lookup<i64(u8*, u8*, i64)>(branch[j]);
+        for (u32 i = 0; i < nsizes; i ++) {
+            auto fixed = linked.lookup<i64(u8*, u8*)>(constant[i][j]);
+            ASSERT_EQUAL(check_mcmp([&](u8* a, u8* b, i64 n) { return fixed(a, b) != 0; }, cond, mcmpSizes[i]), 0);
+            ASSERT_EQUAL(check_mcmp([&](u8* a, u8* b, i64 n) { return var(b, a, n) != 0; }, cond, mcmpSizes[i]), 0);
+            ASSERT_EQUAL(check_mcmp([&](u8* a, u8* b, i64 n) { return br(a, b, n) != 0; }, cond, mcmpSizes[i]), 0);
+        }
+    }
+}
+
+static const FloatCondition fselConditions[] = {
+    FCOND_EQ, FCOND_NE, FCOND_LT, FCOND_LE, FCOND_GT, FCOND_GE
+};
+
+template<typename T>
+static bool float_holds(FloatCondition cond, T a, T b) {
+    switch (cond) {
+        case FCOND_EQ: return a == b;
+        case FCOND_NE: return a != b;
+        case FCOND_LT: return a < b;
+        case FCOND_LE: return a <= b;
+        case FCOND_GT: return a > b;
+        case FCOND_GE: return a >= b;
+    }
+    return false;
+}
+
+// Builds a float select for each condition, with its operands either in
+// registers or as the constants 1.5 (for a and b), 10 and 20 (for c and d),
+// then checks it against C++ comparisons for a few pairs including NaN.
+template<typename T, typename Select, typename Move, typename Const>
+static i32 check_fselcc(Select select, Move move, Const constant, ISALevel level) {
+    using ASM = Assembler;
+    TestContext ctx(level);
+    Assembly& as = ctx.as;
+
+    constexpr u32 nconds = sizeof(fselConditions) / sizeof(fselConditions[0]);
+    constexpr u32 nvariants = 7;
+    Symbol funcs[nconds][nvariants];
+    for (u32 i = 0; i < nconds; i ++) for (u32 v = 0; v < nvariants; v ++) {
+        FloatCondition cond = fselConditions[i];
+        funcs[i][v] = anon(as);
+        ASM::global(as, funcs[i][v]);
+        for (u32 r = 0; r < 4; r ++)
+            move(as, FP(ASM::XMM4 + r), FP(ASM::XMM0 + r));
+        ASMVal a = FP(ASM::XMM4), b = FP(ASM::XMM5), c = FP(ASM::XMM6), d = FP(ASM::XMM7), dst = FP(ASM::XMM8);
+        switch (v) {
+            case 0: break;
+            case 1: b = constant(1.5); break;
+            case 2: a = constant(1.5); break;
+            case 3: c = constant(10), dst = d; break;
+            case 4: d = constant(20), dst = c; break;
+            case 5: c = constant(10), d = constant(20), dst = a; break;
+            case 6: a = constant(1.5), b = constant(2); break;
+        }
+        select(as, cond, dst, a, b, c, d);
+        move(as, FP(ASM::XMM0), dst);
+        ASM::ret(as);
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    const T nan = T(0) / T(0);
+    const T values[] = { -1, 1.5, 2, nan };
+    i32 failures = 0;
+    for (u32 i = 0; i < nconds; i ++) for (u32 v = 0; v < nvariants; v ++) {
+        auto func = linked.lookup<T(T, T, T, T)>(funcs[i][v]);
+        for (T a : values) for (T b : values) {
+            T ca = v == 2 || v == 6 ? T(1.5) : a, cb = v == 1 ? T(1.5) : v == 6 ? T(2) : b;
+            T expected = float_holds(fselConditions[i], ca, cb) ? 10 : 20;
+            if (func(a, b, 10, 20) != expected)
+                failures ++;
+        }
+    }
+    return failures;
+}
+
+// Below ISA_V3, several opcodes take a different path, so their tests run
+// at each level up to the host's.
+static const ISALevel testLevels[] = { ISA_BASELINE, ISA_V2, ISA_V3 };
+
+TEST(asm_fselcc32) {
+    for (ISALevel level : testLevels) if (level <= Assembler::host_level())
+        ASSERT_EQUAL(check_fselcc<f32>(Assembler::fselcc32, Assembler::fmov32, [](f64 x) { return F32(x); }, level), 0);
+}
+
+TEST(asm_fselcc64) {
+    for (ISALevel level : testLevels) if (level <= Assembler::host_level())
+        ASSERT_EQUAL(check_fselcc<f64>(Assembler::fselcc64, Assembler::fmov64, [](f64 x) { return F64(x); }, level), 0);
+}
+
+// Packed vector instructions are checked lane by lane against scalar
+// arithmetic, on pseudo-random inputs where every third lane of b equals a.
+
+struct VectorOpTest {
+    void (*op)(Assembly&, ASMVal, ASMVal, ASMVal);
+    u32 lane, length;
+    i32 count; // Shift count, or -1 if b is a vector.
+    i64 (*reference)(i64 a, i64 b, u32 lane);
+};
+
+static u64 lane_mask(u32 lane) {
+    return lane == 64 ? ~0ull : (1ull << lane) - 1;
+}
+
+static i64 get_lane(const u8* v, u32 lane, u32 i) {
+    switch (lane) {
+        case 8: return ((const i8*)v)[i];
+        case 16: return ((const i16*)v)[i];
+        case 32: return ((const i32*)v)[i];
+        default: return ((const i64*)v)[i];
+    }
+}
+
+static const VectorOpTest vectorOpTests[] = {
+#define VECTOR_OP_SHAPES(lower, count, expr) \
+    { Assembler::lower##8x16, 8, 16, count, expr }, { Assembler::lower##8x32, 8, 32, count, expr }, \
+    { Assembler::lower##16x8, 16, 8, count, expr }, { Assembler::lower##16x16, 16, 16, count, expr }, \
+    { Assembler::lower##32x4, 32, 4, count, expr }, { Assembler::lower##32x8, 32, 8, count, expr }, \
+    { Assembler::lower##64x2, 64, 2, count, expr }, { Assembler::lower##64x4, 64, 4, count, expr }
+    VECTOR_OP_SHAPES(vadd, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) + u64(b); }),
+    VECTOR_OP_SHAPES(vsub, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) - u64(b); }),
+    VECTOR_OP_SHAPES(vmin, -1, [](i64 a, i64 b, u32) -> i64 { return a < b ? a : b; }),
+    VECTOR_OP_SHAPES(vmax, -1, [](i64 a, i64 b, u32) -> i64 { return a > b ? a : b; }),
+#undef VECTOR_OP_SHAPES
+    { Assembler::vmul16x8, 16, 8, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) * u64(b); } },
+    { Assembler::vmul16x16, 16, 16, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) * u64(b); } },
+    { Assembler::vmul32x4, 32, 4, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) * u64(b); } },
+    { Assembler::vmul32x8, 32, 8, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) * u64(b); } },
+    { Assembler::vmul64x2, 64, 2, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) * u64(b); } },
+    { Assembler::vmul64x4, 64, 4, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) * u64(b); } },
+    { Assembler::vand64x2, 64, 2, -1, [](i64 a, i64 b, u32) -> i64 { return a & b; } },
+    { Assembler::vand64x4, 64, 4, -1, [](i64 a, i64 b, u32) -> i64 { return a & b; } },
+    { Assembler::vor64x2, 64, 2, -1, [](i64 a, i64 b, u32) -> i64 { return a | b; } },
+    { Assembler::vor64x4, 64, 4, -1, [](i64 a, i64 b, u32) -> i64 { return a | b; } },
+    { Assembler::vxor64x2, 64, 2, -1, [](i64 a, i64 b, u32) -> i64 { return a ^ b; } },
+    { Assembler::vxor64x4, 64, 4, -1, [](i64 a, i64 b, u32) -> i64 { return a ^ b; } },
+    { Assembler::vshl16x8, 16, 8, 3, [](i64 a, i64 b, u32) -> i64 { return u64(a) << b; } },
+    { Assembler::vshl16x16, 16, 16, 15, [](i64 a, i64 b, u32) -> i64 { return u64(a) << b; } },
+    { Assembler::vshl32x4, 32, 4, 7, [](i64 a, i64 b, u32) -> i64 { return u64(a) << b; } },
+    { Assembler::vshl32x8, 32, 8, 31, [](i64 a, i64 b, u32) -> i64 { return u64(a) << b; } },
+    { Assembler::vshl64x2, 64, 2, 1, [](i64 a, i64 b, u32) -> i64 { return u64(a) << b; } },
+    { Assembler::vshl64x4, 64, 4, 40, [](i64 a, i64 b, u32) -> i64 { return u64(a) << b; } },
+    { Assembler::vshr16x8, 16, 8, 3, [](i64 a, i64 b, u32 lane) -> i64 { return (u64(a) & lane_mask(lane)) >> b; } },
+    { Assembler::vshr16x16, 16, 16, 15, [](i64 a, i64 b, u32 lane) -> i64 { return (u64(a) & lane_mask(lane)) >> b; } },
+    { Assembler::vshr32x4, 32, 4, 7, [](i64 a, i64 b, u32 lane) -> i64 { return (u64(a) & lane_mask(lane)) >> b; } },
+    { Assembler::vshr32x8, 32, 8, 31, [](i64 a, i64 b, u32 lane) -> i64 { return (u64(a) & lane_mask(lane)) >> b; } },
+    { Assembler::vshr64x2, 64, 2, 1, [](i64 a, i64 b, u32 lane) -> i64 { return u64(a) >> b; } },
+    { Assembler::vshr64x4, 64, 4, 40, [](i64 a, i64 b, u32 lane) -> i64 { return u64(a) >> b; } },
+    { Assembler::vsar16x8, 16, 8, 3, [](i64 a, i64 b, u32) -> i64 { return a >> b; } },
+    { Assembler::vsar16x16, 16, 16, 15, [](i64 a, i64 b, u32) -> i64 { return a >> b; } },
+    { Assembler::vsar32x4, 32, 4, 7, [](i64 a, i64 b, u32) -> i64 { return a >> b; } },
+    { Assembler::vsar32x8, 32, 8, 31, [](i64 a, i64 b, u32) -> i64 { return a >> b; } },
+};
+
+static void fill_vectors(u8* a, u8* b, u32 lane, u64 seed) {
+    for (u32 i = 0; i < 64; i ++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        a[i] = u8(seed >> 56), b[i] = u8(seed >> 48);
+    }
+    for (u32 i = 0; i < 64; i += lane / 8 * 3)
+        for (u32 j = 0; j < lane / 8; j ++)
+            b[i + j] = a[i + j];
+}
+
+// Emits a function taking pointers to a, b and the result, which computes
+// into a fresh register, or over a if the variant is odd.
+template<typename Emit>
+static Symbol emit_vector_function(Assembly& as, bool ymm, u32 variant, const Emit& emit) {
+    using ASM = Assembler;
+    Symbol sym = anon(as);
+    ASM::global(as, sym);
+    ASM::vload(as, ymm, ASM::XMM2, Mem(ASM::RDI, 0), 0);
+    ASM::vload(as, ymm, ASM::XMM3, Mem(ASM::RSI, 0), 0);
+    ASMVal dst = variant % 2 ? FP(ASM::XMM2) : FP(ASM::XMM4);
+    emit(dst, FP(ASM::XMM2), FP(ASM::XMM3));
+    ASM::vor64x4(as, FP(ASM::XMM0), dst, dst);
+    ASM::vstore(as, ymm, Mem(ASM::RDX, 0), 0);
+    ASM::vzeroupper(as);
+    ASM::ret(as);
+    return sym;
+}
+
+TEST(asm_vector_arithmetic) {
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    constexpr u32 ntests = sizeof(vectorOpTests) / sizeof(vectorOpTests[0]);
+    Symbol funcs[ntests][2];
+    for (u32 i = 0; i < ntests; i ++) for (u32 v = 0; v < 2; v ++) {
+        const VectorOpTest& test = vectorOpTests[i];
+        funcs[i][v] = emit_vector_function(as, test.lane * test.length == 256, v, [&](ASMVal dst, ASMVal a, ASMVal b) {
+            test.op(as, dst, a, test.count < 0 ? b : Imm(test.count));
+        });
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    i32 failures = 0;
+    u8 a[64], b[64], out[32];
+    for (u32 i = 0; i < ntests; i ++) for (u32 v = 0; v < 2; v ++) {
+        const VectorOpTest& test = vectorOpTests[i];
+        fill_vectors(a, b, test.lane, i * 2 + v);
+        linked.lookup<void(u8*, u8*, u8*)>(funcs[i][v])(a, b, out);
+        for (u32 j = 0; j < test.length; j ++) {
+            i64 x = get_lane(a, test.lane, j), y = test.count < 0 ? get_lane(b, test.lane, j) : test.count;
+            if ((u64(get_lane(out, test.lane, j)) ^ u64(test.reference(x, y, test.lane))) & lane_mask(test.lane))
+                failures ++;
+        }
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+static bool vector_condition_holds(Condition cond, i64 a, i64 b, u32 lane) {
+    u64 ua = u64(a) & lane_mask(lane), ub = u64(b) & lane_mask(lane);
+    switch (cond) {
+        case COND_EQ: return a == b;
+        case COND_NE: return a != b;
+        case COND_LT: return a < b;
+        case COND_LE: return a <= b;
+        case COND_GT: return a > b;
+        case COND_GE: return a >= b;
+        case COND_ABOVE: return ua > ub;
+        case COND_AE: return ua >= ub;
+        case COND_BELOW: return ua < ub;
+        case COND_BE: return ua <= ub;
+        case COND_TEST_ZERO: return (a & b) == 0;
+        case COND_TEST_NONZERO: return (a & b) != 0;
+    }
+    return false;
+}
+
+TEST(asm_vector_compare) {
+    using Compare = void(*)(Assembly&, Condition, ASMVal, ASMVal, ASMVal);
+    const Compare compares[] = {
+        Assembler::vcmpcc8x16, Assembler::vcmpcc8x32, Assembler::vcmpcc16x8, Assembler::vcmpcc16x16,
+        Assembler::vcmpcc32x4, Assembler::vcmpcc32x8, Assembler::vcmpcc64x2, Assembler::vcmpcc64x4
+    };
+    const u32 lanes[] = { 8, 8, 16, 16, 32, 32, 64, 64 }, lengths[] = { 16, 32, 8, 16, 4, 8, 2, 4 };
+
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    constexpr u32 nconds = COND_TEST_NONZERO + 1;
+    Symbol funcs[8][nconds][2];
+    for (u32 i = 0; i < 8; i ++) for (u32 c = 0; c < nconds; c ++) for (u32 v = 0; v < 2; v ++) {
+        funcs[i][c][v] = emit_vector_function(as, lanes[i] * lengths[i] == 256, v, [&](ASMVal dst, ASMVal a, ASMVal b) {
+            compares[i](as, Condition(c), dst, a, b);
+        });
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    i32 failures = 0;
+    u8 a[64], b[64], out[32];
+    for (u32 i = 0; i < 8; i ++) for (u32 c = 0; c < nconds; c ++) for (u32 v = 0; v < 2; v ++) {
+        fill_vectors(a, b, lanes[i], i * 64 + c * 2 + v);
+        linked.lookup<void(u8*, u8*, u8*)>(funcs[i][c][v])(a, b, out);
+        for (u32 j = 0; j < lengths[i]; j ++) {
+            bool holds = vector_condition_holds(Condition(c), get_lane(a, lanes[i], j), get_lane(b, lanes[i], j), lanes[i]);
+            if (get_lane(out, lanes[i], j) != (holds ? -1 : 0))
+                failures ++;
+        }
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+template<typename T>
+static T vector_float_reference(u32 op, T a, T b) {
+    switch (op) {
+        case 0: return a + b;
+        case 1: return a - b;
+        case 2: return a * b;
+        case 3: return a / b;
+        case 4: return a < b ? a : b;
+        default: return a > b ? a : b;
+    }
+}
+
+using VectorOp = void(*)(Assembly&, ASMVal, ASMVal, ASMVal);
+
+// Checks add, sub, mul, div, min and max, in that order, then each float
+// condition, with a NaN in the second lane of b.
+template<typename T, typename I>
+static i32 check_vector_float(const VectorOp* ops, void(*compare)(Assembly&, FloatCondition, ASMVal, ASMVal, ASMVal), bool ymm) {
+    constexpr u32 nconds = sizeof(fselConditions) / sizeof(fselConditions[0]);
+    const u32 length = (ymm ? 32 : 16) / sizeof(T);
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol funcs[6 + nconds];
+    for (u32 i = 0; i < 6 + nconds; i ++) {
+        funcs[i] = emit_vector_function(as, ymm, i, [&](ASMVal dst, ASMVal a, ASMVal b) {
+            if (i < 6) ops[i](as, dst, a, b);
+            else compare(as, fselConditions[i - 6], dst, a, b);
+        });
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    i32 failures = 0;
+    T a[32 / sizeof(T)], b[32 / sizeof(T)], out[32 / sizeof(T)];
+    for (u32 j = 0; j < length; j ++) {
+        a[j] = T(i32(j * 7 % 11) - 5) / 4;
+        b[j] = j % 3 == 0 ? a[j] : T(i32(j * 5 % 13) - 6) / 2;
+    }
+    b[1] = T(0) / T(0);
+    for (u32 i = 0; i < 6 + nconds; i ++) {
+        linked.lookup<void(T*, T*, T*)>(funcs[i])(a, b, out);
+        for (u32 j = i < 6 ? 2 : 0; j < length; j ++) { // NaN aside, min and max match C.
+            if (i < 6 && out[j] != vector_float_reference(i, a[j], b[j]))
+                failures ++;
+            if (i >= 6 && ((I*)out)[j] != (float_holds(fselConditions[i - 6], a[j], b[j]) ? I(-1) : I(0)))
+                failures ++;
+        }
+    }
+    return failures;
+}
+
+TEST(asm_vector_float) {
+    using ASM = Assembler;
+    const VectorOp ops32x4[] = { ASM::vfadd32x4, ASM::vfsub32x4, ASM::vfmul32x4, ASM::vfdiv32x4, ASM::vfmin32x4, ASM::vfmax32x4 };
+    const VectorOp ops32x8[] = { ASM::vfadd32x8, ASM::vfsub32x8, ASM::vfmul32x8, ASM::vfdiv32x8, ASM::vfmin32x8, ASM::vfmax32x8 };
+    const VectorOp ops64x2[] = { ASM::vfadd64x2, ASM::vfsub64x2, ASM::vfmul64x2, ASM::vfdiv64x2, ASM::vfmin64x2, ASM::vfmax64x2 };
+    const VectorOp ops64x4[] = { ASM::vfadd64x4, ASM::vfsub64x4, ASM::vfmul64x4, ASM::vfdiv64x4, ASM::vfmin64x4, ASM::vfmax64x4 };
+    ASSERT_EQUAL((check_vector_float<f32, i32>(ops32x4, ASM::vfcmpcc32x4, false)), 0);
+    ASSERT_EQUAL((check_vector_float<f32, i32>(ops32x8, ASM::vfcmpcc32x8, true)), 0);
+    ASSERT_EQUAL((check_vector_float<f64, i64>(ops64x2, ASM::vfcmpcc64x2, false)), 0);
+    ASSERT_EQUAL((check_vector_float<f64, i64>(ops64x4, ASM::vfcmpcc64x4, true)), 0);
+}
+
+TEST(asm_vector_load_store) {
+    using ASM = Assembler;
+    using Move = void(*)(Assembly&, ASMVal, ASMVal);
+    const Move loads[] = { ASM::vld128, ASM::vld256, ASM::vlda128, ASM::vlda256 };
+    const Move stores[] = { ASM::vst128, ASM::vst256, ASM::vsta128, ASM::vsta256 };
+    const Move moves[] = { ASM::vmov128, ASM::vmov256, ASM::vmov128, ASM::vmov256 };
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol funcs[4];
+    for (u32 i = 0; i < 4; i ++) {
+        funcs[i] = anon(as);
+        ASM::global(as, funcs[i]);
+        i32 offset = i < 2 ? 3 : 32; // Misaligned unless we need alignment.
+        loads[i](as, FP(ASM::XMM9), Mem(ASM::RDI, offset));
+        moves[i](as, FP(ASM::XMM2), FP(ASM::XMM9));
+        stores[i](as, Mem(ASM::R8, offset), FP(ASM::XMM2));
+        ASM::vzeroupper(as);
+        ASM::ret(as);
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    alignas(32) u8 src[96], dst[96];
+    for (u32 i = 0; i < 4; i ++) {
+        for (u32 j = 0; j < 96; j ++)
+            src[j] = u8(j * 7 + i), dst[j] = 0;
+        linked.lookup<void(u8*, u8*, u8*, u8*, u8*)>(funcs[i])(src, nullptr, nullptr, nullptr, dst);
+        i32 offset = i < 2 ? 3 : 32, size = i % 2 ? 32 : 16;
+        for (i32 j = 0; j < 96; j ++)
+            ASSERT_EQUAL(dst[j], j >= offset && j < offset + size ? src[j] : 0);
+    }
+}
+
+// The memory operations use YMM scratch registers, but must leave the upper
+// halves of every other vector register alone.
+TEST(asm_vector_live_across_memory_ops) {
+    using ASM = Assembler;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol funcs[4];
+    for (u32 i = 0; i < 4; i ++) {
+        funcs[i] = anon(as);
+        ASM::global(as, funcs[i]);
+        ASM::vld256(as, FP(ASM::XMM2), Mem(ASM::RDI, 0));
+        ASM::vld256(as, FP(ASM::XMM3), Mem(ASM::RSI, 0));
+        ASM::vadd32x8(as, FP(ASM::XMM4), FP(ASM::XMM2), FP(ASM::XMM3));
+        switch (i) {
+            case 0: ASM::mset(as, Mem(ASM::R8, 0), Imm(0x5a), Imm(64)); break;
+            case 1: ASM::mset(as, Mem(ASM::R8, 0), Imm(0x5a), Imm(300)); break;
+            case 2: ASM::mcpy(as, Mem(ASM::R8, 0), Mem(ASM::R9, 0), Imm(96)); break;
+            default: ASM::mmov(as, Mem(ASM::R8, 0), Mem(ASM::R9, 0), Imm(96)); break;
+        }
+        ASM::vst256(as, Mem(ASM::RDX, 0), FP(ASM::XMM4));
+        ASM::ret(as);
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    u32 a[8], b[8], out[8];
+    u8 dst[300], src[300];
+    for (u32 i = 0; i < 4; i ++) {
+        for (u32 j = 0; j < 8; j ++)
+            a[j] = j * 0x01010101u + i, b[j] = ~j, out[j] = 0;
+        for (u32 j = 0; j < 300; j ++)
+            src[j] = u8(j), dst[j] = 0;
+        linked.lookup<void(u32*, u32*, u32*, u8*, u8*, u8*)>(funcs[i])(a, b, out, nullptr, dst, src);
+        for (u32 j = 0; j < 8; j ++)
+            ASSERT_EQUAL(out[j], a[j] + b[j]);
+        ASSERT_EQUAL(dst[63], i < 2 ? 0x5a : 63);
+    }
+}
+
+// Returning from a function that wrote a YMM register clears the upper
+// halves first, and a function that didn't leaves them alone.
+TEST(asm_vector_ret_clears_upper) {
+    using ASM = Assembler;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol wide = anon(as), narrow = anon(as);
+    ASM::global(as, wide);
+    ASM::vadd32x8(as, FP(ASM::XMM0), FP(ASM::XMM1), FP(ASM::XMM2)); // vpaddd ymm0, ymm1, ymm2
+    ASM::ret(as);
+    ASM::global(as, narrow);
+    ASM::fadd32(as, FP(ASM::XMM0), FP(ASM::XMM1), FP(ASM::XMM2)); // vaddss xmm0, xmm1, xmm2
+    ASM::ret(as);
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    const u8* code = (const u8*)linked.lookup<void()>(wide);
+    ASSERT_EQUAL(code[4], 0xc5);
+    ASSERT_EQUAL(code[5], 0xf8);
+    ASSERT_EQUAL(code[6], 0x77);
+    ASSERT_EQUAL(code[7], 0xc3);
+    code = (const u8*)linked.lookup<void()>(narrow);
+    ASSERT_EQUAL(code[4], 0xc3);
+}
+
+// Vector shapes in the order of each block 12 opcode group.
+static const u32 vectorLanes[] = { 8, 8, 16, 16, 32, 32, 64, 64 }, vectorLengths[] = { 16, 32, 8, 16, 4, 8, 2, 4 };
+
+TEST(asm_vector_broadcast) {
+    using ASM = Assembler;
+    using Broadcast = void(*)(Assembly&, ASMVal, ASMVal);
+    const Broadcast broadcasts[] = {
+        ASM::vbcast8x16, ASM::vbcast8x32, ASM::vbcast16x8, ASM::vbcast16x16,
+        ASM::vbcast32x4, ASM::vbcast32x8, ASM::vbcast64x2, ASM::vbcast64x4
+    };
+    const Broadcast fbroadcasts[] = { ASM::vfbcast32x4, ASM::vfbcast32x8, ASM::vfbcast64x2, ASM::vfbcast64x4 };
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol funcs[8][2], ffuncs[4][2];
+    for (u32 i = 0; i < 8; i ++) for (u32 v = 0; v < 2; v ++) {
+        funcs[i][v] = anon(as);
+        ASM::global(as, funcs[i][v]);
+        broadcasts[i](as, FP(ASM::XMM4), v ? Imm(-0x12345678) : GP(ASM::R9));
+        ASM::vst256(as, Mem(ASM::RSI, 0), FP(ASM::XMM4));
+        ASM::vzeroupper(as);
+        ASM::ret(as);
+    }
+    for (u32 i = 0; i < 4; i ++) for (u32 v = 0; v < 2; v ++) {
+        ffuncs[i][v] = anon(as);
+        ASM::global(as, ffuncs[i][v]);
+        ASMVal constant = i < 2 ? F32(-2.5f) : F64(-2.5);
+        fbroadcasts[i](as, FP(ASM::XMM12), v ? constant : FP(ASM::XMM0));
+        ASM::vst256(as, Mem(ASM::RDI, 0), FP(ASM::XMM12));
+        ASM::vzeroupper(as);
+        ASM::ret(as);
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    i32 failures = 0;
+    u8 out[32];
+    for (u32 i = 0; i < 8; i ++) for (u32 v = 0; v < 2; v ++) {
+        i64 x = v ? -0x12345678 : 0x0123456789abcdefll;
+        for (u32 j = 0; j < 32; j ++)
+            out[j] = 0;
+        linked.lookup<void(i64, u8*, i64, i64, i64, i64)>(funcs[i][v])(0, out, 0, 0, 0, x);
+        for (u32 j = 0; j < 32 / (vectorLanes[i] / 8); j ++)
+            if (get_lane(out, vectorLanes[i], j) != (j < vectorLengths[i] ? get_lane((const u8*)&x, vectorLanes[i], 0) : 0))
+                failures ++;
+    }
+    for (u32 v = 0; v < 2; v ++) {
+        f32 out32[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+        f64 out64[4] = { 0, 0, 0, 0 };
+        linked.lookup<void(f32*, f32)>(ffuncs[0][v])(out32, 1.5f);
+        for (u32 j = 0; j < 8; j ++) if (out32[j] != (j < 4 ? (v ? -2.5f : 1.5f) : 0)) failures ++;
+        linked.lookup<void(f32*, f32)>(ffuncs[1][v])(out32, 1.5f);
+        for (u32 j = 0; j < 8; j ++) if (out32[j] != (v ? -2.5f : 1.5f)) failures ++;
+        linked.lookup<void(f64*, f64)>(ffuncs[2][v])(out64, 1.5);
+        for (u32 j = 0; j < 4; j ++) if (out64[j] != (j < 2 ? (v ? -2.5 : 1.5) : 0)) failures ++;
+        linked.lookup<void(f64*, f64)>(ffuncs[3][v])(out64, 1.5);
+        for (u32 j = 0; j < 4; j ++) if (out64[j] != (v ? -2.5 : 1.5)) failures ++;
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+// Extracts and then inserts every lane of every shape, integer and float.
+TEST(asm_vector_lanes) {
+    using ASM = Assembler;
+    using Extract = void(*)(Assembly&, ASMVal, ASMVal, ASMVal);
+    using Insert = void(*)(Assembly&, ASMVal, ASMVal, ASMVal, ASMVal);
+    const Extract extracts[] = {
+        ASM::vext8x16, ASM::vext8x32, ASM::vext16x8, ASM::vext16x16, ASM::vext32x4, ASM::vext32x8, ASM::vext64x2, ASM::vext64x4,
+        ASM::vfext32x4, ASM::vfext32x8, ASM::vfext64x2, ASM::vfext64x4
+    };
+    const Insert inserts[] = {
+        ASM::vins8x16, ASM::vins8x32, ASM::vins16x8, ASM::vins16x16, ASM::vins32x4, ASM::vins32x8, ASM::vins64x2, ASM::vins64x4,
+        ASM::vfins32x4, ASM::vfins32x8, ASM::vfins64x2, ASM::vfins64x4
+    };
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol extractFuncs[12][32], insertFuncs[12][32];
+    for (u32 i = 0; i < 12; i ++) for (u32 j = 0; j < vectorLengths[i % 8 + (i >= 8 ? 4 : 0)]; j ++) {
+        bool fp = i >= 8;
+        extractFuncs[i][j] = anon(as);
+        ASM::global(as, extractFuncs[i][j]);
+        ASM::vld256(as, FP(ASM::XMM2), Mem(ASM::RDI, 0));
+        extracts[i](as, fp ? FP(ASM::XMM0) : GP(ASM::RAX), FP(ASM::XMM2), Imm(j));
+        ASM::vzeroupper(as);
+        ASM::ret(as);
+
+        // Inserts into a copy, so a should be left alone, and over a.
+        insertFuncs[i][j] = anon(as);
+        ASM::global(as, insertFuncs[i][j]);
+        ASM::vld256(as, FP(ASM::XMM2), Mem(ASM::RDI, 0));
+        if (fp)
+            ASM::fmov64(as, FP(ASM::XMM5), FP(ASM::XMM0));
+        inserts[i](as, FP(ASM::XMM4), FP(ASM::XMM2), fp ? FP(ASM::XMM5) : GP(ASM::RDX), Imm(j));
+        ASM::vst256(as, Mem(ASM::RSI, 0), FP(ASM::XMM4));
+        inserts[i](as, FP(ASM::XMM2), FP(ASM::XMM2), fp ? FP(ASM::XMM5) : GP(ASM::RDX), Imm(j));
+        ASM::vst256(as, Mem(ASM::RSI, 32), FP(ASM::XMM2));
+        ASM::vzeroupper(as);
+        ASM::ret(as);
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    i32 failures = 0;
+    u8 v[32], out[64];
+    for (u32 j = 0; j < 32; j ++)
+        v[j] = u8(j * 37 + 11);
+    for (u32 i = 0; i < 12; i ++) {
+        u32 shape = i % 8 + (i >= 8 ? 4 : 0), lane = vectorLanes[shape], length = vectorLengths[shape];
+        u64 mask = lane_mask(lane);
+        for (u32 j = 0; j < length; j ++) {
+            u64 expected = u64(get_lane(v, lane, j)) & mask;
+            if (i < 8 && linked.lookup<u64(u8*)>(extractFuncs[i][j])(v) != expected)
+                failures ++;
+            if (i >= 8 && lane == 32) {
+                f32 result = linked.lookup<f32(u8*)>(extractFuncs[i][j])(v);
+                if (*(u32*)&result != expected)
+                    failures ++;
+            }
+            if (i >= 8 && lane == 64) {
+                f64 result = linked.lookup<f64(u8*)>(extractFuncs[i][j])(v);
+                if (*(u64*)&result != expected)
+                    failures ++;
+            }
+
+            u64 x = 0xfedcba9876543210ull;
+            f32 x32 = *(f32*)&x;
+            f64 x64 = *(f64*)&x;
+            if (i < 8)
+                linked.lookup<void(u8*, u8*, u64)>(insertFuncs[i][j])(v, out, x);
+            else if (lane == 32)
+                linked.lookup<void(u8*, u8*, f32)>(insertFuncs[i][j])(v, out, x32);
+            else
+                linked.lookup<void(u8*, u8*, f64)>(insertFuncs[i][j])(v, out, x64);
+            for (u32 k = 0; k < 64 / (lane / 8); k ++) {
+                u32 n = k % (32 / (lane / 8));
+                u64 lhs = u64(get_lane(out, lane, k)) & mask, rhs = n == j ? x & mask : n < length ? u64(get_lane(v, lane, n)) & mask : 0;
+                if (lhs != rhs)
+                    failures ++;
+            }
+        }
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+TEST(asm_vector_shuffle) {
+    using ASM = Assembler;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    const VectorOp permutes[] = { ASM::vperm8x16, ASM::vperm8x32, ASM::vperm32x8 };
+    const VectorOp shuffles[] = { ASM::vshuf32x4, ASM::vshuf32x8, ASM::vshuf64x2, ASM::vshuf64x2, ASM::vshuf64x4 };
+    const u8 imms[] = { 0x1b, 0x1b, 0x01, 0x02, 0x4e };
+    Symbol funcs[8];
+    for (u32 i = 0; i < 8; i ++) {
+        funcs[i] = emit_vector_function(as, true, 0, [&](ASMVal dst, ASMVal a, ASMVal b) {
+            if (i < 3) permutes[i](as, dst, a, b);
+            else shuffles[i - 3](as, dst, a, Imm(imms[i - 3]));
+        });
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    u8 a[32], b[32], out[32];
+    for (u32 j = 0; j < 32; j ++)
+        a[j] = u8(j + 100), b[j] = u8(j * 7 % 19 | (j == 5 ? 0x80 : 0));
+
+    for (u32 i = 0; i < 2; i ++) { // vpshufb indexes within each half, and zeroes negative indices.
+        for (u32 j = 0; j < 32; j ++)
+            out[j] = 0;
+        linked.lookup<void(u8*, u8*, u8*)>(funcs[i])(a, b, out);
+        for (u32 j = 0; j < (i ? 32 : 16); j ++)
+            ASSERT_EQUAL(out[j], b[j] & 0x80 ? 0 : a[j / 16 * 16 + (b[j] & 15)]);
+    }
+    u32 indices[8] = { 7, 0, 3, 3, 9, 2, 6, 1 };
+    linked.lookup<void(u8*, u32*, u8*)>(funcs[2])(a, indices, out);
+    for (u32 j = 0; j < 8; j ++)
+        ASSERT_EQUAL(get_lane(out, 32, j), get_lane(a, 32, indices[j] % 8));
+
+    for (u32 i = 3; i < 8; i ++) {
+        for (u32 j = 0; j < 32; j ++)
+            out[j] = 0;
+        linked.lookup<void(u8*, u8*, u8*)>(funcs[i])(a, b, out);
+        u32 lane = i < 5 ? 32 : 64, length = i == 3 ? 4 : i == 4 ? 8 : i < 7 ? 2 : 4, bits = lane == 32 || i == 7 ? 2 : 1;
+        u32 group = i == 7 ? 4 : 128 / lane;
+        for (u32 j = 0; j < length; j ++) {
+            u32 pick = imms[i - 3] >> (j % group * bits) & ((1 << bits) - 1);
+            ASSERT_EQUAL(get_lane(out, lane, j), get_lane(a, lane, j / group * group + pick));
+        }
+    }
+}
+
+TEST(regset_above_64) {
+    RegSet set(3, 64, 70, 127);
+    ASSERT_EQUAL(set.size(), 4);
+    ASSERT(set[64] && set[127] && !set[0] && !set[65]);
+    mreg expected[] = { 3, 64, 70, 127 };
+    u32 i = 0;
+    for (mreg r : set)
+        ASSERT_EQUAL(r, expected[i ++]);
+    ASSERT_EQUAL(i, 4);
+    ASSERT((set - RegSet(3, 127)) == RegSet(64, 70));
+    ASSERT((set & RegSet(70, 5)) == RegSet(70));
+    ASSERT((~set)[65] && !(~set)[70]);
+    ASSERT(!RegSet(3).without(3));
+}
+
+// AVX-512 tests are skipped where the host can't run them.
+static bool has_avx512() {
+    return Assembler::host_level() >= ISA_V4;
+}
+
+// Emits a function taking pointers to a, b (less 192) and the result (less
+// 8), so the displacements cover both scaled 8-bit and 32-bit forms. The
+// variant picks registers that need every EVEX extension bit, computes over
+// a, or sticks to the first sixteen.
+template<typename Emit>
+static Symbol emit_avx512_function(Assembly& as, u32 variant, const Emit& emit) {
+    using ASM = Assembler;
+    Symbol sym = anon(as);
+    ASM::global(as, sym);
+    ASMVal a = FP(variant < 2 ? ASM::XMM18 : ASM::XMM2), b = FP(variant < 2 ? ASM::XMM25 : ASM::XMM9);
+    ASMVal dst = variant == 1 ? a : FP(variant == 0 ? ASM::XMM29 : ASM::XMM4);
+    ASM::vld512(as, a, Mem(ASM::RDI, 0));
+    ASM::vld512(as, b, Mem(ASM::RSI, 192));
+    emit(dst, a, b);
+    ASM::vst512(as, Mem(ASM::RDX, 8), dst);
+    ASM::vzeroupper(as);
+    ASM::ret(as);
+    return sym;
+}
+
+static const VectorOpTest avx512OpTests[] = {
+#define AVX512_OP_SHAPES(lower, expr) \
+    { Assembler::lower##8x64, 8, 64, -1, expr }, { Assembler::lower##16x32, 16, 32, -1, expr }, \
+    { Assembler::lower##32x16, 32, 16, -1, expr }, { Assembler::lower##64x8, 64, 8, -1, expr }
+    AVX512_OP_SHAPES(vadd, [](i64 a, i64 b, u32) -> i64 { return u64(a) + u64(b); }),
+    AVX512_OP_SHAPES(vsub, [](i64 a, i64 b, u32) -> i64 { return u64(a) - u64(b); }),
+    AVX512_OP_SHAPES(vmin, [](i64 a, i64 b, u32) -> i64 { return a < b ? a : b; }),
+    AVX512_OP_SHAPES(vmax, [](i64 a, i64 b, u32) -> i64 { return a > b ? a : b; }),
+#undef AVX512_OP_SHAPES
+    { Assembler::vmul16x32, 16, 32, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) * u64(b); } },
+    { Assembler::vmul32x16, 32, 16, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) * u64(b); } },
+    { Assembler::vmul64x8, 64, 8, -1, [](i64 a, i64 b, u32) -> i64 { return u64(a) * u64(b); } },
+    { Assembler::vand64x8, 64, 8, -1, [](i64 a, i64 b, u32) -> i64 { return a & b; } },
+    { Assembler::vor64x8, 64, 8, -1, [](i64 a, i64 b, u32) -> i64 { return a | b; } },
+    { Assembler::vxor64x8, 64, 8, -1, [](i64 a, i64 b, u32) -> i64 { return a ^ b; } },
+};
+
+TEST(asm_avx512_arithmetic) {
+    if (!has_avx512())
+        return;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    as.isa = ISA_V4;
+    constexpr u32 ntests = sizeof(avx512OpTests) / sizeof(avx512OpTests[0]);
+    Symbol funcs[ntests][3];
+    for (u32 i = 0; i < ntests; i ++) for (u32 v = 0; v < 3; v ++)
+        funcs[i][v] = emit_avx512_function(as, v, [&](ASMVal dst, ASMVal a, ASMVal b) { avx512OpTests[i].op(as, dst, a, b); });
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    i32 failures = 0;
+    u8 a[64], b[64], out[64];
+    for (u32 i = 0; i < ntests; i ++) for (u32 v = 0; v < 3; v ++) {
+        const VectorOpTest& test = avx512OpTests[i];
+        fill_vectors(a, b, test.lane, i * 3 + v);
+        linked.lookup<void(u8*, u8*, u8*)>(funcs[i][v])(a, b - 192, out - 8);
+        for (u32 j = 0; j < test.length; j ++) {
+            i64 x = get_lane(a, test.lane, j), y = get_lane(b, test.lane, j);
+            if ((u64(get_lane(out, test.lane, j)) ^ u64(test.reference(x, y, test.lane))) & lane_mask(test.lane))
+                failures ++;
+        }
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+TEST(asm_avx512_float) {
+    if (!has_avx512())
+        return;
+    using ASM = Assembler;
+    const VectorOp ops32[] = { ASM::vfadd32x16, ASM::vfsub32x16, ASM::vfmul32x16, ASM::vfdiv32x16, ASM::vfmin32x16, ASM::vfmax32x16 };
+    const VectorOp ops64[] = { ASM::vfadd64x8, ASM::vfsub64x8, ASM::vfmul64x8, ASM::vfdiv64x8, ASM::vfmin64x8, ASM::vfmax64x8 };
+    constexpr u32 nconds = sizeof(fselConditions) / sizeof(fselConditions[0]);
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    as.isa = ISA_V4;
+    Symbol funcs[2][6], compares[2][nconds];
+    for (u32 w = 0; w < 2; w ++) {
+        for (u32 i = 0; i < 6; i ++)
+            funcs[w][i] = emit_avx512_function(as, i % 3, [&](ASMVal dst, ASMVal a, ASMVal b) { (w ? ops64 : ops32)[i](as, dst, a, b); });
+        for (u32 c = 0; c < nconds; c ++) {
+            compares[w][c] = anon(as);
+            ASM::global(as, compares[w][c]);
+            ASM::vld512(as, FP(ASM::XMM17), Mem(ASM::RDI, 0));
+            ASM::vld512(as, FP(ASM::XMM30), Mem(ASM::RSI, 0));
+            (w ? ASM::kfcmpcc64x8 : ASM::kfcmpcc32x16)(as, fselConditions[c], Mask(ASM::K6), FP(ASM::XMM17), FP(ASM::XMM30));
+            ASM::ktoi64(as, GP(ASM::RAX), Mask(ASM::K6));
+            ASM::vzeroupper(as);
+            ASM::ret(as);
+        }
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    i32 failures = 0;
+    f32 a32[16], b32[16], out32[16];
+    f64 a64[8], b64[8], out64[8];
+    for (u32 j = 0; j < 16; j ++) {
+        a32[j] = f32(i32(j * 7 % 11) - 5) / 4;
+        b32[j] = j % 3 == 0 ? a32[j] : f32(i32(j * 5 % 13) - 6) / 2;
+        if (j < 8) a64[j] = a32[j], b64[j] = b32[j];
+    }
+    b32[1] = b64[1] = 0.0 / 0.0;
+    for (u32 i = 0; i < 6; i ++) {
+        linked.lookup<void(f32*, f32*, f32*)>(funcs[0][i])(a32, b32 - 48, out32 - 2);
+        for (u32 j = 0; j < 16; j ++) if (j != 1 && out32[j] != vector_float_reference(i, a32[j], b32[j]))
+            failures ++;
+        linked.lookup<void(f64*, f64*, f64*)>(funcs[1][i])(a64, b64 - 24, out64 - 1);
+        for (u32 j = 0; j < 8; j ++) if (j != 1 && out64[j] != vector_float_reference(i, a64[j], b64[j]))
+            failures ++;
+    }
+    for (u32 c = 0; c < nconds; c ++) {
+        u64 mask32 = linked.lookup<u64(f32*, f32*)>(compares[0][c])(a32, b32);
+        u64 mask64 = linked.lookup<u64(f64*, f64*)>(compares[1][c])(a64, b64);
+        for (u32 j = 0; j < 16; j ++) {
+            if ((mask32 >> j & 1) != float_holds(fselConditions[c], a32[j], b32[j]))
+                failures ++;
+            if (j < 8 && (mask64 >> j & 1) != float_holds(fselConditions[c], a64[j], b64[j]))
+                failures ++;
+        }
+        if (mask32 >> 16 || mask64 >> 8)
+            failures ++;
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+// Compares into a mask under every condition, then uses the mask (or one
+// passed in) for a masked load, store and blend.
+TEST(asm_avx512_masks) {
+    if (!has_avx512())
+        return;
+    using ASM = Assembler;
+    using Compare = void(*)(Assembly&, Condition, ASMVal, ASMVal, ASMVal);
+    using Masked = void(*)(Assembly&, ASMVal, ASMVal, ASMVal);
+    using Blend = void(*)(Assembly&, ASMVal, ASMVal, ASMVal, ASMVal);
+    const Compare compares[] = { ASM::kcmpcc8x64, ASM::kcmpcc16x32, ASM::kcmpcc32x16, ASM::kcmpcc64x8 };
+    const Masked loads[] = { ASM::vmld8x64, ASM::vmld16x32, ASM::vmld32x16, ASM::vmld64x8 };
+    const Masked stores[] = { ASM::vmst8x64, ASM::vmst16x32, ASM::vmst32x16, ASM::vmst64x8 };
+    const Blend blends[] = { ASM::vblendm8x64, ASM::vblendm16x32, ASM::vblendm32x16, ASM::vblendm64x8 };
+    const u32 lanes[] = { 8, 16, 32, 64 };
+    constexpr u32 nconds = COND_TEST_NONZERO + 1;
+
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    as.isa = ISA_V4;
+    Symbol compareFuncs[4][nconds], maskedFuncs[4];
+    for (u32 i = 0; i < 4; i ++) {
+        for (u32 c = 0; c < nconds; c ++) {
+            compareFuncs[i][c] = anon(as);
+            ASM::global(as, compareFuncs[i][c]);
+            ASM::vld512(as, FP(ASM::XMM20), Mem(ASM::RDI, 0));
+            ASM::vld512(as, FP(ASM::XMM3), Mem(ASM::RSI, 0));
+            compares[i](as, Condition(c), Mask(ASM::K3), FP(ASM::XMM20), FP(ASM::XMM3));
+            ASM::ktoi64(as, GP(ASM::R10), Mask(ASM::K3));
+            ASM::mov64(as, GP(ASM::RAX), GP(ASM::R10));
+            ASM::vzeroupper(as);
+            ASM::ret(as);
+        }
+
+        // Takes src, a 192-byte out buffer whose first 64 bytes are already
+        // filled, and the mask. Writes the masked store over the first 64,
+        // then the masked load and the blend.
+        maskedFuncs[i] = anon(as);
+        ASM::global(as, maskedFuncs[i]);
+        ASM::i64tok(as, Mask(ASM::K5), GP(ASM::RDX));
+        ASM::vld512(as, FP(ASM::XMM1), Mem(ASM::RSI, 0));
+        ASM::vld512(as, FP(ASM::XMM21), Mem(ASM::RDI, 0));
+        loads[i](as, FP(ASM::XMM20), Mem(ASM::RDI, 0), Mask(ASM::K5));
+        stores[i](as, Mem(ASM::RSI, 0), FP(ASM::XMM21), Mask(ASM::K5));
+        ASM::vst512(as, Mem(ASM::RSI, 64), FP(ASM::XMM20));
+        blends[i](as, FP(ASM::XMM22), FP(ASM::XMM1), FP(ASM::XMM21), Mask(ASM::K5));
+        ASM::vst512(as, Mem(ASM::RSI, 128), FP(ASM::XMM22));
+        ASM::vzeroupper(as);
+        ASM::ret(as);
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    i32 failures = 0;
+    u8 a[64], b[64], out[192];
+    for (u32 i = 0; i < 4; i ++) {
+        u32 lane = lanes[i], length = 512 / lane;
+        for (u32 c = 0; c < nconds; c ++) {
+            fill_vectors(a, b, lane, i * 64 + c);
+            u64 mask = linked.lookup<u64(u8*, u8*)>(compareFuncs[i][c])(a, b);
+            for (u32 j = 0; j < length; j ++)
+                if ((mask >> j & 1) != vector_condition_holds(Condition(c), get_lane(a, lane, j), get_lane(b, lane, j), lane))
+                    failures ++;
+            if (length < 64 && mask >> length)
+                failures ++;
+        }
+
+        const u64 masks[] = { 0, 1, 0x5a5a5a5a5a5a5a5aull, ~0ull >> 3, ~0ull };
+        for (u64 mask : masks) {
+            fill_vectors(a, b, lane, i);
+            for (u32 j = 0; j < 64; j ++)
+                out[j] = b[j];
+            linked.lookup<void(u8*, u8*, u64)>(maskedFuncs[i])(a, out, mask);
+            for (u32 j = 0; j < length; j ++) {
+                bool set = mask >> j & 1;
+                u64 x = get_lane(a, lane, j), old = get_lane(b, lane, j);
+                if (u64(get_lane(out, lane, j)) != (set ? x : old))
+                    failures ++;
+                if (u64(get_lane(out + 64, lane, j)) != (set ? x : 0))
+                    failures ++;
+                if (u64(get_lane(out + 128, lane, j)) != (set ? x : old))
+                    failures ++;
+            }
+        }
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+TEST(asm_avx512_broadcast) {
+    if (!has_avx512())
+        return;
+    using ASM = Assembler;
+    using Broadcast = void(*)(Assembly&, ASMVal, ASMVal);
+    const Broadcast broadcasts[] = { ASM::vbcast8x64, ASM::vbcast16x32, ASM::vbcast32x16, ASM::vbcast64x8 };
+    const u32 lanes[] = { 8, 16, 32, 64 };
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    as.isa = ISA_V4;
+    Symbol funcs[4][2], ffuncs[2];
+    for (u32 i = 0; i < 4; i ++) for (u32 v = 0; v < 2; v ++) {
+        funcs[i][v] = anon(as);
+        ASM::global(as, funcs[i][v]);
+        broadcasts[i](as, FP(ASM::XMM31), v ? Imm(-0x12345678) : GP(ASM::R9));
+        ASM::vmov512(as, FP(ASM::XMM7), FP(ASM::XMM31));
+        ASM::vst512(as, Mem(ASM::RSI, 0), FP(ASM::XMM7));
+        ASM::vzeroupper(as);
+        ASM::ret(as);
+    }
+    for (u32 w = 0; w < 2; w ++) {
+        ffuncs[w] = anon(as);
+        ASM::global(as, ffuncs[w]);
+        if (w) ASM::vfbcast64x8(as, FP(ASM::XMM16), FP(ASM::XMM0));
+        else ASM::vfbcast32x16(as, FP(ASM::XMM16), F32(-2.5f));
+        ASM::vst512(as, Mem(ASM::RDI, 0), FP(ASM::XMM16));
+        ASM::vzeroupper(as);
+        ASM::ret(as);
+    }
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    i32 failures = 0;
+    u8 out[64];
+    for (u32 i = 0; i < 4; i ++) for (u32 v = 0; v < 2; v ++) {
+        i64 x = v ? -0x12345678 : 0x0123456789abcdefll;
+        linked.lookup<void(i64, u8*, i64, i64, i64, i64)>(funcs[i][v])(0, out, 0, 0, 0, x);
+        for (u32 j = 0; j < 512 / lanes[i]; j ++)
+            if (get_lane(out, lanes[i], j) != get_lane((const u8*)&x, lanes[i], 0))
+                failures ++;
+    }
+    f32 out32[16];
+    f64 out64[8];
+    linked.lookup<void(f32*)>(ffuncs[0])(out32);
+    linked.lookup<void(f64*, f64)>(ffuncs[1])(out64, 1.5);
+    for (u32 j = 0; j < 16; j ++)
+        if (out32[j] != -2.5f || (j < 8 && out64[j] != 1.5))
+            failures ++;
+    ASSERT_EQUAL(failures, 0);
+}
+
+// ISA levels.
+
+TEST(asm_host_features) {
+    using ASM = Assembler;
+    u32 features = ASM::host_features();
+    ASSERT_EQUAL(bool(features & ASM::FEATURE_POPCNT), bool(__builtin_cpu_supports("popcnt")));
+    ASSERT_EQUAL(bool(features & ASM::FEATURE_SSE42), bool(__builtin_cpu_supports("sse4.2")));
+    ASSERT_EQUAL(bool(features & ASM::FEATURE_AVX2), bool(__builtin_cpu_supports("avx2")));
+    ASSERT_EQUAL(bool(features & ASM::FEATURE_BMI2), bool(__builtin_cpu_supports("bmi2")));
+    ASSERT_EQUAL(bool(features & ASM::FEATURE_FMA), bool(__builtin_cpu_supports("fma")));
+    ASSERT_EQUAL(bool(features & ASM::FEATURE_AVX512BW), bool(__builtin_cpu_supports("avx512bw")));
+    ASSERT_EQUAL(ASM::level_of(0), ISA_BASELINE);
+    ASSERT_EQUAL(ASM::level_of(ASM::FEATURES_V2 | ASM::FEATURE_AVX2), ISA_V2);
+    ASSERT_EQUAL(ASM::level_of(ASM::FEATURES_V4 & ~ASM::FEATURE_AVX512VL), ISA_V3);
+    ASSERT_EQUAL(ASM::level_of(ASM::FEATURES_V4), ISA_V4);
+}
+
+static bool formats_as(const TargetDesc& desc, const i8* expected) {
+    array<i8, 64> buf;
+    slice<i8> io = buf;
+    io = format(io, desc);
+    u32 n = 64 - io.size();
+    for (u32 i = 0; i < n; i ++)
+        if (buf[i] != expected[i])
+            return false;
+    return !expected[n];
+}
+
+TEST(target_desc_levels) {
+    ASSERT(formats_as(AMD64LinuxAssembler::DESC, "linux-amd64-v3"));
+    ASSERT(formats_as(AMD64LinuxV1Assembler::DESC, "linux-amd64-v1"));
+    ASSERT(AMD64LinuxV1Assembler::DESC != AMD64LinuxAssembler::DESC);
+    ASSERT(AMD64LinuxLevelAssembler<ISA_V3>::DESC == AMD64LinuxAssembler::DESC);
+    ASSERT(AMD64LinuxV1Assembler::clobbers(ASMOpcode::POPC32)[Assembler::RCX]);
+    ASSERT(!AMD64LinuxV2Assembler::clobbers(ASMOpcode::POPC32));
+    ASSERT(AMD64LinuxV2Assembler::clobbers(ASMOpcode::FSUB32)[Assembler::XMM0]);
+    ASSERT(AMD64LinuxV4Assembler::clobbers(ASMOpcode::FSUB32) == AMD64LinuxAssembler::clobbers(ASMOpcode::FSUB32));
+}
+
+// A level target driven through TargetInterface, with an assembly at the
+// matching level, emits that level's encodings.
+TEST(target_level_matches_assembly) {
+    using ASM = Assembler;
+    TargetImplementation<AMD64LinuxV1Assembler> target;
+    TestContext ctx(target.desc().level);
+    Symbol func = anon(ctx.as);
+    target.global(ctx.as, func);
+    target.popc32(ctx.as, GP(ASM::RAX), GP(ASM::RDI));
+    target.ret(ctx.as);
+    LinkedAssembly linked = ctx.as.link();
+    linked.load();
+    auto popc = linked.lookup<u32(u32)>(func);
+    ASSERT_EQUAL(popc(0), 0);
+    ASSERT_EQUAL(popc(0xf0f0f0f0u), 16);
+    const u8* code = (const u8*)popc;
+    ASSERT(code[0] != 0xf3 || code[1] != 0x0f || code[2] != 0xb8); // no popcnt at v1
+}
+
+// The same instructions at the baseline and at v3, against their known
+// encodings.
+TEST(asm_isa_encodings) {
+    using ASM = Assembler;
+    const u8 expected[2][3][4] = {
+        { { 0xf3, 0x0f, 0x58, 0xca }, { 0xf3, 0x0f, 0x6f, 0x07 }, { 0x0f, 0xbc, 0xc7, 0x0f } },
+        { { 0xc5, 0xf2, 0x58, 0xca }, { 0xc5, 0xfa, 0x6f, 0x07 }, { 0xf3, 0x0f, 0xbc, 0xc7 } }
+    };
+    for (u32 i = 0; i < 2; i ++) {
+        TestContext ctx(i ? ISA_V3 : ISA_BASELINE);
+        Assembly& as = ctx.as;
+        Symbol funcs[3];
+        for (u32 j = 0; j < 3; j ++) {
+            funcs[j] = anon(as);
+            ASM::global(as, funcs[j]);
+            switch (j) {
+                case 0: ASM::fadd32(as, FP(ASM::XMM1), FP(ASM::XMM1), FP(ASM::XMM2)); break; // addss xmm1, xmm2
+                case 1: ASM::vload(as, false, ASM::XMM0, Mem(ASM::RDI, 0), 0); break; // movdqu xmm0, [rdi]
+                case 2: ASM::tzc32(as, GP(ASM::RAX), GP(ASM::RDI)); break; // bsf or tzcnt eax, edi
+            }
+            ASM::ret(as);
+        }
+        LinkedAssembly linked = as.link();
+        linked.load();
+        for (u32 j = 0; j < 3; j ++) {
+            const u8* code = (const u8*)linked.lookup<void()>(funcs[j]);
+            for (u32 k = 0; k < 4; k ++)
+                ASSERT_EQUAL(code[k], expected[i][j][k]);
+        }
+    }
+}
+
+template<typename T>
+static T float_reference(u32 op, T x, T y) {
+    switch (op) {
+        case 0: return __builtin_nearbyint(x);
+        case 1: return __builtin_floor(x);
+        case 2: return __builtin_ceil(x);
+        case 3: return __builtin_trunc(x);
+        case 4: return __builtin_fabs(x);
+        case 5: return -x;
+        default: return x - T(__builtin_trunc(T(x / y))) * y;
+    }
+}
+
+// Rounding, abs, neg and rem at each level, with the result in a fresh
+// register or over the source.
+using FloatUnary = void(*)(Assembly&, ASMVal, ASMVal);
+using FloatBinary = void(*)(Assembly&, ASMVal, ASMVal, ASMVal);
+
+template<typename T>
+static i32 check_float_levels(const FloatUnary (&ops)[6], FloatBinary rem, FloatUnary move) {
+    using ASM = Assembler;
+    const T values[] = {
+        0, -T(0), 0.3, -0.3, 0.5, -0.5, 1.5, -1.5, 2.5, -2.5, 7.75, -7.25, 1e10, -1e-30,
+        8388607.5, 4503599627370495.5, T(1) / T(0), -T(1) / T(0), T(0) / T(0)
+    };
+    i32 failures = 0;
+    for (ISALevel level : testLevels) if (level <= ASM::host_level()) {
+        TestContext ctx(level);
+        Assembly& as = ctx.as;
+        Symbol funcs[7][2];
+        for (u32 i = 0; i < 7; i ++) for (u32 v = 0; v < 2; v ++) {
+            funcs[i][v] = anon(as);
+            ASM::global(as, funcs[i][v]);
+            move(as, FP(ASM::XMM2), FP(ASM::XMM0));
+            move(as, FP(ASM::XMM3), FP(ASM::XMM1));
+            ASMVal dst = FP(v ? ASM::XMM2 : ASM::XMM4);
+            if (i < 6) ops[i](as, dst, FP(ASM::XMM2));
+            else rem(as, dst, FP(ASM::XMM2), FP(ASM::XMM3));
+            move(as, FP(ASM::XMM0), dst);
+            ASM::ret(as);
+        }
+        LinkedAssembly linked = as.link();
+        linked.load();
+        for (u32 i = 0; i < 7; i ++) for (u32 v = 0; v < 2; v ++) for (T x : values) {
+            T y = i == 6 ? T(-2.5) : T(0);
+            T expected = float_reference(i, x, y), result = linked.lookup<T(T, T)>(funcs[i][v])(x, y);
+            if (!bits_equal(result, expected) && !(result != result && expected != expected))
+                failures ++;
+        }
+    }
+    return failures;
+}
+
+TEST(asm_float_levels) {
+    using ASM = Assembler;
+    const FloatUnary ops32[6] = { ASM::fround32, ASM::ffloor32, ASM::fceil32, ASM::ftrunc32, ASM::fabs32, ASM::fneg32 };
+    const FloatUnary ops64[6] = { ASM::fround64, ASM::ffloor64, ASM::fceil64, ASM::ftrunc64, ASM::fabs64, ASM::fneg64 };
+    ASSERT_EQUAL(check_float_levels<f32>(ops32, ASM::frem32, ASM::fmov32), 0);
+    ASSERT_EQUAL(check_float_levels<f64>(ops64, ASM::frem64, ASM::fmov64), 0);
+}
+
+TEST(asm_bit_count_levels) {
+    using ASM = Assembler;
+    using Unary = void(*)(Assembly&, ASMVal, ASMVal);
+    const Unary ops[3][4] = {
+        { ASM::popc8, ASM::popc16, ASM::popc32, ASM::popc64 },
+        { ASM::lzc8, ASM::lzc16, ASM::lzc32, ASM::lzc64 },
+        { ASM::tzc8, ASM::tzc16, ASM::tzc32, ASM::tzc64 }
+    };
+    const u64 values[] = {
+        0, 1, 0x80, 0xff, 0x100, 0x8000, 0x12345678, 0x80000000, 0xffffffff,
+        0x8000000000000000ull, 0x0123456789abcdefull, ~0ull
+    };
+    i32 failures = 0;
+    for (ISALevel level : testLevels) if (level <= ASM::host_level()) {
+        TestContext ctx(level);
+        Assembly& as = ctx.as;
+        Symbol funcs[3][4][2];
+        for (u32 i = 0; i < 3; i ++) for (u32 s = 0; s < 4; s ++) for (u32 v = 0; v < 2; v ++) {
+            funcs[i][s][v] = anon(as);
+            ASM::global(as, funcs[i][s][v]);
+            ASM::mov64(as, GP(ASM::R9), GP(ASM::RDI));
+            ops[i][s](as, GP(v ? ASM::R9 : ASM::R8), GP(ASM::R9));
+            ASM::mov64(as, GP(returnRegister), GP(v ? ASM::R9 : ASM::R8));
+            ASM::ret(as);
+        }
+        LinkedAssembly linked = as.link();
+        linked.load();
+        for (u32 i = 0; i < 3; i ++) for (u32 s = 0; s < 4; s ++) for (u32 v = 0; v < 2; v ++) for (u64 value : values) {
+            u32 bits = 8 << s;
+            u64 x = bits == 64 ? value : value & ((1ull << bits) - 1);
+            u64 expected = i == 0 ? __builtin_popcountll(x) : !x ? bits : i == 1 ? __builtin_clzll(x) - (64 - bits) : __builtin_ctzll(x);
+            u64 result = linked.lookup<u64(u64)>(funcs[i][s][v])(value);
+            if ((result & (bits <= 16 ? 0xffff : ~0ull)) != expected)
+                failures ++;
+        }
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+// The memory opcodes only have SSE2 to work with at the baseline.
+TEST(asm_memory_baseline) {
+    using ASM = Assembler;
+    TestContext ctx(ISA_BASELINE);
+    Assembly& as = ctx.as;
+    constexpr u32 nfills = sizeof(msetSizes) / sizeof(msetSizes[0]), nmoves = sizeof(mmovSizes) / sizeof(mmovSizes[0]);
+    constexpr u32 ncompares = sizeof(mcmpSizes) / sizeof(mcmpSizes[0]);
+    Symbol fills[nfills][2], moves[nmoves], copies[nmoves], compares[ncompares];
+    for (u32 i = 0; i < nfills; i ++) for (u32 v = 0; v < 2; v ++) {
+        fills[i][v] = anon(as);
+        ASM::global(as, fills[i][v]);
+        ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDI));
+        ASM::mset(as, Mem(ASM::RAX, 0), v ? GP(ASM::RSI) : Imm(0x5a), Imm(msetSizes[i]));
+        ASM::ret(as);
+    }
+    for (u32 i = 0; i < nmoves; i ++) {
+        moves[i] = anon(as);
+        ASM::global(as, moves[i]);
+        ASM::mmov(as, Mem(ASM::RDI, 0), Mem(ASM::RSI, 0), Imm(mmovSizes[i]));
+        ASM::ret(as);
+        copies[i] = anon(as);
+        ASM::global(as, copies[i]);
+        ASM::mcpy(as, Mem(ASM::RDI, 0), Mem(ASM::RSI, 0), Imm(mmovSizes[i]));
+        ASM::ret(as);
+    }
+    for (u32 i = 0; i < ncompares; i ++) {
+        compares[i] = anon(as);
+        ASM::global(as, compares[i]);
+        ASM::mcmpcc(as, COND_LT, GP(returnRegister), Mem(ASM::RDI, 0), Mem(ASM::RSI, 0), Imm(mcmpSizes[i]));
+        ASM::ret(as);
+    }
+    Symbol fill = anon(as), move = anon(as), copy = anon(as), compare = anon(as);
+    ASM::global(as, fill);
+    ASM::mset(as, Mem(ASM::RDI, 0), GP(ASM::RSI), GP(ASM::RDX));
+    ASM::ret(as);
+    ASM::global(as, move);
+    ASM::mmov(as, Mem(ASM::RDI, 0), Mem(ASM::RSI, 0), GP(ASM::RDX));
+    ASM::ret(as);
+    ASM::global(as, copy);
+    ASM::mcpy(as, Mem(ASM::RDI, 0), Mem(ASM::RSI, 0), GP(ASM::RDX));
+    ASM::ret(as);
+    ASM::global(as, compare);
+    ASM::mcmpcc(as, COND_LT, GP(returnRegister), Mem(ASM::RDI, 0), Mem(ASM::RSI, 0), GP(ASM::RDX));
+    ASM::ret(as);
+
+    LinkedAssembly linked = as.link();
+    linked.load();
+    auto varFill = linked.lookup<void(u8*, u8, i64)>(fill);
+    auto varMove = linked.lookup<void(u8*, u8*, i64)>(move);
+    auto varCopy = linked.lookup<void(u8*, u8*, i64)>(copy);
+    auto varCompare = linked.lookup<i64(u8*, u8*, i64)>(compare);
+    for (u32 i = 0; i < nfills; i ++) {
+        i32 n = msetSizes[i];
+        ASSERT_EQUAL(check_mset(linked.lookup<void(u8*, u8)>(fills[i][0]), n, 0x5a), 0);
+        ASSERT_EQUAL(check_mset(linked.lookup<void(u8*, u8)>(fills[i][1]), n, 0xc3), 0);
+    }
+    for (u32 i = 0; i < nmoves; i ++) for (i32 distance : mmovDistances) {
+        i32 n = mmovSizes[i];
+        ASSERT_EQUAL(check_mmov(linked.lookup<void(u8*, u8*, i64)>(moves[i]), n, distance), 0);
+        ASSERT_EQUAL(check_mmov(varMove, n, distance), 0);
+        if (distance <= -n || distance >= n) {
+            ASSERT_EQUAL(check_mmov(linked.lookup<void(u8*, u8*, i64)>(copies[i]), n, distance), 0);
+            ASSERT_EQUAL(check_mmov(varCopy, n, distance), 0);
+        }
+    }
+    for (u32 i = 0; i < ncompares; i ++) {
+        auto fixed = linked.lookup<i64(u8*, u8*)>(compares[i]);
+        ASSERT_EQUAL(check_mcmp([&](u8* a, u8* b, i64 n) { return fixed(a, b) != 0; }, COND_LT, mcmpSizes[i]), 0);
+        ASSERT_EQUAL(check_mcmp([&](u8* a, u8* b, i64 n) { return varCompare(a, b, n) != 0; }, COND_LT, mcmpSizes[i]), 0);
+    }
+    static u8 buffer[5100];
+    for (i32 n : msetSizes) {
+        for (i32 j = 0; j < n + 64; j ++)
+            buffer[j] = 0;
+        varFill(buffer + 8, 0x7e, n);
+        for (i32 j = 0; j < n + 64; j ++)
+            ASSERT_EQUAL(buffer[j], j >= 8 && j < n + 8 ? 0x7e : 0);
+    }
+}
+
+// Shifts and rotates at each level, over counts past the width, with the
+// count in dst or on the stack, and with a in memory or an immediate.
+static u64 shift_reference(u32 op, u32 bits, u64 value, u64 count) {
+    u64 mask = bits == 64 ? ~0ull : (1ull << bits) - 1, x = value & mask;
+    u32 c = count & (bits == 64 ? 63 : 31), r = c % bits;
+    i64 signed_x = i64(x << (64 - bits)) >> (64 - bits);
+    switch (op) {
+        case 0: return c >= bits ? 0 : x << c & mask;
+        case 1: return c >= bits ? 0 : x >> c;
+        case 2: return u64(signed_x >> (c >= bits ? bits - 1 : c)) & mask;
+        case 3: return r ? (x << r | x >> (bits - r)) & mask : x;
+        default: return r ? (x >> r | x << (bits - r)) & mask : x;
+    }
+}
+
+TEST(asm_shift_levels) {
+    using ASM = Assembler;
+    using Shift = void(*)(Assembly&, ASMVal, ASMVal, ASMVal);
+    const Shift ops[5][4] = {
+        { ASM::shl8, ASM::shl16, ASM::shl32, ASM::shl64 },
+        { ASM::shr8, ASM::shr16, ASM::shr32, ASM::shr64 },
+        { ASM::sar8, ASM::sar16, ASM::sar32, ASM::sar64 },
+        { ASM::rol8, ASM::rol16, ASM::rol32, ASM::rol64 },
+        { ASM::ror8, ASM::ror16, ASM::ror32, ASM::ror64 }
+    };
+    const u64 values[] = { 0, 1, 0x80, 0xff, 0x8000, 0x7fffffff, 0x8123456789abcdefull, ~0ull };
+    const u64 counts[] = { 0, 1, 7, 8, 15, 16, 31, 32, 33, 63, 64, 200 };
+    const i64 immediate = -0x1234567, immediateCount = 13;
+    i32 failures = 0;
+    for (ISALevel level : testLevels) if (level <= ASM::host_level()) {
+        TestContext ctx(level);
+        Assembly& as = ctx.as;
+        Symbol funcs[5][4][7];
+        for (u32 i = 0; i < 5; i ++) for (u32 s = 0; s < 4; s ++) for (u32 v = 0; v < 7; v ++) {
+            funcs[i][s][v] = anon(as);
+            ASM::global(as, funcs[i][s][v]);
+            ASM::stack(as, Imm(16));
+            ASM::mov64(as, Mem(ASM::RSP, 0), GP(ASM::RDI));
+            ASM::mov64(as, Mem(ASM::RSP, 8), GP(ASM::RSI));
+            ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDI));
+            switch (v) {
+                case 0: ops[i][s](as, GP(ASM::R8), GP(ASM::RDI), GP(ASM::RSI)); ASM::mov64(as, GP(ASM::RAX), GP(ASM::R8)); break;
+                case 1: ops[i][s](as, GP(ASM::RSI), GP(ASM::RDI), GP(ASM::RSI)); ASM::mov64(as, GP(ASM::RAX), GP(ASM::RSI)); break;
+                case 2: ops[i][s](as, GP(ASM::RAX), GP(ASM::RAX), Mem(ASM::RSP, 8)); break;
+                case 3: ops[i][s](as, GP(ASM::RAX), Mem(ASM::RSP, 0), Mem(ASM::RSP, 8)); break;
+                case 4: ops[i][s](as, GP(ASM::RSI), Imm(immediate), GP(ASM::RSI)); ASM::mov64(as, GP(ASM::RAX), GP(ASM::RSI)); break;
+                case 5: ops[i][s](as, GP(ASM::RAX), GP(ASM::RDI), Imm(immediateCount)); break;
+                case 6: ops[i][s](as, GP(ASM::RAX), Imm(immediate), Mem(ASM::RSP, 8)); break;
+            }
+            ASM::unstack(as, Imm(16));
+            ASM::ret(as);
+        }
+        LinkedAssembly linked = as.link();
+        linked.load();
+        for (u32 i = 0; i < 5; i ++) for (u32 s = 0; s < 4; s ++) for (u32 v = 0; v < 7; v ++) for (u64 value : values) for (u64 count : counts) {
+            u32 bits = 8 << s;
+            u64 mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+            u64 x = v == 4 || v == 6 ? u64(immediate) : value, c = v == 5 ? immediateCount : count;
+            u64 result = linked.lookup<u64(u64, u64)>(funcs[i][s][v])(value, count);
+            if ((result & mask) != shift_reference(i, bits, x, c))
+                failures ++;
+        }
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+// Fused multiply-add over each arrangement of operands. The last values
+// round differently when the product is rounded on its own, so they tell
+// whether we really fused it at ISA_V3 and above.
+using FloatTernary = void(*)(Assembly&, ASMVal, ASMVal, ASMVal, ASMVal);
+
+template<typename T>
+static i32 check_fused_multiply_add(const FloatTernary (&ops)[3], FloatUnary move) {
+    using ASM = Assembler;
+    constexpr T one = 1, tiny = sizeof(T) == 4 ? T(1) / T(1 << 12) : T(1) / T(1 << 27);
+    const T values[][3] = {
+        { 2, 3, 4 }, { -1.5, 0.25, 10 }, { 0, -7, 0.5 }, { 1e10, 1e-10, -3 },
+        { one + tiny, one + tiny, -(one + 2 * tiny) }, { one + tiny, one - tiny, -one }
+    };
+    const T k = 1.5, k2 = -0.75;
+    i32 failures = 0;
+    for (ISALevel level : testLevels) if (level <= ASM::host_level()) {
+        TestContext ctx(level);
+        Assembly& as = ctx.as;
+        ASMVal constant = sizeof(T) == 4 ? F32(k) : F64(k), constant2 = sizeof(T) == 4 ? F32(k2) : F64(k2);
+        ASMVal x = FP(ASM::XMM3), y = FP(ASM::XMM4), z = FP(ASM::XMM5), w = FP(ASM::XMM6);
+        const ASMVal operands[][4] = {
+            { w, x, y, z }, { x, x, y, z }, { y, x, y, z }, { z, x, y, z }, { z, constant, y, z },
+            { w, x, constant, z }, { x, x, y, constant }, { w, constant, constant, z }, { x, x, x, z },
+            { z, constant, constant2, z }, { x, x, constant, constant2 }, { y, constant, y, constant2 },
+            { w, constant, constant2, constant }
+        };
+        constexpr u32 nvariants = sizeof(operands) / sizeof(operands[0]);
+        Symbol funcs[3][nvariants];
+        for (u32 i = 0; i < 3; i ++) for (u32 v = 0; v < nvariants; v ++) {
+            funcs[i][v] = anon(as);
+            ASM::global(as, funcs[i][v]);
+            move(as, x, FP(ASM::XMM0));
+            move(as, y, FP(ASM::XMM1));
+            move(as, z, FP(ASM::XMM2));
+            ops[i](as, operands[v][0], operands[v][1], operands[v][2], operands[v][3]);
+            move(as, FP(ASM::XMM0), operands[v][0]);
+            ASM::ret(as);
+        }
+        LinkedAssembly linked = as.link();
+        linked.load();
+        for (u32 i = 0; i < 3; i ++) for (u32 v = 0; v < nvariants; v ++) for (const auto& value : values) {
+            const ASMVal* ops = operands[v];
+            auto pick = [&](ASMVal op) -> T { return op == x ? value[0] : op == y ? value[1] : op == z ? value[2] : op == constant ? k : k2; };
+            T a = pick(ops[1]), b = pick(ops[2]), c = pick(ops[3]);
+            if (i == 1) c = -c;
+            if (i == 2) a = -a;
+            volatile T product = a * b;
+            T expected = level >= ISA_V3 ? T(__builtin_fma(a, b, c)) : T(product + c);
+            if (!bits_equal(linked.lookup<T(T, T, T)>(funcs[i][v])(value[0], value[1], value[2]), expected))
+                failures ++;
+        }
+    }
+    return failures;
+}
+
+TEST(asm_fused_multiply_add) {
+    using ASM = Assembler;
+    const FloatTernary ops32[3] = { ASM::fmadd32, ASM::fmsub32, ASM::fnmadd32 };
+    const FloatTernary ops64[3] = { ASM::fmadd64, ASM::fmsub64, ASM::fnmadd64 };
+    ASSERT_EQUAL(check_fused_multiply_add<f32>(ops32, ASM::fmov32), 0);
+    ASSERT_EQUAL(check_fused_multiply_add<f64>(ops64, ASM::fmov64), 0);
+}
+
+// Atomics, one thread at a time, checking that narrow ones leave the rest
+// of the word alone. The second variant puts dst in the address, and the
+// third has dst share a register with a source.
+TEST(asm_atomics) {
+    using ASM = Assembler;
+    using Exchange = void(*)(Assembly&, ASMVal, ASMVal, ASMVal);
+    using CompareExchange = void(*)(Assembly&, ASMVal, ASMVal, ASMVal, ASMVal);
+    using Bitwise = void(*)(Assembly&, ASMVal, ASMVal);
+    const Exchange exchanges[2][4] = {
+        { ASM::axchg8, ASM::axchg16, ASM::axchg32, ASM::axchg64 },
+        { ASM::axadd8, ASM::axadd16, ASM::axadd32, ASM::axadd64 }
+    };
+    const CompareExchange compares[4] = { ASM::acas8, ASM::acas16, ASM::acas32, ASM::acas64 };
+    const Bitwise bitwise[3][4] = {
+        { ASM::aand8, ASM::aand16, ASM::aand32, ASM::aand64 },
+        { ASM::aor8, ASM::aor16, ASM::aor32, ASM::aor64 },
+        { ASM::axor8, ASM::axor16, ASM::axor32, ASM::axor64 }
+    };
+    const i64 immediate = -0x5a, expectedImmediate = 0x21, desiredImmediate = -3;
+    const u64 words[] = { 0x21, 0x0123456789abcdefull, 0xffffffffffffff21ull };
+    const u64 sources[] = { 0x21, 7, ~0ull, 0x8000000000000001ull };
+
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol funcs[6][4][3];
+    for (u32 i = 0; i < 6; i ++) for (u32 s = 0; s < 4; s ++) for (u32 v = 0; v < 3; v ++) {
+        funcs[i][s][v] = anon(as);
+        ASM::global(as, funcs[i][s][v]);
+        ASMVal dst = GP(v == 0 ? ASM::R8 : v == 1 ? ASM::RDI : ASM::RSI);
+        if (i < 2)
+            exchanges[i][s](as, dst, Mem(ASM::RDI, 0), v == 1 ? Imm(immediate) : GP(ASM::RSI));
+        else if (i == 2)
+            compares[s](as, dst, Mem(ASM::RDI, 0), v == 1 ? Imm(expectedImmediate) : GP(ASM::RSI), v == 1 ? Imm(desiredImmediate) : GP(ASM::RDX));
+        else
+            bitwise[i - 3][s](as, Mem(ASM::RDI, 0), v == 1 ? Imm(immediate) : GP(v ? ASM::RDX : ASM::RSI));
+        ASM::mov64(as, GP(returnRegister), i < 3 ? dst : Imm(0));
+        ASM::ret(as);
+    }
+    LinkedAssembly linked = as.link();
+    linked.load();
+
+    i32 failures = 0;
+    for (u32 i = 0; i < 6; i ++) for (u32 s = 0; s < 4; s ++) for (u32 v = 0; v < 3; v ++) for (u64 word : words) for (u64 x : sources) {
+        u32 bits = 8 << s;
+        u64 mask = bits == 64 ? ~0ull : (1ull << bits) - 1, y = ~x ^ 0x99;
+        u64 src = v == 1 ? u64(immediate) : i >= 3 && v == 2 ? y : x;
+        u64 expected = v == 1 ? u64(expectedImmediate) : x, desired = v == 1 ? u64(desiredImmediate) : y;
+        u64 old = word & mask, result;
+        switch (i) {
+            case 0: result = src; break;
+            case 1: result = old + src; break;
+            case 2: result = old == (expected & mask) ? desired : old; break;
+            case 3: result = old & src; break;
+            case 4: result = old | src; break;
+            default: result = old ^ src; break;
+        }
+        u64 memory = word;
+        u64 returned = linked.lookup<u64(u64*, u64, u64)>(funcs[i][s][v])(&memory, x, y);
+        if (memory != ((word & ~mask) | (result & mask)) || (i < 3 && (returned & mask) != old))
+            failures ++;
+    }
+    ASSERT_EQUAL(failures, 0);
+}
+
+// Compare-exchange with its operands in the registers it needs for itself:
+// the address or desired in RAX, dst in RAX, and an RSP-relative address
+// while a register is borrowed.
+TEST(asm_atomic_compare_exchange_fixed_registers) {
+    using ASM = Assembler;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol funcs[5];
+    for (u32 i = 0; i < 5; i ++) {
+        funcs[i] = anon(as);
+        ASM::global(as, funcs[i]);
+        switch (i) {
+            case 0: // Address in RAX.
+                ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDI));
+                ASM::acas64(as, GP(ASM::R8), Mem(ASM::RAX, 0), GP(ASM::RSI), GP(ASM::RDX));
+                break;
+            case 1: // Desired in RAX.
+                ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDX));
+                ASM::acas64(as, GP(ASM::R8), Mem(ASM::RDI, 0), GP(ASM::RSI), GP(ASM::RAX));
+                break;
+            case 2: // Address in RAX, and dst too.
+                ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDI));
+                ASM::acas32(as, GP(ASM::RAX), Mem(ASM::RAX, 0), GP(ASM::RSI), GP(ASM::RDX));
+                ASM::mov64(as, GP(ASM::R8), GP(ASM::RAX));
+                break;
+            case 3: // Desired in RAX, with expected in dst.
+                ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDX));
+                ASM::mov64(as, GP(ASM::R8), GP(ASM::RSI));
+                ASM::acas64(as, GP(ASM::R8), Mem(ASM::RDI, 0), GP(ASM::R8), GP(ASM::RAX));
+                break;
+            default: // Address and desired in RAX's way, on the stack.
+                ASM::push64(as, GP(ASM::RDX));
+                ASM::acas64(as, GP(ASM::RAX), Mem(ASM::RSP, 0), GP(ASM::RSI), Imm(0x77));
+                ASM::mov64(as, GP(ASM::R8), GP(ASM::RAX));
+                ASM::pop64(as, GP(ASM::RDX));
+                ASM::mov64(as, Mem(ASM::RDI, 0), GP(ASM::RDX));
+                break;
+        }
+        ASM::mov64(as, GP(returnRegister), GP(ASM::R8));
+        ASM::ret(as);
+    }
+    LinkedAssembly linked = as.link();
+    linked.load();
+
+    for (u32 i = 0; i < 5; i ++) for (u32 match = 0; match < 2; match ++) {
+        u64 word = 0x0123456789abcdefull, old = i == 4 ? 0x4242 : word, memory = word;
+        u64 expected = match ? old : 5, desired = i == 4 ? 0x77 : 0xfedcba9876543210ull;
+        u64 mask = i == 2 ? 0xffffffffull : ~0ull;
+        u64 returned = linked.lookup<u64(u64*, u64, u64)>(funcs[i])(&memory, expected, i == 4 ? old : desired);
+        ASSERT_EQUAL(returned & mask, old & mask);
+        ASSERT_EQUAL(memory, match ? (word & ~mask) | (desired & mask) : i == 4 ? old : word);
+    }
+}
+
+TEST(asm_atomic_compare_exchange_128) {
+    using ASM = Assembler;
+    if (Assembler::host_level() < ISA_V2)
+        return;
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol funcs[4];
+    for (u32 v = 0; v < 4; v ++) {
+        funcs[v] = anon(as);
+        ASM::global(as, funcs[v]);
+        ASM::push64(as, GP(ASM::RBX));
+        ASM::mov64(as, GP(ASM::R9), GP(ASM::RDX));
+        ASMVal dst = GP(v == 1 ? ASM::RSI : ASM::R8); // The second has dst in the address of expected.
+        if (v < 2)
+            ASM::acas128(as, dst, Mem(ASM::RDI, 0), Mem(ASM::RSI, 0), Mem(ASM::R9, 0));
+        else if (v == 2) { // Every address in one of the registers cmpxchg16b uses.
+            ASM::mov64(as, GP(ASM::RDX), GP(ASM::RDI));
+            ASM::mov64(as, GP(ASM::RAX), GP(ASM::RSI));
+            ASM::mov64(as, GP(ASM::RBX), GP(ASM::R9));
+            ASM::acas128(as, dst, Mem(ASM::RDX, 0), Mem(ASM::RAX, 0), Mem(ASM::RBX, 0));
+        }
+        else { // The same, shuffled, with dst in the address of expected.
+            ASM::mov64(as, GP(ASM::RAX), GP(ASM::RDI));
+            ASM::mov64(as, GP(ASM::RDX), GP(ASM::RSI));
+            ASM::mov64(as, GP(ASM::RCX), GP(ASM::R9));
+            dst = GP(ASM::RDX);
+            ASM::acas128(as, dst, Mem(ASM::RAX, 0), Mem(ASM::RDX, 0), Mem(ASM::RCX, 0));
+        }
+        ASM::mov64(as, GP(returnRegister), dst);
+        ASM::pop64(as, GP(ASM::RBX));
+        ASM::ret(as);
+    }
+    LinkedAssembly linked = as.link();
+    linked.load();
+
+    for (u32 v = 0; v < 4; v ++) for (u32 match = 0; match < 2; match ++) {
+        alignas(16) u64 memory[2] = { 0x0123456789abcdefull, 0xfedcba9876543210ull };
+        u64 expected[2] = { memory[0], match ? memory[1] : 42 }, desired[2] = { 1, 2 };
+        u64 swapped = linked.lookup<u64(u64*, u64*, u64*)>(funcs[v])(memory, expected, desired);
+        ASSERT_EQUAL(swapped, match);
+        ASSERT_EQUAL(memory[0], match ? 1 : 0x0123456789abcdefull);
+        ASSERT_EQUAL(memory[1], match ? 2 : 0xfedcba9876543210ull);
+        ASSERT_EQUAL(expected[0], 0x0123456789abcdefull);
+        ASSERT_EQUAL(expected[1], 0xfedcba9876543210ull);
+    }
+}
+
+TEST(asm_atomic_encodings) {
+    using ASM = Assembler;
+    const u8 expected[] = {
+        0xf0, 0x48, 0x0f, 0xc1, 0x37, // lock xadd [rdi], rsi
+        0xf0, 0x83, 0x27, 0x0f, // lock and dword [rdi], 15
+        0x0f, 0xae, 0xf0, 0x0f, 0xae, 0xe8, 0x0f, 0xae, 0xf8, 0xf3, 0x90, 0xc3 // mfence, lfence, sfence, pause, ret
+    };
+    TestContext ctx;
+    Assembly& as = ctx.as;
+    Symbol func = anon(as);
+    ASM::global(as, func);
+    ASM::axadd64(as, GP(ASM::RSI), Mem(ASM::RDI, 0), GP(ASM::RSI));
+    ASM::aand32(as, Mem(ASM::RDI, 0), Imm(15));
+    ASM::mfence(as);
+    ASM::lfence(as);
+    ASM::sfence(as);
+    ASM::pause(as);
+    ASM::ret(as);
+    LinkedAssembly linked = as.link();
+    linked.load();
+    const u8* code = (const u8*)linked.lookup<void()>(func);
+    for (u32 i = 0; i < sizeof(expected); i ++)
+        ASSERT_EQUAL(code[i], expected[i]);
+}
+
 MAKE_BINARY_INT_TESTS_FOR_EACH_WIDTH(NEG, neg, positive_number, 48, -48);
 MAKE_BINARY_INT_TESTS_FOR_EACH_WIDTH(NEG, neg, negative_number, -48, 48);
 MAKE_BINARY_INT_TESTS_FOR_EACH_WIDTH(NEG, neg, zero, 0, 0);
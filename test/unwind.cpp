@@ -0,0 +1,140 @@
+#include "util/test/harness.h"
+#include "asm/arch/amd64.h"
+#include "util/io.h"
+
+#if defined(RT_AMD64) && defined(RT_LINUX)
+
+extern "C" int _Unwind_Backtrace(int (*trace)(void* context, void* env), void* env);
+extern "C" uptr _Unwind_GetIP(void* context);
+
+slice<i8> readELFFile(const i8* path); // From test/elf.cpp.
+
+struct Backtrace {
+    uptr ips[32];
+    u32 n;
+};
+
+static int recordFrame(void* context, void* env) {
+    Backtrace& backtrace = *(Backtrace*)env;
+    if (backtrace.n == 32)
+        return 5; // _URC_END_OF_STACK
+    backtrace.ips[backtrace.n ++] = _Unwind_GetIP(context);
+    return 0; // _URC_NO_REASON
+}
+
+static void captureBacktrace(Backtrace* backtrace) {
+    _Unwind_Backtrace(recordFrame, backtrace);
+}
+
+static void defineUnwindTestFunctions(Assembly& as) {
+    using ASM = AMD64LinuxAssembler;
+
+    // Calls its second argument with its first, using rbp as a scratch
+    // register, so only the recorded frame info can get us out of it.
+    ASM::global(as, as.symtab["frameless"]);
+    ASM::push64(as, GP(ASM::RBX));
+    ASM::push64(as, GP(ASM::RBP));
+    ASM::stack(as, Imm(8));
+    ASM::mov64(as, GP(ASM::RBP), Imm(0));
+    ASM::mov64(as, GP(ASM::RBX), Imm(0));
+    ASM::call(as, GP(ASM::RSI));
+    ASM::unstack(as, Imm(8));
+    ASM::pop64(as, GP(ASM::RBP));
+    ASM::pop64(as, GP(ASM::RBX));
+    ASM::ret(as);
+
+    ASM::global(as, as.symtab["framed"]);
+    ASM::enter(as);
+    ASM::stack(as, Imm(16));
+    ASM::brcc64(as, COND_EQ, Label(as.symtab["skip"]), GP(ASM::RDI), Imm(0));
+    ASM::call(as, Func(as.symtab["frameless"]));
+    ASM::leave(as);
+    ASM::ret(as);
+    ASM::local(as, as.symtab["skip"]);
+    ASM::leave(as);
+    ASM::ret(as);
+}
+
+TEST(linked_assembly_unwind_without_frame_pointer) {
+    SymbolTable table;
+    Assembly as(table);
+    defineUnwindTestFunctions(as);
+
+    auto linked = as.link();
+    linked.load();
+    ASSERT_EQUAL(linked.functions.size(), 2);
+
+    Backtrace backtrace;
+    backtrace.n = 0;
+    auto framed = linked.lookup<void(Backtrace*, void(*)(Backtrace*))>(as.symtab["framed"]);
+    framed(&backtrace, captureBacktrace);
+
+    auto within = [&](uptr ip, const LinkedFunction& function) -> bool {
+        uptr start = uptr(linked.code + function.offset);
+        return ip > start && ip <= start + function.size;
+    };
+    u32 i = 0;
+    while (i < backtrace.n && !within(backtrace.ips[i], linked.functions[0]))
+        i ++;
+    ASSERT(i + 2 < backtrace.n); // We should make it through both functions and back into this one.
+    ASSERT(within(backtrace.ips[i + 1], linked.functions[1]));
+    ASSERT(!within(backtrace.ips[i + 2], linked.functions[0]) && !within(backtrace.ips[i + 2], linked.functions[1]));
+
+    // Unloading early leaves nothing for the destructor to deregister again.
+    linked.unload();
+    ASSERT(!linked.code && !linked.frames);
+}
+
+TEST(assembly_elf_unwind_info) {
+    SymbolTable table;
+    Assembly as(table);
+    defineUnwindTestFunctions(as);
+
+    file::fd output = file::open(cstring("bin/frames.o"), file::WRITE);
+    as.writeELFObject(output);
+    file::close(output);
+
+    // Find .eh_frame and its relocations by name, then walk its records.
+    slice<i8> bytes = readELFFile(cstring("bin/frames.o"));
+    auto field = [&](u64 offset, u32 size) -> u64 {
+        u64 value = 0;
+        for (u32 i = 0; i < size; i ++)
+            value |= u64(u8(bytes[offset + i])) << i * 8;
+        return value;
+    };
+    u64 shoff = field(40, 8), shnum = field(60, 2);
+    u64 names = field(shoff + field(62, 2) * 64 + 24, 8); // The sh_offset of e_shstrndx.
+    auto find = [&](const char* name) -> u64 {
+        for (u64 i = 0; i < shnum; i ++) {
+            const i8* sectionName = &bytes[names + field(shoff + i * 64, 4)];
+            u32 j = 0;
+            while (name[j] && sectionName[j] == name[j])
+                j ++;
+            if (!name[j] && !sectionName[j])
+                return i;
+        }
+        return 0;
+    };
+    u64 frames = find(".eh_frame"), relocs = find(".rela.eh_frame");
+    ASSERT(frames && relocs);
+    u64 framesHeader = shoff + frames * 64, relocsHeader = shoff + relocs * 64;
+    ASSERT_EQUAL(field(relocsHeader + 4, 4), 4); // SHT_RELA
+    ASSERT_EQUAL(field(relocsHeader + 44, 4), frames); // sh_info
+
+    u64 start = field(framesHeader + 24, 8), end = start + field(framesHeader + 32, 8);
+    u32 cies = 0, fdes = 0;
+    for (u64 offset = start; offset < end; ) {
+        u64 length = field(offset, 4);
+        if (!length)
+            break; // The zero terminator.
+        if (field(offset + 4, 4)) fdes ++; // A nonzero CIE_pointer makes it an FDE.
+        else cies ++;
+        offset += 4 + length;
+    }
+    ASSERT_EQUAL(cies, 1);
+    ASSERT_EQUAL(fdes, 2);
+    ASSERT_EQUAL(field(relocsHeader + 32, 8) / 24, 2); // One pc_begin relocation per FDE.
+    delete[] bytes.data();
+}
+
+#endif